@@ -0,0 +1,311 @@
+//==============================================================================
+// Dictionary designed for read-mostly scene.
+// Copyright (C) 2020	Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sys/sysinfo.h>
+#include <estuary.h>
+#include <gflags/gflags.h>
+#include "benchmark.h"
+
+DEFINE_string(file, "bench-mixed.es", "dict filename");
+DEFINE_uint64(size, 1UL << 24U, "number of items");
+DEFINE_uint32(thread, 4, "number of worker threads");
+DEFINE_uint64(loop, 1000000, "operations per thread");
+DEFINE_bool(build, false, "build instead of running");
+DEFINE_bool(copy, false, "load by copy");
+DEFINE_bool(pool, false, "build with size-class pool for freed slots");
+DEFINE_bool(pin, true, "pin worker threads to cpus");
+DEFINE_string(dist, "zipf", "key distribution: uniform, zipf or hotspot");
+DEFINE_double(theta, 0.99, "skew of zipf distribution, 0-1");
+DEFINE_double(hot_key, 0.01, "fraction of keys in hotspot");
+DEFINE_double(hot_op, 0.9, "fraction of operations on hotspot");
+DEFINE_double(hit, 1.0, "fraction of reads on keys in dict");
+DEFINE_string(val_dist, "uniform", "value size distribution: fixed, uniform or pareto");
+DEFINE_uint32(min_val, 0, "minimum value size");
+DEFINE_uint32(max_val, 255, "maximum value size");
+DEFINE_uint32(write, 5, "percent of updates");
+DEFINE_uint32(erase, 1, "percent of erases");
+DEFINE_string(mode, "single", "read path: single, pipeline or batch");
+DEFINE_uint32(batch, 16, "keys per batch in batch mode");
+
+class KeyPicker final {
+public:
+	KeyPicker() {
+		if (FLAGS_dist == "zipf") {
+			m_zipf = std::make_unique<ZipfGenerator>(FLAGS_size, FLAGS_theta);
+		}
+		m_hotspot = FLAGS_dist == "hotspot";
+		m_hot = std::max<uint64_t>(1, FLAGS_size * FLAGS_hot_key);
+	}
+	//ranks of zipf are scattered over key space
+	uint64_t operator()(XorShift128Plus& rnd) const noexcept {
+		if (m_zipf != nullptr) {
+			return ((*m_zipf)(rnd) * 0x9E3779B97F4A7C15ULL) % FLAGS_size;
+		} else if (m_hotspot && Chance(rnd, FLAGS_hot_op)) {
+			return rnd() % m_hot;
+		}
+		return rnd() % FLAGS_size;
+	}
+	static bool Chance(XorShift128Plus& rnd, double p) noexcept {
+		return (rnd() >> 11U) * 0x1.0p-53 < p;
+	}
+private:
+	std::unique_ptr<ZipfGenerator> m_zipf;
+	bool m_hotspot = false;
+	uint64_t m_hot = 0;
+};
+
+enum ValueDistribution {FIXED, UNIFORM, PARETO};
+static ValueDistribution s_val_dist = UNIFORM;
+
+//value size is picked by random bits
+static unsigned PickValueSize(uint64_t bits) {
+	const unsigned range = FLAGS_max_val - FLAGS_min_val;
+	if (s_val_dist == FIXED || range == 0) {
+		return FLAGS_max_val;
+	} else if (s_val_dist == PARETO) {	//shape 1.5 and scale 16, most values are small
+		const double u = ((bits >> 11U) + 1) * 0x1.0p-53;
+		const auto extra = (uint64_t)(16.0 * (std::pow(u, -1.0/1.5) - 1.0));
+		return FLAGS_min_val + std::min<uint64_t>(extra, range);
+	}
+	return FLAGS_min_val + bits % (range + 1);
+}
+
+static inline uint64_t SplitMix(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27U)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31U);
+}
+
+class MixedGenerator : public estuary::IDataReader {
+public:
+	MixedGenerator() : m_val(FLAGS_max_val, 'v') {}
+	MixedGenerator(const MixedGenerator&) = delete;
+	MixedGenerator& operator=(const MixedGenerator&) = delete;
+
+	void reset() override {
+		m_current = UINT64_MAX;
+	}
+	size_t total() override {
+		return FLAGS_size;
+	}
+	//the same record is given in every pass
+	estuary::IDataReader::Record read() override {
+		m_current++;
+		return {{(const uint8_t*)&m_current, sizeof(uint64_t)},
+				{(const uint8_t*)m_val.data(), PickValueSize(SplitMix(m_current))}};
+	}
+
+private:
+	uint64_t m_current = UINT64_MAX;
+	std::string m_val;
+};
+
+struct Result {
+	LatencyHistogram read;
+	LatencyHistogram write;
+	LatencyHistogram erase;
+	uint64_t hit = 0;
+	uint64_t ns = 0;
+};
+
+static inline uint64_t Now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void Work(const estuary::Estuary& dict, const KeyPicker& picker, Result& result) {
+	XorShift128Plus rnd;
+	const std::string buf(FLAGS_max_val, 'u');
+	const unsigned batch = FLAGS_mode == "batch"? std::max(FLAGS_batch, 1U) : 1U;
+	const bool pipeline = FLAGS_mode == "pipeline";
+	std::vector<uint64_t> keys(batch);
+	std::vector<estuary::Slice> slices(batch);
+	std::vector<std::string> out(batch);
+	auto read_key = [&rnd, &picker]()->uint64_t {
+		return KeyPicker::Chance(rnd, FLAGS_hit)? picker(rnd) : FLAGS_size + rnd() % FLAGS_size;
+	};
+	//next key is touched ahead in pipeline mode
+	uint64_t next_key = read_key();
+	uint64_t next_code = dict.touch({(const uint8_t*)&next_key, sizeof(uint64_t)});
+
+	//mix is counted by keys, a batch of reads takes one draw
+	const double reads = (100.0 - FLAGS_write - FLAGS_erase) / batch;
+	const double draws = FLAGS_write + FLAGS_erase + reads;
+	const double write_line = FLAGS_write / draws;
+	const double erase_line = (FLAGS_write + FLAGS_erase) / draws;
+
+	const auto begin = Now();
+	for (uint64_t i = 0; i < FLAGS_loop; ) {
+		const double op = (rnd() >> 11U) * 0x1.0p-53;
+		if (op < write_line) {
+			uint64_t key = picker(rnd);
+			const auto start = Now();
+			dict.update({(const uint8_t*)&key, sizeof(uint64_t)}, {(const uint8_t*)buf.data(), PickValueSize(rnd())});
+			result.write.record(Now() - start);
+			i++;
+			continue;
+		} else if (op < erase_line) {
+			uint64_t key = picker(rnd);
+			const auto start = Now();
+			dict.erase({(const uint8_t*)&key, sizeof(uint64_t)});
+			result.erase.record(Now() - start);
+			i++;
+			continue;
+		}
+		i += batch;
+		if (pipeline) {
+			const auto key = next_key;
+			const auto code = next_code;
+			next_key = read_key();
+			const auto start = Now();
+			next_code = dict.touch({(const uint8_t*)&next_key, sizeof(uint64_t)});
+			result.hit += dict.fetch(code, {(const uint8_t*)&key, sizeof(uint64_t)}, out[0]);
+			result.read.record(Now() - start);
+		} else if (batch > 1) {
+			for (unsigned j = 0; j < batch; j++) {
+				keys[j] = read_key();
+				slices[j] = {(const uint8_t*)&keys[j], sizeof(uint64_t)};
+			}
+			const auto start = Now();
+			result.hit += dict.batch_fetch(batch, slices.data(), out.data());
+			result.read.record((Now() - start) / batch);
+		} else {
+			uint64_t key = read_key();
+			const auto start = Now();
+			result.hit += dict.fetch({(const uint8_t*)&key, sizeof(uint64_t)}, out[0]);
+			result.read.record(Now() - start);
+		}
+	}
+	result.ns = Now() - begin;
+}
+
+static void Report(const char* name, const LatencyHistogram& hist) {
+	if (hist.count() == 0) {
+		return;
+	}
+	std::cout << std::setw(6) << name << ": " << std::setw(10) << hist.count() << " ops"
+			  << ", p50 " << hist.percentile(0.5) << " ns"
+			  << ", p99 " << hist.percentile(0.99) << " ns"
+			  << ", p999 " << hist.percentile(0.999) << " ns" << std::endl;
+}
+
+static int BenchMixed() {
+	auto mode = FLAGS_copy? estuary::Estuary::COPY_DATA : estuary::Estuary::MONOPOLY;
+	auto dict = estuary::Estuary::Load(FLAGS_file, mode);
+	if (!dict) {
+		std::cout << "fail to load: " << FLAGS_file << std::endl;
+		return -1;
+	}
+	const KeyPicker picker;
+
+	const unsigned n = FLAGS_thread;
+	const auto cpus = std::thread::hardware_concurrency();
+	std::vector<Result> results(n);
+	std::vector<std::thread> workers;
+	workers.reserve(n);
+	for (unsigned i = 0; i < n; i++) {
+		workers.emplace_back([&dict, &picker, &results, i, cpus]() {
+			if (FLAGS_pin && cpus != 0) {
+				PinThread(i % cpus);
+			}
+			Work(dict, picker, results[i]);
+		});
+	}
+	for (auto& t : workers) {
+		t.join();
+	}
+
+	Result total;
+	double qps = 0.0;
+	for (auto& res : results) {
+		total.read.merge(res.read);
+		total.write.merge(res.write);
+		total.erase.merge(res.erase);
+		total.hit += res.hit;
+		const auto keys = res.read.count() * (FLAGS_mode == "batch"? FLAGS_batch : 1U)
+			+ res.write.count() + res.erase.count();
+		qps += keys * 1e9 / res.ns;
+	}
+	const auto reads = total.read.count() * (FLAGS_mode == "batch"? FLAGS_batch : 1U);
+	std::cout << FLAGS_mode << " mode, " << FLAGS_dist << " keys, " << n << " threads: "
+			  << (qps/1000000.0) << " mqps" << std::endl;
+	std::cout << "hit ratio: " << (reads == 0? 0.0 : (double)total.hit / reads) << std::endl;
+	Report(FLAGS_mode == "batch"? "batch" : "read", total.read);	//latency of batch is divided by keys
+	Report("write", total.write);
+	Report("erase", total.erase);
+	return 0;
+}
+
+static int BenchBuild() {
+	estuary::Estuary::Config config;
+	config.item_limit = FLAGS_size;
+	config.max_key_len = sizeof(uint64_t);
+	config.max_val_len = std::max(FLAGS_max_val, 1U);
+	unsigned avg_val = (FLAGS_min_val + FLAGS_max_val) / 2;
+	if (s_val_dist == FIXED) {
+		avg_val = FLAGS_max_val;
+	} else if (s_val_dist == PARETO) {
+		avg_val = std::min(FLAGS_min_val + 48U, FLAGS_max_val);
+	}
+	config.avg_item_size = avg_val + 1 + sizeof(uint64_t);
+	config.pool = FLAGS_pool;
+
+	MixedGenerator source;
+	if (!estuary::Estuary::Create(FLAGS_file, config, &source)) {
+		std::cout << "fail to build" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	google::ParseCommandLineFlags(&argc, &argv, true);
+
+	auto cpus = get_nprocs();
+	if (cpus <= 0) cpus = 1;
+	if (FLAGS_thread == 0) {
+		FLAGS_thread = cpus;
+	}
+	if (FLAGS_val_dist == "fixed") {
+		s_val_dist = FIXED;
+	} else if (FLAGS_val_dist == "pareto") {
+		s_val_dist = PARETO;
+	}
+	if (FLAGS_write + FLAGS_erase > 100 || FLAGS_theta <= 0.0 || FLAGS_theta >= 1.0
+		|| FLAGS_min_val > FLAGS_max_val || FLAGS_max_val > estuary::Estuary::MAX_VAL_LEN) {
+		std::cout << "bad arguments" << std::endl;
+		return -1;
+	}
+
+	if (FLAGS_build) {
+		return BenchBuild();
+	} else {
+		return BenchMixed();
+	}
+}
@@ -18,7 +18,10 @@
 
 #pragma once
 
+#include <cmath>
 #include <random>
+#include <vector>
+#include <pthread.h>
 #include "../test/test.h"
 
 class XorShift128Plus final {
@@ -39,4 +42,83 @@ public:
 	}
 private:
 	uint64_t _s[2];
-};
\ No newline at end of file
+};
+
+//pick ranks in [0,n) with probability proportional to 1/(rank+1)^theta, by Gray's method
+class ZipfGenerator final {
+public:
+	ZipfGenerator(uint64_t n, double theta) : m_n(n), m_theta(theta) {
+		double zeta2 = 0.0;
+		for (uint64_t i = 1; i <= n; i++) {
+			m_zeta += 1.0 / std::pow((double)i, theta);
+			if (i == 2) zeta2 = m_zeta;
+		}
+		m_alpha = 1.0 / (1.0 - theta);
+		m_eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / m_zeta);
+	}
+	uint64_t operator()(XorShift128Plus& rnd) const noexcept {
+		const double u = (rnd() >> 11U) * 0x1.0p-53;
+		const double uz = u * m_zeta;
+		if (uz < 1.0) return 0;
+		if (uz < 1.0 + std::pow(0.5, m_theta)) return 1;
+		const auto rank = (uint64_t)(m_n * std::pow(m_eta * u - m_eta + 1.0, m_alpha));
+		return rank < m_n? rank : m_n - 1;
+	}
+private:
+	uint64_t m_n;
+	double m_theta;
+	double m_zeta = 0.0;
+	double m_alpha = 0.0;
+	double m_eta = 0.0;
+};
+
+//log-linear buckets with 16 sub-buckets per power of 2, error is less than 1/16
+class LatencyHistogram final {
+public:
+	void record(uint64_t ns) noexcept {
+		m_buckets[index(ns)]++;
+		m_count++;
+	}
+	void merge(const LatencyHistogram& other) noexcept {
+		for (unsigned i = 0; i < BUCKETS; i++) {
+			m_buckets[i] += other.m_buckets[i];
+		}
+		m_count += other.m_count;
+	}
+	uint64_t count() const noexcept { return m_count; }
+	//lower bound of the bucket holding the p-th (0-1) value
+	uint64_t percentile(double p) const noexcept {
+		const auto rank = std::max<uint64_t>(1, (uint64_t)std::ceil(p * m_count));
+		uint64_t sum = 0;
+		for (unsigned i = 0; i < BUCKETS; i++) {
+			sum += m_buckets[i];
+			if (sum >= rank) {
+				return lower(i);
+			}
+		}
+		return 0;
+	}
+private:
+	static constexpr unsigned SUB_BITS = 4;
+	static constexpr unsigned SUB = 1U << SUB_BITS;
+	static constexpr unsigned BUCKETS = SUB * 2 + (64 - SUB_BITS - 1) * SUB;
+	static unsigned index(uint64_t v) noexcept {
+		if (v < SUB * 2) return v;
+		const unsigned msb = 63U - __builtin_clzll(v);
+		return SUB * 2 + (msb - SUB_BITS - 1) * SUB + ((v >> (msb - SUB_BITS)) & (SUB - 1));
+	}
+	static uint64_t lower(unsigned i) noexcept {
+		if (i < SUB * 2) return i;
+		const unsigned msb = (i - SUB * 2) / SUB + SUB_BITS + 1;
+		return (1ULL << msb) | ((uint64_t)((i - SUB * 2) % SUB) << (msb - SUB_BITS));
+	}
+	uint64_t m_buckets[BUCKETS] = {};
+	uint64_t m_count = 0;
+};
+
+static inline bool PinThread(unsigned cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
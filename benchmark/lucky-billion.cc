@@ -34,6 +34,8 @@ DEFINE_uint32(thread, 4, "number of worker threads");
 DEFINE_bool(build, false, "build instead of fetching");
 DEFINE_bool(copy, false, "load by copy");
 DEFINE_bool(disable_write, false, "disable write");
+DEFINE_bool(fixed, false, "fetch by fixed-width view");
+DEFINE_bool(cuckoo, false, "build with cuckoo buckets");
 
 static constexpr size_t BILLION = 1UL << 30U;
 
@@ -88,6 +90,12 @@ static int BenchFetch() {
 		return 1;
 	}
 
+	const estuary::LuckyEstuaryT<sizeof(uint64_t), EmbeddingGenerator::VALUE_SIZE> view(dict);
+	if (FLAGS_fixed && !view) {
+		std::cout << "unexpected widths" << std::endl;
+		return 1;
+	}
+
 	const unsigned n = FLAGS_thread;
 	constexpr unsigned batch = 5000;
 	constexpr unsigned loop = 1000;
@@ -110,7 +118,7 @@ static int BenchFetch() {
 	workers.reserve(n);
 	std::vector<uint64_t> results(n);
 	for (unsigned i = 0; i < n; i++) {
-		workers.emplace_back([&dict](uint64_t* res){
+		workers.emplace_back([&dict, &view](uint64_t* res){
 			std::vector<uint64_t> key_vec(batch);
 			auto out = std::make_unique<uint8_t[]>(EmbeddingGenerator::VALUE_SIZE*batch);
 
@@ -121,7 +129,11 @@ static int BenchFetch() {
 					key_vec[j] = rnd()%BILLION;
 				}
 				auto start = std::chrono::steady_clock::now();
-				dict.batch_fetch(batch, (const uint8_t*)key_vec.data(), out.get());
+				if (FLAGS_fixed) {
+					view.batch_fetch(batch, (const uint8_t*)key_vec.data(), out.get());
+				} else {
+					dict.batch_fetch(batch, (const uint8_t*)key_vec.data(), out.get());
+				}
 				auto end = std::chrono::steady_clock::now();
 				sum_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
 			}
@@ -153,8 +165,9 @@ static int BenchFetch() {
 
 static int BenchBuild() {
 	estuary::LuckyEstuary::Config config;
-	config.entry = BILLION;
+	config.entry = FLAGS_cuckoo? BILLION * 100 / estuary::LuckyEstuary::MAX_CUCKOO_LOAD + 1 : BILLION;
 	config.capacity = BILLION;
+	config.cuckoo = FLAGS_cuckoo;
 	config.key_len = sizeof(uint64_t);
 	config.val_len = EmbeddingGenerator::VALUE_SIZE;
 
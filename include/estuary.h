@@ -37,16 +37,116 @@ public:
 	bool fetch(Slice key, std::string& out) const;
 	bool erase(Slice key) const;
 	bool update(Slice key, Slice val) const;
+	//record is treated as missing since expire (unix time in seconds), 0 means never.
+	//only works with Config::expiration
+	bool update(Slice key, Slice val, uint32_t expire) const;
 
 	//Pipeline API
 	uint64_t touch(Slice key) const noexcept;
 	void touch(uint64_t code) const noexcept;
 	bool fetch(uint64_t code, Slice key, std::string& out) const;
 
+	//Batch API, return number of hits
+	//out should hold batch strings, index of missing keys will be written to miss if provided
+	unsigned batch_fetch(unsigned batch, const Slice* __restrict__ keys, std::string* __restrict__ out,
+						 unsigned* __restrict__ miss=nullptr) const;
+
+	//Group-commit API, lock is taken once for the whole batch, return number of successes
+	//index of failed records will be written to fail if provided
+	unsigned batch_update(unsigned batch, const Slice* __restrict__ keys, const Slice* __restrict__ vals,
+						  unsigned* __restrict__ fail=nullptr) const;
+	unsigned batch_erase(unsigned batch, const Slice* __restrict__ keys, unsigned* __restrict__ fail=nullptr) const;
+	//stop at the first failure, return number of records updated
+	size_t batch_update(IDataReader& source) const;
+
+	//Zero-copy API, out points into the dictionary directly
+	//data is reliable only if check(ticket) still returns true after consuming
+	struct Ticket {
+		const uint64_t* entry = nullptr;
+		uint64_t version = 0;
+	};
+	bool peek(Slice key, Slice& out, Ticket& ticket) const;
+	bool peek(uint64_t code, Slice key, Slice& out, Ticket& ticket) const;
+	bool check(const Ticket& ticket) const noexcept;
+
+	//Scan API, live records are visited in order of data by sequential reading
+	//data can be split into total pieces for parallel scanning, each cursor covers one piece.
+	//records are copied chunk by chunk under lock, those moved or updated between chunks
+	//may be missed or visited twice
+	class Cursor final {
+	public:
+		//return false at the end
+		bool next(std::string& key, std::string& val);
+		Cursor() = default;
+	private:
+		friend class Estuary;
+		const Estuary* m_dict = nullptr;
+		size_t m_pos = 0;		//block of next record
+		size_t m_end = 0;
+		size_t m_last = 0;		//block of the last record visited, where walking restarts
+		size_t m_offset = 0;
+		std::string m_chunk;	//[klen:32][vlen:32][key][val]...
+	};
+	Cursor scan(unsigned piece=0, unsigned total=1) const;
+
+	//Async API, records are read from file by io_uring instead of faulting in pages of data,
+	//so many lookups can be in flight in one thread. it works when data is backed by file
+	//(SHARED, MONOPOLY, LAZY and TIERED), otherwise lookups are done at submitting.
+	//an instance serves only one thread, callbacks are invoked in poll, val is valid only
+	//during callback.
+	class AsyncFetcher final {
+	public:
+		using Callback = std::function<void(bool found, Slice val)>;
+		explicit AsyncFetcher(const Estuary& dict, unsigned depth=64);
+		~AsyncFetcher() noexcept;
+		bool operator!() const noexcept { return m_dict == nullptr; }
+		//return false if depth lookups are in flight already
+		bool submit(Slice key, Callback done);
+		//invoke callbacks of finished lookups and return the number, wait for one at least
+		//if wait is true and something is in flight. it should not be called in callbacks
+		unsigned poll(bool wait=false);
+		unsigned pending() const noexcept { return m_depth - m_idle.size(); }
+
+		struct Ring;
+		struct Lookup;
+	private:
+		const Estuary* m_dict = nullptr;
+		Ring* m_ring = nullptr;		//null if io_uring is unavailable or useless
+		Lookup* m_slots = nullptr;
+		unsigned m_depth = 0;
+		std::vector<unsigned> m_idle;
+		std::vector<unsigned> m_ready;
+		std::string m_value;
+
+		void _start(Lookup& lookup);
+		void _probe(Lookup& lookup);
+		void _read(Lookup& lookup, size_t off, size_t len);
+		void _complete(Lookup& lookup, int res);
+		void _finish(Lookup& lookup, bool found);
+		AsyncFetcher(const AsyncFetcher&) = delete;
+		AsyncFetcher& operator=(const AsyncFetcher&) = delete;
+	};
+
+	//Incremental defragmentation, which can be called by a background thread to keep updates smooth
+	//move about budget blocks of records at most, return true when nothing is left to do
+	bool compact(size_t budget) const;
+
+	//Warmup API for LAZY loading, which can be called by a background thread at any rate
+	//fault in about budget bytes of data, return true when nothing is left to do
+	bool warmup(size_t budget) const noexcept;
+	unsigned warmup_progress() const noexcept;	//0-100
+
+	//Tiering API for TIERED loading, hits are sampled by page of data
+	//pin the hottest pages of file within about budget bytes in page cache, return bytes pinned.
+	//pages written by this instance are private memory and never pinned
+	size_t promote(size_t budget) const;
+
 	bool operator!() const noexcept { return m_meta == nullptr; }
 	unsigned max_key_len() const noexcept { return m_const.max_key_len; }
-	unsigned max_val_len() const noexcept { return m_const.max_val_len; }
+	unsigned max_val_len() const noexcept { return m_const.max_val_len - m_const.val_head; }
 	size_t item() const noexcept;
+	//bumped by every committed write, readers attached can tell whether anything is changed
+	uint64_t generation() const noexcept;
 	size_t data_free() const;
 	size_t item_limit() const;
 
@@ -54,11 +154,20 @@ public:
 	Estuary(Estuary&& other) noexcept
 			: m_resource(std::move(other.m_resource)), m_meta(other.m_meta), m_const(other.m_const),
 				m_lock(other.m_lock), m_table(other.m_table), m_data(other.m_data),
-				m_monopoly_extra(std::move(other.m_monopoly_extra)) {
+				m_monopoly_extra(std::move(other.m_monopoly_extra)),
+				m_tier(other.m_tier), m_codec(other.m_codec), m_wal(other.m_wal), m_replica(other.m_replica),
+				m_pool(other.m_pool), m_attach(other.m_attach), m_warm(other.m_warm),
+				m_dirty(std::move(other.m_dirty)) {
 		other.m_meta = nullptr;
 		other.m_lock = nullptr;
 		other.m_table = nullptr;
 		other.m_data = nullptr;
+		other.m_tier = nullptr;
+		other.m_codec = nullptr;
+		other.m_wal = nullptr;
+		other.m_replica = nullptr;
+		other.m_pool = nullptr;
+		other.m_attach = nullptr;
 	}
 	Estuary& operator=(Estuary&& other) noexcept {
 		if (&other != this) {
@@ -79,23 +188,95 @@ public:
 		// when item_size has a poor distribution, avgerage value may not work.
 		// a little bigger value is needed.
 		unsigned avg_item_size = 2048;		//2-16777215
+
+		unsigned concurrency = 1;			//threads for building, 0 means all cores
+		// build by external sorting within about sort_memory bytes when it's not 0.
+		// temporary data are spilled beside the target file, both are written sequentially.
+		size_t sort_memory = 0;
+		// values are compressed with a dictionary sampled from source, avg_item_size is
+		// about compressed size then. zero-copy view may point into a thread local buffer.
+		bool compress = false;
+		// every record carries an expire time in 4 more bytes, expired records are missed
+		// by readers and reclaimed by defragmentation and sweeping without erasing.
+		bool expiration = false;
+		// freed slots are kept in free lists by size class and reused in place by later updates,
+		// so most of updates avoid defragmentation and less space is reserved for it.
+		// a slot is reused 50ms after freeing at least, readers should not take longer to copy.
+		bool pool = false;
 	};
 
 	static bool Create(const std::string& path, const Config& config, IDataReader* source=nullptr);
-	enum LoadPolicy {SHARED, MONOPOLY, COPY_DATA};
+	// LAZY works like MONOPOLY without populating, only table is warmed up at loading
+	// TIERED works like COPY_DATA with only table copied, data is read from file on demand
+	// REPLICATED works like COPY_DATA with a table replica on every other NUMA node for local readers,
+	// the primary table serves the node it lives on
+	// READ_ONLY attaches to a file updated by a SHARED writer in other process, pages are mapped
+	// without write permission and shared by all readers. writes and scanning are refused.
+	// readers are registered in path.readers beside the file if possible
+	enum LoadPolicy {SHARED, MONOPOLY, COPY_DATA, LAZY, TIERED, REPLICATED, READ_ONLY};
 	static Estuary Load(const std::string& path, LoadPolicy policy=MONOPOLY);
 	static Estuary Load(size_t size, const std::function<bool(uint8_t*)>& load);
+	// updates are appended to a write-ahead log, which is replayed at loading.
+	// base file is never written, so only COPY_DATA and TIERED are acceptable
+	static Estuary Load(const std::string& path, const std::string& log, LoadPolicy policy=COPY_DATA);
 
-	// only data limit can be extended, item limit cannot
+	// only data limit can be extended
 	// percent should be 1-100
 	static bool Extend(const std::string& path, unsigned percent, Config* result=nullptr);
+	// offline tool, item limit is extended by rehashing records into a new file which replaces
+	// the old one, source is not needed. the file should not be loaded by anyone, and about
+	// the same space is needed beside it. data limit is unchanged.
+	// there is no online growing with a dual-table lookup, reload the grown file instead
+	static bool Grow(const std::string& path, unsigned percent, Config* result=nullptr);
 
-	bool dump(const std::string& path) const noexcept {
-		return m_resource.dump(path.c_str());
-	}
+	//Inspect API, analyze a saved file without loading, table and data are scanned in parallel.
+	//the file is mapped read-only without locking, so it may be held by a live instance
+	struct Layout {
+		Config config;					//the same as Extend describes
+		size_t item = 0;
+		size_t total_entry = 0;
+		size_t clean_entry = 0;
+		size_t deleted_entry = 0;		//tombstones, reclaimed by sweeping
+		size_t total_block = 0;
+		size_t free_block = 0;
+		size_t record_bytes = 0;		//keys and values of items
+		size_t padding_bytes = 0;
+		size_t free_section = 0;		//runs of adjacent free blocks
+		size_t max_free_section = 0;	//in blocks
+		size_t pooled_block = 0;		//free blocks in slots kept by pool
+		size_t room = 0;				//projected items can be inserted at current average size
+		//bucket 0 holds 0, bucket i holds [2^(i-1), 2^i), the last one holds all bigger values
+		static constexpr unsigned BUCKETS = 40;
+		size_t probe_distance[BUCKETS] = {};	//from home position of item
+		size_t free_section_size[BUCKETS] = {};	//in blocks
+	};
+	// results may be inaccurate if the file is being updated by SHARED instances
+	static bool Inspect(const std::string& path, Layout& out, unsigned concurrency=0);
+
+	bool dump(const std::string& path) const noexcept;
+
+	//Delta API, chunks written by this instance are tracked since loading or the last delta
+	//writers are blocked during dumping, replicas should apply deltas in order.
+	//not available in SHARED mode, where changes by other writers are unknown
+	bool dump_delta(const std::string& path) const;
+	// the file should not be loaded by anyone, deltas not following the last one are refused
+	static bool ApplyDelta(const std::string& path, const std::string& delta);
+
+	//Log API, log is committed in group by a background thread
+	//wait until all updates before are durable.
+	//once log fails, it returns false and writes are refused until a checkpoint succeeds
+	bool sync() const;
+	//dump to path atomically and truncate log, writers are blocked during dumping.
+	//with log, the new file stays locked by this instance like the base file
+	bool checkpoint(const std::string& path) const;
 
 	struct Meta;
 	struct Lock;
+	struct Pool;
+
+	// pids of live readers attached to path by READ_ONLY, slots left by dead ones are cleared.
+	// pids may be reused by system, so it's a hint only
+	static std::vector<int> Readers(const std::string& path);
 
 private:
 	MemMap m_resource;
@@ -104,6 +285,8 @@ private:
 		uint32_t max_key_len : 8;
 		uint32_t max_val_len : 24;
 		uint32_t reserved_block = 0;
+		uint32_t val_head = 0;	//bytes stored ahead of value at most
+		uint32_t expire_head = 0;	//bytes of expire time ahead of value
 		uint64_t seed = 0;
 		size_t total_block = 0;
 		Divisor<uint64_t> total_entry;
@@ -112,15 +295,54 @@ private:
 	uint64_t* m_table = nullptr;
 	uint8_t* m_data = nullptr;
 	std::unique_ptr<uint8_t[]> m_monopoly_extra;
+	struct Tier;
+	Tier* m_tier = nullptr;
+	struct Codec;
+	Codec* m_codec = nullptr;
+	struct Wal;
+	Wal* m_wal = nullptr;
+	struct Replica;
+	Replica* m_replica = nullptr;
+	Pool* m_pool = nullptr;		//in file, only for pool mode
+	struct Attach;
+	Attach* m_attach = nullptr;	//only for READ_ONLY
+	mutable struct {
+		size_t cursor = 0;
+		size_t done = 0;
+	} m_warm;
+	mutable std::vector<uint64_t> m_dirty;	//bitmap of written chunks
 
 	Estuary(const Estuary&) noexcept = delete;
 	Estuary& operator=(const Estuary&) noexcept = delete;
 
+	bool _stable(uint64_t version) const noexcept;
 	bool _fetch(uint64_t code, Slice key, std::string& out) const;
+	bool _peek(uint64_t code, Slice key, Slice& out, Ticket& ticket) const;
 	bool _erase(Slice key) const;
-	bool _update(Slice key, Slice val) const;
+	bool _update(Slice key, Slice val, uint32_t expire=0) const;
+	void _log(bool erase, Slice key, Slice val={}, uint32_t expire=0) const;
+	bool _log_failed() const noexcept;
+	bool _scan(Cursor& cursor) const;
+	bool _located(size_t blk) const;
+	bool _resume(Cursor& cursor) const;
+	void _sweep(size_t budget) const;
+	void _clean_tail(size_t pos) const;
+	void _move_record(size_t vic) const;
+	bool _defrag(size_t need, size_t budget) const;
+	void _release(size_t blk, size_t bcnt) const;
+	size_t _reuse(size_t bcnt) const;
+	void _link(size_t blk, uint16_t stamp) const;
+	void _unlink(size_t blk) const;
+
+	void _heat(const uint8_t* block) const noexcept;
+	void _dirty(size_t off, size_t len) const noexcept;
+	void _sync_entry(const void* entry) const noexcept;
+	uint64_t* _local_table() const noexcept;
+	void _dirty_block(size_t blk, size_t cnt=1) const noexcept;
 
 	void _init(MemMap&& res, bool monopoly, const char* path);
+	bool _tier();
+	bool _replicate();
 };
 
 } //estuary
@@ -0,0 +1,132 @@
+//==============================================================================
+// Dictionary designed for read-mostly scene.
+// Copyright (C) 2020	Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#pragma once
+#ifndef ESTUARY_HANDLE_H
+#define ESTUARY_HANDLE_H
+
+#include <cstdint>
+#include <functional>
+#include "estuary.h"
+#include "lucky_estuary.h"
+#include "sharded_estuary.h"
+
+namespace estuary {
+
+//readers count themselves in striped slots by epoch parity, swappers publish the new instance,
+//flip the epoch twice and wait for old parities to drain before destroying the old instance.
+//it works like LuckyEstuary with epoch, but in private memory.
+class HandleCore {
+public:
+	struct Epoch;
+	struct Loading;
+	HandleCore(const HandleCore&) = delete;
+	HandleCore& operator=(const HandleCore&) = delete;
+
+protected:
+	explicit HandleCore(void (*destroy)(void*), void* dict);
+	~HandleCore() noexcept;
+
+	const void* _enter(uint32_t*& active) const noexcept;
+	static void _leave(uint32_t* active) noexcept;
+	void _swap(void* dict);
+	bool _reload(std::function<void*()>&& load);
+	bool _wait();
+	uint64_t _version() const noexcept;
+
+private:
+	void (*m_destroy)(void*);
+	void* m_current;
+	Epoch* m_epoch;
+	Loading* m_loading;
+};
+
+// versioned handle for switching to a freshly loaded dictionary under live traffic.
+// readers take the current instance by get() without locking, and keep it alive until
+// the guard is released. the old one is destroyed by the swapping thread once readers
+// have left, so guards should be short-lived.
+template <typename Dict>
+class Handle final : private HandleCore {
+public:
+	class Guard final {
+	public:
+		const Dict* operator->() const noexcept { return m_dict; }
+		const Dict& operator*() const noexcept { return *m_dict; }
+		bool operator!() const noexcept { return m_dict == nullptr || !*m_dict; }
+
+		Guard(Guard&& other) noexcept : m_dict(other.m_dict), m_active(other.m_active) {
+			other.m_dict = nullptr;
+			other.m_active = nullptr;
+		}
+		Guard& operator=(Guard&& other) noexcept {
+			if (&other != this) {
+				this->~Guard();
+				new(this)Guard(std::move(other));
+			}
+			return *this;
+		}
+		~Guard() noexcept { HandleCore::_leave(m_active); }
+
+	private:
+		friend class Handle;
+		const Dict* m_dict = nullptr;
+		uint32_t* m_active = nullptr;
+		Guard() noexcept = default;
+		Guard(const Guard&) = delete;
+		Guard& operator=(const Guard&) = delete;
+	};
+	Guard get() const noexcept {
+		Guard guard;
+		guard.m_dict = (const Dict*)_enter(guard.m_active);
+		return guard;
+	}
+
+	// switch to dict and wait until the old one is destroyed.
+	// it waits for all guards, so calling it with a guard held by the same thread deadlocks
+	void swap(Dict&& dict) {
+		_swap(new Dict(std::move(dict)));
+	}
+	// load a new instance in a background thread, and switch to it when done.
+	// data can be warmed up in load before switching, so readers never wait for page faults.
+	// reload and wait should be called by one thread, return false if the last one is not waited
+	bool reload(std::function<Dict()> load) {
+		return _reload([load]()->void* {
+			auto dict = load();
+			return !dict? nullptr : new Dict(std::move(dict));
+		});
+	}
+	// wait for the background loading, return whether it has been switched in.
+	// exceptions from load are logged and taken as failure.
+	// it waits for the switching, so don't call it with a guard held either
+	bool wait() { return _wait(); }
+	// number of switches done
+	uint64_t version() const noexcept { return _version(); }
+
+	Handle() : HandleCore(Destroy, nullptr) {}
+	explicit Handle(Dict&& dict) : HandleCore(Destroy, new Dict(std::move(dict))) {}
+
+private:
+	static void Destroy(void* dict) { delete (Dict*)dict; }
+};
+
+using EstuaryHandle = Handle<Estuary>;
+using LuckyEstuaryHandle = Handle<LuckyEstuary>;
+using ShardedEstuaryHandle = Handle<ShardedEstuary>;
+
+} //estuary
+#endif //ESTUARY_HANDLE_H
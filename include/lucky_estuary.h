@@ -29,6 +29,9 @@
 
 namespace estuary {
 
+template <unsigned KeyLen, unsigned ValLen>
+class LuckyEstuaryT;
+
 class LuckyEstuary final {
 public:
 	bool fetch(const uint8_t* key, uint8_t* val) const;
@@ -40,10 +43,32 @@ public:
 							 uint8_t* __restrict__ data, unsigned* __restrict__ miss) const {
 		return _batch_fetch(batch, nullptr, keys, data, miss);
 	}
+	// writers can work in parallel when loaded as MONOPOLY or COPY_DATA
 	bool erase(const uint8_t* key) const;
 	bool update(const uint8_t* key, const uint8_t* val) const;
 	size_t batch_update(IDataReader& source) const;
 
+	//Scan API, nodes are visited in order by sequential reading, only those in table are given.
+	//nodes can be split into total pieces for parallel scanning, each cursor covers one piece.
+	//items updated during scanning may be missed or visited twice
+	class Cursor final {
+	public:
+		//return false at the end
+		bool next(uint8_t* key, uint8_t* val);
+		Cursor() = default;
+	private:
+		friend class LuckyEstuary;
+		const LuckyEstuary* m_dict = nullptr;
+		uint32_t m_pos = 0;
+		uint32_t m_end = 0;
+	};
+	Cursor scan(unsigned piece=0, unsigned total=1) const;
+
+	//Warmup API for LAZY loading, which can be called by a background thread at any rate
+	//fault in about budget bytes of data, return true when nothing is left to do
+	bool warmup(size_t budget) const noexcept;
+	unsigned warmup_progress() const noexcept;	//0-100
+
 	bool operator!() const noexcept { return m_meta == nullptr; }
 	unsigned key_len() const noexcept { return m_const.key_len; }
 	unsigned val_len() const noexcept { return m_const.val_len; }
@@ -53,14 +78,19 @@ public:
 	LuckyEstuary() = default;
 	LuckyEstuary(LuckyEstuary&& other) noexcept
 		: m_resource(std::move(other.m_resource)), m_meta(other.m_meta), m_const(other.m_const),
-		  m_lock(other.m_lock), m_stamps(other.m_stamps), m_recycle(other.m_recycle), m_table(other.m_table),
-		  m_data(other.m_data), m_monopoly_extra(std::move(other.m_monopoly_extra))
+		  m_lock(other.m_lock), m_stripes(other.m_stripes), m_epoch(other.m_epoch), m_stamps(other.m_stamps),
+		  m_recycle(other.m_recycle), m_table(other.m_table), m_buckets(other.m_buckets), m_version(other.m_version),
+		  m_data(other.m_data), m_monopoly_extra(std::move(other.m_monopoly_extra)), m_warm(other.m_warm)
 	{
 		other.m_meta = nullptr;
 		other.m_lock = nullptr;
+		other.m_stripes = nullptr;
+		other.m_epoch = nullptr;
 		other.m_stamps = nullptr;
 		other.m_recycle = nullptr;
 		other.m_table = nullptr;
+		other.m_buckets = nullptr;
+		other.m_version = nullptr;
 		other.m_data = nullptr;
 	}
 	LuckyEstuary& operator=(LuckyEstuary&& other) noexcept {
@@ -77,28 +107,59 @@ public:
 	static constexpr size_t MIN_CAPACITY = UINT16_MAX+1;
 	static constexpr size_t MAX_CAPACITY = UINT32_MAX-(UINT16_MAX+1);
 	static constexpr size_t MAX_LOAD_FACTOR = 2;
+	static constexpr size_t MAX_CUCKOO_LOAD = 95;	//percent of slots
 	struct Config {
 		uint32_t entry = MIN_CAPACITY;
 		uint32_t capacity = MIN_CAPACITY;
 		unsigned key_len = sizeof(uint64_t);		//1-255
 		unsigned val_len = 0;						//0-65536
+		unsigned concurrency = 1;					//threads for building, 0 means all cores
+		// readers register in an epoch table, nodes are reused once all readers have left,
+		// instead of waiting for a fixed delay. a reader crashed in SHARED mode blocks writers.
+		bool epoch = false;
+		// two-choice buckets with inline tags instead of chains, a probe touches two known cache lines.
+		// entry means slots here, split into buckets of 12, capacity can reach MAX_CUCKOO_LOAD percent of them.
+		// writers are serialized, and Grow is not supported.
+		bool cuckoo = false;
 	};
 
 	static bool Create(const std::string& path, const Config& config, IDataReader* source=nullptr);
-	enum LoadPolicy {SHARED, MONOPOLY, COPY_DATA};
+	// LAZY works like MONOPOLY without populating, only table is warmed up at loading
+	enum LoadPolicy {SHARED, MONOPOLY, COPY_DATA, LAZY};
 	static LuckyEstuary Load(const std::string& path, LoadPolicy policy=MONOPOLY);
 	static LuckyEstuary Load(size_t size, const std::function<bool(uint8_t*)>& load);
 
-	// only capacity can be extended, entry cannot
+	// only capacity can be extended
 	// percent should be 1-100
 	static bool Extend(const std::string& path, unsigned percent, Config* result=nullptr);
+	// offline tool, entry is extended by relinking nodes into a new file which replaces the old one,
+	// so capacity can be extended further. the file should not be loaded by anyone, and about
+	// the same space is needed beside it.
+	// there is no online growing with a dual-table lookup, reload the grown file instead
+	static bool Grow(const std::string& path, unsigned percent, Config* result=nullptr);
 
-	bool dump(const std::string& path) const noexcept {
-		return m_resource.dump(path.c_str());
-	}
+	//Inspect API, analyze a saved file without loading, buckets are scanned in parallel
+	struct Layout {
+		Config config;					//the same as Extend describes
+		uint32_t item = 0;
+		uint32_t empty_entry = 0;		//buckets without any node, or empty slots for cuckoo
+		uint32_t max_chain = 0;			//or the fullest bucket for cuckoo
+		uint32_t free_node = 0;			//nodes in free list
+		uint32_t recycling_node = 0;	//nodes waiting in recycle ring
+		uint32_t room = 0;				//items can be inserted
+		//bucket 0 holds 0, bucket i holds [2^(i-1), 2^i), the last one holds all bigger values
+		static constexpr unsigned BUCKETS = 33;
+		uint64_t chain_length[BUCKETS] = {};	//nodes in bucket
+	};
+	// results may be inaccurate if the file is being updated by SHARED instances
+	static bool Inspect(const std::string& path, Layout& out, unsigned concurrency=0);
+
+	bool dump(const std::string& path) const noexcept;
 
 	struct Meta;
 	struct Lock;
+	struct Epoch;
+	struct Bucket;
 
 private:
 	MemMap m_resource;
@@ -112,21 +173,87 @@ private:
 		Divisor<uint64_t> total_entry;
 	} m_const;
 	Lock* m_lock = nullptr;
+	struct Stripe;
+	Stripe* m_stripes = nullptr;
+	Epoch* m_epoch = nullptr;
 	int64_t* m_stamps = nullptr;
 	uint32_t* m_recycle = nullptr;
 	uint32_t* m_table = nullptr;
+	Bucket* m_buckets = nullptr;	//only for cuckoo
+	uint64_t* m_version = nullptr;	//odd when items are moving between buckets
 	uint8_t* m_data = nullptr;
 	std::unique_ptr<uint8_t[]> m_monopoly_extra;
+	mutable struct {
+		size_t cursor = 0;
+		size_t done = 0;
+	} m_warm;
 
+	bool _linked(uint32_t id, const uint8_t* key) const noexcept;
 	void _recycle(uint32_t vic) const;
-	bool _erase(const uint8_t* key) const;
-	bool _update(const uint8_t* key, const uint8_t* val) const;
+	void _reclaim() const;
+	void _synchronize(uint64_t target) const;
+	uint32_t _allocate() const;
+	uint32_t _allocate(Stripe& stripe) const;
+	void _retire(Stripe& stripe, uint32_t vic) const;
+	void _flush(Stripe& stripe) const;
+	void _mark_writing() const;
+	bool _erase(uint32_t entry, const uint8_t* key, Stripe* stripe=nullptr) const;
+	bool _update(uint32_t entry, const uint8_t* key, const uint8_t* val, Stripe* stripe=nullptr) const;
+	bool _cuckoo_erase(const uint8_t* key) const;
+	bool _cuckoo_update(const uint8_t* key, const uint8_t* val) const;
+	bool _cuckoo_vacate(const uint32_t where[2], uint32_t& bucket, unsigned& slot) const;
 
 	void _init(MemMap&& res, bool monopoly, const char* path);
 
 	unsigned _batch_fetch(unsigned batch, const uint8_t* __restrict__ dft_val,
 						  const uint8_t* __restrict__ keys, uint8_t* __restrict__ data, unsigned* miss) const;
+
+	template <unsigned, unsigned> friend class LuckyEstuaryT;
+	template <typename Shape>
+	bool _fetch(const Shape& shape, const uint8_t* key, uint8_t* val) const;
+	template <typename Shape>
+	unsigned _batch_fetch(const Shape& shape, unsigned batch, const uint8_t* __restrict__ dft_val,
+						  const uint8_t* __restrict__ keys, uint8_t* __restrict__ data, unsigned* miss) const;
+	template <typename Shape>
+	unsigned _cuckoo_batch_fetch(const Shape& shape, unsigned batch, const uint8_t* __restrict__ dft_val,
+								 const uint8_t* __restrict__ keys, uint8_t* __restrict__ data, unsigned* miss) const;
 };
 
+// read-only view with key and value widths known by compiler, which makes lookups a little faster.
+// it's bound only when widths match, only widths listed in LUCKY_FIXED_WIDTHS are available.
+template <unsigned KeyLen, unsigned ValLen>
+class LuckyEstuaryT final {
+public:
+	LuckyEstuaryT() = default;
+	explicit LuckyEstuaryT(const LuckyEstuary& dict) noexcept
+		: m_dict(!dict || dict.key_len() != KeyLen || dict.val_len() != ValLen? nullptr : &dict) {}
+
+	bool fetch(const uint8_t* key, uint8_t* val) const;
+	unsigned batch_fetch(unsigned batch, const uint8_t* __restrict__ keys, uint8_t* __restrict__ data,
+						 const uint8_t* __restrict__ dft_val=nullptr) const {
+		return _batch_fetch(batch, dft_val, keys, data, nullptr);
+	}
+	unsigned batch_try_fetch(unsigned batch, const uint8_t* __restrict__ keys,
+							 uint8_t* __restrict__ data, unsigned* __restrict__ miss) const {
+		return _batch_fetch(batch, nullptr, keys, data, miss);
+	}
+	bool operator!() const noexcept { return m_dict == nullptr; }
+
+private:
+	const LuckyEstuary* m_dict = nullptr;
+
+	unsigned _batch_fetch(unsigned batch, const uint8_t* __restrict__ dft_val,
+						  const uint8_t* __restrict__ keys, uint8_t* __restrict__ data, unsigned* miss) const;
+};
+
+#define LUCKY_FIXED_WIDTHS(X) \
+	X(4, 0) X(4, 4) X(4, 8) X(4, 16) X(4, 32) X(4, 64) X(4, 128) \
+	X(8, 0) X(8, 4) X(8, 8) X(8, 16) X(8, 32) X(8, 64) X(8, 128) \
+	X(16, 0) X(16, 4) X(16, 8) X(16, 16) X(16, 32) X(16, 64) X(16, 128)
+
+#define DECLARE_FIXED_VIEW(key_len, val_len) extern template class LuckyEstuaryT<key_len, val_len>;
+LUCKY_FIXED_WIDTHS(DECLARE_FIXED_VIEW)
+#undef DECLARE_FIXED_VIEW
+
 } //estuary
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+//==============================================================================
+// Dictionary designed for read-mostly scene.
+// Copyright (C) 2020	Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#pragma once
+#ifndef SHARDED_ESTUARY_H
+#define SHARDED_ESTUARY_H
+
+#include <string>
+#include <vector>
+#include "estuary.h"
+
+namespace estuary {
+
+// keys are routed to shard files by a fixed hash, so every shard has its own lock,
+// table and data. shards can be written in parallel, extended and rebuilt one by one.
+class ShardedEstuary final {
+public:
+	bool fetch(Slice key, std::string& out) const { return m_shards[locate(key)].fetch(key, out); }
+	bool erase(Slice key) const { return m_shards[locate(key)].erase(key); }
+	bool update(Slice key, Slice val) const { return m_shards[locate(key)].update(key, val); }
+
+	//Batch API, return number of hits
+	//out should hold batch strings, index of missing keys will be written to miss if provided
+	unsigned batch_fetch(unsigned batch, const Slice* __restrict__ keys, std::string* __restrict__ out,
+						 unsigned* __restrict__ miss=nullptr) const;
+
+	bool operator!() const noexcept { return m_shards.empty(); }
+	unsigned shards() const noexcept { return m_shards.size(); }
+	unsigned locate(Slice key) const noexcept;
+	const Estuary& shard(unsigned idx) const noexcept { return m_shards[idx]; }
+	size_t item() const noexcept;
+	size_t data_free() const;
+	size_t item_limit() const;
+
+	ShardedEstuary() = default;
+	ShardedEstuary(ShardedEstuary&&) noexcept = default;
+	ShardedEstuary& operator=(ShardedEstuary&&) noexcept = default;
+
+	static constexpr unsigned MAX_SHARDS = 256;
+	static std::string ShardPath(const std::string& path, unsigned idx);
+	// item_limit in config is shared by all shards in proportion to their records
+	static bool Create(const std::string& path, unsigned shards, const Estuary::Config& config,
+					   IDataReader* source=nullptr);
+	// rebuild one shard offline with records belonged to it, other records in source are skipped
+	static bool Rebuild(const std::string& path, unsigned shards, unsigned idx,
+						const Estuary::Config& config, IDataReader& source);
+	static ShardedEstuary Load(const std::string& path, unsigned shards,
+							   Estuary::LoadPolicy policy=Estuary::MONOPOLY);
+
+	bool dump(const std::string& path) const noexcept;
+
+private:
+	std::vector<Estuary> m_shards;
+
+	ShardedEstuary(const ShardedEstuary&) noexcept = delete;
+	ShardedEstuary& operator=(const ShardedEstuary&) noexcept = delete;
+};
+
+} //estuary
+#endif //SHARDED_ESTUARY_H
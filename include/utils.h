@@ -31,6 +31,9 @@ namespace estuary {
 
 extern int OpenAndLock(const char* path, bool exclusive=true, bool create=false) noexcept;
 extern bool ExtendFile(int fd, size_t size) noexcept;
+extern bool SyncFile(const char* path, bool directory=false) noexcept;
+//fd should be of tmp, which is synced and renamed to path, the directory is synced at last
+extern bool ReplaceFile(int fd, const char* tmp, const char* path) noexcept;
 
 class MemMap final {
 public:
@@ -43,6 +46,13 @@ public:
 	struct LoadByCopy {};
 	static constexpr LoadByCopy load_by_copy = {};
 	explicit MemMap(const char* path, LoadByCopy);
+	struct LoadByDemand {};	//private mapping, pages are read when touched
+	static constexpr LoadByDemand load_by_demand = {};
+	explicit MemMap(const char* path, LoadByDemand) noexcept;
+	struct ReadOnly {};	//shared mapping without write permission, file is locked in shared mode
+	static constexpr ReadOnly read_only = {};
+	explicit MemMap(const char* path, ReadOnly) noexcept;
+	explicit MemMap(int fd, ReadOnly) noexcept;	// doesn't hold fd, pages are read when touched
 	MemMap(size_t size, const std::function<bool(uint8_t*)>& load);
 
 	MemMap(MemMap&& other) noexcept
@@ -63,7 +73,10 @@ public:
 	uint8_t* addr() const noexcept { return m_addr; }
 	const uint8_t* end() const noexcept { return m_addr + m_size; }
 	bool operator!() const noexcept { return m_addr == nullptr; }
+	int fd() const noexcept { return m_fd; }	//negative if file is not held
 	bool dump(const char* path) const noexcept;
+	// fault in pages of [off, off+len) ahead of use
+	void warmup(size_t off, size_t len) const noexcept;
 
 private:
 	MemMap(const MemMap&) noexcept = delete;
@@ -82,6 +95,7 @@ struct IDataReader {
 	struct Record {
 		Slice key;
 		Slice val;
+		uint32_t expire = 0;	//unix time in seconds, 0 means never, used by Estuary with expiration
 	};
 	virtual void reset() = 0;
 	virtual size_t total() = 0;
@@ -103,6 +117,47 @@ private:
 	static Logger* s_instance;
 };
 
+//process wide statistics, which are recorded only when the library is built with ENABLE_STATISTICS
+struct Statistics {
+	enum Counter {
+		FETCH,				//lookups by Estuary, retries included
+		FETCH_MISS,
+		FETCH_RETRY,		//lookups restarted since entries were moved by sweeping
+		UPDATE,
+		SWEEP_NS,			//time spent in sweeping by updates
+		DEFRAG_NS,			//time spent in defragmentation by updates and compacting
+		DEFRAG_BLOCK,		//blocks of records moved by defragmentation
+		POOL_REUSE,			//updates written into freed slots kept by pool
+		LUCKY_FETCH,
+		LUCKY_FETCH_MISS,
+		LUCKY_UPDATE,
+		RECLAIM_WAIT_NS,	//time LuckyEstuary writers wait for readers before reusing nodes
+		COUNTER_NUM
+	};
+	enum Histogram {
+		PROBE_LENGTH,		//entries passed before the end of an Estuary lookup
+		CHAIN_LENGTH,		//nodes visited by a LuckyEstuary lookup
+		UPDATE_NS,			//time spent by an Estuary update under lock
+		LUCKY_UPDATE_NS,
+		HISTOGRAM_NUM
+	};
+	//bucket 0 holds 0, bucket i holds [2^(i-1), 2^i), the last one holds all bigger values
+	static constexpr unsigned BUCKETS = 40;
+
+	bool enabled = false;
+	uint64_t counter[COUNTER_NUM] = {};
+	uint64_t histogram[HISTOGRAM_NUM][BUCKETS] = {};
+
+	uint64_t count(Histogram h) const noexcept;
+	//upper bound of the bucket holding the p-th (0-1) value
+	uint64_t percentile(Histogram h, double p) const noexcept;
+	//activities between two snapshots
+	Statistics operator-(const Statistics& base) const noexcept;
+};
+
+//aggregate statistics of all threads on demand, values are cumulative since process start
+extern Statistics Stats() noexcept;
+
 //Robison
 template <typename Word>
 class Divisor final {
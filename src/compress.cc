@@ -0,0 +1,184 @@
+//==============================================================================
+// Dictionary designed for read-mostly scene.
+// Copyright (C) 2020  Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <cstring>
+#include "internal.h"
+
+namespace estuary {
+
+static constexpr unsigned MIN_MATCH = 4;
+static constexpr unsigned HASH_BITS = 12;
+static constexpr unsigned DICT_HASH_BITS = 14;
+static constexpr size_t MAX_DISTANCE = UINT16_MAX;
+static_assert(CompressDict::MAX_SIZE < MAX_DISTANCE);
+
+static FORCE_INLINE uint32_t Read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static FORCE_INLINE uint32_t HashOf(uint32_t v, unsigned bits) {
+	return (v * 2654435761U) >> (32U - bits);
+}
+
+void CompressDict::init(const uint8_t* data, size_t size) {
+	m_data = data;
+	m_size = std::min(size, MAX_SIZE);
+	m_table = std::make_unique<uint32_t[]>(1U << DICT_HASH_BITS);
+	for (size_t i = 0; i + MIN_MATCH <= m_size; i++) {
+		m_table[HashOf(Read32(m_data+i), DICT_HASH_BITS)] = i + 1;
+	}
+}
+
+// LZ4 block format: token, literals, 16bit distance, match. last sequence has only literals.
+// distance may reach into dictionary which lies just before input.
+size_t Compress(const uint8_t* src, size_t len, const CompressDict& dict, uint8_t* out, size_t cap) noexcept {
+	uint32_t table[1U << HASH_BITS];
+	memset(table, 0, sizeof(table));
+	size_t op = 0;
+	auto put_len = [out, cap, &op](size_t n)->bool {
+		for (; n >= UINT8_MAX; n -= UINT8_MAX) {
+			if (op >= cap) return false;
+			out[op++] = UINT8_MAX;
+		}
+		if (op >= cap) return false;
+		out[op++] = n;
+		return true;
+	};
+	auto put_sequence = [out, cap, &op, &put_len](const uint8_t* lit, size_t lit_len,
+			size_t distance, size_t match_len)->bool {
+		if (op >= cap) return false;
+		auto& token = out[op++];
+		const auto extra = match_len != 0? match_len - MIN_MATCH : 0;
+		token = (std::min<size_t>(lit_len, 15U) << 4U) | std::min<size_t>(extra, 15U);
+		if (lit_len >= 15U && !put_len(lit_len - 15U)) {
+			return false;
+		}
+		if (op + lit_len > cap) return false;
+		memcpy(out+op, lit, lit_len);
+		op += lit_len;
+		if (match_len == 0) {
+			return true;
+		}
+		if (op + 2 > cap) return false;
+		out[op++] = distance & 0xffU;
+		out[op++] = distance >> 8U;
+		return extra < 15U || put_len(extra - 15U);
+	};
+
+	size_t anchor = 0;
+	for (size_t i = 0; i + MIN_MATCH <= len; ) {
+		const auto v = Read32(src+i);
+		auto& slot = table[HashOf(v, HASH_BITS)];
+		const size_t cand = slot;
+		slot = i + 1;
+		size_t distance = 0;
+		size_t match_len = 0;
+		if (cand != 0 && i - (cand-1) <= MAX_DISTANCE && Read32(src+cand-1) == v) {
+			const auto ref = src + cand - 1;
+			match_len = MIN_MATCH;
+			while (i + match_len < len && ref[match_len] == src[i+match_len]) {
+				match_len++;
+			}
+			distance = i - (cand-1);
+		} else if (dict.size() != 0) {
+			const size_t pos = dict.table()[HashOf(v, DICT_HASH_BITS)];
+			if (pos != 0 && i + dict.size() - (pos-1) <= MAX_DISTANCE && Read32(dict.data()+pos-1) == v) {
+				const auto ref = dict.data() + pos - 1;
+				const size_t limit = dict.size() - (pos-1);
+				match_len = MIN_MATCH;
+				while (match_len < limit && i + match_len < len && ref[match_len] == src[i+match_len]) {
+					match_len++;
+				}
+				distance = i + limit;
+			}
+		}
+		if (match_len == 0) {
+			i++;
+			continue;
+		}
+		if (!put_sequence(src+anchor, i-anchor, distance, match_len)) {
+			return 0;
+		}
+		i += match_len;
+		anchor = i;
+	}
+	if (!put_sequence(src+anchor, len-anchor, 0, 0)) {
+		return 0;
+	}
+	return op;
+}
+
+bool Decompress(const uint8_t* src, size_t len, const CompressDict& dict, uint8_t* out, size_t raw_len) noexcept {
+	size_t ip = 0;
+	size_t op = 0;
+	auto get_len = [src, len, &ip](size_t& n)->bool {
+		uint8_t b;
+		do {
+			if (ip >= len) return false;
+			b = src[ip++];
+			n += b;
+		} while (b == UINT8_MAX);
+		return true;
+	};
+	while (ip < len) {
+		const auto token = src[ip++];
+		size_t lit_len = token >> 4U;
+		if (lit_len == 15U && !get_len(lit_len)) {
+			return false;
+		}
+		if (lit_len > len - ip || lit_len > raw_len - op) {
+			return false;
+		}
+		memcpy(out+op, src+ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == len) {
+			break;
+		}
+		if (ip + 2 > len) {
+			return false;
+		}
+		const size_t distance = src[ip] | (src[ip+1] << 8U);
+		ip += 2;
+		size_t match_len = token & 15U;
+		if (match_len == 15U && !get_len(match_len)) {
+			return false;
+		}
+		match_len += MIN_MATCH;
+		if (distance == 0 || distance > op + dict.size() || match_len > raw_len - op) {
+			return false;
+		}
+		size_t k = 0;
+		if (distance > op) {	//from dictionary
+			const auto back = distance - op;
+			const auto ref = dict.data() + dict.size() - back;
+			const auto n = std::min(back, match_len);
+			memcpy(out+op, ref, n);
+			k = n;
+		}
+		for (; k < match_len; k++) {	//may overlap
+			out[op+k] = out[op+k-distance];
+		}
+		op += match_len;
+	}
+	return op == raw_len;
+}
+
+} //estuary
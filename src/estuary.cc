@@ -17,10 +17,28 @@
 //==============================================================================
 
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <ctime>
+#include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <estuary.h>
 #include "internal.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 namespace estuary {
 
@@ -32,9 +50,14 @@ const char* DataException::what() const noexcept {
 }
 
 static constexpr uint16_t MAGIC = 0xE998;
+static constexpr uint16_t MAGIC_EXT = 0xE999;	//with features
+static constexpr uint8_t FEATURE_COMPRESS = 1U;
+static constexpr uint8_t FEATURE_EXPIRE = 2U;
+static constexpr uint8_t FEATURE_POOL = 4U;
+static constexpr uint8_t ALL_FEATURES = FEATURE_COMPRESS | FEATURE_EXPIRE | FEATURE_POOL;
 struct Estuary::Meta {
 	uint16_t magic = MAGIC;
-	uint8_t _pad = 0;
+	uint8_t features = 0;
 	bool writing = false;
 	uint32_t kv_limit = 0;
 	uint64_t seed = 0;
@@ -53,10 +76,17 @@ size_t Estuary::item() const noexcept {
 
 struct Estuary::Lock {
 	pthread_mutex_t core;
-	uint8_t _pad1[64U-(sizeof(pthread_mutex_t)&63U)];
-	bool sweeping = false;
-	uint8_t _pad2[7];
+	size_t sweep_cursor = 0;
+	uint64_t generation = 0;	//of committed writes
+	uint64_t delta = 0;		//generation of deltas, only the one in file is used
+	uint8_t _pad1[(64U-((sizeof(pthread_mutex_t)+sizeof(size_t)+sizeof(uint64_t)*2)&63U))&63U];
+	uint64_t version = 0;	//odd when entries are being moved
 };
+static_assert(offsetof(Estuary::Lock, version) % 64U == 0);
+
+uint64_t Estuary::generation() const noexcept {
+	return m_meta == nullptr? 0 : LoadAcquire(m_lock->generation);
+}
 
 static constexpr size_t MAX_OFF_MARK = 15U;
 static constexpr unsigned ADDR_BITWIDTH = 39U;		//4TB
@@ -123,6 +153,7 @@ static constexpr size_t MIN_ENTRY = 256;
 static constexpr size_t MAX_ENTRY = 1ULL << 34U;
 
 static constexpr size_t DATA_RESERVE_FACTOR = 10;   // 1/DATA_RESERVE_FACTOR data is reserved clean
+static constexpr size_t POOL_RESERVE_FACTOR = 32;   // less is reserved when freed slots are reused in place
 static constexpr size_t ENTRY_RESERVE_FACTOR = 8;   // 1/ENTRY_RESERVE_FACTOR entries are reserved clean
 static constexpr size_t TotalEntry(size_t item_limit) { return item_limit*3/2; }
 static constexpr size_t ItemLimit(size_t entry) { return entry*2/3; }
@@ -130,6 +161,10 @@ static_assert(ENTRY_RESERVE_FACTOR > 3);
 static_assert(MAX_ENTRY < DATA_BLOCK_LIMIT / 2);
 static_assert(MIN_ENTRY > ENTRY_RESERVE_FACTOR);
 
+static FORCE_INLINE size_t ReserveFactor(uint8_t features) {
+	return (features & FEATURE_POOL)? POOL_RESERVE_FACTOR : DATA_RESERVE_FACTOR;
+}
+
 static constexpr size_t DATA_BLOCK_SIZE = 8;
 static_assert((DATA_BLOCK_SIZE % sizeof(uint64_t)) == 0);
 
@@ -141,7 +176,8 @@ union RecordMark {
 	};
 	struct {
 		uint64_t klen_ : 8;
-		uint64_t bcnt : 56;
+		uint64_t bcnt : 48;
+		uint64_t pooled : 8;	//free section linked in pool
 	};
 	uint64_t u = 0;
 };
@@ -212,6 +248,260 @@ static FORCE_INLINE RecordMark MarkForEmpty(size_t bcnt) {
 
 #define BLK(idx) (m_data+(idx)*DATA_BLOCK_SIZE)
 
+//free slots are linked in lists by size class, each one looks like [mark][stamp|prev][next]...
+//classes grow by a quarter of power of 2, slots in class c hold ClassSize(c) blocks at least
+static constexpr size_t POOL_MIN_BLOCK = 3;
+static constexpr unsigned POOL_CLASSES = 160;	//149 are enough for 39 bits
+static constexpr uint64_t POOL_END = MAX_ADDR;
+static constexpr unsigned SLOT_ADDR_BITS = 48;
+static_assert(DATA_BLOCK_LIMIT < (1ULL << SLOT_ADDR_BITS));
+//a freed slot is not reused until readers that may still copy the old record are gone,
+//otherwise the same content written back to it looks unchanged to them
+static constexpr unsigned POOL_DELAY_MS = 50;
+
+struct Estuary::Pool {
+	struct {
+		uint64_t head;
+		uint64_t tail;
+	} lists[POOL_CLASSES];
+};
+
+static FORCE_INLINE uint64_t& SlotLink(uint8_t* block) {
+	return ((uint64_t*)block)[1];
+}
+static FORCE_INLINE uint64_t SlotPrev(uint8_t* block) {
+	return SlotLink(block) & ((1ULL << SLOT_ADDR_BITS) - 1U);
+}
+static FORCE_INLINE void SetSlotPrev(uint8_t* block, uint64_t prev) {
+	SlotLink(block) = (SlotLink(block) & ~((1ULL << SLOT_ADDR_BITS) - 1U)) | prev;
+}
+//when the slot was freed, in milliseconds of monotonic clock, wrapping in about a minute
+static FORCE_INLINE uint16_t SlotStamp(uint8_t* block) {
+	return SlotLink(block) >> SLOT_ADDR_BITS;
+}
+static FORCE_INLINE uint16_t PoolStamp() noexcept {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000U + ts.tv_nsec / 1000000U;
+}
+static FORCE_INLINE uint64_t& SlotNext(uint8_t* block) {
+	return ((uint64_t*)block)[2];
+}
+
+static FORCE_INLINE unsigned FloorClass(size_t bcnt) {
+	assert(bcnt >= POOL_MIN_BLOCK);
+	if (bcnt < 8) {
+		return bcnt - POOL_MIN_BLOCK;
+	}
+	const unsigned e = 63U - __builtin_clzll(bcnt);
+	return 5U + (e-3U)*4U + ((bcnt >> (e-2U)) & 3U);
+}
+static FORCE_INLINE size_t ClassSize(unsigned c) {
+	if (c < 5) {
+		return c + POOL_MIN_BLOCK;
+	}
+	return (4U + (c-5U)%4U) << ((c-5U)/4U + 1U);
+}
+static FORCE_INLINE unsigned CeilClass(size_t bcnt) {
+	if (bcnt <= POOL_MIN_BLOCK) {
+		return 0;
+	}
+	const auto c = FloorClass(bcnt);
+	return ClassSize(c) < bcnt? c+1 : c;
+}
+
+struct Estuary::Tier {
+	MemMap head;		//meta, lock and table
+	MemMap view;		//read-only shared mapping of file, pages are pinned in page cache through it
+	MemMap heat;		//sampled hits by page of data
+	std::vector<uint64_t> pinned;
+	std::vector<uint64_t> written;	//pages of data diverged from file
+	unsigned page_shift = 0;
+	size_t pinned_page = 0;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	~Tier() noexcept {
+		pthread_mutex_destroy(&lock);
+	}
+};
+
+static constexpr unsigned HEAT_SAMPLE_MASK = 15U;	//1/16 hits are counted
+static thread_local unsigned s_heat_tick = 0;
+
+FORCE_INLINE void Estuary::_heat(const uint8_t* block) const noexcept {
+	if (m_tier != nullptr && (++s_heat_tick & HEAT_SAMPLE_MASK) == 0) {
+		auto& heat = m_tier->heat.addr()[(block - m_resource.addr()) >> m_tier->page_shift];
+		const auto h = LoadRelaxed(heat);
+		if (h < UINT8_MAX) {
+			StoreRelaxed(heat, (uint8_t)(h+1));
+		}
+	}
+}
+
+static constexpr unsigned DELTA_CHUNK_SHIFT = 12U;	//4KB
+
+FORCE_INLINE void Estuary::_dirty(size_t off, size_t len) const noexcept {
+	const auto last = (off + len - 1) >> DELTA_CHUNK_SHIFT;
+	for (auto i = off >> DELTA_CHUNK_SHIFT; i <= last; i++) {
+		m_dirty[i/64] |= 1ULL << (i%64);
+	}
+}
+
+struct Estuary::Replica {
+	std::vector<MemMap> spaces;
+	std::vector<uint64_t*> tables;	//by node, the home node and offline nodes share the primary table
+};
+
+static constexpr unsigned NODE_REFRESH_MASK = 1023U;	//threads may migrate
+static thread_local struct {
+	unsigned node = 0;
+	unsigned tick = 0;
+} s_local;
+
+static FORCE_INLINE unsigned LocalNode() noexcept {
+	if ((s_local.tick++ & NODE_REFRESH_MASK) == 0) {
+		unsigned cpu = 0;
+		unsigned node = 0;
+		if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+			s_local.node = node;
+		}
+	}
+	return s_local.node;
+}
+
+FORCE_INLINE uint64_t* Estuary::_local_table() const noexcept {
+	if (m_replica == nullptr) {
+		return m_table;
+	}
+	const auto& tables = m_replica->tables;
+	const auto node = LocalNode();
+	return node < tables.size()? tables[node] : m_table;
+}
+
+//called after every store into the primary table
+FORCE_INLINE void Estuary::_sync_entry(const void* entry) const noexcept {
+	const size_t pos = (const uint64_t*)entry - m_table;
+	const size_t table_off = (m_data - m_resource.addr()) - m_const.total_entry.value() * sizeof(uint64_t);
+	_dirty(table_off + pos * sizeof(uint64_t), sizeof(uint64_t));
+	if (m_replica != nullptr) {
+		const auto val = LoadRelaxed(m_table[pos]);
+		for (auto table : m_replica->tables) {
+			if (table != m_table) {
+				StoreRelease(table[pos], val);
+			}
+		}
+	}
+}
+
+FORCE_INLINE void Estuary::_dirty_block(size_t blk, size_t cnt) const noexcept {
+	const auto off = (m_data - m_resource.addr()) + blk * DATA_BLOCK_SIZE;
+	_dirty(off, cnt * DATA_BLOCK_SIZE);
+	if (m_tier != nullptr) {	//marked before entries are published
+		auto& written = m_tier->written;
+		const auto last = (off + cnt * DATA_BLOCK_SIZE - 1) >> m_tier->page_shift;
+		for (auto i = off >> m_tier->page_shift; i <= last; i++) {
+			StoreRelease(written[i/64], (uint64_t)(LoadRelaxed(written[i/64]) | (1ULL << (i%64))));
+		}
+	}
+}
+
+struct Estuary::Codec {
+	CompressDict dict;
+};
+
+// a value is stored as [0][raw] or [1][raw length:24][compressed] in compression mode
+static constexpr unsigned VALUE_HEAD = 4;
+static constexpr size_t MIN_COMPRESS_LEN = 32;
+static_assert(Estuary::MAX_VAL_LEN < (1U << 24U));
+
+static Slice Encode(const CompressDict& dict, Slice val, std::string& buf) {
+	buf.resize(val.len + VALUE_HEAD);
+	auto out = (uint8_t*)buf.data();
+	if (val.len >= MIN_COMPRESS_LEN) {
+		auto n = Compress(val.ptr, val.len, dict, out+VALUE_HEAD, val.len-VALUE_HEAD);
+		if (n != 0) {
+			out[0] = 1;
+			out[1] = val.len & 0xffU;
+			out[2] = (val.len >> 8U) & 0xffU;
+			out[3] = val.len >> 16U;
+			return {out, n+VALUE_HEAD};
+		}
+	}
+	out[0] = 0;
+	if (val.len != 0) {
+		memcpy(out+1, val.ptr, val.len);
+	}
+	return {out, val.len+1};
+}
+
+static bool Decode(const CompressDict& dict, const uint8_t* src, size_t len, std::string& out) {
+	if (len != 0 && src[0] == 0) {
+		out.assign((const char*)src+1, len-1);
+		return true;
+	}
+	if (len < VALUE_HEAD || src[0] != 1) {
+		return false;
+	}
+	const size_t raw_len = src[1] | (src[2] << 8U) | (src[3] << 16U);
+	out.resize(raw_len);
+	return Decompress(src+VALUE_HEAD, len-VALUE_HEAD, dict, (uint8_t*)out.data(), raw_len);
+}
+
+static thread_local std::string s_codec_buf;
+
+//decode a stable copy in place
+static void Decode(const CompressDict& dict, std::string& out) {
+	if (!Decode(dict, (const uint8_t*)out.data(), out.size(), s_codec_buf)) {
+		throw DataException();
+	}
+	out.swap(s_codec_buf);
+}
+
+//raw value is still zero-copy, compressed one is decoded into a thread local buffer
+static bool Decode(const CompressDict& dict, Slice& out) {
+	static thread_local std::string buf;
+	if (out.len != 0 && out.ptr[0] == 0) {
+		out = {out.ptr+1, out.len-1};
+		return true;
+	}
+	if (!Decode(dict, out.ptr, out.len, buf)) {
+		return false;
+	}
+	out = {(const uint8_t*)buf.data(), buf.size()};
+	return true;
+}
+
+// expire time is stored ahead of the (encoded) value in expiration mode, 0 means never
+static constexpr unsigned EXPIRE_HEAD = sizeof(uint32_t);
+
+static FORCE_INLINE uint32_t Now() noexcept {
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+//head is 0 without expiration, a short value can only be read from a moving record
+static FORCE_INLINE bool Expired(const uint8_t* val, size_t vlen, unsigned head, uint32_t now) noexcept {
+	if (LIKELY(head == 0)) {
+		return false;
+	}
+	if (UNLIKELY(vlen < head)) {
+		return true;
+	}
+	uint32_t expire;
+	memcpy(&expire, val, sizeof(expire));
+	return expire != 0 && expire <= now;
+}
+
+//val should not point into buf
+static Slice WithExpire(Slice val, uint32_t expire, std::string& buf) {
+	buf.resize(EXPIRE_HEAD + val.len);
+	memcpy(&buf[0], &expire, EXPIRE_HEAD);
+	if (val.len != 0) {
+		memcpy(&buf[EXPIRE_HEAD], val.ptr, val.len);
+	}
+	return {(const uint8_t*)buf.data(), buf.size()};
+}
+
 template <typename Func>
 static FORCE_INLINE void SearchInTable(const Func& func, Entry* table, uint64_t total_entry, size_t pos, uint32_t tag) {
 	const auto end = table + total_entry;
@@ -231,11 +521,118 @@ static FORCE_INLINE void SearchInTable(const Func& func, uint64_t code, Entry* t
 	SearchInTable(func, table, total_entry.value(), code % total_entry, CutTag(code));
 }
 
+static constexpr unsigned GROUP_SIZE = CACHE_BLOCK_SIZE / sizeof(Entry);
+static_assert(GROUP_SIZE <= 32);
+
+struct GroupMask {
+	uint32_t hit;	//live entries with the tag
+	uint32_t clean;
+};
+
+// scan a group of entries at once, it's just a hint for readers
+static FORCE_INLINE GroupMask ScanGroup(const Entry* group, uint32_t tag) noexcept {
+	GroupMask mask = {0, 0};
+#if defined(__SSE2__)
+	const auto vtag = _mm_set1_epi8(static_cast<char>(tag));
+	const auto vaddr = _mm_set1_epi64x(MAX_ADDR);
+	const auto vone = _mm_set1_epi64x(1);
+	for (unsigned i = 0; i < GROUP_SIZE; i += 2) {
+		const auto v = _mm_loadu_si128((const __m128i*)(group+i));
+		const auto addr = _mm_and_si128(v, vaddr);
+		const unsigned t = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vtag));
+		const unsigned c = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(addr, vaddr)));
+		const unsigned d = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_or_si128(addr, vone), vaddr)));
+		//tag is the top byte, address takes two lanes of 32-bit which should both match
+		const unsigned empty = ((d & 3U) == 3U) | (((d & 12U) == 12U) << 1U);
+		const unsigned hit = (((t >> 7U) & 1U) | ((t >> 14U) & 2U)) & ~empty;
+		const unsigned clean = ((c & 3U) == 3U) | (((c & 12U) == 12U) << 1U);
+		mask.hit |= hit << i;
+		mask.clean |= clean << i;
+	}
+#elif defined(__aarch64__)
+	const auto vtag = vdupq_n_u64(tag);
+	const auto vaddr = vdupq_n_u64(MAX_ADDR);
+	const auto vone = vdupq_n_u64(1);
+	for (unsigned i = 0; i < GROUP_SIZE; i += 2) {
+		const auto v = vld1q_u64((const uint64_t*)(group+i));
+		const auto addr = vandq_u64(v, vaddr);
+		const auto empty = vceqq_u64(vorrq_u64(addr, vone), vaddr);
+		const auto hit = vbicq_u64(vceqq_u64(vshrq_n_u64(v, 56), vtag), empty);
+		const auto clean = vceqq_u64(addr, vaddr);
+		mask.hit |= ((vgetq_lane_u64(hit, 0) & 1U) | (vgetq_lane_u64(hit, 1) & 2U)) << i;
+		mask.clean |= ((vgetq_lane_u64(clean, 0) & 1U) | (vgetq_lane_u64(clean, 1) & 2U)) << i;
+	}
+#else
+	for (unsigned i = 0; i < GROUP_SIZE; i++) {
+		const auto e = group[i];
+		if (IsEmpty(e)) {
+			mask.clean |= static_cast<uint32_t>(IsClean(e)) << i;
+		} else {
+			mask.hit |= static_cast<uint32_t>(e.tag == tag) << i;
+		}
+	}
+#endif
+	return mask;
+}
+
+//entries before the first group aligned to cache line
+static FORCE_INLINE size_t GroupHead(const Entry* table, uint64_t total_entry) noexcept {
+	const auto misalign = (uintptr_t)table % CACHE_BLOCK_SIZE;
+	return std::min<size_t>(misalign == 0? 0 : (CACHE_BLOCK_SIZE - misalign) / sizeof(Entry), total_entry);
+}
+
+uint32_t ScanEntryGroup(const uint64_t* group, unsigned tag, uint32_t* clean) noexcept {
+	const auto mask = ScanGroup((const Entry*)group, tag);
+	*clean = mask.clean;
+	return mask.hit;
+}
+
+// same as SearchInTable, but entries neither clean nor with the tag can be skipped.
+// groups are aligned to cache line in memory, entries out of groups at both ends are scanned one by one.
+template <typename Func>
+static FORCE_INLINE void ProbeInTable(const Func& func, Entry* table, uint64_t total_entry, size_t pos, uint32_t tag) {
+	const auto head = GroupHead(table, total_entry);
+	const auto tail = total_entry - (total_entry - head) % GROUP_SIZE;
+	for (size_t i = 0; i < total_entry; ) {
+		if (UNLIKELY(pos < head || pos >= tail)) {
+			if (func(table[pos], tag, i)) {
+				return;
+			}
+			i++;
+			if (++pos >= total_entry) {
+				pos = 0;
+			}
+			continue;
+		}
+		const auto shift = (pos - head) % GROUP_SIZE;
+		const auto base = pos - shift;
+		const auto mask = ScanGroup(table+base, tag);
+		auto bits =  ((mask.hit | mask.clean) >> shift) << shift;
+		while (bits != 0) {
+			const unsigned k = __builtin_ctz(bits);
+			if (func(table[base+k], tag, i+k-shift)) {
+				return;
+			}
+			bits &= bits - 1U;
+		}
+		i += GROUP_SIZE - shift;
+		pos = base + GROUP_SIZE;
+		if (pos >= total_entry) {
+			pos = 0;
+		}
+	}
+}
+
+template <typename Func>
+static FORCE_INLINE void ProbeInTable(const Func& func, uint64_t code, Entry* table, const Divisor<uint64_t>& total_entry) {
+	ProbeInTable(func, table, total_entry.value(), code % total_entry, CutTag(code));
+}
+
 uint64_t Estuary::touch(Slice key) const noexcept {
 	auto code = Hash(key.ptr, key.len, m_const.seed);
 	if (m_meta != nullptr) {
 		const auto pos = code % m_const.total_entry;
-		PrefetchForFuture(m_table + pos);
+		PrefetchForFuture(_local_table() + pos);
 	}
 	return code;
 }
@@ -244,7 +641,7 @@ void Estuary::touch(uint64_t code) const noexcept {
 	if (m_meta == nullptr) {
 		return;
 	}
-	SearchInTable([this](Entry& ent, uint32_t tag, size_t)->bool {
+	ProbeInTable([this](Entry& ent, uint32_t tag, size_t)->bool {
 		auto e = ent;
 		if (IsEmpty(e)) {
 			return IsClean(e);
@@ -253,7 +650,7 @@ void Estuary::touch(uint64_t code) const noexcept {
 			return true;
 		}
 		return false;
-	}, code, (Entry*)m_table, m_const.total_entry);
+	}, code, (Entry*)_local_table(), m_const.total_entry);
 }
 
 bool Estuary::fetch(Slice key, std::string& out) const {
@@ -264,25 +661,32 @@ bool Estuary::fetch(Slice key, std::string& out) const {
 	return fetch(code, key, out);
 }
 
-//FIXME: have a very low probability of false miss
+//entries may be moved during sweeping, a miss is reliable only if version is unchanged
+bool Estuary::_stable(uint64_t version) const noexcept {
+	AcquireBarrier();
+	return (version & 1U) == 0 && LoadAcquire(m_lock->version) == version;
+}
+
 bool Estuary::fetch(uint64_t code, Slice key, std::string& out) const {
-	auto done = _fetch(code, key, out);
-#ifndef DISABLE_FETCH_RETRY
-	//entry can be moved at most twice during sweeping, witch may cause false miss
-	//NOTICE: That's not completely avoided.
-	if (!done && UNLIKELY(m_lock->sweeping)) {
-		done = _fetch(code, key, out);
-		if (!done) {
-			done = _fetch(code, key, out);
+	for (;;) {
+		const auto version = LoadAcquire(m_lock->version);
+		if (_fetch(code, key, out)) {
+			return true;
+		}
+		if (LIKELY(_stable(version))) {
+			StatAdd(Statistics::FETCH_MISS);
+			return false;
 		}
+		StatAdd(Statistics::FETCH_RETRY);
 	}
-#endif
-	return done;
 }
 
 bool Estuary::_fetch(uint64_t code, Slice key, std::string& out) const {
 	bool done = false;
-	SearchInTable([this, key, &out, &done](Entry& ent, uint32_t tag, size_t)->bool {
+	size_t probe = 0;
+	const auto now = m_const.expire_head != 0? Now() : 0;
+	ProbeInTable([this, key, &out, &done, &probe, now](Entry& ent, uint32_t tag, size_t off)->bool {
+		probe = off;
 		auto e = LoadAcquire(ent);
 	retry:
 		if (IsEmpty(e)) {
@@ -296,35 +700,331 @@ bool Estuary::_fetch(uint64_t code, Slice key, std::string& out) const {
 				goto retry;
 			}
 			if (LIKELY(KeyMatch(key, mark, block))) {
-				out.assign((const char*)RcVal(mark, block), mark.vlen);
+				const auto val = RcVal(mark, block);
+				if (UNLIKELY(Expired(val, mark.vlen, m_const.expire_head, now))) {
+					t = LoadAcquire(ent);
+					if (UNLIKELY(e != t)) {
+						e = t;
+						goto retry;
+					}
+					return true;
+				}
+				out.assign((const char*)val + m_const.expire_head, mark.vlen - m_const.expire_head);
 				t = LoadAcquire(ent);
 				if (UNLIKELY(e != t)) {
 					e = t;
 					goto retry;
 				}
+				_heat(block);
 				done = true;
 				return true;
 			}
+			//key may be read from a moved record, make sure it's really a mismatch
+			t = LoadAcquire(ent);
+			if (UNLIKELY(e != t)) {
+				e = t;
+				goto retry;
+			}
 		}
 		return false;
-	}, code, (Entry*)m_table, m_const.total_entry);
+	}, code, (Entry*)_local_table(), m_const.total_entry);
+	StatAdd(Statistics::FETCH);
+	StatRecord(Statistics::PROBE_LENGTH, probe);
+	if (done && m_codec != nullptr) {
+		Decode(m_codec->dict, out);
+	}
+	return done;
+}
+
+bool Estuary::peek(Slice key, Slice& out, Ticket& ticket) const {
+	if (m_meta == nullptr) {
+		return false;
+	}
+	auto code = Hash(key.ptr, key.len, m_const.seed);
+	return peek(code, key, out, ticket);
+}
+
+bool Estuary::peek(uint64_t code, Slice key, Slice& out, Ticket& ticket) const {
+	for (;;) {
+		const auto version = LoadAcquire(m_lock->version);
+		if (_peek(code, key, out, ticket)) {
+			return true;
+		}
+		if (LIKELY(_stable(version))) {
+			StatAdd(Statistics::FETCH_MISS);
+			return false;
+		}
+		StatAdd(Statistics::FETCH_RETRY);
+	}
+}
+
+bool Estuary::check(const Ticket& ticket) const noexcept {
+	if (ticket.entry == nullptr) {
+		return false;
+	}
+	//reading of data should not be delayed after checking
+	AcquireBarrier();
+	EntryView t = { .u = LoadAcquire(*ticket.entry) };
+	EntryView e = { .u = ticket.version };
+	return t.e == e.e;
+}
+
+bool Estuary::_peek(uint64_t code, Slice key, Slice& out, Ticket& ticket) const {
+	bool done = false;
+	size_t probe = 0;
+	const auto now = m_const.expire_head != 0? Now() : 0;
+	ProbeInTable([this, key, &out, &ticket, &done, &probe, now](Entry& ent, uint32_t tag, size_t off)->bool {
+		probe = off;
+		auto e = LoadAcquire(ent);
+	retry:
+		if (IsEmpty(e)) {
+			return IsClean(e);
+		} else if (e.tag == tag) {
+			auto block = BLK(e.blk);
+			auto mark = LoadAcquire(Rc(block));
+			auto t = LoadAcquire(ent);
+			if (UNLIKELY(e != t)) {
+				e = t;
+				goto retry;
+			}
+			if (LIKELY(KeyMatch(key, mark, block))) {
+				const auto val = RcVal(mark, block);
+				if (UNLIKELY(Expired(val, mark.vlen, m_const.expire_head, now))) {
+					t = LoadAcquire(ent);
+					if (UNLIKELY(e != t)) {
+						e = t;
+						goto retry;
+					}
+					return true;
+				}
+				out = {val + m_const.expire_head, mark.vlen - m_const.expire_head};
+				if (m_codec != nullptr && UNLIKELY(!Decode(m_codec->dict, out))) {
+					t = LoadAcquire(ent);
+					if (e != t) {
+						e = t;
+						goto retry;
+					}
+					throw DataException();
+				}
+				ticket.entry = (const uint64_t*)&ent;
+				ticket.version = EntryView{ .e = e }.u;
+				_heat(block);
+				done = true;
+				return true;
+			}
+			//key may be read from a moved record, make sure it's really a mismatch
+			t = LoadAcquire(ent);
+			if (UNLIKELY(e != t)) {
+				e = t;
+				goto retry;
+			}
+		}
+		return false;
+	}, code, (Entry*)_local_table(), m_const.total_entry);
+	StatAdd(Statistics::FETCH);
+	StatRecord(Statistics::PROBE_LENGTH, probe);
 	return done;
 }
 
+unsigned Estuary::batch_fetch(unsigned batch, const Slice* __restrict__ keys, std::string* __restrict__ out,
+							  unsigned* __restrict__ miss) const {
+	if (m_meta == nullptr) {
+		if (miss != nullptr) {
+			for (unsigned i = 0; i < batch; i++) {
+				miss[i] = i;
+			}
+		}
+		return 0;
+	}
+
+	constexpr unsigned WINDOW_SIZE = 16;
+	struct State {
+		unsigned idx;
+		uint32_t tag;
+		uint64_t code;
+		size_t pos;
+		size_t step;
+		Entry* ent;		//candidate waiting for its block
+		Entry e;
+	} states[WINDOW_SIZE];
+
+	auto table = (Entry*)_local_table();
+	const auto total_entry = m_const.total_entry.value();
+	const auto head = GroupHead(table, total_entry);
+	const auto tail = total_entry - (total_entry - head) % GROUP_SIZE;
+	unsigned hit = 0;
+	auto window = std::min(batch, WINDOW_SIZE);
+	const auto version = LoadAcquire(m_lock->version);
+	const auto now = m_const.expire_head != 0? Now() : 0;
+
+	static thread_local std::vector<uint64_t> codes;
+	codes.resize(batch);
+	HashBatch(keys, batch, m_const.seed, codes.data());
+	StatAdd(Statistics::FETCH, batch);
+
+	auto init_pipeline = [this, table](State& state, unsigned idx) {
+		state.idx = idx;
+		state.code = codes[idx];
+		state.tag = CutTag(state.code);
+		state.pos = state.code % m_const.total_entry;
+		state.step = 0;
+		state.ent = nullptr;
+		PrefetchForNext(table + state.pos);
+	};
+
+	unsigned idx = 0;
+	for (; idx < window; idx++) {
+		init_pipeline(states[idx], idx);
+	}
+	while (window > 0) {
+		for (unsigned i = 0; i < window; ) {
+			auto& cur = states[i];
+			auto& key = keys[cur.idx];
+			bool found = false;
+			if (cur.ent != nullptr) {
+				auto block = BLK(cur.e.blk);
+				auto mark = LoadAcquire(Rc(block));
+				auto t = LoadAcquire(*cur.ent);
+				if (LIKELY(t == cur.e)) {
+					if (LIKELY(KeyMatch(key, mark, block))) {
+						const auto val = RcVal(mark, block);
+						const bool expired = Expired(val, mark.vlen, m_const.expire_head, now);
+						if (LIKELY(!expired)) {
+							out[cur.idx].assign((const char*)val + m_const.expire_head, mark.vlen - m_const.expire_head);
+						}
+						t = LoadAcquire(*cur.ent);
+						if (UNLIKELY(expired) && t == cur.e) {
+							StatRecord(Statistics::PROBE_LENGTH, cur.step - 1);
+							StatAdd(Statistics::FETCH_MISS);
+							if (miss != nullptr) {
+								*miss++ = cur.idx;
+							}
+							goto reload;
+						}
+						if (LIKELY(t == cur.e)) {
+							if (m_codec != nullptr) {
+								Decode(m_codec->dict, out[cur.idx]);
+							}
+							_heat(block);
+							StatRecord(Statistics::PROBE_LENGTH, cur.step - 1);
+							hit++;
+							goto reload;
+						}
+					} else if (LIKELY(LoadAcquire(*cur.ent) == cur.e)) {
+						cur.ent = nullptr;	//go on probing
+						i++;
+						continue;
+					}
+				}
+				//entry changed, examine it again
+				cur.pos = cur.ent - table;
+				cur.step--;
+				cur.ent = nullptr;
+			}
+			while (cur.step < total_entry) {
+				if (LIKELY(cur.pos >= head && cur.pos < tail)) {	//skip uninteresting entries in group
+					const auto shift = (cur.pos - head) % GROUP_SIZE;
+					const auto mask = ScanGroup(table + (cur.pos - shift), cur.tag);
+					const auto bits = (mask.hit | mask.clean) >> shift;
+					const auto skip = bits != 0? __builtin_ctz(bits) : GROUP_SIZE - shift;
+					cur.step += skip;
+					cur.pos += skip;
+					if (UNLIKELY(cur.pos >= total_entry)) {
+						cur.pos = 0;
+					}
+					if (bits == 0) {
+						PrefetchForNext(table + cur.pos);
+						found = true;
+						break;
+					}
+				}
+				auto& ent = table[cur.pos];
+				auto e = LoadAcquire(ent);
+				cur.step++;
+				if (UNLIKELY(++cur.pos >= total_entry)) {
+					cur.pos = 0;
+				}
+				if (IsEmpty(e)) {
+					if (IsClean(e)) {
+						break;
+					}
+				} else if (e.tag == cur.tag) {
+					cur.ent = &ent;
+					cur.e = e;
+					PrefetchForNext(BLK(e.blk));
+					found = true;
+					break;
+				}
+				if ((cur.pos & (GROUP_SIZE-1)) == 0) {
+					PrefetchForNext(table + cur.pos);
+					found = true;
+					break;
+				}
+			}
+			if (found) {
+				i++;
+				continue;
+			}
+			StatRecord(Statistics::PROBE_LENGTH, cur.step - 1);
+			if (UNLIKELY(!_stable(version))) {
+				StatAdd(Statistics::FETCH_RETRY);
+				if (fetch(cur.code, key, out[cur.idx])) {
+					hit++;
+					goto reload;
+				}
+			} else {
+				StatAdd(Statistics::FETCH_MISS);
+			}
+			if (miss != nullptr) {
+				*miss++ = cur.idx;
+			}
+		reload:
+			if (idx < batch) {
+				init_pipeline(cur, idx++);
+				i++;
+			} else {
+				cur = states[--window];
+			}
+		}
+	}
+	return hit;
+}
+
 bool Estuary::erase(Slice key) const {
-	if (m_meta == nullptr || key.ptr == nullptr || key.len == 0 || key.len > max_key_len()) {
+	if (m_meta == nullptr || m_attach != nullptr || key.ptr == nullptr || key.len == 0 || key.len > max_key_len()) {
 		return {};
 	}
 	MutexLock master_lock(&m_lock->core);
+	if (_log_failed()) {
+		return false;
+	}
 	if (m_meta->writing) {
 		throw DataException();
 	}
 	m_meta->writing = true;
 	auto done = _erase(key);
 	m_meta->writing = false;
+	if (done) {
+		_log(true, key);
+	}
 	return done;
 }
 
+//no probing path goes across a deleted entry followed by a clean one
+void Estuary::_clean_tail(size_t pos) const {
+	auto table = (Entry*)m_table;
+	const auto n = m_const.total_entry.value();
+	if (!IsClean(table[pos+1 < n? pos+1 : 0])) {
+		return;
+	}
+	while (IsEmpty(table[pos]) && !IsClean(table[pos])) {
+		StoreRelease(table[pos], CLEAN_ENTRY);
+		_sync_entry(&table[pos]);
+		m_meta->clean_entry++;
+		pos = pos != 0? pos-1 : n-1;
+	}
+}
+
 bool Estuary::_erase(Slice key) const {
 	bool done = false;
 	SearchInTable([this, key, &done](Entry& ent, uint32_t tag, size_t)->bool{
@@ -333,14 +1033,14 @@ bool Estuary::_erase(Slice key) const {
 			return IsClean(e);
 		} else if (e.tag == tag) {
 			auto block = BLK(e.blk);
-			ConsistencyAssert(Rc(block).klen != 0 && Rc(block).vlen <= max_val_len());
+			ConsistencyAssert(Rc(block).klen != 0 && Rc(block).vlen <= m_const.max_val_len);
 			if (LIKELY(KeyMatch(key, block))) {
 				StoreRelease(ent, DELETED_ENTRY);
+				_sync_entry(&ent);
+				_clean_tail(&ent - (Entry*)m_table);
 				ConsistencyAssert(m_meta->item != 0);
 				m_meta->item--;
-				const auto bcnt = RecordBlocks(block);
-				Rc(block) = MarkForEmpty(bcnt);
-				m_meta->free_block += bcnt;
+				_release(e.blk, RecordBlocks(block));
 				ConsistencyAssert(m_meta->free_block <= m_const.total_block);
 				done = true;
 				return true;
@@ -378,411 +1078,2406 @@ static uint64_t FillRecord(uint8_t* block, Slice key, Slice val) {
 }
 
 bool Estuary::update(Slice key, Slice val) const {
-	if (m_meta == nullptr
+	return update(key, val, 0);
+}
+
+bool Estuary::update(Slice key, Slice val, uint32_t expire) const {
+	if (m_meta == nullptr || m_attach != nullptr
 		|| key.ptr == nullptr || key.len == 0 || key.len > max_key_len()
-		|| (val.len != 0 && val.ptr == nullptr) || val.len > max_val_len()) {
+		|| (val.len != 0 && val.ptr == nullptr) || val.len > max_val_len()
+		|| (expire != 0 && m_const.expire_head == 0)) {
 		return false;
 	}
 	MutexLock master_lock(&m_lock->core);
+	if (_log_failed()) {
+		return false;
+	}
 	if (m_meta->writing) {
 		throw DataException();
 	}
 	m_meta->writing = true;
-	auto done = _update(key, val);
+	auto done = _update(key, val, expire);
 	m_meta->writing = false;
+	if (done) {
+		_log(false, key, val, expire);
+	}
 	return done;
 }
 
-#define TOTAL_RESERVED_BLOCK (m_const.reserved_block + (m_const.total_block-m_const.reserved_block)/DATA_RESERVE_FACTOR)
+unsigned Estuary::batch_update(unsigned batch, const Slice* __restrict__ keys, const Slice* __restrict__ vals,
+							   unsigned* __restrict__ fail) const {
+	if (m_meta == nullptr || m_attach != nullptr) {
+		return 0;
+	}
+	unsigned hit = 0;
+	MutexLock master_lock(&m_lock->core);
+	if (_log_failed()) {
+		return 0;
+	}
+	if (m_meta->writing) {
+		throw DataException();
+	}
+	m_meta->writing = true;
+	for (unsigned i = 0; i < batch; i++) {
+		auto key = keys[i];
+		auto val = vals[i];
+		if (key.ptr != nullptr && key.len != 0 && key.len <= max_key_len()
+			&& (val.len == 0 || val.ptr != nullptr) && val.len <= max_val_len() && _update(key, val)) {
+			_log(false, key, val);
+			hit++;
+		} else if (fail != nullptr) {
+			*fail++ = i;
+		}
+	}
+	m_meta->writing = false;
+	return hit;
+}
 
-size_t Estuary::data_free() const {
-	if (m_meta == nullptr) return 0;
-	ConsistencyAssert(m_meta->free_block >= TOTAL_RESERVED_BLOCK);
-	return (m_meta->free_block - TOTAL_RESERVED_BLOCK) * DATA_BLOCK_SIZE;
+unsigned Estuary::batch_erase(unsigned batch, const Slice* __restrict__ keys, unsigned* __restrict__ fail) const {
+	if (m_meta == nullptr || m_attach != nullptr) {
+		return 0;
+	}
+	unsigned hit = 0;
+	MutexLock master_lock(&m_lock->core);
+	if (_log_failed()) {
+		return 0;
+	}
+	if (m_meta->writing) {
+		throw DataException();
+	}
+	m_meta->writing = true;
+	for (unsigned i = 0; i < batch; i++) {
+		auto key = keys[i];
+		if (key.ptr != nullptr && key.len != 0 && key.len <= max_key_len() && _erase(key)) {
+			_log(true, key);
+			hit++;
+		} else if (fail != nullptr) {
+			*fail++ = i;
+		}
+	}
+	m_meta->writing = false;
+	return hit;
 }
-size_t Estuary::item_limit() const {
-	if (m_meta == nullptr) return 0;
-	return ItemLimit(m_const.total_entry.value());
+
+size_t Estuary::batch_update(IDataReader& source) const {
+	auto total = source.total();
+	if (m_meta == nullptr || m_attach != nullptr || total == 0) {
+		return 0;
+	}
+	source.reset();
+	MutexLock master_lock(&m_lock->core);
+	if (_log_failed()) {
+		return 0;
+	}
+	if (m_meta->writing) {
+		throw DataException();
+	}
+	m_meta->writing = true;
+	size_t idx;
+	for (idx = 0; idx < total; idx++) {
+		auto rec = source.read();
+		if (rec.key.ptr == nullptr || rec.key.len == 0 || rec.key.len > max_key_len()
+			|| (rec.val.len != 0 && rec.val.ptr == nullptr) || rec.val.len > max_val_len()
+			|| (rec.expire != 0 && m_const.expire_head == 0)
+			|| !_update(rec.key, rec.val, rec.expire)) {
+			break;
+		}
+		_log(false, rec.key, rec.val, rec.expire);
+	}
+	m_meta->writing = false;
+	return idx;
 }
 
-bool Estuary::_update(Slice key, Slice val) const {
-	auto new_block = RecordBlocks(key.len, val.len);
-	if (m_meta->free_block < new_block + TOTAL_RESERVED_BLOCK
-		|| TotalEntry(m_meta->item) > m_const.total_entry.value()) {
+static constexpr size_t SCAN_CHUNK_SIZE = 256*1024;	//bytes copied under lock at most
+
+//whether a live record begins at blk, only entries point to beginnings of records
+bool Estuary::_located(size_t blk) const {
+	if (blk >= m_const.total_block) {
 		return false;
 	}
-	ConsistencyAssert(m_meta->block_cursor < m_const.total_block
-		&& m_meta->free_block <= m_const.total_block
-		&& m_meta->clean_entry <= m_const.total_entry.value());
+	const auto mark = Rc(BLK(blk));
+	if (mark.klen == 0 || mark.klen > m_const.max_key_len
+		|| blk + RecordBlocks(mark.klen, mark.vlen) > m_const.total_block) {
+		return false;
+	}
+	bool done = false;
+	SearchInTable([blk, &done](Entry& ent, uint32_t, size_t)->bool {
+		const auto e = ent;
+		if (IsEmpty(e)) {
+			return IsClean(e);
+		}
+		done = e.blk == blk;
+		return done;
+	}, Hash(RcKey(BLK(blk)), mark.klen, m_const.seed), (Entry*)m_table, m_const.total_entry);
+	return done;
+}
 
-	if (UNLIKELY(m_meta->clean_entry <= m_const.total_entry.value() / ENTRY_RESERVE_FACTOR)) {
-		//x times random input brings 1-1/e^x coverage，x = ln(ENTRY_RESERVE_FACTOR)
-		//this procedure is slow, but rarely happen
-
-		auto table = (Entry*)m_table;
-		auto& total_entry = m_const.total_entry;
-		auto upstairs = [table, &total_entry, this](bool end)->bool {
-			bool moved = false;
-			for (size_t i = 0; i < total_entry.value(); i++) {
-				if (LIKELY(IsEmpty(table[i]) || table[i].fit)) {
-					continue;
-				}
-				auto curr = &table[i];
-				size_t pos = 0;
-				if (LIKELY(curr->off < MAX_OFF_MARK)) {
-					if (UNLIKELY(i < curr->off)) {
-						pos = total_entry.value() + i - curr->off;
-					} else {
-						pos = i - curr->off;
-					}
-				} else {
-					auto block = BLK(curr->blk);
-					const auto code = Hash(RcKey(block), Rc(block).klen, m_const.seed);
-					ConsistencyAssert(curr->tag == CutTag(code));
-					pos = code % total_entry;
-				}
-				bool fit = true;
-				SearchInTable([&fit, &moved, curr, end](Entry& ent, uint32_t tag, size_t off)->bool{
-					if (IsEmpty(ent)) {
-						moved = true;
-						ConsistencyAssert(!IsClean(ent));
-						ent = *curr;
-						ent.off = std::min(off, MAX_OFF_MARK);
-						if (fit) {
-							ent.fit = 1;
-						}
-						StoreRelease(*curr, DELETED_ENTRY);
-						if (end) {
-							curr->fit = 1;
-						}
-						return true;
-					} else if (!ent.fit) {
-						if (&ent == curr) {
-							if (fit) {
-								curr->fit = 1;
-							}
-							return true;
-						}
-						fit = false;
-					}
-					return false;
-				}, table, total_entry.value(), pos, curr->tag);
-			}
-			return moved;
-		};
+static constexpr unsigned RESUME_STEP = 4096;	//records walked under lock at most
 
-		//entry can be moved twice at most
-		m_lock->sweeping = true;
-		MemoryBarrier();
-		if (upstairs(false)) {
-			upstairs(true);
+//move cursor to the first beginning of record or free section at or after it, lock should be held.
+//data is walked from the nearest known beginning before: the last record visited if it stays,
+//the free section at block cursor and the one after it, or block 0.
+//return false if it's not done within RESUME_STEP records, and it can go on from the last one later.
+bool Estuary::_resume(Cursor& cursor) const {
+	const auto pos = cursor.m_pos;
+	size_t from = 0;
+	if (cursor.m_last < pos && _located(cursor.m_last)) {
+		from = cursor.m_last;
+	}
+	const auto cur = m_meta->block_cursor;
+	if (cur <= pos && cur > from) {
+		from = cur;
+		const auto end = cur + Rc(BLK(cur)).bcnt;
+		if (end <= pos && end < m_const.total_block) {
+			from = end;
 		}
-
-		size_t dirty = 0;
-		size_t item = 0;
-		for (size_t i = 0; i < total_entry.value(); i++) {
-			if (IsEmpty(table[i])) {
-				if (table[i].fit) {
-					dirty++;
-					table[i].fit = 0;
-				} else {
-					table[i] = CLEAN_ENTRY;
-				}
-			} else {
-				item++;
-				table[i].fit = 0;
-			}
+	}
+	for (unsigned step = 0; from < pos; ) {
+		const auto mark = Rc(BLK(from));
+		if (mark.klen == 0) {
+			ConsistencyAssert(mark.bcnt != 0 && from + mark.bcnt <= m_const.total_block);
+			from += mark.bcnt;
+			continue;
 		}
-
-		//keep sweeping status longer
-		sched_yield();
-		MemoryBarrier();
-		m_lock->sweeping = false;
-
-		ConsistencyAssert(item == m_meta->item);
-		m_meta->clean_entry = total_entry.value() - item - dirty;
+		if (++step > RESUME_STEP) {
+			cursor.m_last = from;
+			return false;
+		}
+		from += RecordBlocks(mark.klen, mark.vlen);
 	}
+	cursor.m_pos = from;
+	return true;
+}
 
-	auto& cur = m_meta->block_cursor;
-	ConsistencyAssert(Rc(BLK(cur)).klen == 0 && cur+Rc(BLK(cur)).bcnt <= m_const.total_block);
+Estuary::Cursor Estuary::scan(unsigned piece, unsigned total) const {
+	Cursor cursor;
+	if (m_meta == nullptr || m_attach != nullptr || total == 0 || piece >= total) {
+		return cursor;
+	}
+	cursor.m_dict = this;
+	cursor.m_pos = (__uint128_t)m_const.total_block * piece / total;
+	cursor.m_end = (__uint128_t)m_const.total_block * (piece+1) / total;
+	return cursor;
+}
 
-	const auto code = Hash(key.ptr, key.len, m_const.seed);
-	auto origin_entry = CLEAN_ENTRY;
-	//update after movement may cause ABA problem, detect and fix it
+bool Estuary::Cursor::next(std::string& key, std::string& val) {
+	if (m_offset >= m_chunk.size() && (m_dict == nullptr || !m_dict->_scan(*this))) {
+		return false;
+	}
+	uint32_t len[2];
+	memcpy(len, m_chunk.data() + m_offset, sizeof(len));
+	m_offset += sizeof(len);
+	key.assign(m_chunk.data() + m_offset, len[0]);
+	m_offset += len[0];
+	val.assign(m_chunk.data() + m_offset, len[1]);
+	m_offset += len[1];
+	if (m_dict->m_codec != nullptr) {
+		Decode(m_dict->m_codec->dict, val);
+	}
+	return true;
+}
 
-	auto move_record = [this, &cur, code, key, &origin_entry](size_t vic) {
-		assert(Rc(BLK(vic)).klen != 0);
-		const auto bcnt = RecordBlocks(BLK(vic));
-		memcpy(BLK(cur)+sizeof(RecordMark), BLK(vic)+sizeof(RecordMark), bcnt*DATA_BLOCK_SIZE-sizeof(RecordMark));
-		const auto bcode = Hash(RcKey(BLK(vic)), Rc(BLK(vic)).klen, m_const.seed);
-		Entry* pent = nullptr;
-		if (UNLIKELY(bcode == code && KeyMatch(key, BLK(vic)))) {
-			pent = &origin_entry;
-			ConsistencyAssert(IsClean(origin_entry));
-		}
-		bool done = false;
-		SearchInTable([this, &cur, vic, bcnt, &done, pent](Entry& ent, uint32_t tag, size_t off)->bool{
-			auto e = ent;
-			if (IsEmpty(e)) {
-				return IsClean(e);
-			} else if (e.blk == vic) {
-				if (UNLIKELY(pent != nullptr)) {
-					*pent = e;
-				}
-				m_meta->free_block -= bcnt;
-				auto next = cur + bcnt;
-				if (LIKELY(next != m_const.total_block)) {
-					ConsistencyAssert(next < m_const.total_block);
-					Rc(BLK(next)) = MarkForEmpty(Rc(BLK(cur)).bcnt-bcnt);
-				}
-				Rc(BLK(cur)) = Rc(BLK(vic));
-				e.blk = cur;
-				StoreRelease(ent, e);
-				Rc(BLK(vic)) = MarkForEmpty(bcnt);
-				cur = next;
-				m_meta->free_block += bcnt;
-				done = true;
-				return true;
+//copy a chunk of records from cursor, which stops at a live record or the end of piece
+bool Estuary::_scan(Cursor& cursor) const {
+	cursor.m_chunk.clear();
+	cursor.m_offset = 0;
+	const auto now = m_const.expire_head != 0? Now() : 0;
+	while (cursor.m_pos < cursor.m_end) {
+		{
+			MutexLock master_lock(&m_lock->core);
+			if (m_meta->writing) {
+				throw DataException();
 			}
-			return false;
-		}, bcode, (Entry*)m_table, m_const.total_entry);
-		if (UNLIKELY(!done)) {
-			Rc(BLK(vic)) = MarkForEmpty(bcnt);
-			m_meta->free_block += bcnt;
-			ConsistencyAssert(m_meta->free_block <= m_const.total_block);
-		}
-	};
-
-	//defragmentation
-	ConsistencyAssert(Rc(BLK(cur)).bcnt >= m_const.reserved_block);
-	bool overflow = false;
-	while (Rc(BLK(cur)).bcnt < new_block + m_const.reserved_block) {
-		auto nxt = cur + Rc(BLK(cur)).bcnt;
-		if (UNLIKELY(nxt == m_const.total_block)) {
-			ConsistencyAssert(!overflow && m_meta->free_block >= Rc(BLK(cur)).bcnt);
-			overflow = true; //no more than once
-			size_t vic = 0;
-			while (vic < cur) {	//some blocks may be moved more than once
-				if (Rc(BLK(vic)).klen == 0) {
-					vic += Rc(BLK(vic)).bcnt;
-				} else if (vic < new_block + m_const.reserved_block) {
-					const auto bcnt = RecordBlocks(BLK(vic));
-					if (Rc(BLK(cur)).bcnt < bcnt) {
-						break;
+			//block 0 is always a beginning, otherwise the record at cursor may be moved or erased
+			if (cursor.m_pos != 0 && !_located(cursor.m_pos) && !_resume(cursor)) {
+				continue;	//let writers go
+			}
+			{
+				auto& pos = cursor.m_pos;
+				while (pos < cursor.m_end) {
+					const auto mark = Rc(BLK(pos));
+					if (mark.klen == 0) {
+						ConsistencyAssert(mark.bcnt != 0 && pos + mark.bcnt <= m_const.total_block);
+						pos += mark.bcnt;
+						continue;
 					}
-					move_record(vic);
-					vic += bcnt;
-					if (UNLIKELY(cur == m_const.total_block)) {
+					if (cursor.m_chunk.size() >= SCAN_CHUNK_SIZE) {
 						break;
 					}
-				} else {
-					break;
+					const auto val = RcVal(mark, BLK(pos));
+					cursor.m_last = pos;
+					if (!Expired(val, mark.vlen, m_const.expire_head, now)) {
+						const uint32_t len[2] = {mark.klen, mark.vlen - m_const.expire_head};
+						cursor.m_chunk.append((const char*)len, sizeof(len));
+						cursor.m_chunk.append((const char*)RcKey(BLK(pos)), mark.klen);
+						cursor.m_chunk.append((const char*)val + m_const.expire_head, len[1]);
+					}
+					pos += RecordBlocks(mark.klen, mark.vlen);
+				}
+				if (!cursor.m_chunk.empty()) {
+					return true;
 				}
 			}
-			ConsistencyAssert(vic <= cur);
-			Rc(m_data) = MarkForEmpty(vic);
-			cur = 0;
-		} else {
-			size_t bcnt;
-			if (Rc(BLK(nxt)).klen == 0) {
-				ConsistencyAssert(nxt+Rc(BLK(nxt)).bcnt <= m_const.total_block);
-				bcnt = Rc(BLK(nxt)).bcnt;
-			} else { //reserved_block must be enough
-				bcnt = RecordBlocks(BLK(nxt));
-				ConsistencyAssert(bcnt <= Rc(BLK(cur)).bcnt);
-				move_record(nxt);
-			}
-			Rc(BLK(cur)).bcnt += bcnt;
 		}
 	}
+	return !cursor.m_chunk.empty();
+}
 
-	m_meta->free_block -= new_block;
-	const auto next = cur + new_block;
-	Rc(BLK(next)) = MarkForEmpty(Rc(BLK(cur)).bcnt-new_block);
-	Rc(BLK(cur)).bcnt = new_block;
-	const auto neo = cur;
-	cur = next;
-	auto tip = FillRecord(BLK(neo), key, val);
+struct RingMap {
+	uint8_t* ptr = nullptr;
+	size_t size = 0;
+	uint8_t* addr() const noexcept { return ptr; }
+	bool operator!() const noexcept { return ptr == nullptr; }
+	void unmap() noexcept {
+		if (ptr != nullptr) {
+			munmap(ptr, size);
+			ptr = nullptr;
+		}
+	}
+};
 
-	// FIXED: use first deleted entry without looking forward may cause leak
-	// now just remember it then look forward for the target
-	struct {
-		Entry* entry = nullptr;
-		Entry value;
-	} bookmark;
-	bool done = false;
-	SearchInTable([this, &cur, neo, tip, key, val, &bookmark, &done, origin_entry](Entry& ent, uint32_t tag, size_t off)->bool{
-		const auto e = ent;
-		if (IsEmpty(e)) {
-			if (bookmark.entry == nullptr) {
-				bookmark = {&ent, Entry(neo, tip, tag, off)};
-			}
-			return IsClean(e);
-		} else if (e.tag == tag) {
-			auto block = BLK(e.blk);
-			ConsistencyAssert(Rc(block).klen != 0 && Rc(block).vlen <= max_val_len());
-			if (LIKELY(KeyMatch(key, block))) {
-				const auto bcnt = RecordBlocks(block);
-				if (UNLIKELY(ValMatch(val, block))) {	//rollback
-					Rc(BLK(neo)) = MarkForEmpty(bcnt);
-					const auto tail = Rc(BLK(cur)).bcnt;
-					cur = neo;
-					Rc(BLK(neo)) = MarkForEmpty(bcnt+tail);
-				} else {
-					Entry entry(neo, tip, tag, off);
-					if (UNLIKELY(entry == origin_entry)) {		//ABA after movement
-						entry.tip ^= 1;
-					}
-					StoreRelease(ent, entry);
-					Rc(block) = MarkForEmpty(bcnt);
-				}
-				m_meta->free_block += bcnt;
-				ConsistencyAssert(m_meta->free_block <= m_const.total_block);
-				done = true;
-				return true;
-			}
+// a ring of io_uring built by raw syscalls, only the submitting thread touches it
+struct Estuary::AsyncFetcher::Ring {
+	int fd = -1;
+	RingMap sq;
+	RingMap cq;
+	RingMap sqes;
+	unsigned* sq_tail = nullptr;
+	unsigned sq_mask = 0;
+	unsigned* sq_array = nullptr;
+	unsigned* cq_head = nullptr;
+	unsigned* cq_tail = nullptr;
+	unsigned cq_mask = 0;
+	io_uring_cqe* cqes = nullptr;
+	unsigned queued = 0;	//not submitted yet
+	unsigned flying = 0;	//submitted but not reaped
+
+	~Ring() noexcept {
+		sq.unmap();
+		cq.unmap();
+		sqes.unmap();
+		if (fd >= 0) {
+			close(fd);
 		}
+	}
+	bool init(unsigned depth);
+	void push(int file, uint8_t* buf, size_t len, size_t off, uint64_t tag) noexcept;
+	bool enter(bool wait) noexcept;
+};
+
+static RingMap MapRing(int fd, size_t size, off_t off) noexcept {
+	RingMap out;
+	auto addr = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, off);
+	if (addr != MAP_FAILED) {
+		out.ptr = (uint8_t*)addr;
+		out.size = size;
+	}
+	return out;
+}
+
+bool Estuary::AsyncFetcher::Ring::init(unsigned depth) {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (fd < 0) {
+		Logger::Printf("fail to setup io_uring[%d]\n", errno);
 		return false;
-	}, code, (Entry*)m_table, m_const.total_entry);
+	}
+	sq = MapRing(fd, params.sq_off.array + params.sq_entries * sizeof(unsigned), IORING_OFF_SQ_RING);
+	cq = MapRing(fd, params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe), IORING_OFF_CQ_RING);
+	sqes = MapRing(fd, params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+	if (!sq || !cq || !sqes) {
+		Logger::Printf("fail to map io_uring[%d]\n", errno);
+		return false;
+	}
+	sq_tail = (unsigned*)(sq.addr() + params.sq_off.tail);
+	sq_mask = *(unsigned*)(sq.addr() + params.sq_off.ring_mask);
+	sq_array = (unsigned*)(sq.addr() + params.sq_off.array);
+	cq_head = (unsigned*)(cq.addr() + params.cq_off.head);
+	cq_tail = (unsigned*)(cq.addr() + params.cq_off.tail);
+	cq_mask = *(unsigned*)(cq.addr() + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe*)(cq.addr() + params.cq_off.cqes);
+	return true;
+}
 
-	if (!done && bookmark.entry != nullptr) {
-		if (IsClean(*bookmark.entry)) {
-			m_meta->clean_entry--;
+//sq never overflows, every lookup has one read in flight at most
+void Estuary::AsyncFetcher::Ring::push(int file, uint8_t* buf, size_t len, size_t off, uint64_t tag) noexcept {
+	const auto tail = *sq_tail;
+	const auto idx = tail & sq_mask;
+	auto& sqe = ((io_uring_sqe*)sqes.addr())[idx];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ;
+	sqe.fd = file;
+	sqe.addr = (uintptr_t)buf;
+	sqe.len = len;
+	sqe.off = off;
+	sqe.user_data = tag;
+	sq_array[idx] = idx;
+	StoreRelease(*sq_tail, tail + 1);
+	queued++;
+}
+
+bool Estuary::AsyncFetcher::Ring::enter(bool wait) noexcept {
+	for (;;) {
+		const unsigned flags = wait? IORING_ENTER_GETEVENTS : 0;
+		const auto n = syscall(__NR_io_uring_enter, fd, queued, wait? 1 : 0, flags, nullptr, 0);
+		if (n >= 0) {
+			queued -= n;
+			flying += n;
+			return true;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			Logger::Printf("fail to enter io_uring[%d]\n", errno);
+			return false;
 		}
-		StoreRelease(*bookmark.entry, bookmark.value);
-		m_meta->item++;
-		return true;
 	}
-	return done;
 }
 
-static bool InitLock(Estuary::Lock* lock, bool shared=true) {
-	const int pshared = shared? PTHREAD_PROCESS_SHARED : PTHREAD_PROCESS_PRIVATE;
-	pthread_mutexattr_t mutexattr;
-	if (pthread_mutexattr_init(&mutexattr) != 0
-		|| pthread_mutexattr_setpshared(&mutexattr, pshared) != 0
-		|| pthread_mutex_init(&lock->core, &mutexattr) != 0) {
-		//pthread_mutexattr_destroy is unnecessary
+struct Estuary::AsyncFetcher::Lookup {
+	Callback done;
+	std::string key;
+	std::string val;
+	std::string buf;
+	uint64_t version = 0;
+	uint32_t tag = 0;
+	size_t pos = 0;		//current entry
+	size_t step = 0;	//entries probed
+	Entry ent;
+	size_t want = 0;	//bytes of record to read
+	size_t got = 0;
+	bool found = false;
+};
+
+static constexpr size_t ASYNC_READ_SIZE = 512;	//enough for most records
+
+Estuary::AsyncFetcher::AsyncFetcher(const Estuary& dict, unsigned depth) {
+	if (dict.m_meta == nullptr || depth == 0) {
+		return;
+	}
+	m_dict = &dict;
+	m_depth = depth;
+	m_slots = new Lookup[depth];
+	m_idle.reserve(depth);
+	for (unsigned i = depth; i > 0; i--) {
+		m_idle.push_back(i-1);
+	}
+	m_ready.reserve(depth);
+	//anonymous data does not come from file, and private pages may diverge from file
+	if (dict.m_resource.fd() < 0) {
+		return;
+	}
+	auto ring = std::make_unique<Ring>();
+	if (ring->init(depth)) {
+		m_ring = ring.release();
+	}
+}
+
+Estuary::AsyncFetcher::~AsyncFetcher() noexcept {
+	if (m_ring != nullptr) {
+		//buffers must outlive reads in flight
+		while (m_ring->flying != 0 && m_ring->enter(true)) {
+			const auto tail = LoadAcquire(*m_ring->cq_tail);
+			auto head = *m_ring->cq_head;
+			m_ring->flying -= tail - head;
+			StoreRelease(*m_ring->cq_head, tail);
+		}
+		delete m_ring;
+	}
+	delete[] m_slots;
+}
+
+bool Estuary::AsyncFetcher::submit(Slice key, Callback done) {
+	if (m_dict == nullptr || m_idle.empty()) {
 		return false;
 	}
-	lock->sweeping = false;
+	auto& lookup = m_slots[m_idle.back()];
+	m_idle.pop_back();
+	lookup.done = std::move(done);
+	lookup.key.assign((const char*)key.ptr, key.len);
+	if (m_ring == nullptr) {
+		lookup.found = m_dict->fetch(key, lookup.val);
+		m_ready.push_back(&lookup - m_slots);
+		return true;
+	}
+	_start(lookup);
 	return true;
 }
 
-Estuary::~Estuary() noexcept {
-	if (m_meta == nullptr) {
+void Estuary::AsyncFetcher::_start(Lookup& lookup) {
+	const auto& dict = *m_dict;
+	const auto code = Hash((const uint8_t*)lookup.key.data(), lookup.key.size(), dict.m_const.seed);
+	lookup.version = LoadAcquire(dict.m_lock->version);
+	lookup.tag = CutTag(code);
+	lookup.pos = code % dict.m_const.total_entry;
+	lookup.step = 0;
+	_probe(lookup);
+}
+
+void Estuary::AsyncFetcher::_finish(Lookup& lookup, bool found) {
+	if (found) {
+		if (m_dict->m_codec != nullptr) {
+			Decode(m_dict->m_codec->dict, lookup.val);
+		}
+	} else if (!m_dict->_stable(lookup.version)) {
+		StatAdd(Statistics::FETCH_RETRY);
+		_start(lookup);
 		return;
+	} else {
+		StatAdd(Statistics::FETCH_MISS);
 	}
-	if (m_monopoly_extra != nullptr) {
-		pthread_mutex_destroy(&m_lock->core);
+	StatAdd(Statistics::FETCH);
+	StatRecord(Statistics::PROBE_LENGTH, lookup.step);
+	lookup.found = found;
+	m_ready.push_back(&lookup - m_slots);
+}
+
+//probe table in memory until a record should be read
+void Estuary::AsyncFetcher::_probe(Lookup& lookup) {
+	const auto& dict = *m_dict;
+	const auto table = (Entry*)dict._local_table();
+	const auto total_entry = dict.m_const.total_entry.value();
+	const Slice key = {(const uint8_t*)lookup.key.data(), lookup.key.size()};
+	const auto now = dict.m_const.expire_head != 0? Now() : 0;
+	for (; lookup.step < total_entry; lookup.step++) {
+		auto& ent = table[lookup.pos];
+		auto e = LoadAcquire(ent);
+	retry:
+		if (IsEmpty(e)) {
+			if (IsClean(e)) {
+				break;
+			}
+		} else if (e.tag == lookup.tag) {
+			const auto off = (dict.m_data - dict.m_resource.addr()) + e.blk * DATA_BLOCK_SIZE;
+			const auto tier = dict.m_tier;
+			const auto page = tier != nullptr? off >> tier->page_shift : 0;
+			if (tier == nullptr || ((LoadAcquire(tier->written[page/64]) >> (page%64)) & 1U) == 0) {
+				lookup.ent = e;
+				lookup.got = 0;
+				lookup.want = std::min(ASYNC_READ_SIZE, dict.m_resource.size() - off);
+				lookup.buf.resize(lookup.want);
+				_read(lookup, off, lookup.want);
+				return;
+			}
+			//written page lives in memory only, same as _fetch
+			auto block = dict.m_data + e.blk * DATA_BLOCK_SIZE;
+			auto mark = LoadAcquire(Rc(block));
+			auto t = LoadAcquire(ent);
+			if (UNLIKELY(e != t)) {
+				e = t;
+				goto retry;
+			}
+			if (KeyMatch(key, mark, block)) {
+				const auto val = RcVal(mark, block);
+				const bool expired = Expired(val, mark.vlen, dict.m_const.expire_head, now);
+				if (!expired) {
+					lookup.val.assign((const char*)val + dict.m_const.expire_head, mark.vlen - dict.m_const.expire_head);
+				}
+				t = LoadAcquire(ent);
+				if (UNLIKELY(e != t)) {
+					e = t;
+					goto retry;
+				}
+				if (!expired) {
+					dict._heat(block);
+				}
+				_finish(lookup, !expired);
+				return;
+			}
+			t = LoadAcquire(ent);
+			if (UNLIKELY(e != t)) {
+				e = t;
+				goto retry;
+			}
+		}
+		if (++lookup.pos >= total_entry) {
+			lookup.pos = 0;
+		}
 	}
+	_finish(lookup, false);
 }
 
-Estuary Estuary::Load(const std::string& path, LoadPolicy policy) {
-	Estuary out;
-	MemMap res;
-	switch (policy) {
-		case SHARED:
-			res = MemMap(path.c_str(), true, false);
-			break;
-		case MONOPOLY:
-			res = MemMap(path.c_str(), true, true);
-			break;
-		case COPY_DATA:
-			res = MemMap(path.c_str(), MemMap::load_by_copy);
-			break;
+void Estuary::AsyncFetcher::_read(Lookup& lookup, size_t off, size_t len) {
+	m_ring->push(m_dict->m_resource.fd(), (uint8_t*)lookup.buf.data() + lookup.got, len, off, &lookup - m_slots);
+}
+
+void Estuary::AsyncFetcher::_complete(Lookup& lookup, int res) {
+	const auto& dict = *m_dict;
+	if (res <= 0) {		//hardly happens, turn to mapping
+		lookup.found = dict.fetch({(const uint8_t*)lookup.key.data(), lookup.key.size()}, lookup.val);
+		m_ready.push_back(&lookup - m_slots);
+		return;
+	}
+	const auto off = (dict.m_data - dict.m_resource.addr()) + lookup.ent.blk * DATA_BLOCK_SIZE;
+	lookup.got += res;
+	if (lookup.got < lookup.want) {
+		_read(lookup, off + lookup.got, lookup.want - lookup.got);
+		return;
+	}
+	auto block = (uint8_t*)lookup.buf.data();
+	RecordMark mark;
+	mark.u = 0;
+	memcpy(&mark, block, std::min(lookup.got, sizeof(uint32_t)));
+	const Slice key = {(const uint8_t*)lookup.key.data(), lookup.key.size()};
+	const size_t need = sizeof(uint32_t) + mark.klen + mark.vlen;
+	bool match = false;
+	if (mark.klen == key.len && need <= dict.m_resource.size() - off) {
+		if (need > lookup.got) {
+			lookup.want = need;
+			lookup.buf.resize(need);
+			_read(lookup, off + lookup.got, need - lookup.got);
+			return;
+		}
+		match = memcmp(key.ptr, RcKey(block), key.len) == 0;
+	}
+	//record may be moved or erased during reading
+	auto& ent = ((Entry*)dict._local_table())[lookup.pos];
+	if (UNLIKELY(LoadAcquire(ent) != lookup.ent)) {
+		_probe(lookup);
+		return;
+	}
+	if (match) {
+		const auto head = dict.m_const.expire_head;
+		const auto val = RcVal(mark, block);
+		if (Expired(val, mark.vlen, head, head != 0? Now() : 0)) {
+			_finish(lookup, false);
+			return;
+		}
+		lookup.val.assign((const char*)val + head, mark.vlen - head);
+		dict._heat(dict.m_data + lookup.ent.blk * DATA_BLOCK_SIZE);
+		_finish(lookup, true);
+		return;
+	}
+	if (++lookup.pos >= dict.m_const.total_entry.value()) {
+		lookup.pos = 0;
+	}
+	lookup.step++;
+	_probe(lookup);
+}
+
+unsigned Estuary::AsyncFetcher::poll(bool wait) {
+	if (m_ring != nullptr) {
+		auto& ring = *m_ring;
+		for (;;) {
+			const bool block = wait && m_ready.empty() && ring.queued + ring.flying != 0;
+			if ((ring.queued != 0 || block) && !ring.enter(block)) {
+				break;
+			}
+			auto head = *ring.cq_head;
+			const auto tail = LoadAcquire(*ring.cq_tail);
+			for (; head != tail; head++) {
+				const auto& cqe = ring.cqes[head & ring.cq_mask];
+				ring.flying--;
+				_complete(m_slots[cqe.user_data], cqe.res);
+			}
+			StoreRelease(*ring.cq_head, head);
+			//follow-up reads are submitted at once
+			if (ring.queued == 0 && (!wait || !m_ready.empty() || ring.flying == 0)) {
+				break;
+			}
+		}
+	}
+	unsigned cnt = 0;
+	for (; cnt < m_ready.size(); cnt++) {
+		auto& lookup = m_slots[m_ready[cnt]];
+		auto done = std::move(lookup.done);
+		lookup.done = nullptr;
+		m_value.swap(lookup.val);
+		const bool found = lookup.found;
+		m_idle.push_back(m_ready[cnt]);
+		done(found, {(const uint8_t*)m_value.data(), found? m_value.size() : 0});
+	}
+	m_ready.clear();
+	return cnt;
+}
+
+#define TOTAL_RESERVED_BLOCK (m_const.reserved_block \
+	+ (m_const.total_block-m_const.reserved_block)/ReserveFactor(m_meta->features))
+
+size_t Estuary::data_free() const {
+	if (m_meta == nullptr) return 0;
+	ConsistencyAssert(m_meta->free_block >= TOTAL_RESERVED_BLOCK);
+	return (m_meta->free_block - TOTAL_RESERVED_BLOCK) * DATA_BLOCK_SIZE;
+}
+size_t Estuary::item_limit() const {
+	if (m_meta == nullptr) return 0;
+	return ItemLimit(m_const.total_entry.value());
+}
+
+static constexpr size_t SWEEP_STEP = 512;
+
+// reclaim deleted entries cluster by cluster (a cluster is a run between clean entries).
+// live entries are moved backward into the first hole on their probing path, then no hole
+// left in the cluster is on any probing path, so all of them can be cleaned.
+// at least budget entries will be examined, but a cluster is never split.
+void Estuary::_sweep(size_t budget) const {
+	auto table = (Entry*)m_table;
+	const auto& total_entry = m_const.total_entry;
+	const size_t n = total_entry.value();
+	auto wrap = [n](size_t pos)->size_t {
+		return pos < n? pos : pos - n;
+	};
+
+	auto start = m_lock->sweep_cursor < n? m_lock->sweep_cursor : 0;
+	for (size_t i = 0; !IsClean(table[start]); i++) {
+		ConsistencyAssert(i < n);
+		start = wrap(start+1);
+	}
+
+	//readers may miss moving entries, tell them to retry
+	StoreRelease(m_lock->version, m_lock->version+1);
+	MemoryBarrier();
+
+	std::vector<size_t> holes;	//offsets from the cluster start
+	size_t cleaned = 0;
+	const auto now = m_const.expire_head != 0? Now() : 0;
+	for (size_t done = 0; done < budget && done < n; ) {
+		holes.clear();
+		size_t rel = 1;
+		for (auto pos = wrap(start+1); !IsClean(table[pos]); pos = wrap(pos+1), rel++) {
+			auto e = table[pos];
+			if (!IsEmpty(e) && UNLIKELY(m_const.expire_head != 0)) {
+				auto block = BLK(e.blk);
+				if (Expired(RcVal(block), Rc(block).vlen, m_const.expire_head, now)) {
+					StoreRelease(table[pos], DELETED_ENTRY);
+					_sync_entry(&table[pos]);
+					ConsistencyAssert(m_meta->item != 0);
+					m_meta->item--;
+					_release(e.blk, RecordBlocks(block));
+					e = DELETED_ENTRY;
+				}
+			}
+			if (IsEmpty(e)) {
+				holes.push_back(rel);
+				continue;
+			}
+			if (holes.empty()) {
+				continue;
+			}
+			size_t home;	//offset from the cluster start
+			if (LIKELY(e.off < MAX_OFF_MARK)) {
+				home = rel - e.off;
+			} else {
+				auto block = BLK(e.blk);
+				const auto code = Hash(RcKey(block), Rc(block).klen, m_const.seed);
+				ConsistencyAssert(e.tag == CutTag(code));
+				home = wrap(code % total_entry + n - start);
+			}
+			ConsistencyAssert(home != 0 && home <= rel);
+			auto it = std::lower_bound(holes.begin(), holes.end(), home);
+			if (it == holes.end()) {
+				continue;
+			}
+			const auto hole = *it;
+			holes.erase(it);
+			e.off = std::min(hole - home, MAX_OFF_MARK);
+			StoreRelease(table[wrap(start+hole)], e);
+			StoreRelease(table[pos], DELETED_ENTRY);
+			_sync_entry(&table[wrap(start+hole)]);
+			_sync_entry(&table[pos]);
+			holes.push_back(rel);
+		}
+		for (auto hole : holes) {
+			StoreRelease(table[wrap(start+hole)], CLEAN_ENTRY);
+			_sync_entry(&table[wrap(start+hole)]);
+		}
+		cleaned += holes.size();
+		done += rel;
+		start = wrap(start+rel);
+	}
+	m_lock->sweep_cursor = start;
+
+	MemoryBarrier();
+	StoreRelease(m_lock->version, m_lock->version+1);
+
+	m_meta->clean_entry += cleaned;
+	ConsistencyAssert(m_meta->clean_entry + m_meta->item <= n);
+}
+
+//expired record is dropped instead of being moved
+void Estuary::_move_record(size_t vic) const {
+	auto& cur = m_meta->block_cursor;
+	assert(Rc(BLK(vic)).klen != 0);
+	const auto bcnt = RecordBlocks(BLK(vic));
+	const bool expired = m_const.expire_head != 0
+		&& Expired(RcVal(BLK(vic)), Rc(BLK(vic)).vlen, m_const.expire_head, Now());
+	if (!expired) {
+		memcpy(BLK(cur)+sizeof(RecordMark), BLK(vic)+sizeof(RecordMark), bcnt*DATA_BLOCK_SIZE-sizeof(RecordMark));
+	}
+	const auto bcode = Hash(RcKey(BLK(vic)), Rc(BLK(vic)).klen, m_const.seed);
+	bool done = false;
+	SearchInTable([this, &cur, vic, bcnt, expired, &done](Entry& ent, uint32_t tag, size_t off)->bool{
+		auto e = ent;
+		if (IsEmpty(e)) {
+			return IsClean(e);
+		} else if (e.blk == vic && expired) {
+			StoreRelease(ent, DELETED_ENTRY);
+			_sync_entry(&ent);
+			_clean_tail(&ent - (Entry*)m_table);
+			ConsistencyAssert(m_meta->item != 0);
+			m_meta->item--;
+			return true;	//blocks are freed below
+		} else if (e.blk == vic) {
+			m_meta->free_block -= bcnt;
+			auto next = cur + bcnt;
+			if (LIKELY(next != m_const.total_block)) {
+				ConsistencyAssert(next < m_const.total_block);
+				Rc(BLK(next)) = MarkForEmpty(Rc(BLK(cur)).bcnt-bcnt);
+				_dirty_block(next);
+			}
+			Rc(BLK(cur)) = Rc(BLK(vic));
+			_dirty_block(cur, bcnt);
+			e.blk = cur;
+			StoreRelease(ent, e);
+			_sync_entry(&ent);
+			Rc(BLK(vic)) = MarkForEmpty(bcnt);
+			_dirty_block(vic);
+			cur = next;
+			m_meta->free_block += bcnt;
+			done = true;
+			return true;
+		}
+		return false;
+	}, bcode, (Entry*)m_table, m_const.total_entry);
+	if (UNLIKELY(!done)) {	//orphan or expired
+		Rc(BLK(vic)) = MarkForEmpty(bcnt);
+		_dirty_block(vic);
+		m_meta->free_block += bcnt;
+		ConsistencyAssert(m_meta->free_block <= m_const.total_block);
+	}
+}
+
+//free section at blk is put at tail of its list, the oldest slot is reused first
+void Estuary::_link(size_t blk, uint16_t stamp) const {
+	auto block = BLK(blk);
+	const auto c = FloorClass(Rc(block).bcnt);
+	auto& list = m_pool->lists[c];
+	Rc(block).pooled = 1;
+	SlotLink(block) = list.tail | ((uint64_t)stamp << SLOT_ADDR_BITS);
+	SlotNext(block) = POOL_END;
+	_dirty_block(blk, POOL_MIN_BLOCK);
+	if (list.tail == POOL_END) {
+		list.head = blk;
+	} else {
+		SlotNext(BLK(list.tail)) = blk;
+		_dirty_block(list.tail, POOL_MIN_BLOCK);
+	}
+	list.tail = blk;
+	const size_t pool_off = (m_data - m_resource.addr()) - m_const.total_entry.value() * sizeof(Entry) - sizeof(Pool);
+	_dirty(pool_off + c * sizeof(list), sizeof(list));
+}
+
+void Estuary::_unlink(size_t blk) const {
+	auto block = BLK(blk);
+	const auto c = FloorClass(Rc(block).bcnt);
+	auto& list = m_pool->lists[c];
+	const auto prev = SlotPrev(block);
+	const auto next = SlotNext(block);
+	ConsistencyAssert(Rc(block).pooled && (prev == POOL_END || prev < m_const.total_block)
+		&& (next == POOL_END || next < m_const.total_block));
+	if (prev == POOL_END) {
+		list.head = next;
+	} else {
+		SlotNext(BLK(prev)) = next;
+		_dirty_block(prev, POOL_MIN_BLOCK);
+	}
+	if (next == POOL_END) {
+		list.tail = prev;
+	} else {
+		SetSlotPrev(BLK(next), prev);
+		_dirty_block(next, POOL_MIN_BLOCK);
+	}
+	Rc(block).pooled = 0;
+	_dirty_block(blk);
+	const size_t pool_off = (m_data - m_resource.addr()) - m_const.total_entry.value() * sizeof(Entry) - sizeof(Pool);
+	_dirty(pool_off + c * sizeof(list), sizeof(list));
+}
+
+//blocks of a dead record are freed, and linked in pool with following free sections
+//except the one at cursor, which belongs to defragmentation
+void Estuary::_release(size_t blk, size_t bcnt) const {
+	m_meta->free_block += bcnt;
+	if (m_pool != nullptr) {
+		for (auto next = blk + bcnt; next < m_const.total_block && next != m_meta->block_cursor
+				&& Rc(BLK(next)).klen == 0; next = blk + bcnt) {
+			if (Rc(BLK(next)).pooled) {
+				_unlink(next);
+			}
+			bcnt += Rc(BLK(next)).bcnt;
+		}
+	}
+	Rc(BLK(blk)) = MarkForEmpty(bcnt);
+	_dirty_block(blk);
+	if (m_pool != nullptr && bcnt >= POOL_MIN_BLOCK) {
+		_link(blk, PoolStamp());
+	}
+}
+
+//take bcnt blocks from a pooled slot freed POOL_DELAY_MS ago, the rest of slot goes back to pool.
+//slots are in order of freeing, so a list is skipped if its head is not old enough.
+//return POOL_END if no slot is big enough
+size_t Estuary::_reuse(size_t bcnt) const {
+	const auto now = PoolStamp();
+	for (auto c = CeilClass(bcnt); c < POOL_CLASSES; c++) {
+		const auto blk = m_pool->lists[c].head;
+		if (blk == POOL_END) {
+			continue;
+		}
+		const auto stamp = SlotStamp(BLK(blk));
+		if ((uint16_t)(now - stamp) < POOL_DELAY_MS) {	//a wrapped one waits once more at most
+			continue;
+		}
+		const size_t size = Rc(BLK(blk)).bcnt;
+		ConsistencyAssert(size >= bcnt && blk + size <= m_const.total_block);
+		_unlink(blk);
+		if (size > bcnt) {
+			Rc(BLK(blk+bcnt)) = MarkForEmpty(size-bcnt);
+			_dirty_block(blk+bcnt);
+			if (size-bcnt >= POOL_MIN_BLOCK) {
+				_link(blk+bcnt, stamp);
+			}
+		}
+		m_meta->free_block -= bcnt;
+		return blk;
+	}
+	return POOL_END;
+}
+
+// extend free section at cursor to hold need blocks, moving budget blocks of records at most
+// need should be no more than free_block - TOTAL_RESERVED_BLOCK + reserved_block
+bool Estuary::_defrag(size_t need, size_t budget) const {
+	auto& cur = m_meta->block_cursor;
+	ConsistencyAssert(Rc(BLK(cur)).klen == 0 && cur+Rc(BLK(cur)).bcnt <= m_const.total_block);
+
+	size_t moved = 0;
+	bool overflow = false;
+	while (Rc(BLK(cur)).bcnt < need) {
+		if (moved >= budget) {
+			StatAdd(Statistics::DEFRAG_BLOCK, moved);
+			return false;
+		}
+		auto nxt = cur + Rc(BLK(cur)).bcnt;
+		if (UNLIKELY(nxt == m_const.total_block)) {
+			ConsistencyAssert(!overflow && m_meta->free_block >= Rc(BLK(cur)).bcnt);
+			overflow = true; //no more than once
+			size_t vic = 0;
+			while (vic < cur) {	//some blocks may be moved more than once
+				if (Rc(BLK(vic)).klen == 0) {
+					if (Rc(BLK(vic)).pooled) {
+						_unlink(vic);
+					}
+					vic += Rc(BLK(vic)).bcnt;
+				} else if (vic < need && moved < budget) {
+					const auto bcnt = RecordBlocks(BLK(vic));
+					if (Rc(BLK(cur)).bcnt < bcnt) {
+						break;
+					}
+					_move_record(vic);
+					moved += bcnt;
+					vic += bcnt;
+					if (UNLIKELY(cur == m_const.total_block)) {
+						break;
+					}
+				} else {
+					break;
+				}
+			}
+			ConsistencyAssert(vic <= cur);
+			Rc(m_data) = MarkForEmpty(vic);
+			_dirty_block(0);
+			cur = 0;
+		} else {
+			size_t bcnt;
+			if (Rc(BLK(nxt)).klen == 0) {
+				ConsistencyAssert(nxt+Rc(BLK(nxt)).bcnt <= m_const.total_block);
+				if (Rc(BLK(nxt)).pooled) {
+					_unlink(nxt);
+				}
+				bcnt = Rc(BLK(nxt)).bcnt;
+			} else { //reserved_block must be enough
+				bcnt = RecordBlocks(BLK(nxt));
+				ConsistencyAssert(bcnt <= Rc(BLK(cur)).bcnt);
+				_move_record(nxt);
+				moved += bcnt;
+			}
+			Rc(BLK(cur)).bcnt += bcnt;
+			_dirty_block(cur);
+		}
+	}
+	StatAdd(Statistics::DEFRAG_BLOCK, moved);
+	return true;
+}
+
+bool Estuary::compact(size_t budget) const {
+	if (m_meta == nullptr || m_attach != nullptr) {
+		return true;
+	}
+	MutexLock master_lock(&m_lock->core);
+	if (m_meta->writing) {
+		throw DataException();
+	}
+	if (m_meta->free_block < TOTAL_RESERVED_BLOCK) {
+		return true;
+	}
+	m_meta->writing = true;
+	const auto start = StatClock();
+	auto done = _defrag(std::min(TOTAL_RESERVED_BLOCK,
+		m_meta->free_block - TOTAL_RESERVED_BLOCK + m_const.reserved_block), budget);
+	StatAdd(Statistics::DEFRAG_NS, StatClock() - start);
+	m_meta->writing = false;
+	return done;
+}
+
+bool Estuary::_update(Slice key, Slice val, uint32_t expire) const {
+	static thread_local std::string buf;
+	if (m_codec != nullptr) {
+		val = Encode(m_codec->dict, val, buf);
+	}
+	static thread_local std::string expire_buf;
+	if (m_const.expire_head != 0) {
+		val = WithExpire(val, expire, expire_buf);
+	}
+	auto new_block = RecordBlocks(key.len, val.len);
+	if (m_meta->free_block < new_block + TOTAL_RESERVED_BLOCK
+		|| TotalEntry(m_meta->item) > m_const.total_entry.value()) {
+		return false;
+	}
+	ConsistencyAssert(m_meta->block_cursor < m_const.total_block
+		&& m_meta->free_block <= m_const.total_block
+		&& m_meta->clean_entry <= m_const.total_entry.value());
+	StatAdd(Statistics::UPDATE);
+	const auto start = StatClock();
+
+	//sweep a little at a time before clean entries are really exhausted
+	const auto threshold = m_const.total_entry.value() / ENTRY_RESERVE_FACTOR;
+	if (UNLIKELY(m_meta->clean_entry <= threshold*2)) {
+		_sweep(m_meta->clean_entry <= threshold? m_const.total_entry.value() : SWEEP_STEP);
+		StatAdd(Statistics::SWEEP_NS, StatClock() - start);
+	}
+
+	const auto code = Hash(key.ptr, key.len, m_const.seed);
+	auto& cur = m_meta->block_cursor;
+	auto neo = m_pool != nullptr? _reuse(new_block) : POOL_END;
+	const bool reused = neo != POOL_END;
+	if (reused) {
+		StatAdd(Statistics::POOL_REUSE);
+	} else {
+		//defragmentation
+		ConsistencyAssert(Rc(BLK(m_meta->block_cursor)).bcnt >= m_const.reserved_block);
+		const auto defrag_start = StatClock();
+		_defrag(new_block + m_const.reserved_block, SIZE_MAX);
+		StatAdd(Statistics::DEFRAG_NS, StatClock() - defrag_start);
+		ConsistencyAssert(Rc(BLK(m_meta->block_cursor)).bcnt >= new_block + m_const.reserved_block);
+
+		m_meta->free_block -= new_block;
+		const auto next = cur + new_block;
+		Rc(BLK(next)) = MarkForEmpty(Rc(BLK(cur)).bcnt-new_block);
+		_dirty_block(next);
+		Rc(BLK(cur)).bcnt = new_block;
+		neo = cur;
+		cur = next;
+	}
+	auto tip = FillRecord(BLK(neo), key, val);
+	_dirty_block(neo, new_block);
+
+	// FIXED: use first deleted entry without looking forward may cause leak
+	// now just remember it then look forward for the target
+	struct {
+		Entry* entry = nullptr;
+		Entry value;
+	} bookmark;
+	bool done = false;
+	SearchInTable([this, &cur, neo, reused, tip, key, val, &bookmark, &done](Entry& ent, uint32_t tag, size_t off)->bool{
+		const auto e = ent;
+		if (IsEmpty(e)) {
+			if (bookmark.entry == nullptr) {
+				bookmark = {&ent, Entry(neo, tip, tag, off)};
+			}
+			return IsClean(e);
+		} else if (e.tag == tag) {
+			auto block = BLK(e.blk);
+			ConsistencyAssert(Rc(block).klen != 0 && Rc(block).vlen <= m_const.max_val_len);
+			if (LIKELY(KeyMatch(key, block))) {
+				const auto bcnt = RecordBlocks(block);
+				if (UNLIKELY(ValMatch(val, block))) {	//rollback
+					if (reused) {
+						_release(neo, bcnt);
+					} else {
+						Rc(BLK(neo)) = MarkForEmpty(bcnt);
+						const auto tail = Rc(BLK(cur)).bcnt;
+						cur = neo;
+						Rc(BLK(neo)) = MarkForEmpty(bcnt+tail);
+						m_meta->free_block += bcnt;
+					}
+				} else {
+					Entry entry(neo, tip, tag, off);
+					//the record may have been moved away from neo before, keep tip changing
+					//to avoid ABA problem
+					if (UNLIKELY(entry.tip == e.tip)) {
+						entry.tip ^= 1;
+					}
+					StoreRelease(ent, entry);
+					_sync_entry(&ent);
+					_release(e.blk, bcnt);
+				}
+				ConsistencyAssert(m_meta->free_block <= m_const.total_block);
+				done = true;
+				return true;
+			}
+		}
+		return false;
+	}, code, (Entry*)m_table, m_const.total_entry);
+
+	if (!done && bookmark.entry != nullptr) {
+		if (IsClean(*bookmark.entry)) {
+			m_meta->clean_entry--;
+		}
+		StoreRelease(*bookmark.entry, bookmark.value);
+		_sync_entry(bookmark.entry);
+		m_meta->item++;
+		done = true;
+	}
+	StatRecord(Statistics::UPDATE_NS, StatClock() - start);
+	return done;
+}
+
+static bool InitLock(Estuary::Lock* lock, bool shared=true) {
+	const int pshared = shared? PTHREAD_PROCESS_SHARED : PTHREAD_PROCESS_PRIVATE;
+	pthread_mutexattr_t mutexattr;
+	if (pthread_mutexattr_init(&mutexattr) != 0
+		|| pthread_mutexattr_setpshared(&mutexattr, pshared) != 0
+		|| pthread_mutex_init(&lock->core, &mutexattr) != 0) {
+		//pthread_mutexattr_destroy is unnecessary
+		return false;
+	}
+	lock->sweep_cursor = 0;
+	lock->generation = 0;
+	lock->version = 0;
+	return true;
+}
+
+static bool WriteAll(int fd, const uint8_t* data, size_t size) noexcept {
+	while (size > 0) {
+		auto sz = write(fd, data, size);
+		if (sz <= 0) {
+			return false;
+		}
+		data += sz;
+		size -= sz;
+	}
+	return true;
+}
+
+// records are appended under master lock, then written and synced by a background thread.
+// fdatasync covers all records appended during the last one, that makes group commit.
+// once a batch fails, the log is cut back to the durable part and writers are refused
+// until a checkpoint covers everything.
+struct Estuary::Wal {
+	int fd = -1;
+	int base = -1;			//holds the lock of base file
+	std::string buffer;		//records waiting to be written
+	uint64_t appended = 0;	//bytes ever appended
+	uint64_t synced = 0;
+	uint64_t durable = 0;	//length of log file synced
+	bool busy = false;
+	bool failed = false;
+	bool quit = false;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+	pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+	std::thread worker;
+
+	void run() noexcept {
+		std::string batch;
+		pthread_mutex_lock(&lock);
+		while (true) {
+			while (buffer.empty() && !quit) {
+				pthread_cond_wait(&wake, &lock);
+			}
+			if (buffer.empty()) {
+				break;
+			}
+			batch.swap(buffer);
+			const auto target = appended;
+			busy = true;
+			pthread_mutex_unlock(&lock);
+			const bool ok = WriteAll(fd, (const uint8_t*)batch.data(), batch.size()) && fdatasync(fd) == 0;
+			if (!ok) {
+				//records after a torn one can never be replayed
+				Logger::Printf("fail to write log, writing is stopped until checkpoint\n");
+				if (ftruncate64(fd, durable) != 0) {
+					Logger::Printf("fail to cut log\n");
+				}
+			}
+			pthread_mutex_lock(&lock);
+			busy = false;
+			if (ok) {
+				synced = target;
+				durable += batch.size();
+			} else {
+				failed = true;
+				buffer.clear();
+			}
+			batch.clear();
+			pthread_cond_broadcast(&done);
+		}
+		pthread_mutex_unlock(&lock);
+	}
+
+	~Wal() noexcept {
+		pthread_mutex_lock(&lock);
+		quit = true;
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&lock);
+		if (worker.joinable()) {
+			worker.join();
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (base >= 0) {
+			close(base);
+		}
+		pthread_cond_destroy(&done);
+		pthread_cond_destroy(&wake);
+		pthread_mutex_destroy(&lock);
+	}
+};
+
+// a log record is [mark][key][value], or [mark][key][expire][value] for LOG_UPDATE_EXPIRE
+static constexpr uint8_t LOG_UPDATE = 1U;
+static constexpr uint8_t LOG_ERASE = 2U;
+static constexpr uint8_t LOG_UPDATE_EXPIRE = 3U;
+struct LogMark {
+	uint32_t check = 0;
+	uint8_t op = 0;
+	uint8_t klen = 0;
+	uint16_t _pad = 0;
+	uint32_t vlen = 0;
+};
+static_assert(sizeof(LogMark) == 12);
+
+static uint32_t LogCheck(const LogMark& mark, Slice key, Slice val) {
+	auto code = Hash(key.ptr, key.len, ((uint64_t)mark.vlen << 16U) | ((uint64_t)mark.op << 8U) | mark.klen);
+	code = Hash(val.ptr, val.len, code);
+	return code ^ (code >> 32U);
+}
+
+//writes cannot be logged after a failure
+bool Estuary::_log_failed() const noexcept {
+	return m_wal != nullptr && LoadAcquire(m_wal->failed);
+}
+
+//every committed write passes here
+void Estuary::_log(bool erase, Slice key, Slice val, uint32_t expire) const {
+	StoreRelease(m_lock->generation, m_lock->generation+1);
+	if (m_wal == nullptr) {
+		return;
+	}
+	static thread_local std::string buf;
+	LogMark mark;
+	mark.op = erase? LOG_ERASE : LOG_UPDATE;
+	if (expire != 0) {
+		mark.op = LOG_UPDATE_EXPIRE;
+		val = WithExpire(val, expire, buf);
+	}
+	mark.klen = key.len;
+	mark.vlen = val.len;
+	mark.check = LogCheck(mark, key, val);
+	auto& wal = *m_wal;
+	MutexLock log_lock(&wal.lock);
+	wal.buffer.append((const char*)&mark, sizeof(mark));
+	wal.buffer.append((const char*)key.ptr, key.len);
+	if (val.len != 0) {
+		wal.buffer.append((const char*)val.ptr, val.len);
+	}
+	wal.appended += sizeof(mark) + key.len + val.len;
+	pthread_cond_signal(&wal.wake);
+}
+
+//readers attached are registered in a table of pids beside the file, 0 means a free slot
+static constexpr unsigned READER_SLOTS = 1024;
+
+static bool Alive(int32_t pid) noexcept {
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static MemMap OpenRegistry(const std::string& path, bool create) noexcept {
+	const auto name = path + ".readers";
+	int fd = open(name.c_str(), create? O_RDWR|O_CREAT : O_RDWR, 0644);
+	if (fd < 0) {
+		return {};
+	}
+	constexpr size_t size = READER_SLOTS * sizeof(int32_t);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate64(fd, size) != 0)) {
+		close(fd);
+		return {};
+	}
+	MemMap res(fd);
+	close(fd);
+	if (res.size() < size) {
+		return {};
+	}
+	return res;
+}
+
+struct Estuary::Attach {
+	MemMap registry;
+	int32_t* slot = nullptr;
+
+	explicit Attach(const std::string& path) : registry(OpenRegistry(path, true)) {
+		if (!registry) {
+			Logger::Printf("fail to register reader: %s\n", path.c_str());
+			return;
+		}
+		const int32_t self = getpid();
+		auto slots = (int32_t*)registry.addr();
+		for (unsigned i = 0; i < READER_SLOTS; i++) {
+			auto pid = LoadAcquire(slots[i]);
+			if ((pid == 0 || !Alive(pid)) && CompareAndSwap(slots[i], pid, self)) {
+				slot = &slots[i];
+				return;
+			}
+		}
+		Logger::Printf("too many readers: %s\n", path.c_str());
+	}
+	~Attach() noexcept {
+		if (slot == nullptr) {
+			return;
+		}
+		const int32_t self = getpid();
+		auto pid = self;
+		while (!CompareAndSwap(*slot, pid, 0) && pid == self);	//slot is not owned by forked process
+	}
+};
+
+std::vector<int> Estuary::Readers(const std::string& path) {
+	std::vector<int> out;
+	auto registry = OpenRegistry(path, false);
+	if (!registry) {
+		return out;
+	}
+	auto slots = (int32_t*)registry.addr();
+	for (unsigned i = 0; i < READER_SLOTS; i++) {
+		auto pid = LoadAcquire(slots[i]);
+		if (pid == 0) {
+			continue;
+		} else if (Alive(pid)) {
+			out.push_back(pid);
+		} else {
+			CompareAndSwap(slots[i], pid, 0);
+		}
+	}
+	return out;
+}
+
+Estuary::~Estuary() noexcept {
+	delete m_attach;
+	delete m_wal;
+	delete m_replica;
+	delete m_tier;
+	delete m_codec;
+	if (m_meta == nullptr) {
+		return;
+	}
+	if (m_monopoly_extra != nullptr) {
+		pthread_mutex_destroy(&m_lock->core);
+	}
+}
+
+bool Estuary::dump(const std::string& path) const noexcept {
+	if (m_tier == nullptr) {
+		return m_resource.dump(path.c_str());
+	}
+	if (m_meta == nullptr) {
+		return false;
+	}
+	auto fd = open(path.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0644);
+	if (fd < 0) {
+		Logger::Printf("fail to open file: %s\n", path.c_str());
+		return false;
+	}
+	const auto& head = m_tier->head;
+	auto done = WriteAll(fd, head.addr(), head.size())
+		&& WriteAll(fd, m_resource.addr() + head.size(), m_resource.size() - head.size());
+	close(fd);
+	return done;
+}
+
+// a delta is [head][run]...[run of meta], each run is [offset:64][length:64][bytes].
+// it turns a file of base generation into target generation, others are refused.
+static constexpr uint32_t DELTA_MAGIC = 0xE998DE18U;
+struct DeltaHead {
+	uint32_t magic = DELTA_MAGIC;
+	uint32_t _pad = 0;
+	uint64_t size = 0;	//size of the whole file
+	uint64_t seed = 0;
+	uint64_t base = 0;
+	uint64_t target = 0;
+};
+
+//the lock in file, which is not the working one for private instances
+static FORCE_INLINE Estuary::Lock* FileLock(Header* meta) noexcept {
+	return (Estuary::Lock*)((uint8_t*)meta + sizeof(Header));
+}
+struct DeltaRun {
+	uint64_t offset = 0;
+	uint64_t length = 0;
+};
+
+bool Estuary::dump_delta(const std::string& path) const {
+	if (m_meta == nullptr || m_attach != nullptr) {
+		return false;
+	}
+	if (m_monopoly_extra == nullptr) {
+		Logger::Printf("changes by other writers cannot be tracked in SHARED mode\n");
+		return false;
+	}
+	auto fd = open(path.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0644);
+	if (fd < 0) {
+		Logger::Printf("fail to open file: %s\n", path.c_str());
+		return false;
+	}
+	MutexLock master_lock(&m_lock->core);
+	if (m_meta->writing) {
+		close(fd);
+		throw DataException();
+	}
+	const auto size = m_resource.size();
+	//lock is alive in shared memory and never shipped, dictionary is never changed
+	size_t table_off = (m_data - m_resource.addr()) - m_const.total_entry.value() * sizeof(Entry);
+	if (m_pool != nullptr) {
+		table_off -= sizeof(Pool);	//shipped with table
+	}
+	const size_t head_size = m_tier != nullptr? m_tier->head.size() : 0;
+	auto put = [this, fd, head_size](size_t off, size_t len)->bool {
+		DeltaRun run;
+		run.offset = off;
+		run.length = len;
+		if (!WriteAll(fd, (const uint8_t*)&run, sizeof(run))) {
+			return false;
+		}
+		if (off < head_size) {	//table copied by tiering
+			const auto n = std::min(len, head_size - off);
+			if (!WriteAll(fd, m_tier->head.addr() + off, n)) {
+				return false;
+			}
+			off += n;
+			len -= n;
+		}
+		return WriteAll(fd, m_resource.addr() + off, len);
+	};
+
+	auto& generation = FileLock(m_meta)->delta;
+	DeltaHead head;
+	head.size = size;
+	head.seed = m_const.seed;
+	head.base = generation;
+	head.target = generation + 1;
+	auto done = WriteAll(fd, (const uint8_t*)&head, sizeof(head));
+	const size_t chunks = (size + (1U << DELTA_CHUNK_SHIFT) - 1) >> DELTA_CHUNK_SHIFT;
+	auto dirty = [this](size_t i)->bool {
+		return (m_dirty[i/64] >> (i%64)) & 1U;
+	};
+	for (size_t i = 0; done && i < chunks; ) {
+		if (!dirty(i)) {
+			i++;
+			continue;
+		}
+		auto j = i + 1;
+		while (j < chunks && dirty(j)) {
+			j++;
+		}
+		const auto begin = std::max(i << DELTA_CHUNK_SHIFT, table_off);
+		const auto end = std::min(j << DELTA_CHUNK_SHIFT, size);
+		done = begin >= end || put(begin, end - begin);
+		i = j;
+	}
+	done = done && put(0, sizeof(Header));
+	if (close(fd) != 0 || !done) {
+		Logger::Printf("fail to write delta: %s\n", path.c_str());
+		return false;
+	}
+	std::fill(m_dirty.begin(), m_dirty.end(), 0);
+	generation = head.target;
+	return true;
+}
+
+Estuary Estuary::Load(const std::string& path, const std::string& log, LoadPolicy policy) {
+	if (policy != COPY_DATA && policy != TIERED) {
+		Logger::Printf("base file should be loaded privately: %s\n", path.c_str());
+		return {};
+	}
+	auto out = Load(path, policy);
+	if (!out) {
+		return out;
+	}
+	int fd = OpenAndLock(log.c_str(), true, true);
+	if (fd < 0) {
+		return {};
+	}
+	size_t valid = 0;
+	MemMap content(fd);	//fails when log is empty
+	if (!!content) {
+		const uint8_t* pos = content.addr();
+		while ((size_t)(content.end() - pos) >= sizeof(LogMark)) {
+			LogMark mark;
+			memcpy(&mark, pos, sizeof(mark));
+			if ((mark.op != LOG_UPDATE && mark.op != LOG_ERASE && mark.op != LOG_UPDATE_EXPIRE)
+				|| (mark.op == LOG_UPDATE_EXPIRE && mark.vlen < EXPIRE_HEAD)
+				|| mark.klen + (size_t)mark.vlen > (size_t)(content.end() - pos) - sizeof(mark)) {
+				break;
+			}
+			const Slice key = {pos + sizeof(mark), mark.klen};
+			Slice val = {key.ptr + key.len, mark.vlen};
+			if (mark.check != LogCheck(mark, key, val)) {
+				break;
+			}
+			uint32_t expire = 0;
+			if (mark.op == LOG_UPDATE_EXPIRE) {
+				memcpy(&expire, val.ptr, sizeof(expire));
+				val = {val.ptr + EXPIRE_HEAD, val.len - EXPIRE_HEAD};
+			}
+			if (mark.op == LOG_ERASE) {
+				out.erase(key);
+			} else if (!out.update(key, val, expire)) {
+				Logger::Printf("fail to replay log: %s\n", log.c_str());
+				close(fd);
+				return {};
+			}
+			pos = val.ptr + val.len;
+		}
+		valid = pos - content.addr();
+		if (pos != content.end()) {
+			Logger::Printf("broken tail of log is dropped: %s\n", log.c_str());
+		}
+		content = MemMap();
+	}
+	//records beyond valid part are never committed
+	if (ftruncate64(fd, valid) != 0 || fcntl(fd, F_SETFL, O_APPEND) != 0) {
+		Logger::Printf("fail to reset log: %s\n", log.c_str());
+		close(fd);
+		return {};
+	}
+	//no one else should write the base file, the lock is held by mapping in TIERED
+	int base = -1;
+	if (out.m_resource.fd() < 0 && (base = OpenAndLock(path.c_str(), true, false)) < 0) {
+		close(fd);
+		return {};
+	}
+	auto wal = std::make_unique<Wal>();
+	wal->fd = fd;
+	wal->base = base;
+	wal->durable = valid;
+	wal->worker = std::thread(&Wal::run, wal.get());
+	out.m_wal = wal.release();
+	return out;
+}
+
+bool Estuary::sync() const {
+	if (m_wal == nullptr) {
+		return false;
+	}
+	auto& wal = *m_wal;
+	MutexLock log_lock(&wal.lock);
+	const auto target = wal.appended;
+	while (wal.synced < target && !wal.failed) {
+		pthread_cond_wait(&wal.done, &wal.lock);
+	}
+	return !wal.failed;
+}
+
+bool Estuary::checkpoint(const std::string& path) const {
+	if (m_meta == nullptr || m_attach != nullptr) {
+		return false;
+	}
+	MutexLock master_lock(&m_lock->core);
+	if (m_meta->writing) {
+		throw DataException();
+	}
+	const auto tmp = path + ".tmp";
+	const auto pos = path.rfind('/');
+	const auto dir = pos == std::string::npos? std::string(".") : path.substr(0, pos+1);
+	//new file is locked before it can be seen by others
+	int fd = OpenAndLock(tmp.c_str(), true, true);
+	if (fd < 0 || !dump(tmp) || !SyncFile(tmp.c_str()) || rename(tmp.c_str(), path.c_str()) != 0
+		|| !SyncFile(dir.c_str(), true)) {
+		Logger::Printf("fail to make checkpoint: %s\n", path.c_str());
+		unlink(tmp.c_str());
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	if (m_wal == nullptr) {
+		close(fd);
+		return true;
+	}
+	//everything in log is covered by checkpoint now
+	auto& wal = *m_wal;
+	MutexLock log_lock(&wal.lock);
+	if (wal.base >= 0) {
+		close(wal.base);
+	}
+	wal.base = fd;
+	while (wal.busy) {
+		pthread_cond_wait(&wal.done, &wal.lock);
+	}
+	wal.buffer.clear();
+	if (ftruncate64(wal.fd, 0) != 0) {
+		Logger::Printf("fail to reset log\n");
+		wal.failed = true;
+		return false;
+	}
+	wal.synced = wal.appended;
+	wal.durable = 0;
+	StoreRelease(wal.failed, false);
+	pthread_cond_broadcast(&wal.done);
+	return true;
+}
+
+Estuary Estuary::Load(const std::string& path, LoadPolicy policy) {
+	Estuary out;
+	MemMap res;
+	switch (policy) {
+		case SHARED:
+			res = MemMap(path.c_str(), true, false);
+			break;
+		case MONOPOLY:
+			res = MemMap(path.c_str(), true, true);
+			break;
+		case COPY_DATA:
+			res = MemMap(path.c_str(), MemMap::load_by_copy);
+			break;
+		case LAZY:
+			res = MemMap(path.c_str(), false, true);
+			break;
+		case TIERED:
+			res = MemMap(path.c_str(), MemMap::load_by_demand);
+			break;
+		case REPLICATED:
+			res = MemMap(path.c_str(), MemMap::load_by_copy);
+			break;
+		case READ_ONLY:
+			res = MemMap(path.c_str(), MemMap::read_only);
+			break;
 		default:
 			return out;
 	}
-	if (!!res) {
-		out._init(std::move(res), policy!=SHARED, path.c_str());
+	if (!!res) {
+		out._init(std::move(res), policy!=SHARED && policy!=READ_ONLY, path.c_str());
+	}
+	if (policy == READ_ONLY && !!out) {
+		out.m_attach = new Attach(path);
+	}
+	if (policy == TIERED && !!out && !out._tier()) {
+		Logger::Printf("fail to copy table: %s\n", path.c_str());
+		return {};
+	}
+	if (policy == REPLICATED && !!out && !out._replicate()) {
+		Logger::Printf("fail to replicate table: %s\n", path.c_str());
+		return {};
+	}
+	if (policy == LAZY && !!out) {
+		//table is small and touched by every probe
+		const size_t table_end = out.m_data - out.m_resource.addr();
+		out.m_resource.warmup(0, table_end);
+		out.m_warm.cursor = table_end;
+		out.m_warm.done = table_end;
+	}
+	return out;
+}
+
+bool Estuary::warmup(size_t budget) const noexcept {
+	const auto size = m_resource.size();
+	if (m_meta == nullptr || LoadAcquire(m_warm.cursor) >= size) {
+		return true;
+	}
+	const auto off = AddRelaxed(m_warm.cursor, budget);
+	if (off >= size) {
+		return true;
+	}
+	const auto len = std::min(budget, size - off);
+	m_resource.warmup(off, len);
+	AddRelaxed(m_warm.done, len);
+	return off + len >= size;
+}
+
+unsigned Estuary::warmup_progress() const noexcept {
+	const auto size = m_resource.size();
+	if (m_meta == nullptr || size == 0) {
+		return 0;
+	}
+	return std::min(LoadAcquire(m_warm.done), size) * 100 / size;
+}
+
+Estuary Estuary::Load(size_t size, const std::function<bool(uint8_t*)>& load) {
+	Estuary out;
+	MemMap res(size, load);
+	if (!!res) {
+		out._init(std::move(res), true, "...");
+	}
+	return out;
+}
+
+//move meta and table into anonymous memory, data pages are left in file mapping
+bool Estuary::_tier() {
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	auto tier = std::make_unique<Tier>();
+	const size_t head = m_data - m_resource.addr();
+	tier->head = MemMap(head, [this, head](uint8_t* space)->bool {
+		memcpy(space, m_resource.addr(), head);
+		return true;
+	});
+	//locking the private mapping would copy every page into anonymous memory
+	tier->view = MemMap(m_resource.fd(), MemMap::read_only);
+	tier->page_shift = __builtin_ctzll(page_size);
+	const auto pages = (m_resource.size() + page_size - 1) >> tier->page_shift;
+	tier->heat = MemMap(pages, [](uint8_t*)->bool { return true; });
+	if (!tier->head || !tier->view || !tier->heat) {
+		return false;
+	}
+	tier->pinned.resize((pages + 63) / 64);
+	tier->written.resize((pages + 63) / 64);
+	m_meta = (Meta*)tier->head.addr();
+	m_table = (uint64_t*)(tier->head.addr() + ((uint8_t*)m_table - m_resource.addr()));
+	if (m_pool != nullptr) {
+		m_pool = (Pool*)(tier->head.addr() + ((uint8_t*)m_pool - m_resource.addr()));
+	}
+	madvise(m_resource.addr(), head & ~(page_size-1), MADV_DONTNEED);
+	m_tier = tier.release();
+	return true;
+}
+
+//node list looks like "0-1,3"
+static std::vector<unsigned> OnlineNodes() {
+	std::vector<unsigned> nodes;
+	auto fp = fopen("/sys/devices/system/node/online", "r");
+	if (fp != nullptr) {
+		unsigned a, b;
+		int n;
+		while ((n = fscanf(fp, "%u-%u", &a, &b)) > 0) {
+			if (n == 1) {
+				b = a;
+			}
+			for (auto i = a; i <= b && i < 1024U; i++) {
+				nodes.push_back(i);
+			}
+			if (fgetc(fp) != ',') {
+				break;
+			}
+		}
+		fclose(fp);
+	}
+	if (nodes.empty()) {
+		nodes.push_back(0);
+	}
+	return nodes;
+}
+
+static constexpr int NUMA_MPOL_BIND = 2;
+static constexpr unsigned NUMA_MPOL_MF_MOVE = 1U << 1U;
+static constexpr unsigned NUMA_MPOL_F_NODE = 1U << 0U;
+static constexpr unsigned NUMA_MPOL_F_ADDR = 1U << 1U;
+
+//replicas are read-only for readers, writers update them after the primary table.
+//the primary table serves the node it lives on, other nodes get their own copies.
+bool Estuary::_replicate() {
+	const size_t size = m_const.total_entry.value() * sizeof(uint64_t);
+	const auto nodes = OnlineNodes();
+	int home = nodes.front();
+	if (syscall(SYS_get_mempolicy, &home, nullptr, 0, m_table, NUMA_MPOL_F_NODE|NUMA_MPOL_F_ADDR) != 0) {
+		home = nodes.front();
+	}
+	auto replica = std::make_unique<Replica>();
+	for (auto node : nodes) {
+		if (node == (unsigned)home) {
+			continue;
+		}
+		MemMap space(size, [this, node, size](uint8_t* addr)->bool {
+			std::vector<unsigned long> mask(node/64 + 1, 0);
+			mask[node/64] = 1UL << (node%64);
+			//pages are not touched yet, so binding works without moving
+			if (syscall(SYS_mbind, addr, size, NUMA_MPOL_BIND, mask.data(), mask.size()*64+1, NUMA_MPOL_MF_MOVE) != 0) {
+				Logger::Printf("fail to bind table to node %u[%d]\n", node, errno);
+			}
+			memcpy(addr, m_table, size);
+			return true;
+		});
+		if (!space) {
+			return false;
+		}
+		if (replica->tables.size() <= node) {
+			replica->tables.resize(node+1, m_table);
+		}
+		replica->tables[node] = (uint64_t*)space.addr();
+		replica->spaces.push_back(std::move(space));
+	}
+	if (!replica->spaces.empty()) {
+		m_replica = replica.release();
+	}
+	return true;
+}
+
+size_t Estuary::promote(size_t budget) const {
+	if (m_tier == nullptr) {
+		return 0;
+	}
+	auto& tier = *m_tier;
+	MutexLock tier_lock(&tier.lock);
+	const auto heat = tier.heat.addr();
+	const auto pages = tier.heat.size();
+	const size_t page_size = 1ULL << tier.page_shift;
+
+	//pages hotter than threshold are wanted, pages with threshold heat may be partly wanted
+	size_t histogram[UINT8_MAX+1] = {0};
+	for (size_t i = 0; i < pages; i++) {
+		histogram[LoadRelaxed(heat[i])]++;
+	}
+	size_t quota = budget >> tier.page_shift;
+	unsigned threshold = UINT8_MAX;
+	for (; threshold != 0 && histogram[threshold] <= quota; threshold--) {
+		quota -= histogram[threshold];
+	}
+	if (threshold == 0) {	//never pin cold pages
+		quota = 0;
+	}
+
+	auto pinned = [&tier](size_t i)->bool {
+		return (tier.pinned[i/64] >> (i%64)) & 1U;
+	};
+	//written pages are anonymous already, pinning file pages behind them makes no sense
+	auto written = [&tier](size_t i)->bool {
+		return (LoadAcquire(tier.written[i/64]) >> (i%64)) & 1U;
+	};
+	size_t begin = 0;
+	size_t len = 0;
+	bool pin = false;
+	auto flush = [this, &tier, &begin, &len, &pin, page_size]() {
+		if (len == 0) {
+			return;
+		}
+		auto addr = tier.view.addr() + (begin << tier.page_shift);
+		if (pin && mlock(addr, len * page_size) != 0) {
+			Logger::Printf("fail to pin pages[%d]\n", errno);
+		} else {
+			if (!pin) {
+				munlock(addr, len * page_size);
+			}
+			for (auto i = begin; i < begin + len; i++) {
+				tier.pinned[i/64] ^= 1ULL << (i%64);
+			}
+			tier.pinned_page = pin? tier.pinned_page + len : tier.pinned_page - len;
+		}
+		len = 0;
+	};
+	for (size_t i = 0; i < pages; i++) {
+		const unsigned h = LoadRelaxed(heat[i]);
+		bool want = h > threshold;
+		if (h == threshold && quota != 0 && !written(i)) {
+			want = true;
+			quota--;
+		}
+		want = want && !written(i);
+		StoreRelaxed(heat[i], (uint8_t)(h/2));	//decay
+		if (want == pinned(i)) {
+			continue;
+		}
+		if (len != 0 && (want != pin || begin + len != i)) {
+			flush();
+		}
+		if (len == 0) {
+			begin = i;
+			pin = want;
+		}
+		len++;
+	}
+	flush();
+	return tier.pinned_page * page_size;
+}
+
+struct Offsets {
+	size_t lock = 0;
+	size_t dict = 0;	//[size:32][pad:32][dictionary]
+	size_t pool = 0;	//just before table
+	size_t table = 0;
+	size_t data = 0;
+};
+
+static FORCE_INLINE size_t DictSpace(size_t size) {
+	return sizeof(uint64_t) + ((size + sizeof(uint64_t)-1) & ~(sizeof(uint64_t)-1));
+}
+
+static bool GetOffsets(const MemMap& res, Offsets& offsets, bool strict=false) {
+	if (!res || res.size() < sizeof(Header)) {
+		return false;
+	}
+	auto meta = (Header*)res.addr();
+	offsets.lock = sizeof(Header);
+	offsets.table = ((offsets.lock+sizeof(Estuary::Lock)) & ~(sizeof(uintptr_t)-1ULL)) + sizeof(uintptr_t);
+	if (meta->magic == MAGIC_EXT && (meta->features & FEATURE_COMPRESS)) {
+		offsets.dict = offsets.table;
+		if (res.size() < offsets.dict + sizeof(uint64_t)) {
+			return false;
+		}
+		const auto dict_size = *(const uint32_t*)(res.addr() + offsets.dict);
+		if (dict_size > CompressDict::MAX_SIZE) {
+			return false;
+		}
+		offsets.table += DictSpace(dict_size);
+	}
+	if (meta->magic == MAGIC_EXT && (meta->features & FEATURE_POOL)) {
+		offsets.pool = offsets.table;
+		offsets.table += sizeof(Estuary::Pool);
+	}
+	offsets.data = offsets.table + meta->total_entry * sizeof(Entry);
+	const auto data_end = offsets.data + meta->total_block * DATA_BLOCK_SIZE;
+	if ((meta->magic != MAGIC || meta->features != 0)
+		&& (meta->magic != MAGIC_EXT || (meta->features & ~ALL_FEATURES) != 0)) {
+		return false;
+	}
+	if (meta->total_entry < MIN_ENTRY || meta->total_entry > MAX_ENTRY
+		|| meta->total_block < meta->total_entry || meta->total_block > DATA_BLOCK_LIMIT
+		|| res.size() < data_end) {
+		return false;
+	}
+	if (strict) {
+		auto& mark = *(RecordMark*)&meta->kv_limit;
+		const auto reserved_block = RecordBlocks(mark.klen, mark.vlen) * 2;
+		return res.size() == data_end && meta->total_block > reserved_block;
+	}
+	return true;
+}
+
+void Estuary::_init(MemMap&& res, bool monopoly, const char* path) {
+	Offsets offsets;
+	if (!GetOffsets(res, offsets)) {
+		Logger::Printf("broken file: %s\n", path);
+		return;
+	}
+	auto meta = (Header*)res.addr();
+
+	std::unique_ptr<uint8_t[]> monopoly_extra;
+	auto lock = (Lock*)(res.addr() + offsets.lock);
+	if (monopoly) {
+		if (meta->writing) {
+			Logger::Printf("file is not saved correctly: %s\n", path);
+			return;
+		}
+		monopoly_extra = std::make_unique<uint8_t[]>(sizeof(Lock));
+		lock = (Lock*)monopoly_extra.get();
+		if (!InitLock(lock)) {
+			Logger::Printf("fail to reset locks in: %s\n", path);
+			return;
+		}
+	}
+
+	m_lock = lock;
+	if (offsets.pool != 0) {
+		m_pool = (Pool*)(res.addr()+offsets.pool);
+	}
+	m_table = (uint64_t*)(res.addr()+offsets.table);
+	m_data = res.addr()+offsets.data;
+	auto& mark = *(RecordMark*)&meta->kv_limit;
+	m_const.max_key_len = mark.klen;
+	m_const.max_val_len = mark.vlen;
+	m_const.reserved_block = RecordBlocks(mark.klen, mark.vlen) * 2;
+	m_const.seed = meta->seed;
+	m_const.total_entry = meta->total_entry;
+	m_const.total_block = meta->total_block;
+	if (m_const.total_block <= m_const.reserved_block) {
+		return;
+	}
+	if (offsets.dict != 0) {
+		auto codec = std::make_unique<Codec>();
+		codec->dict.init(res.addr() + offsets.dict + sizeof(uint64_t), *(const uint32_t*)(res.addr() + offsets.dict));
+		m_const.val_head += VALUE_HEAD;
+		m_codec = codec.release();
+	}
+	if (meta->features & FEATURE_EXPIRE) {
+		m_const.val_head += EXPIRE_HEAD;
+		m_const.expire_head = EXPIRE_HEAD;
+	}
+	m_monopoly_extra = std::move(monopoly_extra);
+	m_resource = std::move(res);
+	m_warm.cursor = m_resource.size();
+	m_warm.done = m_resource.size();
+	const auto chunks = (m_resource.size() + (1U << DELTA_CHUNK_SHIFT) - 1) >> DELTA_CHUNK_SHIFT;
+	m_dirty.assign((chunks + 63) / 64, 0);
+	m_meta = meta;
+}
+
+// records are copied one by one at first, then hashed and put into table shards in parallel
+static int ParallelFill(Header* meta, Entry* table, uint8_t* data, size_t init_end,
+						const Estuary::Config& config, IDataReader& source, unsigned concurrency) {
+	auto blk = [data](size_t idx)->uint8_t* {
+		return data + idx*DATA_BLOCK_SIZE;
+	};
+	const auto total = source.total();
+
+	std::vector<size_t> starts(concurrency+1);
+	size_t padding_sum = 0;
+	size_t cursor = 0;
+	for (size_t i = 0, part = 0; i < total; i++) {
+		while (part < concurrency && total*part/concurrency == i) {
+			starts[part++] = cursor;
+		}
+		auto rec = source.read();
+		if (rec.key.ptr == nullptr || rec.key.len == 0 || rec.key.len > config.max_key_len
+			|| (rec.val.len != 0 && rec.val.ptr == nullptr) || rec.val.len > config.max_val_len) {
+			Logger::Printf("broken item\n");
+			return -1;
+		}
+		padding_sum += PaddingSize(rec.key.len, rec.val.len);
+		auto bcnt = RecordBlocks(rec.key.len, rec.val.len);
+		if (cursor + bcnt > init_end) {
+			Logger::Printf("out of data capacity\n");
+			return static_cast<int>(padding_sum/(i+1)) + 1;
+		}
+		auto block = blk(cursor);
+		Rc(block).klen = rec.key.len;
+		Rc(block).vlen = rec.val.len;
+		memcpy(RcKey(block), rec.key.ptr, rec.key.len);
+		memcpy(RcVal(block), rec.val.ptr, rec.val.len);
+		cursor += bcnt;
+	}
+	starts[concurrency] = cursor;
+
+	struct Item {
+		uint64_t code;
+		uint64_t blk : ADDR_BITWIDTH;
+		uint64_t tip : 12;
+	};
+	const unsigned n_shard = concurrency * 4;
+	const size_t n_entry = meta->total_entry;
+	const Divisor<uint64_t> total_entry(n_entry);
+	const uint64_t seed = meta->seed;
+	auto shard_begin = [n_shard, n_entry](unsigned shard)->size_t {
+		return (shard * n_entry + n_shard - 1) / n_shard;
+	};
+
+	//buckets[part*n_shard+shard] keeps input order within each part
+	std::vector<std::vector<Item>> buckets(concurrency*n_shard);
+	ParallelRun(concurrency, [&](unsigned part) {
+		auto bucket = &buckets[part*n_shard];
+		const auto expect = (total/concurrency) / n_shard + (total/concurrency) / (n_shard*8) + 1;
+		for (unsigned i = 0; i < n_shard; i++) {
+			bucket[i].reserve(expect);
+		}
+		for (auto cur = starts[part]; cur < starts[part+1]; ) {
+			auto block = blk(cur);
+			Item item;
+			item.code = Hash(RcKey(block), Rc(block).klen, seed);
+			item.blk = cur;
+			item.tip = CalcTip(block);
+			const auto pos = item.code % total_entry;
+			bucket[pos*n_shard/n_entry].push_back(item);
+			cur += RecordBlocks(block);
+		}
+	});
+
+	// return 1 when new entry is inserted, 0 when old one is replaced, -1 when reaching limit,
+	// or the end of table if it can't wrap around, the head belongs to shard 0
+	auto insert = [&blk, table, n_entry, &total_entry](const Item& item, size_t limit, bool wrap, size_t& freed)->int {
+		const auto tag = CutTag(item.code);
+		auto pos = item.code % total_entry;
+		Slice key = {RcKey(blk(item.blk)), Rc(blk(item.blk)).klen};
+		for (size_t off = 0; off < n_entry; off++) {
+			if (pos == limit) {
+				return -1;
+			}
+			auto& ent = table[pos];
+			if (IsEmpty(ent)) {
+				ent = Entry(item.blk, item.tip, tag, off);
+				return 1;
+			} else if (ent.tag == tag && KeyMatch(key, blk(ent.blk))) {
+				const auto bcnt = RecordBlocks(blk(ent.blk));
+				Rc(blk(ent.blk)) = MarkForEmpty(bcnt);
+				freed += bcnt;
+				ent = Entry(item.blk, item.tip, tag, off);
+				return 0;
+			}
+			if (UNLIKELY(++pos >= n_entry)) {
+				if (!wrap) {
+					return -1;
+				}
+				pos = 0;
+			}
+		}
+		return -1;
+	};
+
+	std::vector<std::vector<Item>> spills(n_shard);
+	std::vector<size_t> items(concurrency, 0);
+	std::vector<size_t> frees(concurrency, 0);
+	std::atomic<unsigned> next_shard(0);
+	ParallelRun(concurrency, [&](unsigned worker) {
+		size_t item_cnt = 0;
+		size_t freed = 0;
+		for (unsigned shard; (shard = next_shard++) < n_shard; ) {
+			const auto limit = shard_begin(shard+1);
+			for (unsigned part = 0; part < concurrency; part++) {
+				for (auto& item : buckets[part*n_shard+shard]) {
+					auto ret = insert(item, limit, false, freed);
+					if (ret < 0) {
+						spills[shard].push_back(item);
+					} else {
+						item_cnt += ret;
+					}
+				}
+				std::vector<Item>().swap(buckets[part*n_shard+shard]);
+			}
+		}
+		items[worker] = item_cnt;
+		frees[worker] = freed;
+	});
+
+	size_t item_sum = 0;
+	size_t free_sum = 0;
+	for (unsigned i = 0; i < concurrency; i++) {
+		item_sum += items[i];
+		free_sum += frees[i];
+	}
+	for (auto& spill : spills) {
+		for (auto& item : spill) {
+			auto ret = insert(item, n_entry, true, free_sum);
+			ConsistencyAssert(ret >= 0);
+			item_sum += ret;
+		}
+	}
+
+	meta->item = item_sum;
+	meta->clean_entry = n_entry - item_sum;
+	meta->block_cursor = cursor;
+	meta->free_block = meta->total_block - cursor + free_sum;
+	return 0;
+}
+
+namespace {
+
+struct SortItem {
+	uint64_t pos;
+	uint64_t code;
+	uint64_t seq;
+	uint32_t klen;
+	uint32_t vlen;
+
+	const uint8_t* key() const noexcept { return (const uint8_t*)(this+1); }
+	const uint8_t* val() const noexcept { return key() + klen; }
+	size_t size() const noexcept { return Size(klen, vlen); }
+	static size_t Size(size_t klen, size_t vlen) noexcept {
+		return (sizeof(SortItem)+klen+vlen+(sizeof(uint64_t)-1)) & ~(sizeof(uint64_t)-1);
+	}
+};
+
+// order by table position, then key, then input sequence
+static bool operator<(const SortItem& a, const SortItem& b) noexcept {
+	if (a.pos != b.pos) return a.pos < b.pos;
+	if (a.code != b.code) return a.code < b.code;
+	if (a.klen != b.klen) return a.klen < b.klen;
+	auto ret = memcmp(a.key(), b.key(), a.klen);
+	if (ret != 0) return ret < 0;
+	return a.seq < b.seq;
+}
+
+static bool SameKey(const SortItem& a, const SortItem& b) noexcept {
+	return a.pos == b.pos && a.code == b.code && a.klen == b.klen
+		&& memcmp(a.key(), b.key(), a.klen) == 0;
+}
+
+// sorted items in a spilled file or in memory
+class SortedRun final {
+public:
+	SortedRun(int fd, size_t size, size_t buffer) : m_fd(fd), m_end(size), m_space(buffer) {
+		m_buffer = std::make_unique<uint8_t[]>(m_space);
+	}
+	SortedRun(const uint8_t* base, std::vector<size_t>&& index) : m_base(base), m_index(std::move(index)) {}
+	SortedRun(SortedRun&& other) noexcept
+			: m_fd(other.m_fd), m_off(other.m_off), m_end(other.m_end), m_space(other.m_space),
+			  m_avail(other.m_avail), m_cursor(other.m_cursor), m_buffer(std::move(other.m_buffer)),
+			  m_base(other.m_base), m_index(std::move(other.m_index)) {
+		other.m_fd = -1;
+	}
+	SortedRun& operator=(SortedRun&&) = delete;
+	~SortedRun() noexcept {
+		if (m_fd >= 0) {
+			close(m_fd);
+		}
+	}
+
+	// return nullptr when run is finished or broken
+	const SortItem* head() noexcept {
+		if (m_base != nullptr) {
+			return m_cursor < m_index.size()? (const SortItem*)(m_base + m_index[m_cursor]) : nullptr;
+		}
+		if (m_avail - m_cursor < sizeof(SortItem) && !_fill(sizeof(SortItem))) {
+			return nullptr;
+		}
+		auto item = (const SortItem*)(m_buffer.get() + m_cursor);
+		if (m_avail - m_cursor < item->size()) {
+			if (!_fill(item->size())) {
+				return nullptr;
+			}
+			item = (const SortItem*)(m_buffer.get() + m_cursor);
+		}
+		return item;
+	}
+	void next() noexcept {
+		if (m_base != nullptr) {
+			m_cursor++;
+		} else {
+			m_cursor += ((const SortItem*)(m_buffer.get() + m_cursor))->size();
+		}
+	}
+
+private:
+	int m_fd = -1;
+	size_t m_off = 0;
+	size_t m_end = 0;
+	size_t m_space = 0;
+	size_t m_avail = 0;
+	size_t m_cursor = 0;
+	std::unique_ptr<uint8_t[]> m_buffer;
+	const uint8_t* m_base = nullptr;
+	std::vector<size_t> m_index;
+
+	bool _fill(size_t need) noexcept {
+		const auto remain = m_avail - m_cursor;
+		if (need > m_space) {
+			auto buffer = std::make_unique<uint8_t[]>(need);
+			memcpy(buffer.get(), m_buffer.get()+m_cursor, remain);
+			m_buffer = std::move(buffer);
+			m_space = need;
+		} else {
+			memmove(m_buffer.get(), m_buffer.get()+m_cursor, remain);
+		}
+		m_cursor = 0;
+		m_avail = remain;
+		auto len = std::min(m_space - m_avail, m_end - m_off);
+		if (len != 0) {
+			if (pread(m_fd, m_buffer.get()+m_avail, len, m_off) != static_cast<ssize_t>(len)) {
+				return false;
+			}
+			m_off += len;
+			m_avail += len;
+		}
+		return m_avail >= need;
+	}
+};
+
+} //namespace
+
+// records are sorted by their table positions in bounded memory (spilling runs to temporary files),
+// then table and data are both written sequentially in one pass
+static int SortedFill(const std::string& path, Header* meta, Entry* table, uint8_t* data, size_t init_end,
+					  const Estuary::Config& config, IDataReader& source) {
+	auto blk = [data](size_t idx)->uint8_t* {
+		return data + idx*DATA_BLOCK_SIZE;
+	};
+	const size_t n_entry = meta->total_entry;
+	const Divisor<uint64_t> total_entry(n_entry);
+	const auto total = source.total();
+
+	const auto buffer_size = std::max(config.sort_memory,
+		SortItem::Size(config.max_key_len, config.max_val_len));
+	auto buffer = std::make_unique<uint8_t[]>(buffer_size);
+	std::vector<size_t> index;
+	size_t used = 0;
+	std::vector<SortedRun> runs;
+	std::vector<std::pair<int,size_t>> spilled;
+	auto close_spilled = [&spilled]() {
+		for (auto& run : spilled) {
+			close(run.first);
+		}
+	};
+
+	auto spill = [&]()->bool {
+		std::sort(index.begin(), index.end(), [&buffer](size_t a, size_t b)->bool {
+			return *(const SortItem*)(buffer.get()+a) < *(const SortItem*)(buffer.get()+b);
+		});
+		std::string tmp = path + ".sort.XXXXXX";
+		int fd = mkstemp(&tmp[0]);
+		if (fd < 0) {
+			Logger::Printf("fail to create temporary file: %s\n", tmp.c_str());
+			return false;
+		}
+		unlink(tmp.c_str());
+		spilled.emplace_back(fd, used);
+		std::vector<uint8_t> out;
+		out.reserve(16*1024*1024);
+		for (auto off : index) {
+			auto item = (const SortItem*)(buffer.get()+off);
+			if (out.size() + item->size() > out.capacity() && !out.empty()) {
+				if (!WriteAll(fd, out.data(), out.size())) {
+					return false;
+				}
+				out.clear();
+			}
+			out.insert(out.end(), (const uint8_t*)item, (const uint8_t*)item+item->size());
+		}
+		if (!WriteAll(fd, out.data(), out.size())) {
+			Logger::Printf("fail to write temporary file\n");
+			return false;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		index.clear();
+		used = 0;
+		return true;
+	};
+
+	size_t padding_sum = 0;
+	for (size_t i = 0; i < total; i++) {
+		auto rec = source.read();
+		if (rec.key.ptr == nullptr || rec.key.len == 0 || rec.key.len > config.max_key_len
+			|| (rec.val.len != 0 && rec.val.ptr == nullptr) || rec.val.len > config.max_val_len) {
+			Logger::Printf("broken item\n");
+			close_spilled();
+			return -1;
+		}
+		padding_sum += PaddingSize(rec.key.len, rec.val.len);
+		const auto size = SortItem::Size(rec.key.len, rec.val.len);
+		if (used + size > buffer_size && !spill()) {
+			close_spilled();
+			return -1;
+		}
+		auto item = (SortItem*)(buffer.get()+used);
+		item->code = Hash(rec.key.ptr, rec.key.len, meta->seed);
+		item->pos = item->code % total_entry;
+		item->seq = i;
+		item->klen = rec.key.len;
+		item->vlen = rec.val.len;
+		memcpy((uint8_t*)item->key(), rec.key.ptr, rec.key.len);
+		memcpy((uint8_t*)item->val(), rec.val.ptr, rec.val.len);
+		index.push_back(used);
+		used += size;
+	}
+	if (spilled.empty()) {
+		std::sort(index.begin(), index.end(), [&buffer](size_t a, size_t b)->bool {
+			return *(const SortItem*)(buffer.get()+a) < *(const SortItem*)(buffer.get()+b);
+		});
+		runs.emplace_back(buffer.get(), std::move(index));
+	} else {
+		if (!index.empty() && !spill()) {
+			close_spilled();
+			return -1;
+		}
+		buffer.reset();
+		const auto run_buffer = std::max<size_t>(config.sort_memory / spilled.size(), 64*1024);
+		for (auto& run : spilled) {
+			runs.emplace_back(run.first, run.second, run_buffer);
+		}
+		spilled.clear();
 	}
-	return out;
-}
 
-Estuary Estuary::Load(size_t size, const std::function<bool(uint8_t*)>& load) {
-	Estuary out;
-	MemMap res(size, load);
-	if (!!res) {
-		out._init(std::move(res), true, "...");
+	auto later = [&runs](unsigned a, unsigned b)->bool {
+		return *runs[b].head() < *runs[a].head();
+	};
+	std::vector<unsigned> heap;
+	for (unsigned i = 0; i < runs.size(); i++) {
+		if (runs[i].head() != nullptr) {
+			heap.push_back(i);
+		}
 	}
-	return out;
-}
+	std::make_heap(heap.begin(), heap.end(), later);
 
-struct Offsets {
-	size_t lock = 0;
-	size_t table = 0;
-	size_t data = 0;
-};
+	struct Wrapped {
+		uint64_t pos;
+		Entry entry;
+	};
+	std::vector<Wrapped> wrapped;
+	std::vector<uint8_t> pending;
+	size_t cursor = 0;
+	size_t next_pos = 0;
+	size_t item_cnt = 0;
+	size_t emitted = 0;
 
-static bool GetOffsets(const MemMap& res, Offsets& offsets, bool strict=false) {
-	if (!res || res.size() < sizeof(Header)) {
-		return false;
+	// return false when out of data capacity
+	auto emit = [&](const SortItem& item)->bool {
+		auto bcnt = RecordBlocks(item.klen, item.vlen);
+		if (cursor + bcnt > init_end) {
+			Logger::Printf("out of data capacity\n");
+			return false;
+		}
+		auto block = blk(cursor);
+		Rc(block).klen = item.klen;
+		Rc(block).vlen = item.vlen;
+		memcpy(RcKey(block), item.key(), item.klen);
+		memcpy(RcVal(block), item.val(), item.vlen);
+		Entry entry(cursor, CalcTip(block), CutTag(item.code));
+		cursor += bcnt;
+		item_cnt++;
+		if (UNLIKELY(next_pos >= n_entry)) {
+			wrapped.push_back({item.pos, entry});
+			return true;
+		}
+		for (; next_pos < item.pos; next_pos++) {
+			table[next_pos] = CLEAN_ENTRY;
+		}
+		entry.off = std::min(next_pos - item.pos, MAX_OFF_MARK);
+		table[next_pos++] = entry;
+		return true;
+	};
+
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), later);
+		auto& run = runs[heap.back()];
+		auto item = run.head();
+		if (!pending.empty() && !SameKey(*(const SortItem*)pending.data(), *item)) {
+			if (!emit(*(const SortItem*)pending.data())) {
+				return static_cast<int>(padding_sum/total) + 1;
+			}
+		}
+		pending.assign((const uint8_t*)item, (const uint8_t*)item+item->size());
+		emitted++;
+		run.next();
+		if (run.head() != nullptr) {
+			std::push_heap(heap.begin(), heap.end(), later);
+		} else {
+			heap.pop_back();
+		}
 	}
-	auto meta = (Header*)res.addr();
-	offsets.lock = sizeof(Header);
-	offsets.table = ((offsets.lock+sizeof(Estuary::Lock)) & ~(sizeof(uintptr_t)-1ULL)) + sizeof(uintptr_t);
-	offsets.data = offsets.table + meta->total_entry * sizeof(Entry);
-	const auto data_end = offsets.data + meta->total_block * DATA_BLOCK_SIZE;
-	if (meta->magic != MAGIC
-		|| meta->total_entry < MIN_ENTRY || meta->total_entry > MAX_ENTRY
-		|| meta->total_block < meta->total_entry || meta->total_block > DATA_BLOCK_LIMIT
-		|| res.size() < data_end) {
-		return false;
+	if (emitted != total) {
+		Logger::Printf("fail to read temporary file\n");
+		return -1;
 	}
-	if (strict) {
-		auto& mark = *(RecordMark*)&meta->kv_limit;
-		const auto reserved_block = RecordBlocks(mark.klen, mark.vlen) * 2;
-		return res.size() == data_end && meta->total_block > reserved_block;
+	if (!pending.empty() && !emit(*(const SortItem*)pending.data())) {
+		return static_cast<int>(padding_sum/total) + 1;
 	}
-	return true;
-}
-
-void Estuary::_init(MemMap&& res, bool monopoly, const char* path) {
-	Offsets offsets;
-	if (!GetOffsets(res, offsets)) {
-		Logger::Printf("broken file: %s\n", path);
-		return;
+	for (; next_pos < n_entry; next_pos++) {
+		table[next_pos] = CLEAN_ENTRY;
 	}
-	auto meta = (Header*)res.addr();
-
-	std::unique_ptr<uint8_t[]> monopoly_extra;
-	auto lock = (Lock*)(res.addr() + offsets.lock);
-	if (monopoly) {
-		if (meta->writing) {
-			Logger::Printf("file is not saved correctly: %s\n", path);
-			return;
-		}
-		monopoly_extra = std::make_unique<uint8_t[]>(sizeof(Lock));
-		lock = (Lock*)monopoly_extra.get();
-		if (!InitLock(lock)) {
-			Logger::Printf("fail to reset locks in: %s\n", path);
-			return;
+	size_t pos = 0;
+	for (auto& item : wrapped) {
+		while (!IsEmpty(table[pos])) {
+			pos++;
 		}
+		item.entry.off = std::min(pos + n_entry - item.pos, MAX_OFF_MARK);
+		table[pos++] = item.entry;
 	}
 
-	m_lock = lock;
-	m_table = (uint64_t*)(res.addr()+offsets.table);
-	m_data = res.addr()+offsets.data;
-	auto& mark = *(RecordMark*)&meta->kv_limit;
-	m_const.max_key_len = mark.klen;
-	m_const.max_val_len = mark.vlen;
-	m_const.reserved_block = RecordBlocks(mark.klen, mark.vlen) * 2;
-	m_const.seed = meta->seed;
-	m_const.total_entry = meta->total_entry;
-	m_const.total_block = meta->total_block;
-	if (m_const.total_block <= m_const.reserved_block) {
-		return;
-	}
-	m_monopoly_extra = std::move(monopoly_extra);
-	m_resource = std::move(res);
-	m_meta = meta;
+	meta->item = item_cnt;
+	meta->clean_entry = n_entry - item_cnt;
+	meta->block_cursor = cursor;
+	meta->free_block = meta->total_block - cursor;
+	return 0;
 }
 
 // return 0 means success, -1 means fail, 1~(DATA_BLOCK_SIZE-1) means retry
 static int DoCreate(const std::string& path, const Estuary::Config& config,
-					size_t total_block, IDataReader* source) {
+					size_t total_block, IDataReader* source, const std::string* dict) {
 	Header header;
+	if (dict != nullptr) {
+		header.magic = MAGIC_EXT;
+		header.features |= FEATURE_COMPRESS;
+	}
+	if (config.expiration) {
+		header.magic = MAGIC_EXT;
+		header.features |= FEATURE_EXPIRE;
+	}
+	if (config.pool) {
+		header.magic = MAGIC_EXT;
+		header.features |= FEATURE_POOL;
+	}
 	((RecordMark*)&header.kv_limit)->klen = config.max_key_len;
 	((RecordMark*)&header.kv_limit)->vlen = config.max_val_len;
 	header.seed = GetSeed();
@@ -793,7 +3488,7 @@ static int DoCreate(const std::string& path, const Estuary::Config& config,
 	header.clean_entry = header.total_entry;
 	header.total_block = std::max(config.item_limit+1, total_block);
 	const auto init_end = header.total_block;
-	header.total_block += header.total_block / (DATA_RESERVE_FACTOR-1) + 1;
+	header.total_block += header.total_block / (ReserveFactor(header.features)-1) + 1;
 	header.total_block += RecordBlocks(config.max_key_len, config.max_val_len) * 2;
 	if (header.total_block > DATA_BLOCK_LIMIT) {
 		Logger::Printf("too big\n");
@@ -805,6 +3500,14 @@ static int DoCreate(const std::string& path, const Estuary::Config& config,
 	const auto lock_off = size;
 	size += sizeof(Estuary::Lock);
 	size = (size & ~(sizeof(uintptr_t)-1ULL)) + sizeof(uintptr_t);
+	const auto dict_off = size;
+	if (dict != nullptr) {
+		size += DictSpace(dict->size());
+	}
+	const auto pool_off = size;
+	if (config.pool) {
+		size += sizeof(Estuary::Pool);
+	}
 	const auto table_off = size;
 	size += header.total_entry * sizeof(Entry);
 	const auto data_off = size;
@@ -828,8 +3531,22 @@ static int DoCreate(const std::string& path, const Estuary::Config& config,
 		Logger::Printf("fail to init\n");
 		return -1;
 	}
-	for (size_t i = 0; i < header.total_entry; i++) {
-		*(Entry*)(table+i) = CLEAN_ENTRY;
+	if (dict != nullptr) {
+		*(uint32_t*)(res.addr()+dict_off) = dict->size();
+		memcpy(res.addr()+dict_off+sizeof(uint64_t), dict->data(), dict->size());
+	}
+	if (config.pool) {	//empty at first, slots are linked when records are freed by updates
+		auto pool = (Estuary::Pool*)(res.addr()+pool_off);
+		for (auto& list : pool->lists) {
+			list.head = POOL_END;
+			list.tail = POOL_END;
+		}
+	}
+	const bool sorted = source != nullptr && config.sort_memory != 0;
+	if (!sorted) {	//table will be filled sequentially in sorted mode
+		for (size_t i = 0; i < header.total_entry; i++) {
+			*(Entry*)(table+i) = CLEAN_ENTRY;
+		}
 	}
 
 	if (source != nullptr) {
@@ -840,8 +3557,19 @@ static int DoCreate(const std::string& path, const Estuary::Config& config,
 			Logger::Printf("too many items\n");
 			return -1;
 		}
+		const auto concurrency = std::min<size_t>(Concurrency(config.concurrency), total/MIN_ENTRY+1);
 		size_t padding_sum = 0;
-		for (size_t i = 0; i < total; i++) {
+		if (sorted) {
+			auto ret = SortedFill(path, meta, (Entry*)table, data, init_end, config, *source);
+			if (ret != 0) {
+				return ret;
+			}
+		} else if (concurrency > 1) {
+			auto ret = ParallelFill(meta, (Entry*)table, data, init_end, config, *source, concurrency);
+			if (ret != 0) {
+				return ret;
+			}
+		} else for (size_t i = 0; i < total; i++) {
 			auto rec = source->read();
 			if (rec.key.ptr == nullptr || rec.key.len == 0 || rec.key.len > config.max_key_len
 				|| (rec.val.len != 0 && rec.val.ptr == nullptr) || rec.val.len > config.max_val_len) {
@@ -890,25 +3618,138 @@ static int DoCreate(const std::string& path, const Estuary::Config& config,
 	return 0;
 }
 
+//take heads of values evenly from source
+static std::string SampleDict(IDataReader& source) {
+	constexpr unsigned SAMPLES = 256;
+	constexpr size_t PIECE = CompressDict::MAX_SIZE / SAMPLES;
+	std::string dict;
+	source.reset();
+	const auto total = source.total();
+	const auto step = std::max<size_t>(total / SAMPLES, 1);
+	for (size_t i = 0; i < total && i < step * SAMPLES; i++) {
+		auto rec = source.read();
+		if (i % step == 0 && rec.val.ptr != nullptr) {
+			dict.append((const char*)rec.val.ptr, std::min(rec.val.len, PIECE));
+		}
+	}
+	return dict;
+}
+
+namespace {
+// values in source are encoded for storage
+class EncodedReader final : public IDataReader {
+public:
+	EncodedReader(IDataReader& source, const CompressDict& dict, size_t max_val_len)
+		: m_source(source), m_dict(dict), m_max_val_len(max_val_len) {}
+	void reset() override { m_source.reset(); }
+	size_t total() override { return m_source.total(); }
+	Record read() override {
+		auto rec = m_source.read();
+		if (rec.val.len > m_max_val_len) {
+			rec.val.ptr = nullptr;	//rejected as broken
+		} else if (rec.val.ptr != nullptr || rec.val.len == 0) {
+			rec.val = Encode(m_dict, rec.val, m_buf);
+		}
+		return rec;
+	}
+
+private:
+	IDataReader& m_source;
+	const CompressDict& m_dict;
+	const size_t m_max_val_len;
+	std::string m_buf;
+};
+
+// expire times in source are put ahead of values
+class ExpiringReader final : public IDataReader {
+public:
+	ExpiringReader(IDataReader& source, size_t max_val_len)
+		: m_source(source), m_max_val_len(max_val_len) {}
+	void reset() override { m_source.reset(); }
+	size_t total() override { return m_source.total(); }
+	Record read() override {
+		auto rec = m_source.read();
+		if (rec.val.len > m_max_val_len) {
+			rec.val.ptr = nullptr;	//rejected as broken
+		} else if (rec.val.ptr != nullptr || rec.val.len == 0) {
+			rec.val = WithExpire(rec.val, rec.expire, m_buf);
+		}
+		return rec;
+	}
+
+private:
+	IDataReader& m_source;
+	const size_t m_max_val_len;
+	std::string m_buf;
+};
+} //namespace
+
 bool Estuary::Create(const std::string& path, const Config& config, IDataReader* source) {
 	if (TotalEntry(config.item_limit) < MIN_ENTRY || TotalEntry(config.item_limit) > MAX_ENTRY
 		|| config.max_key_len == 0 || config.max_key_len > MAX_KEY_LEN
 		|| config.max_val_len == 0 || config.max_val_len > MAX_VAL_LEN
+		|| config.max_val_len + (config.compress? VALUE_HEAD : 0) + (config.expiration? EXPIRE_HEAD : 0) > MAX_VAL_LEN
 		|| config.avg_item_size < 2 || config.avg_item_size > config.max_key_len + config.max_val_len) {
 		Logger::Printf("bad arguments\n");
 		return false;
 	}
 
-	auto avg_item_size = config.avg_item_size + sizeof(uint32_t);
-	//round up with half block unless avg_item_size is too small
-	size_t total_block = (avg_item_size + DATA_BLOCK_SIZE/2) * (config.item_limit+1) / DATA_BLOCK_SIZE;
-	auto ret = DoCreate(path, config, total_block, source);
-	if (ret > static_cast<int>(DATA_BLOCK_SIZE/2)) {
-		Logger::Printf("retry with more space\n");
-		total_block = (avg_item_size + ret) * (config.item_limit+1) / DATA_BLOCK_SIZE;
-		ret = DoCreate(path, config, total_block, source);
+	auto create = [&path](const Config& config, IDataReader* source, const std::string* dict)->bool {
+		auto avg_item_size = config.avg_item_size + sizeof(uint32_t);
+		//round up with half block unless avg_item_size is too small
+		size_t total_block = (avg_item_size + DATA_BLOCK_SIZE/2) * (config.item_limit+1) / DATA_BLOCK_SIZE;
+		auto ret = DoCreate(path, config, total_block, source, dict);
+		if (ret > static_cast<int>(DATA_BLOCK_SIZE/2)) {
+			Logger::Printf("retry with more space\n");
+			total_block = (avg_item_size + ret) * (config.item_limit+1) / DATA_BLOCK_SIZE;
+			ret = DoCreate(path, config, total_block, source, dict);
+		}
+		return ret == 0;
+	};
+	Config stored = config;
+	if (config.expiration) {
+		stored.max_val_len += EXPIRE_HEAD;
+		stored.avg_item_size += EXPIRE_HEAD;
+	}
+	if (!config.compress) {
+		if (source == nullptr || !config.expiration) {
+			return create(stored, source, nullptr);
+		}
+		ExpiringReader expiring(*source, config.max_val_len);
+		return create(stored, &expiring, nullptr);
+	}
+
+	std::string dict;
+	if (source != nullptr) {
+		dict = SampleDict(*source);
 	}
-	return ret == 0;
+	CompressDict codec;
+	codec.init((const uint8_t*)dict.data(), dict.size());
+	stored.max_val_len += VALUE_HEAD;
+	if (source == nullptr) {
+		return create(stored, nullptr, &dict);
+	}
+	EncodedReader encoded(*source, codec, config.max_val_len);
+	if (!config.expiration) {
+		return create(stored, &encoded, &dict);
+	}
+	ExpiringReader expiring(encoded, config.max_val_len + VALUE_HEAD);
+	return create(stored, &expiring, &dict);
+}
+
+static void Describe(const Header& meta, Estuary::Config& config) {
+	const size_t item_limit = ItemLimit(meta.total_entry);
+	auto& mark = *(const RecordMark*)&meta.kv_limit;
+	config.compress = (meta.features & FEATURE_COMPRESS) != 0;
+	config.expiration = (meta.features & FEATURE_EXPIRE) != 0;
+	config.pool = (meta.features & FEATURE_POOL) != 0;
+	config.max_key_len = mark.klen;
+	config.max_val_len = mark.vlen - (config.compress? VALUE_HEAD : 0) - (config.expiration? EXPIRE_HEAD : 0);
+	config.item_limit = item_limit;
+	auto block_cnt = meta.total_block - RecordBlocks(mark.klen, mark.vlen) * 2;
+	block_cnt -= block_cnt / ReserveFactor(meta.features);
+	config.avg_item_size = (block_cnt * DATA_BLOCK_SIZE
+			- item_limit * (DATA_BLOCK_SIZE/2)) / item_limit - sizeof(uint32_t);
 }
 
 bool Estuary::Extend(const std::string& path, unsigned percent, Config* result) {
@@ -932,10 +3773,7 @@ bool Estuary::Extend(const std::string& path, unsigned percent, Config* result)
 		close(fd);
 		return false;
 	}
-	const size_t item_limit = ItemLimit(meta->total_entry);
 	auto& mark = *(RecordMark*)&meta->kv_limit;
-	const unsigned max_key_len = mark.klen;
-	const unsigned max_val_len = mark.vlen;
 	const auto reserved_block = RecordBlocks(mark.klen, mark.vlen) * 2;
 	auto block_cnt = meta->total_block - reserved_block;
 	auto extend_block = (block_cnt * percent + 99) / 100;
@@ -965,17 +3803,344 @@ bool Estuary::Extend(const std::string& path, unsigned percent, Config* result)
 
 	meta->total_block += extend_block;
 	meta->free_block += extend_block;
+	if (result != nullptr) {
+		Describe(*meta, *result);
+	}
 	close(fd);
+	return true;
+}
+
+//offline rehashing into a new file beside, which replaces the old one at last,
+//so a crash in the middle leaves the old file intact
+bool Estuary::Grow(const std::string& path, unsigned percent, Config* result) {
+	if (percent == 0 || percent > 100) {
+		return false;
+	}
+	int fd = OpenAndLock(path.c_str(), true, false);
+	if (fd < 0) {
+		return false;
+	}
+	MemMap res(fd);
+	Offsets offsets;
+	if (!GetOffsets(res, offsets, true)) {
+		Logger::Printf("broken file: %s\n", path.c_str());
+		close(fd);
+		return false;
+	}
+	auto old_meta = (const Header*)res.addr();
+	if (old_meta->writing) {
+		Logger::Printf("file is not saved correctly: %s\n", path.c_str());
+		close(fd);
+		return false;
+	}
+	const size_t old_entry = old_meta->total_entry;
+	const auto new_entry = std::min({old_entry + (old_entry * percent + 99) / 100, MAX_ENTRY, old_meta->total_block});
+	if (new_entry <= old_entry) {
+		Logger::Printf("cannot grow: %s\n", path.c_str());
+		close(fd);
+		return false;
+	}
+	const auto extend = (new_entry - old_entry) * sizeof(Entry);
+	const auto data_size = old_meta->total_block * DATA_BLOCK_SIZE;
+
+	//new file is locked before it can be seen by others
+	const auto tmp = path + ".grow";
+	MemMap out(tmp.c_str(), false, true, res.size() + extend);
+	struct stat st;
+	if (!out || fstat(fd, &st) != 0 || fchmod(out.fd(), st.st_mode & 07777) != 0) {
+		Logger::Printf("fail to create: %s\n", tmp.c_str());
+		close(fd);
+		return false;
+	}
+	//meta, lock, dictionary and pool lists are kept
+	memcpy(out.addr(), res.addr(), offsets.table);
+	auto meta = (Header*)out.addr();
+	meta->writing = true;
+	auto parked = (const Entry*)(res.addr() + offsets.table);
+	auto table = (Entry*)(out.addr() + offsets.table);
+	auto data = out.addr() + offsets.data + extend;
+	memcpy(data, res.addr() + offsets.data, data_size);
+	auto blk = [data](size_t idx)->uint8_t* {
+		return data + idx*DATA_BLOCK_SIZE;
+	};
 
+	for (size_t i = 0; i < new_entry; i++) {
+		table[i] = CLEAN_ENTRY;
+	}
+	Divisor<uint64_t> total_entry(new_entry);
+	for (size_t i = 0; i < old_entry; i++) {
+		const auto e = parked[i];
+		if (IsEmpty(e)) {
+			continue;
+		}
+		auto block = blk(e.blk);
+		SearchInTable([e](Entry& ent, uint32_t tag, size_t off)->bool{
+			if (!IsEmpty(ent)) {
+				return false;
+			}
+			assert(tag == e.tag);
+			ent = Entry(e.blk, e.tip, tag, off);
+			return true;
+		}, Hash(RcKey(block), Rc(block).klen, meta->seed), table, total_entry);
+	}
+	meta->total_entry = new_entry;
+	meta->clean_entry = new_entry - meta->item;
+	((Lock*)(out.addr() + offsets.lock))->sweep_cursor = 0;
+	meta->writing = false;
 	if (result != nullptr) {
-		result->max_key_len = max_key_len;
-		result->max_val_len = max_val_len;
-		result->item_limit = item_limit;
-		block_cnt += extend_block;
-		block_cnt -= block_cnt / DATA_RESERVE_FACTOR;
-		result->avg_item_size = (block_cnt * DATA_BLOCK_SIZE
-				- item_limit * (DATA_BLOCK_SIZE/2)) / item_limit - sizeof(uint32_t);
+		Describe(*meta, *result);
+	}
+
+	if (!ReplaceFile(out.fd(), tmp.c_str(), path.c_str())) {
+		Logger::Printf("fail to replace: %s\n", path.c_str());
+		unlink(tmp.c_str());
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+// live entries are scanned by pieces of table, which also find the first record at or after
+// each boundary of data. records are always reachable from entries, so data can be walked
+// by pieces starting from those records.
+bool Estuary::Inspect(const std::string& path, Layout& out, unsigned concurrency) {
+	//neither locked nor writable, so a live file is left as it is
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		Logger::Printf("fail to open file: %s\n", path.c_str());
+		return false;
+	}
+	const MemMap res(fd, MemMap::read_only);
+	close(fd);
+	Offsets offsets;
+	if (!GetOffsets(res, offsets, true)) {
+		Logger::Printf("broken file: %s\n", path.c_str());
+		return false;
+	}
+	auto meta = (const Header*)res.addr();
+	if (meta->writing) {
+		Logger::Printf("file is not saved correctly: %s\n", path.c_str());
+		return false;
+	}
+	out = Layout();
+	Describe(*meta, out.config);
+	out.total_entry = meta->total_entry;
+	out.total_block = meta->total_block;
+	out.free_block = meta->free_block;
+
+	const auto table = (const Entry*)(res.addr() + offsets.table);
+	const auto data = res.addr() + offsets.data;
+	const size_t total_entry = meta->total_entry;
+	const size_t total_block = meta->total_block;
+	const auto seed = meta->seed;
+	const unsigned n = Concurrency(concurrency);
+	auto piece = [n](size_t total, unsigned i)->size_t {
+		return (__uint128_t)total * i / n;
+	};
+
+	std::vector<Layout> parts(n);
+	std::vector<size_t> starts((size_t)n * n, total_block);	//by part and piece of data
+	std::atomic<bool> broken = {false};
+	ParallelRun(n, [&](unsigned id) {
+		auto& part = parts[id];
+		auto first = &starts[(size_t)id * n];
+		for (size_t i = piece(total_entry, id); i < piece(total_entry, id+1); i++) {
+			const auto e = table[i];
+			if (IsClean(e)) {
+				part.clean_entry++;
+				continue;
+			} else if (IsEmpty(e)) {
+				part.deleted_entry++;
+				continue;
+			}
+			auto block = data + e.blk*DATA_BLOCK_SIZE;
+			if (e.blk >= total_block || Rc((uint8_t*)block).klen == 0) {
+				broken = true;
+				return;
+			}
+			const auto mark = Rc((uint8_t*)block);
+			const auto home = Hash(block+sizeof(uint32_t), mark.klen, seed) % total_entry;
+			const auto distance = i >= home? i - home : i + total_entry - home;
+			part.probe_distance[Log2Bucket(distance, Layout::BUCKETS)]++;
+			part.item++;
+			const size_t k = (__uint128_t)e.blk * n / total_block;
+			first[k] = std::min(first[k], (size_t)e.blk);
+		}
+	});
+	if (broken) {
+		Logger::Printf("broken table: %s\n", path.c_str());
+		return false;
+	}
+
+	//walk k covers [begin[k], begin[k+1]), free runs never cross a record
+	std::vector<size_t> begin(n+1, total_block);
+	for (unsigned k = n; k-- > 1; ) {
+		begin[k] = begin[k+1];
+		for (unsigned id = 0; id < n; id++) {
+			begin[k] = std::min(begin[k], starts[(size_t)id * n + k]);
+		}
+	}
+	begin[0] = 0;
+	std::vector<size_t> records(n, 0);
+	ParallelRun(n, [&](unsigned k) {
+		auto& part = parts[k];
+		size_t run = 0;
+		auto flush = [&part, &run]() {
+			if (run != 0) {
+				part.free_section++;
+				part.max_free_section = std::max(part.max_free_section, run);
+				part.free_section_size[Log2Bucket(run, Layout::BUCKETS)]++;
+				run = 0;
+			}
+		};
+		size_t pos = begin[k];
+		while (pos < begin[k+1]) {
+			const auto mark = Rc((uint8_t*)data + pos*DATA_BLOCK_SIZE);
+			size_t bcnt;
+			if (mark.klen == 0) {
+				bcnt = mark.bcnt;
+				run += bcnt;
+				if (mark.pooled) {
+					part.pooled_block += bcnt;
+				}
+			} else {
+				flush();
+				bcnt = RecordBlocks(mark.klen, mark.vlen);
+				part.record_bytes += mark.klen + mark.vlen;
+				part.padding_bytes += PaddingSize(mark.klen, mark.vlen);
+				records[k]++;
+			}
+			if (bcnt == 0 || bcnt > begin[k+1] - pos) {
+				broken = true;
+				return;
+			}
+			pos += bcnt;
+		}
+		flush();
+	});
+	if (broken) {
+		Logger::Printf("broken data: %s\n", path.c_str());
+		return false;
+	}
+
+	size_t record_cnt = 0;
+	for (unsigned i = 0; i < n; i++) {
+		const auto& part = parts[i];
+		out.item += part.item;
+		out.clean_entry += part.clean_entry;
+		out.deleted_entry += part.deleted_entry;
+		out.record_bytes += part.record_bytes;
+		out.padding_bytes += part.padding_bytes;
+		out.free_section += part.free_section;
+		out.max_free_section = std::max(out.max_free_section, part.max_free_section);
+		out.pooled_block += part.pooled_block;
+		for (unsigned j = 0; j < Layout::BUCKETS; j++) {
+			out.probe_distance[j] += part.probe_distance[j];
+			out.free_section_size[j] += part.free_section_size[j];
+		}
+		record_cnt += records[i];
+	}
+	if (out.item != meta->item || record_cnt != out.item) {
+		Logger::Printf("inconsistent items in: %s\n", path.c_str());
+		return false;
+	}
+
+	const size_t item_limit = ItemLimit(total_entry);
+	size_t room = item_limit > out.item? item_limit - out.item : 0;
+	auto& mark = *(const RecordMark*)&meta->kv_limit;
+	const auto reserved_block = RecordBlocks(mark.klen, mark.vlen) * 2;
+	const auto keep_block = reserved_block + (total_block - reserved_block) / ReserveFactor(meta->features);
+	const size_t spare_block = meta->free_block > keep_block? meta->free_block - keep_block : 0;
+	const size_t used_bytes = out.record_bytes + out.padding_bytes + out.item * sizeof(uint32_t);
+	const size_t avg_block = out.item != 0? (used_bytes / out.item + DATA_BLOCK_SIZE-1) / DATA_BLOCK_SIZE
+		: RecordBlocks(1, out.config.avg_item_size);
+	out.room = std::min(room, spare_block / std::max<size_t>(avg_block, 1));
+	return true;
+}
+
+bool Estuary::ApplyDelta(const std::string& path, const std::string& delta) {
+	MemMap patch(delta.c_str());
+	if (!patch) {
+		return false;
+	}
+	int fd = OpenAndLock(path.c_str(), true, false);
+	if (fd < 0) {
+		return false;
+	}
+	MemMap res(fd);
+	Offsets offsets;
+	if (!GetOffsets(res, offsets, true)) {
+		Logger::Printf("broken file: %s\n", path.c_str());
+		close(fd);
+		return false;
+	}
+	auto meta = (Header*)res.addr();
+	auto head = (const DeltaHead*)patch.addr();
+	if (patch.size() < sizeof(DeltaHead) || head->magic != DELTA_MAGIC
+		|| head->size != res.size() || head->seed != meta->seed) {
+		Logger::Printf("delta mismatches: %s\n", delta.c_str());
+		close(fd);
+		return false;
+	}
+	auto& generation = FileLock(meta)->delta;
+	if (head->base != generation) {	//skipped, stale or reordered
+		Logger::Printf("delta of generation %lu mismatches %lu: %s\n", head->base, generation, delta.c_str());
+		close(fd);
+		return false;
+	}
+	if (meta->writing) {
+		Logger::Printf("file is not saved correctly: %s\n", path.c_str());
+		close(fd);
+		return false;
+	}
+
+	//check all runs before touching anything, meta comes last
+	auto pos = patch.addr() + sizeof(DeltaHead);
+	bool complete = false;
+	while (pos != patch.end()) {
+		DeltaRun run;
+		if ((size_t)(patch.end() - pos) < sizeof(run)) {
+			break;
+		}
+		memcpy(&run, pos, sizeof(run));
+		pos += sizeof(run);
+		if (run.length > (size_t)(patch.end() - pos) || run.offset > res.size()
+			|| run.length > res.size() - run.offset) {
+			break;
+		}
+		pos += run.length;
+		if (run.offset == 0) {
+			complete = run.length == sizeof(Header) && pos == patch.end();
+			break;
+		} else if (run.offset < (offsets.pool != 0? offsets.pool : offsets.table)) {
+			break;
+		}
 	}
+	if (!complete) {
+		Logger::Printf("broken delta: %s\n", delta.c_str());
+		close(fd);
+		return false;
+	}
+
+	meta->writing = true;
+	pos = patch.addr() + sizeof(DeltaHead);
+	while (pos != patch.end()) {
+		DeltaRun run;
+		memcpy(&run, pos, sizeof(run));
+		pos += sizeof(run);
+		if (run.offset == 0) {
+			break;
+		}
+		memcpy(res.addr() + run.offset, pos, run.length);
+		pos += run.length;
+	}
+	Header neo;
+	memcpy(&neo, pos, sizeof(Header));
+	neo.writing = false;
+	generation = head->target;
+	*meta = neo;
+	close(fd);
 	return true;
 }
 
@@ -0,0 +1,111 @@
+//==============================================================================
+// Dictionary designed for read-mostly scene.
+// Copyright (C) 2020	Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <thread>
+#include <handle.h>
+#include "internal.h"
+
+namespace estuary {
+
+static constexpr unsigned HANDLE_SLOTS = 63;
+struct HandleCore::Epoch : EpochSlots<HANDLE_SLOTS> {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;	//for swappers
+};
+
+struct HandleCore::Loading {
+	std::thread worker;
+	bool done = false;
+};
+
+HandleCore::HandleCore(void (*destroy)(void*), void* dict)
+	: m_destroy(destroy), m_current(dict), m_epoch(new Epoch()), m_loading(nullptr) {}
+
+HandleCore::~HandleCore() noexcept {
+	_wait();
+	if (m_current != nullptr) {
+		m_destroy(m_current);
+	}
+	pthread_mutex_destroy(&m_epoch->lock);
+	delete m_epoch;
+}
+
+const void* HandleCore::_enter(uint32_t*& active) const noexcept {
+	active = m_epoch->enter();
+	return LoadAcquire(m_current);
+}
+
+void HandleCore::_leave(uint32_t* active) noexcept {
+	Epoch::leave(active);
+}
+
+//readers who may see the old instance have left after two flips
+void HandleCore::_swap(void* dict) {
+	void* old;
+	{
+		MutexLock swap_lock(&m_epoch->lock);
+		old = m_current;
+		StoreRelease(m_current, dict);
+		m_epoch->synchronize(m_epoch->current + 2);
+	}
+	if (old != nullptr) {
+		m_destroy(old);
+	}
+}
+
+uint64_t HandleCore::_version() const noexcept {
+	return LoadAcquire(m_epoch->current) / 2;
+}
+
+bool HandleCore::_reload(std::function<void*()>&& load) {
+	if (m_loading != nullptr) {
+		return false;
+	}
+	auto loading = new Loading;
+	loading->worker = std::thread([this, loading, load=std::move(load)]() {
+		void* dict = nullptr;
+		try {	//nothing should escape the thread
+			dict = load();
+			if (dict != nullptr) {
+				_swap(dict);
+				loading->done = true;
+			}
+		} catch (const std::exception& e) {
+			Logger::Printf("fail to reload: %s\n", e.what());
+		} catch (...) {
+			Logger::Printf("fail to reload\n");
+		}
+		if (dict != nullptr && !loading->done) {
+			m_destroy(dict);
+		}
+	});
+	m_loading = loading;
+	return true;
+}
+
+bool HandleCore::_wait() {
+	if (m_loading == nullptr) {
+		return false;
+	}
+	m_loading->worker.join();
+	const bool done = m_loading->done;
+	delete m_loading;
+	m_loading = nullptr;
+	return done;
+}
+
+} //estuary
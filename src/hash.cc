@@ -16,70 +16,53 @@
 // along with the This Library; if not, see <https://www.gnu.org/licenses/>.
 //==============================================================================
 
+#include <cstring>
+#include <utils.h>
 #include "internal.h"
 
 namespace estuary {
 
-static FORCE_INLINE uint64_t Rot64(uint64_t x, unsigned k) {
-	return (x << k) | (x >> (64U - k));
+//works on both scalar and vector of words, in place to keep vectors away from ABI
+template <typename Word>
+static FORCE_INLINE void Rot64(Word& x, unsigned k) {
+	x = (x << k) | (x >> (64U - k));
 }
 
-static FORCE_INLINE void Mix(uint64_t& h0, uint64_t& h1, uint64_t& h2, uint64_t& h3) {
-	h2 = Rot64(h2,50);  h2 += h3;  h0 ^= h2;
-	h3 = Rot64(h3,52);  h3 += h0;  h1 ^= h3;
-	h0 = Rot64(h0,30);  h0 += h1;  h2 ^= h0;
-	h1 = Rot64(h1,41);  h1 += h2;  h3 ^= h1;
-	h2 = Rot64(h2,54);  h2 += h3;  h0 ^= h2;
-	h3 = Rot64(h3,48);  h3 += h0;  h1 ^= h3;
-	h0 = Rot64(h0,38);  h0 += h1;  h2 ^= h0;
-	h1 = Rot64(h1,37);  h1 += h2;  h3 ^= h1;
-	h2 = Rot64(h2,62);  h2 += h3;  h0 ^= h2;
-	h3 = Rot64(h3,34);  h3 += h0;  h1 ^= h3;
-	h0 = Rot64(h0,5);   h0 += h1;  h2 ^= h0;
-	h1 = Rot64(h1,36);  h1 += h2;  h3 ^= h1;
+template <typename Word>
+static FORCE_INLINE void Mix(Word& h0, Word& h1, Word& h2, Word& h3) {
+	Rot64(h2,50);  h2 += h3;  h0 ^= h2;
+	Rot64(h3,52);  h3 += h0;  h1 ^= h3;
+	Rot64(h0,30);  h0 += h1;  h2 ^= h0;
+	Rot64(h1,41);  h1 += h2;  h3 ^= h1;
+	Rot64(h2,54);  h2 += h3;  h0 ^= h2;
+	Rot64(h3,48);  h3 += h0;  h1 ^= h3;
+	Rot64(h0,38);  h0 += h1;  h2 ^= h0;
+	Rot64(h1,37);  h1 += h2;  h3 ^= h1;
+	Rot64(h2,62);  h2 += h3;  h0 ^= h2;
+	Rot64(h3,34);  h3 += h0;  h1 ^= h3;
+	Rot64(h0,5);   h0 += h1;  h2 ^= h0;
+	Rot64(h1,36);  h1 += h2;  h3 ^= h1;
 }
 
-static FORCE_INLINE void End(uint64_t& h0, uint64_t& h1, uint64_t& h2, uint64_t& h3) {
-	h3 ^= h2;  h2 = Rot64(h2,15);  h3 += h2;
-	h0 ^= h3;  h3 = Rot64(h3,52);  h0 += h3;
-	h1 ^= h0;  h0 = Rot64(h0,26);  h1 += h0;
-	h2 ^= h1;  h1 = Rot64(h1,51);  h2 += h1;
-	h3 ^= h2;  h2 = Rot64(h2,28);  h3 += h2;
-	h0 ^= h3;  h3 = Rot64(h3,9);   h0 += h3;
-	h1 ^= h0;  h0 = Rot64(h0,47);  h1 += h0;
-	h2 ^= h1;  h1 = Rot64(h1,54);  h2 += h1;
-	h3 ^= h2;  h2 = Rot64(h2,32);  h3 += h2;
-	h0 ^= h3;  h3 = Rot64(h3,25);  h0 += h3;
-	h1 ^= h0;  h0 = Rot64(h0,63);  h1 += h0;
+template <typename Word>
+static FORCE_INLINE void End(Word& h0, Word& h1, Word& h2, Word& h3) {
+	h3 ^= h2;  Rot64(h2,15);  h3 += h2;
+	h0 ^= h3;  Rot64(h3,52);  h0 += h3;
+	h1 ^= h0;  Rot64(h0,26);  h1 += h0;
+	h2 ^= h1;  Rot64(h1,51);  h2 += h1;
+	h3 ^= h2;  Rot64(h2,28);  h3 += h2;
+	h0 ^= h3;  Rot64(h3,9);   h0 += h3;
+	h1 ^= h0;  Rot64(h0,47);  h1 += h0;
+	h2 ^= h1;  Rot64(h1,54);  h2 += h1;
+	h3 ^= h2;  Rot64(h2,32);  h3 += h2;
+	h0 ^= h3;  Rot64(h3,25);  h0 += h3;
+	h1 ^= h0;  Rot64(h0,63);  h1 += h0;
 }
 
-//SpookyHash
-uint64_t Hash(const uint8_t* msg, unsigned len, uint64_t seed) noexcept {
-	constexpr uint64_t magic = 0xdeadbeefdeadbeefULL;
-
-	uint64_t a = seed;
-	uint64_t b = seed;
-	uint64_t c = magic;
-	uint64_t d = magic;
-
-	for (auto end = msg + (len&~0x1fU); msg < end; msg += 32) {
-		auto x = (const uint64_t*)msg;
-		c += x[0];
-		d += x[1];
-		Mix(a, b, c, d);
-		a += x[2];
-		b += x[3];
-	}
-
-	if (len & 0x10U) {
-		auto x = (const uint64_t*)msg;
-		c += x[0];
-		d += x[1];
-		Mix(a, b, c, d);
-		msg += 16;
-	}
+static constexpr uint64_t MAGIC = 0xdeadbeefdeadbeefULL;
 
-	d += ((uint64_t)len) << 56U;
+//last 0-15 bytes
+static FORCE_INLINE void Tail(const uint8_t* msg, unsigned len, uint64_t& c, uint64_t& d) {
 	switch (len & 0xfU) {
 		case 15:
 			d += ((uint64_t)msg[14]) << 48U;
@@ -117,12 +100,166 @@ uint64_t Hash(const uint8_t* msg, unsigned len, uint64_t seed) noexcept {
 			c += (uint64_t)msg[0];
 			break;
 		case 0:
-			c += magic;
-			d += magic;
+			c += MAGIC;
+			d += MAGIC;
+	}
+}
+
+//SpookyHash
+uint64_t Hash(const uint8_t* msg, unsigned len, uint64_t seed) noexcept {
+	uint64_t a = seed;
+	uint64_t b = seed;
+	uint64_t c = MAGIC;
+	uint64_t d = MAGIC;
+
+	for (auto end = msg + (len&~0x1fU); msg < end; msg += 32) {
+		auto x = (const uint64_t*)msg;
+		c += x[0];
+		d += x[1];
+		Mix(a, b, c, d);
+		a += x[2];
+		b += x[3];
+	}
+
+	if (len & 0x10U) {
+		auto x = (const uint64_t*)msg;
+		c += x[0];
+		d += x[1];
+		Mix(a, b, c, d);
+		msg += 16;
 	}
+
+	d += ((uint64_t)len) << 56U;
+	Tail(msg, len, c, d);
 	End(a, b, c, d);
 
 	return a;
 }
 
-} //estuary
\ No newline at end of file
+// same steps as Hash on N messages with the same length, each lane of vector holds one message
+template <typename Vector, unsigned N>
+static FORCE_INLINE void HashLanes(const uint8_t* const* msgs, unsigned len, uint64_t seed, uint64_t* out) {
+	Vector a = Vector{} + seed;
+	Vector b = a;
+	Vector c = Vector{} + MAGIC;
+	Vector d = c;
+	Vector x[4];
+	auto load = [msgs, &x](unsigned off, unsigned cnt) {
+		for (unsigned i = 0; i < N; i++) {
+			uint64_t word[4];
+			memcpy(word, msgs[i]+off, cnt*sizeof(uint64_t));
+			for (unsigned j = 0; j < cnt; j++) {
+				x[j][i] = word[j];
+			}
+		}
+	};
+
+	unsigned off = 0;
+	for (; off + 32 <= len; off += 32) {
+		load(off, 4);
+		c += x[0];
+		d += x[1];
+		Mix(a, b, c, d);
+		a += x[2];
+		b += x[3];
+	}
+	if (len & 0x10U) {
+		load(off, 2);
+		c += x[0];
+		d += x[1];
+		Mix(a, b, c, d);
+		off += 16;
+	}
+
+	d += ((uint64_t)len) << 56U;
+	for (unsigned i = 0; i < N; i++) {
+		uint64_t tc = 0;
+		uint64_t td = 0;
+		Tail(msgs[i]+off, len, tc, td);
+		x[0][i] = tc;
+		x[1][i] = td;
+	}
+	c += x[0];
+	d += x[1];
+	End(a, b, c, d);
+	memcpy(out, &a, sizeof(a));
+}
+
+static constexpr unsigned GROUP = HASH_GROUP;
+using GroupKernel = void (*)(const uint8_t* const* msgs, unsigned len, uint64_t seed, uint64_t* out) noexcept;
+
+void HashGroup(const uint8_t* const* msgs, unsigned len, uint64_t seed, uint64_t* out) noexcept {
+	for (unsigned i = 0; i < GROUP; i++) {
+		out[i] = Hash(msgs[i], len, seed);
+	}
+}
+
+#if defined(__x86_64__)
+typedef uint64_t U64x4 __attribute__((vector_size(32)));
+typedef uint64_t U64x8 __attribute__((vector_size(64)));
+
+__attribute__((target("avx2")))
+void HashGroupAVX2(const uint8_t* const* msgs, unsigned len, uint64_t seed, uint64_t* out) noexcept {
+	HashLanes<U64x4, 4>(msgs, len, seed, out);
+	HashLanes<U64x4, 4>(msgs+4, len, seed, out+4);
+}
+
+__attribute__((target("avx512f")))
+void HashGroupAVX512(const uint8_t* const* msgs, unsigned len, uint64_t seed, uint64_t* out) noexcept {
+	HashLanes<U64x8, 8>(msgs, len, seed, out);
+}
+#endif
+
+static GroupKernel PickKernel() noexcept {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return HashGroupAVX512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return HashGroupAVX2;
+	}
+#endif
+	return HashGroup;
+}
+
+static const GroupKernel s_hash_group = PickKernel();
+
+void HashBatch(const uint8_t* keys, size_t stride, unsigned len, size_t n, uint64_t seed, uint64_t* out) noexcept {
+	const uint8_t* msgs[GROUP];
+	size_t i = 0;
+	for (; i + GROUP <= n; i += GROUP) {
+		for (unsigned j = 0; j < GROUP; j++) {
+			msgs[j] = keys + (i+j)*stride;
+		}
+		s_hash_group(msgs, len, seed, out+i);
+	}
+	for (; i < n; i++) {
+		out[i] = Hash(keys + i*stride, len, seed);
+	}
+}
+
+void HashBatch(const Slice* keys, size_t n, uint64_t seed, uint64_t* out) noexcept {
+	const uint8_t* msgs[GROUP];
+	size_t i = 0;
+	while (i + GROUP <= n) {
+		const auto len = keys[i].len;
+		unsigned j = 0;
+		for (; j < GROUP && keys[i+j].len == len; j++) {
+			msgs[j] = keys[i+j].ptr;
+		}
+		if (j == GROUP) {
+			s_hash_group(msgs, len, seed, out+i);
+			i += GROUP;
+		} else {
+			for (; j != 0; j--, i++) {
+				out[i] = Hash(keys[i].ptr, keys[i].len, seed);
+			}
+		}
+	}
+	for (; i < n; i++) {
+		out[i] = Hash(keys[i].ptr, keys[i].len, seed);
+	}
+}
+
+} //estuary
@@ -24,7 +24,12 @@
 #include <cstdint>
 #include <chrono>
 #include <exception>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include <pthread.h>
+#include <utils.h>
 
 #define FORCE_INLINE inline __attribute__((always_inline))
 #define NOINLINE __attribute__((noinline))
@@ -39,6 +44,38 @@ static_assert(sizeof(uintptr_t)==sizeof(uint64_t));
 
 namespace estuary {
 extern uint64_t Hash(const uint8_t* msg, unsigned len, uint64_t seed) noexcept;
+//give the same codes as Hash, groups of keys with the same length are hashed by SIMD if possible
+extern void HashBatch(const uint8_t* keys, size_t stride, unsigned len, size_t n, uint64_t seed, uint64_t* out) noexcept;
+struct Slice;
+extern void HashBatch(const Slice* keys, size_t n, uint64_t seed, uint64_t* out) noexcept;
+//kernels behind HashBatch, each hashes HASH_GROUP keys of the same length.
+//SIMD ones should be called only if the cpu supports them
+static constexpr unsigned HASH_GROUP = 8;
+extern void HashGroup(const uint8_t* const* msgs, unsigned len, uint64_t seed, uint64_t* out) noexcept;
+#if defined(__x86_64__)
+extern void HashGroupAVX2(const uint8_t* const* msgs, unsigned len, uint64_t seed, uint64_t* out) noexcept;
+extern void HashGroupAVX512(const uint8_t* const* msgs, unsigned len, uint64_t seed, uint64_t* out) noexcept;
+#endif
+//the group scan used by Estuary readers over CACHE_BLOCK_SIZE/8 table entries,
+//return mask of live entries with the tag, and mask of clean entries in clean
+extern uint32_t ScanEntryGroup(const uint64_t* group, unsigned tag, uint32_t* clean) noexcept;
+
+//preset dictionary for LZ compression, the data is not copied
+class CompressDict final {
+public:
+	static constexpr size_t MAX_SIZE = 32768;
+	void init(const uint8_t* data, size_t size);
+	const uint8_t* data() const noexcept { return m_data; }
+	size_t size() const noexcept { return m_size; }
+	const uint32_t* table() const noexcept { return m_table.get(); }
+private:
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+	std::unique_ptr<uint32_t[]> m_table;
+};
+//return compressed size, 0 means the output cannot fit within cap
+extern size_t Compress(const uint8_t* src, size_t len, const CompressDict& dict, uint8_t* out, size_t cap) noexcept;
+extern bool Decompress(const uint8_t* src, size_t len, const CompressDict& dict, uint8_t* out, size_t raw_len) noexcept;
 
 struct LockException : public std::exception {
 	const char* what() const noexcept override;
@@ -112,6 +149,16 @@ static FORCE_INLINE void PrefetchForFuture(const void* ptr) {
 #endif
 static_assert(CACHE_BLOCK_SIZE >= 64U && (CACHE_BLOCK_SIZE&(CACHE_BLOCK_SIZE-1)) == 0);
 
+template <typename T>
+T FORCE_INLINE LoadRelaxed(const T& tgt) {
+	return __atomic_load_n(&tgt, __ATOMIC_RELAXED);
+}
+
+template <typename T>
+void FORCE_INLINE StoreRelaxed(T& tgt, T val) {
+	__atomic_store_n(&tgt, val, __ATOMIC_RELAXED);
+}
+
 template <typename T>
 T FORCE_INLINE LoadAcquire(const T& tgt) {
 	return __atomic_load_n(&tgt, __ATOMIC_ACQUIRE);
@@ -132,9 +179,140 @@ T FORCE_INLINE SubRelaxed(T& tgt, T val) {
 	return __atomic_fetch_sub(&tgt, val, __ATOMIC_RELAXED);
 }
 
+template <typename T>
+T FORCE_INLINE SubRelease(T& tgt, T val) {
+	return __atomic_fetch_sub(&tgt, val, __ATOMIC_RELEASE);
+}
+
+template <typename T>
+bool FORCE_INLINE CompareAndSwap(T& tgt, T& expected, T val) {
+	return __atomic_compare_exchange_n(&tgt, &expected, val, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void FORCE_INLINE AcquireBarrier() {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
 void FORCE_INLINE MemoryBarrier() {
 	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
+//bucket 0 holds 0, bucket i holds [2^(i-1), 2^i), the last one holds all bigger values
+static FORCE_INLINE unsigned Log2Bucket(uint64_t val, unsigned buckets) noexcept {
+	return val == 0? 0 : std::min(64U - __builtin_clzll(val), buckets-1);
+}
+
+//the same in all modules, readers are spread over slots by it
+inline unsigned ReaderIndex() noexcept {
+	static unsigned cnt = 0;
+	static thread_local const unsigned idx = AddRelaxed(cnt, 1U);
+	return idx;
+}
+
+//readers count themselves in the slot of current epoch parity, a slot may be shared by threads.
+//writers flip the epoch and wait for the old parity to drain, so readers entered before two
+//flips have all left (like SRCU). it's plain data and can be put in files
+template <unsigned SLOTS>
+struct EpochSlots {
+	uint64_t current;
+	struct {
+		uint32_t active[2];
+	} __attribute__((aligned(CACHE_BLOCK_SIZE))) slots[SLOTS];
+
+	//return the counter to leave
+	uint32_t* enter() noexcept {
+		auto active = &slots[ReaderIndex() % SLOTS].active[LoadAcquire(current) & 1U];
+		AddRelaxed(*active, 1U);
+		MemoryBarrier();
+		return active;
+	}
+	static void leave(uint32_t* active) noexcept {
+		if (active != nullptr) {
+			SubRelease(*active, 1U);
+		}
+	}
+	//flip epoch until target, flippers should be serialized
+	void synchronize(uint64_t target) noexcept {
+		while (current < target) {
+			const auto old = current;
+			StoreRelease(current, old+1);
+			MemoryBarrier();
+			for (auto& slot : slots) {
+				while (LoadAcquire(slot.active[old&1U]) != 0) {
+					std::this_thread::yield();
+				}
+			}
+		}
+	}
+} __attribute__((aligned(CACHE_BLOCK_SIZE)));
+
+//statistics of one thread, written by the owner only
+struct alignas(CACHE_BLOCK_SIZE) StatBlock {
+	uint64_t counter[Statistics::COUNTER_NUM];
+	uint64_t histogram[Statistics::HISTOGRAM_NUM][Statistics::BUCKETS];
+};
+
+#ifdef ENABLE_STATISTICS
+extern thread_local StatBlock* t_stat_block;
+extern StatBlock* RegisterStatBlock();
+
+static FORCE_INLINE StatBlock& LocalStatBlock() {
+	if (UNLIKELY(t_stat_block == nullptr)) {
+		t_stat_block = RegisterStatBlock();
+	}
+	return *t_stat_block;
+}
+#endif
+
+static FORCE_INLINE void StatAdd(Statistics::Counter counter, uint64_t n=1) noexcept {
+#ifdef ENABLE_STATISTICS
+	auto& val = LocalStatBlock().counter[counter];
+	StoreRelaxed(val, val + n);
+#else
+	(void)counter;
+	(void)n;
+#endif
+}
+
+static FORCE_INLINE void StatRecord(Statistics::Histogram histogram, uint64_t val) noexcept {
+#ifdef ENABLE_STATISTICS
+	auto& cnt = LocalStatBlock().histogram[histogram][Log2Bucket(val, Statistics::BUCKETS)];
+	StoreRelaxed(cnt, cnt + 1);
+#else
+	(void)histogram;
+	(void)val;
+#endif
+}
+
+//nanoseconds, always 0 without statistics
+static FORCE_INLINE uint64_t StatClock() noexcept {
+#ifdef ENABLE_STATISTICS
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+	return 0;
+#endif
+}
+
+static inline unsigned Concurrency(unsigned n) {
+	if (n == 0) {
+		n = std::thread::hardware_concurrency();
+	}
+	return n == 0? 1 : n;
+}
+
+//run func(0)...func(n-1) in n threads
+template <typename Func>
+static void ParallelRun(unsigned n, const Func& func) {
+	std::vector<std::thread> workers;
+	workers.reserve(n);
+	for (unsigned i = 0; i < n; i++) {
+		workers.emplace_back(func, i);
+	}
+	for (auto& t : workers) {
+		t.join();
+	}
+}
+
 } //estuary
 #endif //ESTUARY_INTERNAL_H
@@ -17,19 +17,29 @@
 //==============================================================================
 
 #include <cassert>
+#include <cstddef>
 #include <cstring>
 #include <tuple>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <vector>
 #include <algorithm>
 #include <pthread.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <lucky_estuary.h>
 #include "internal.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace estuary {
 
 static constexpr uint16_t MAGIC = 0xE888;
+static constexpr uint16_t EPOCH_BIT = 1;	//with reader epoch table
+static constexpr uint16_t CUCKOO_BIT = 2;	//with cuckoo buckets instead of chains
 struct LuckyEstuary::Meta {
 	uint16_t magic = MAGIC;
 	bool writing = false;
@@ -62,6 +72,43 @@ static constexpr unsigned RECYCLE_CAPACITY = UINT16_MAX+1;
 static constexpr unsigned RECYCLE_BIN_SIZE = UINT8_MAX+1;
 static constexpr long RECYCLE_DELAY_MS = 50;
 
+static constexpr unsigned STRIPE_COUNT = 64;
+static constexpr unsigned FREE_CACHE_SIZE = 32;
+//nodes held by stripes should not starve the recycle ring
+static_assert(STRIPE_COUNT*(RECYCLE_BIN_SIZE+FREE_CACHE_SIZE+1) <= RECYCLE_CAPACITY/2);
+
+// writers on different stripes of table can work in parallel, only for private memory
+struct LuckyEstuary::Stripe {
+	pthread_mutex_t lock;
+	uint32_t free_cnt = 0;
+	uint32_t victim_cnt = 0;
+	uint32_t free[FREE_CACHE_SIZE];
+	uint32_t victim[RECYCLE_BIN_SIZE];
+} __attribute__((aligned(CACHE_BLOCK_SIZE)));
+
+//a node unlinked before two flips of epoch cannot be reached any more
+static constexpr size_t EPOCH_PAGE_SIZE = 4096;
+static constexpr unsigned READER_SLOTS = EPOCH_PAGE_SIZE/CACHE_BLOCK_SIZE - 1;
+struct LuckyEstuary::Epoch : EpochSlots<READER_SLOTS> {};
+static_assert(sizeof(LuckyEstuary::Epoch) == EPOCH_PAGE_SIZE);
+
+class ReadGuard final {
+public:
+	explicit ReadGuard(LuckyEstuary::Epoch* epoch) noexcept {
+		if (epoch != nullptr) {
+			m_active = epoch->enter();
+		}
+	}
+	~ReadGuard() noexcept {
+		LuckyEstuary::Epoch::leave(m_active);
+	}
+
+private:
+	uint32_t* m_active = nullptr;
+	ReadGuard(const ReadGuard&) noexcept = delete;
+	ReadGuard& operator=(const ReadGuard&) noexcept = delete;
+};
+
 struct Node {
 	static constexpr uint32_t END = UINT32_MAX;
 	uint32_t next;
@@ -73,6 +120,45 @@ struct Node {
 #define ENTRY(key) (Hash((key), m_const.key_len, m_const.seed) % m_const.total_entry)
 #define NODE(idx) ((Node*)(m_data+(idx)*(size_t)m_const.item_size))
 
+//a bucket fills one cache line, tags are checked before touching nodes
+static constexpr unsigned BUCKET_SLOTS = 12;
+static constexpr unsigned CUCKOO_SEARCH_LIMIT = 512;	//buckets visited to find a vacancy
+struct LuckyEstuary::Bucket {
+	uint8_t tag[BUCKET_SLOTS];
+	uint32_t id[BUCKET_SLOTS];
+} __attribute__((aligned(CACHE_BLOCK_SIZE)));
+static_assert(sizeof(LuckyEstuary::Bucket) == CACHE_BLOCK_SIZE);
+using Bucket = LuckyEstuary::Bucket;
+
+//an item lives in one of two buckets chosen by halves of its code.
+//tag is mixed from the whole code, or it would be decided by the quotient of bucket.
+struct Probe {
+	uint32_t where[2];
+	uint8_t tag;
+};
+static FORCE_INLINE Probe CuckooProbe(uint64_t code, const Divisor<uint64_t>& total_bucket) {
+	Probe probe;
+	probe.where[0] = (code & UINT32_MAX) % total_bucket;
+	probe.where[1] = (code >> 32U) % total_bucket;
+	probe.tag = (code * 0x9E3779B97F4A7C15ULL) >> 56U;
+	return probe;
+}
+
+//slots with the tag, it's just a hint for readers
+static FORCE_INLINE unsigned MatchTags(const Bucket& bucket, uint8_t tag) {
+#if defined(__SSE2__)
+	//tags take the first 12 bytes of line
+	const auto v = _mm_load_si128((const __m128i*)&bucket);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(tag)))) & ((1U << BUCKET_SLOTS) - 1U);
+#else
+	unsigned mask = 0;
+	for (unsigned i = 0; i < BUCKET_SLOTS; i++) {
+		mask |= static_cast<unsigned>(LoadRelaxed(bucket.tag[i]) == tag) << i;
+	}
+	return mask;
+#endif
+}
+
 //optimize for common short cases
 static FORCE_INLINE bool Equal(const uint8_t* a, const uint8_t* b, uint8_t len) {
 	if (len == sizeof(uint64_t)) {
@@ -82,42 +168,251 @@ static FORCE_INLINE bool Equal(const uint8_t* a, const uint8_t* b, uint8_t len)
 	}
 }
 
-bool LuckyEstuary::fetch(const uint8_t* key, uint8_t* val) const {
+static constexpr size_t ItemSize(uint8_t key_len, uint32_t val_len) {
+	return ((sizeof(uint32_t)+key_len+val_len)+(sizeof(uint32_t)-1)) & ~(sizeof(uint32_t)-1U);
+}
+
+//widths known at runtime
+struct DynamicShape {
+	unsigned key_len;
+	unsigned val_len;
+	size_t item_size;
+};
+
+//widths known by compiler, fixed size loads, compares and addressing can be emitted
+template <unsigned KeyLen, unsigned ValLen>
+struct FixedShape {
+	static constexpr unsigned key_len = KeyLen;
+	static constexpr unsigned val_len = ValLen;
+	static constexpr size_t item_size = ItemSize(KeyLen, ValLen);
+};
+
+//the line after node is needed when key or value crosses the boundary
+template <typename Shape>
+static FORCE_INLINE void PrefetchNode(const void* node, const Shape& shape) {
+	PrefetchForNext(node);
+	auto off = (uintptr_t)node & (CACHE_BLOCK_SIZE-1);
+	auto blk = (const void*)(((uintptr_t)node & ~(uintptr_t)(CACHE_BLOCK_SIZE-1)) + CACHE_BLOCK_SIZE);
+	if (off + sizeof(uint32_t)+shape.key_len > CACHE_BLOCK_SIZE) {
+		PrefetchForNext(blk);
+	} else if (off + sizeof(uint32_t)+shape.key_len+shape.val_len > CACHE_BLOCK_SIZE) {
+		PrefetchForFuture(blk);
+	}
+}
+
+//search both buckets, until no item moved between them during searching
+template <typename Shape>
+static FORCE_INLINE bool CuckooSearch(const Shape& shape, const Bucket* buckets, const uint64_t& version,
+									  const uint8_t* data, const Probe& probe, const uint8_t* key, uint8_t* val,
+									  unsigned& depth) {
+	uint64_t start;
+	do {
+		start = LoadAcquire(version);
+		for (auto ent : probe.where) {
+			auto& bucket = buckets[ent];
+			for (auto bits = MatchTags(bucket, probe.tag); bits != 0; bits &= bits - 1U) {
+				const auto id = LoadAcquire(bucket.id[__builtin_ctz(bits)]);
+				if (id == Node::END) {
+					continue;
+				}
+				auto node = (const Node*)(data + id*shape.item_size);
+				depth++;
+				if (Equal(node->line, key, shape.key_len)) {
+					memcpy(val, node->line+shape.key_len, shape.val_len);
+					return true;
+				}
+			}
+		}
+		AcquireBarrier();
+	} while ((start & 1U) != 0 || LoadRelaxed(version) != start);
+	return false;
+}
+
+//keys go through stages: loading buckets, loading candidate nodes, and copying.
+//unlike chains, addresses of each stage are known without waiting for the previous one.
+//the other bucket is loaded only when no tag matches in the first one, which saves bandwidth.
+template <typename Shape>
+FORCE_INLINE unsigned LuckyEstuary::_cuckoo_batch_fetch(const Shape& shape, unsigned batch,
+		const uint8_t* __restrict__ dft_val, const uint8_t* __restrict__ keys, uint8_t* __restrict__ data,
+		unsigned* __restrict__ miss) const {
+	constexpr unsigned DISTANCE = 8;
+	constexpr unsigned RING_SIZE = DISTANCE*4;
+	constexpr unsigned MAX_CANDIDATE = 4;
+	constexpr unsigned UNSURE = UINT32_MAX;
+	struct State {
+		Probe probe;
+		uint64_t version;
+		unsigned cnt;
+		unsigned scanned;
+		uint32_t candidate[MAX_CANDIDATE];
+	} states[RING_SIZE];
+
+	static thread_local std::vector<uint64_t> codes;
+	codes.resize(batch);
+	HashBatch(keys, shape.key_len, shape.key_len, batch, m_const.seed, codes.data());
+	StatAdd(Statistics::LUCKY_FETCH, batch);
+
+	auto scan = [this, &shape](State& state, unsigned k) {
+		auto& bucket = m_buckets[state.probe.where[k]];
+		for (auto bits = MatchTags(bucket, state.probe.tag); bits != 0; bits &= bits - 1U) {
+			const auto id = LoadAcquire(bucket.id[__builtin_ctz(bits)]);
+			if (id == Node::END) {
+				continue;
+			}
+			if (state.cnt < MAX_CANDIDATE) {
+				state.candidate[state.cnt] = id;
+				PrefetchNode(m_data + id*shape.item_size, shape);
+			}
+			state.cnt++;
+		}
+		state.scanned = k + 1;
+		AcquireBarrier();
+		if ((state.version & 1U) != 0 || LoadRelaxed(*m_version) != state.version) {
+			state.cnt = UNSURE;
+		}
+	};
+	auto stage1 = [this, &scan](State& state) {
+		state.version = LoadAcquire(*m_version);
+		state.cnt = 0;
+		scan(state, 0);
+		if (state.cnt == 0) {
+			PrefetchForNext(&m_buckets[state.probe.where[1]]);
+		}
+	};
+	auto stage2 = [&scan](State& state) {
+		if (state.cnt == 0) {
+			scan(state, 1);
+		}
+	};
+
+	unsigned hit = 0;
+	auto stage3 = [&](const State& state, unsigned idx) {
+		auto key = keys + idx * shape.key_len;
+		auto out = data + idx * shape.val_len;
+		bool found = false;
+		unsigned depth = 0;
+		if (state.cnt <= MAX_CANDIDATE) {
+			for (unsigned j = 0; j < state.cnt; j++) {
+				auto node = (const Node*)(m_data + state.candidate[j]*shape.item_size);
+				depth++;
+				if (Equal(node->line, key, shape.key_len)) {
+					memcpy(out, node->line+shape.key_len, shape.val_len);
+					found = true;
+					break;
+				}
+			}
+		}
+		if (!found && (state.cnt > MAX_CANDIDATE || state.scanned < 2)) {
+			found = CuckooSearch(shape, m_buckets, *m_version, m_data, state.probe, key, out, depth);
+		}
+		StatRecord(Statistics::CHAIN_LENGTH, depth);
+		if (found) {
+			hit++;
+			return;
+		}
+		StatAdd(Statistics::LUCKY_FETCH_MISS);
+		if (dft_val != nullptr) {
+			memcpy(out, dft_val, shape.val_len);
+		} else if (miss != nullptr) {
+			*miss++ = idx;
+		}
+	};
+
+	ReadGuard guard(m_epoch);
+	for (unsigned i = 0; i < batch + DISTANCE*3; i++) {
+		if (i >= DISTANCE*3) {
+			stage3(states[(i-DISTANCE*3)%RING_SIZE], i-DISTANCE*3);
+		}
+		if (i >= DISTANCE*2 && i < batch + DISTANCE*2) {
+			stage2(states[(i-DISTANCE*2)%RING_SIZE]);
+		}
+		if (i >= DISTANCE && i < batch + DISTANCE) {
+			stage1(states[(i-DISTANCE)%RING_SIZE]);
+		}
+		if (i < batch) {
+			auto& state = states[i%RING_SIZE];
+			state.probe = CuckooProbe(codes[i], m_const.total_entry);
+			PrefetchForNext(&m_buckets[state.probe.where[0]]);
+		}
+	}
+	return hit;
+}
+
+template <typename Shape>
+FORCE_INLINE bool LuckyEstuary::_fetch(const Shape& shape, const uint8_t* key, uint8_t* val) const {
 	if (m_meta == nullptr || key == nullptr) {
 		return false;
 	}
-	for (auto id = LoadAcquire(m_table[ENTRY(key)]); id != Node::END; ) {
-		auto node = NODE(id);
-		if (Equal(node->line, key, m_const.key_len)) {
-			memcpy(val, node->line+m_const.key_len, m_const.val_len);
+	auto node_at = [this, &shape](uint32_t idx)->Node* {
+		return (Node*)(m_data + idx*shape.item_size);
+	};
+	ReadGuard guard(m_epoch);
+	if (m_buckets != nullptr) {
+		const auto probe = CuckooProbe(Hash(key, shape.key_len, m_const.seed), m_const.total_entry);
+		PrefetchForNext(&m_buckets[probe.where[1]]);
+		StatAdd(Statistics::LUCKY_FETCH);
+		unsigned depth = 0;
+		const bool found = CuckooSearch(shape, m_buckets, *m_version, m_data, probe, key, val, depth);
+		if (!found) {
+			StatAdd(Statistics::LUCKY_FETCH_MISS);
+		}
+		StatRecord(Statistics::CHAIN_LENGTH, depth);
+		return found;
+	}
+	const auto entry = Hash(key, shape.key_len, m_const.seed) % m_const.total_entry;
+	StatAdd(Statistics::LUCKY_FETCH);
+	unsigned depth = 0;
+	for (auto id = LoadAcquire(m_table[entry]); id != Node::END; ) {
+		auto node = node_at(id);
+		depth++;
+		if (Equal(node->line, key, shape.key_len)) {
+			memcpy(val, node->line+shape.key_len, shape.val_len);
+			StatRecord(Statistics::CHAIN_LENGTH, depth);
 			return true;
 		}
 		id = LoadAcquire(node->next);
 	}
+	StatAdd(Statistics::LUCKY_FETCH_MISS);
+	StatRecord(Statistics::CHAIN_LENGTH, depth);
 	return false;
 }
 
-unsigned LuckyEstuary::_batch_fetch(unsigned batch, const uint8_t* __restrict__ dft_val,
+template <typename Shape>
+FORCE_INLINE unsigned LuckyEstuary::_batch_fetch(const Shape& shape, unsigned batch, const uint8_t* __restrict__ dft_val,
 									const uint8_t* __restrict__ keys, uint8_t* __restrict__ data,
 									unsigned* __restrict__ miss) const {
+	if (m_buckets != nullptr) {
+		return _cuckoo_batch_fetch(shape, batch, dft_val, keys, data, miss);
+	}
 	constexpr unsigned WINDOW_SIZE = 16;
 	struct State {
 		unsigned idx;
 		uint32_t ent;
 		Node* node;
+#ifdef ENABLE_STATISTICS
+		unsigned depth;
+#endif
 	} states[WINDOW_SIZE];
 
 	unsigned hit = 0;
 	auto window = std::min(batch, WINDOW_SIZE);
 
-	auto init_pipeline = [this, keys](State& state, unsigned idx) {
+	static thread_local std::vector<uint64_t> codes;
+	codes.resize(batch);
+	HashBatch(keys, shape.key_len, shape.key_len, batch, m_const.seed, codes.data());
+	StatAdd(Statistics::LUCKY_FETCH, batch);
+
+	auto init_pipeline = [this](State& state, unsigned idx) {
 		state.idx = idx;
 		state.node = nullptr;
-		auto key = keys + idx * m_const.key_len;
-		state.ent = Hash(key, m_const.key_len, m_const.seed) % m_const.total_entry;
+#ifdef ENABLE_STATISTICS
+		state.depth = 0;
+#endif
+		state.ent = codes[idx] % m_const.total_entry;
 		PrefetchForNext(&m_table[state.ent]);
 	};
 
+	ReadGuard guard(m_epoch);
 	unsigned idx = 0;
 	for (; idx < window; idx++) {
 		init_pipeline(states[idx], idx);
@@ -125,14 +420,17 @@ unsigned LuckyEstuary::_batch_fetch(unsigned batch, const uint8_t* __restrict__
 	while (window > 0) {
 		for (unsigned i = 0; i < window; ) {
 			auto& cur = states[i];
-			auto key = keys + cur.idx * m_const.key_len;
-			auto out = data + cur.idx * m_const.val_len;
+			auto key = keys + cur.idx * shape.key_len;
+			auto out = data + cur.idx * shape.val_len;
 			uint32_t next = Node::END;
 			if (cur.node == nullptr) {
 				next = LoadAcquire(m_table[cur.ent]);
 			} else {
-				if (Equal(key, cur.node->line, m_const.key_len)) {
-					memcpy(out, cur.node->line+m_const.key_len, m_const.val_len);
+				if (Equal(key, cur.node->line, shape.key_len)) {
+					memcpy(out, cur.node->line+shape.key_len, shape.val_len);
+#ifdef ENABLE_STATISTICS
+					StatRecord(Statistics::CHAIN_LENGTH, cur.depth);
+#endif
 					hit++;
 					goto reload;
 				} else {
@@ -140,19 +438,20 @@ unsigned LuckyEstuary::_batch_fetch(unsigned batch, const uint8_t* __restrict__
 				}
 			}
 			if (next != Node::END) {
-				cur.node = NODE(next);
-				PrefetchForNext(cur.node);
-				auto off = (uintptr_t)cur.node & (CACHE_BLOCK_SIZE-1);
-				auto blk = (const void*)(((uintptr_t)cur.node & ~(uintptr_t)(CACHE_BLOCK_SIZE-1)) + CACHE_BLOCK_SIZE);
-				if (off + sizeof(uint32_t)+m_const.key_len > CACHE_BLOCK_SIZE) {
-					PrefetchForNext(blk);
-				} else if (off + sizeof(uint32_t)+m_const.key_len+m_const.val_len > CACHE_BLOCK_SIZE) {
-					PrefetchForFuture(blk);
-				}
+				cur.node = (Node*)(m_data + next*shape.item_size);
+#ifdef ENABLE_STATISTICS
+				cur.depth++;
+#endif
+				PrefetchNode(cur.node, shape);
 				i++;
 				continue;
-			} else if (dft_val != nullptr) {
-				memcpy(out, dft_val, m_const.val_len);
+			}
+#ifdef ENABLE_STATISTICS
+			StatAdd(Statistics::LUCKY_FETCH_MISS);
+			StatRecord(Statistics::CHAIN_LENGTH, cur.depth);
+#endif
+			if (dft_val != nullptr) {
+				memcpy(out, dft_val, shape.val_len);
 			} else if (miss != nullptr) {
 				*miss++ = cur.idx;
 			}
@@ -168,28 +467,134 @@ unsigned LuckyEstuary::_batch_fetch(unsigned batch, const uint8_t* __restrict__
 	return hit;
 }
 
+bool LuckyEstuary::fetch(const uint8_t* key, uint8_t* val) const {
+	return _fetch(DynamicShape{m_const.key_len, m_const.val_len, m_const.item_size}, key, val);
+}
+
+unsigned LuckyEstuary::_batch_fetch(unsigned batch, const uint8_t* __restrict__ dft_val,
+									const uint8_t* __restrict__ keys, uint8_t* __restrict__ data,
+									unsigned* __restrict__ miss) const {
+	return _batch_fetch(DynamicShape{m_const.key_len, m_const.val_len, m_const.item_size},
+						batch, dft_val, keys, data, miss);
+}
+
+template <unsigned KeyLen, unsigned ValLen>
+bool LuckyEstuaryT<KeyLen, ValLen>::fetch(const uint8_t* key, uint8_t* val) const {
+	return m_dict != nullptr && m_dict->_fetch(FixedShape<KeyLen, ValLen>(), key, val);
+}
+
+template <unsigned KeyLen, unsigned ValLen>
+unsigned LuckyEstuaryT<KeyLen, ValLen>::_batch_fetch(unsigned batch, const uint8_t* __restrict__ dft_val,
+		const uint8_t* __restrict__ keys, uint8_t* __restrict__ data, unsigned* __restrict__ miss) const {
+	if (m_dict == nullptr) {
+		return 0;
+	}
+	return m_dict->_batch_fetch(FixedShape<KeyLen, ValLen>(), batch, dft_val, keys, data, miss);
+}
+
+#define INSTANTIATE_FIXED_VIEW(key_len, val_len) template class LuckyEstuaryT<key_len, val_len>;
+LUCKY_FIXED_WIDTHS(INSTANTIATE_FIXED_VIEW)
+#undef INSTANTIATE_FIXED_VIEW
+
+//whether node is reachable from the bucket of key
+FORCE_INLINE bool LuckyEstuary::_linked(uint32_t id, const uint8_t* key) const noexcept {
+	if (m_buckets != nullptr) {
+		const auto probe = CuckooProbe(Hash(key, m_const.key_len, m_const.seed), m_const.total_entry);
+		uint64_t start;
+		do {
+			start = LoadAcquire(*m_version);
+			for (auto ent : probe.where) {
+				for (auto& idx : m_buckets[ent].id) {
+					if (LoadAcquire(idx) == id) {
+						return true;
+					}
+				}
+			}
+			AcquireBarrier();
+		} while ((start & 1U) != 0 || LoadRelaxed(*m_version) != start);
+		return false;
+	}
+	for (auto idx = LoadAcquire(m_table[ENTRY(key)]); idx != Node::END; idx = LoadAcquire(NODE(idx)->next)) {
+		if (idx == id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+LuckyEstuary::Cursor LuckyEstuary::scan(unsigned piece, unsigned total) const {
+	Cursor cursor;
+	if (m_meta == nullptr || total == 0 || piece >= total) {
+		return cursor;
+	}
+	const uint64_t total_node = m_const.capacity + (uint64_t)RECYCLE_CAPACITY;
+	cursor.m_dict = this;
+	cursor.m_pos = total_node * piece / total;
+	cursor.m_end = total_node * (piece+1) / total;
+	return cursor;
+}
+
+bool LuckyEstuary::Cursor::next(uint8_t* key, uint8_t* val) {
+	if (m_dict == nullptr || key == nullptr || val == nullptr) {
+		return false;
+	}
+	const auto& dict = *m_dict;
+	const auto key_len = dict.m_const.key_len;
+	ReadGuard guard(dict.m_epoch);
+	while (m_pos < m_end) {
+		const auto id = m_pos++;
+		auto node = (const Node*)(dict.m_data + id*(size_t)dict.m_const.item_size);
+		PrefetchForFuture((const uint8_t*)node + dict.m_const.item_size * 4);
+		memcpy(key, node->line, key_len);
+		if (!dict._linked(id, key)) {
+			continue;
+		}
+		memcpy(val, node->line+key_len, dict.m_const.val_len);
+		//node may be reused during copying
+		if (Equal(node->line, key, key_len) && dict._linked(id, key)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 bool LuckyEstuary::erase(const uint8_t* key) const {
 	if (m_meta == nullptr || key == nullptr) {
 		return false;
 	}
+	const auto entry = ENTRY(key);
+	if (m_stripes != nullptr) {
+		_mark_writing();
+		auto& stripe = m_stripes[entry % STRIPE_COUNT];
+		MutexLock stripe_lock(&stripe.lock);
+		return _erase(entry, key, &stripe);
+	}
 	MutexLock master_lock(&m_lock->core);
 	if (m_meta->writing) {
 		throw DataException();
 	}
 	m_meta->writing = true;
-	auto done = _erase(key);
+	auto done = _erase(entry, key);
 	m_meta->writing = false;
 	return done;
 }
 
-bool LuckyEstuary::_erase(const uint8_t* key) const {
-	for (auto knot = (Node*)(&m_table[ENTRY(key)]); knot->next != Node::END;) {
+bool LuckyEstuary::_erase(uint32_t entry, const uint8_t* key, Stripe* stripe) const {
+	if (m_buckets != nullptr) {
+		return _cuckoo_erase(key);
+	}
+	for (auto knot = (Node*)(&m_table[entry]); knot->next != Node::END;) {
 		auto node = NODE(knot->next);
 		if (Equal(node->line, key, m_const.key_len)) {
 			auto vic = knot->next;
 			knot->next = node->next;
-			_recycle(vic);
-			m_meta->item--;
+			if (stripe != nullptr) {
+				_retire(*stripe, vic);
+				SubRelaxed(m_meta->item, 1U);
+			} else {
+				_recycle(vic);
+				m_meta->item--;
+			}
 			return true;
 		}
 		knot = node;
@@ -203,17 +608,35 @@ size_t LuckyEstuary::batch_update(IDataReader& source) const {
 		return 0;
 	}
 	source.reset();
+	auto bad = [this](const IDataReader::Record& rec)->bool {
+		return rec.key.ptr == nullptr || rec.key.len != m_const.key_len
+			|| rec.val.len != m_const.val_len || (rec.val.len != 0 && rec.val.ptr == nullptr);
+	};
+	size_t idx;
+	if (m_stripes != nullptr) {
+		_mark_writing();
+		for (idx = 0; idx < total; idx++) {
+			auto rec = source.read();
+			if (bad(rec)) {
+				break;
+			}
+			const auto entry = ENTRY(rec.key.ptr);
+			auto& stripe = m_stripes[entry % STRIPE_COUNT];
+			MutexLock stripe_lock(&stripe.lock);
+			if (!_update(entry, rec.key.ptr, rec.val.ptr, &stripe)) {
+				break;
+			}
+		}
+		return idx;
+	}
 	MutexLock master_lock(&m_lock->core);
 	if (m_meta->writing) {
 		throw DataException();
 	}
 	m_meta->writing = true;
-	size_t idx;
 	for (idx = 0; idx < total; idx++) {
 		auto rec = source.read();
-		if (rec.key.ptr == nullptr || rec.key.len != m_const.key_len
-			|| rec.val.len != m_const.val_len || (rec.val.len != 0 && rec.val.ptr == nullptr)
-			|| !_update(rec.key.ptr, rec.val.ptr)) {
+		if (bad(rec) || !_update(ENTRY(rec.key.ptr), rec.key.ptr, rec.val.ptr)) {
 			break;
 		}
 	}
@@ -225,12 +648,19 @@ bool LuckyEstuary::update(const uint8_t* key, const uint8_t* val) const {
 	if (m_meta == nullptr || key == nullptr || val == nullptr) {
 		return false;
 	}
+	const auto entry = ENTRY(key);
+	if (m_stripes != nullptr) {
+		_mark_writing();
+		auto& stripe = m_stripes[entry % STRIPE_COUNT];
+		MutexLock stripe_lock(&stripe.lock);
+		return _update(entry, key, val, &stripe);
+	}
 	MutexLock master_lock(&m_lock->core);
 	if (m_meta->writing) {
 		throw DataException();
 	}
 	m_meta->writing = true;
-	auto done = _update(key, val);
+	auto done = _update(entry, key, val);
 	m_meta->writing = false;
 	return done;
 }
@@ -240,25 +670,86 @@ static FORCE_INLINE int64_t GetStamp() {
 		std::chrono::system_clock::now()).time_since_epoch().count();
 }
 
-bool LuckyEstuary::_update(const uint8_t* key, const uint8_t* val) const {
+uint32_t LuckyEstuary::_allocate() const {
 	ConsistencyAssert(m_meta->free_list.head != Node::END);
-	auto new_node = [this](const uint8_t* key, const uint8_t* val)->std::tuple<uint32_t,Node*> {
-		auto id = m_meta->free_list.head;
-		auto node = NODE(id);
-		m_meta->free_list.head = node->free;
-		if (node->free == Node::END) {
-			m_meta->free_list.tail = Node::END;
+	auto id = m_meta->free_list.head;
+	auto node = NODE(id);
+	m_meta->free_list.head = node->free;
+	if (node->free == Node::END) {
+		m_meta->free_list.tail = Node::END;
+	}
+	return id;
+}
+
+uint32_t LuckyEstuary::_allocate(Stripe& stripe) const {
+	if (stripe.free_cnt == 0) {
+		MutexLock master_lock(&m_lock->core);
+		if (m_meta->free_list.head == Node::END) {
+			//the ring may be not full, nodes are held by stripes
+			_reclaim();
 		}
-		if (m_const.key_len == sizeof(uint64_t)) {
-			*(uint64_t*)node->line = *(const uint64_t*)key;
-		} else {
-			memcpy(node->line, key, m_const.key_len);
+		while (stripe.free_cnt < FREE_CACHE_SIZE && m_meta->free_list.head != Node::END) {
+			stripe.free[stripe.free_cnt++] = _allocate();
 		}
-		memcpy(node->line+m_const.key_len, val, m_const.val_len);
+	}
+	return stripe.free[--stripe.free_cnt];
+}
+
+void LuckyEstuary::_retire(Stripe& stripe, uint32_t vic) const {
+	stripe.victim[stripe.victim_cnt++] = vic;
+	if (stripe.victim_cnt == RECYCLE_BIN_SIZE) {
+		MutexLock master_lock(&m_lock->core);
+		_flush(stripe);
+	}
+}
+
+//nodes held by stripes are missing in the file until they are flushed, so the file is
+//marked as writing from the first striped write until all stripes are flushed
+void LuckyEstuary::_mark_writing() const {
+	if (!LoadRelaxed(m_meta->writing)) {
+		MutexLock master_lock(&m_lock->core);
+		m_meta->writing = true;
+	}
+}
+
+//return all nodes held by stripe, core lock should be held
+void LuckyEstuary::_flush(Stripe& stripe) const {
+	for (unsigned i = 0; i < stripe.victim_cnt; i++) {
+		_recycle(stripe.victim[i]);
+	}
+	stripe.victim_cnt = 0;
+	while (stripe.free_cnt != 0) {
+		auto id = stripe.free[--stripe.free_cnt];
+		NODE(id)->free = m_meta->free_list.head;
+		m_meta->free_list.head = id;
+		if (m_meta->free_list.tail == Node::END) {
+			m_meta->free_list.tail = id;
+		}
+	}
+}
+
+static FORCE_INLINE void FillNode(Node* node, const uint8_t* key, const uint8_t* val, uint8_t key_len, uint32_t val_len) {
+	if (key_len == sizeof(uint64_t)) {
+		*(uint64_t*)node->line = *(const uint64_t*)key;
+	} else {
+		memcpy(node->line, key, key_len);
+	}
+	memcpy(node->line+key_len, val, val_len);
+}
+
+bool LuckyEstuary::_update(uint32_t entry, const uint8_t* key, const uint8_t* val, Stripe* stripe) const {
+	if (m_buckets != nullptr) {
+		return _cuckoo_update(key, val);
+	}
+	StatAdd(Statistics::LUCKY_UPDATE);
+	const auto start = StatClock();
+	auto new_node = [this, stripe](const uint8_t* key, const uint8_t* val)->std::tuple<uint32_t,Node*> {
+		auto id = stripe != nullptr? _allocate(*stripe) : _allocate();
+		auto node = NODE(id);
+		FillNode(node, key, val, m_const.key_len, m_const.val_len);
 		return {id, node};
 	};
 
-	const auto entry = ENTRY(key);
 	for (auto knot = (Node*)(&m_table[entry]); knot->next != Node::END;) {
 		auto node = NODE(knot->next);
 		if (Equal(node->line, key, m_const.key_len)) {
@@ -267,22 +758,171 @@ bool LuckyEstuary::_update(const uint8_t* key, const uint8_t* val) const {
 				auto [id, neo] = new_node(key, val);
 				neo->next = node->next;
 				StoreRelease(knot->next, id);
-				_recycle(vic);
+				if (stripe != nullptr) {
+					_retire(*stripe, vic);
+				} else {
+					_recycle(vic);
+				}
 			}
+			StatRecord(Statistics::LUCKY_UPDATE_NS, StatClock() - start);
 			return true;
 		}
 		knot = node;
 	}
-	if (m_meta->item >= m_const.capacity) {
+	if (stripe != nullptr) {
+		//other stripes may insert at the same time
+		auto item = LoadAcquire(m_meta->item);
+		do {
+			if (item >= m_const.capacity) {
+				return false;
+			}
+		} while (!CompareAndSwap(m_meta->item, item, item+1));
+	} else if (m_meta->item >= m_const.capacity) {
 		return false;
 	}
 	auto [id, neo] = new_node(key, val);
 	neo->next = m_table[entry];
 	StoreRelease(m_table[entry], id);
+	if (stripe == nullptr) {
+		m_meta->item++;
+	}
+	StatRecord(Statistics::LUCKY_UPDATE_NS, StatClock() - start);
+	return true;
+}
+
+//slot holding the key, only for writers
+static uint32_t* CuckooFind(Bucket* buckets, const Probe& probe, const uint8_t* data, size_t item_size,
+							const uint8_t* key, uint8_t key_len) {
+	for (auto ent : probe.where) {
+		auto& bucket = buckets[ent];
+		for (unsigned i = 0; i < BUCKET_SLOTS; i++) {
+			const auto id = bucket.id[i];
+			if (bucket.tag[i] == probe.tag && id != Node::END
+				&& Equal(((const Node*)(data + id*item_size))->line, key, key_len)) {
+				return &bucket.id[i];
+			}
+		}
+	}
+	return nullptr;
+}
+
+bool LuckyEstuary::_cuckoo_erase(const uint8_t* key) const {
+	const auto probe = CuckooProbe(Hash(key, m_const.key_len, m_const.seed), m_const.total_entry);
+	auto slot = CuckooFind(m_buckets, probe, m_data, m_const.item_size, key, m_const.key_len);
+	if (slot == nullptr) {
+		return false;
+	}
+	auto vic = *slot;
+	StoreRelease(*slot, Node::END);
+	_recycle(vic);
+	m_meta->item--;
+	return true;
+}
+
+bool LuckyEstuary::_cuckoo_update(const uint8_t* key, const uint8_t* val) const {
+	StatAdd(Statistics::LUCKY_UPDATE);
+	const auto start = StatClock();
+	const auto probe = CuckooProbe(Hash(key, m_const.key_len, m_const.seed), m_const.total_entry);
+	auto slot = CuckooFind(m_buckets, probe, m_data, m_const.item_size, key, m_const.key_len);
+	if (slot != nullptr) {
+		auto vic = *slot;
+		if (LIKELY(memcmp(NODE(vic)->line+m_const.key_len, val, m_const.val_len) != 0)) {
+			auto id = _allocate();
+			FillNode(NODE(id), key, val, m_const.key_len, m_const.val_len);
+			StoreRelease(*slot, id);
+			_recycle(vic);
+		}
+		StatRecord(Statistics::LUCKY_UPDATE_NS, StatClock() - start);
+		return true;
+	}
+	uint32_t ent;
+	unsigned pos;
+	if (m_meta->item >= m_const.capacity || !_cuckoo_vacate(probe.where, ent, pos)) {
+		return false;
+	}
+	auto id = _allocate();
+	FillNode(NODE(id), key, val, m_const.key_len, m_const.val_len);
+	auto& bucket = m_buckets[ent];
+	StoreRelease(bucket.id[pos], id);
+	StoreRelease(bucket.tag[pos], probe.tag);
 	m_meta->item++;
+	StatRecord(Statistics::LUCKY_UPDATE_NS, StatClock() - start);
 	return true;
 }
 
+//find a vacant slot in given buckets. when both are full, a path to some vacancy is searched
+//breadth first, then items on the path are kicked to their other buckets from the far end.
+bool LuckyEstuary::_cuckoo_vacate(const uint32_t where[2], uint32_t& bucket, unsigned& slot) const {
+	auto vacancy = [this](uint32_t ent)->int {
+		for (unsigned i = 0; i < BUCKET_SLOTS; i++) {
+			if (m_buckets[ent].id[i] == Node::END) {
+				return i;
+			}
+		}
+		return -1;
+	};
+	for (unsigned k = 0; k < 2; k++) {
+		auto pos = vacancy(where[k]);
+		if (pos >= 0) {
+			bucket = where[k];
+			slot = pos;
+			return true;
+		}
+	}
+
+	struct Step {
+		uint32_t ent;
+		int parent;
+		unsigned slot;	//item in this slot of parent moves here
+	};
+	std::vector<Step> steps;
+	steps.reserve(CUCKOO_SEARCH_LIMIT + BUCKET_SLOTS);
+	steps.push_back({where[0], -1, 0});
+	if (where[1] != where[0]) {
+		steps.push_back({where[1], -1, 0});
+	}
+	auto visited = [&steps](uint32_t ent)->bool {
+		return std::any_of(steps.begin(), steps.end(), [ent](const Step& step) { return step.ent == ent; });
+	};
+	auto move = [this](uint32_t from, unsigned from_slot, uint32_t to, unsigned to_slot) {
+		auto& src = m_buckets[from];
+		auto& dst = m_buckets[to];
+		StoreRelease(dst.id[to_slot], src.id[from_slot]);
+		StoreRelease(dst.tag[to_slot], src.tag[from_slot]);
+	};
+	for (unsigned k = 0; k < steps.size() && steps.size() < CUCKOO_SEARCH_LIMIT; k++) {
+		const auto cur = steps[k].ent;
+		for (unsigned i = 0; i < BUCKET_SLOTS; i++) {
+			const auto probe = CuckooProbe(Hash(NODE(m_buckets[cur].id[i])->line, m_const.key_len, m_const.seed),
+										   m_const.total_entry);
+			const auto alt = probe.where[0] == cur? probe.where[1] : probe.where[0];
+			if (visited(alt)) {
+				continue;
+			}
+			const auto pos = vacancy(alt);
+			if (pos < 0) {
+				steps.push_back({alt, (int)k, i});
+				continue;
+			}
+			//readers missing during moving will retry
+			const auto version = *m_version;
+			StoreRelaxed(*m_version, version+1);
+			move(cur, i, alt, pos);
+			unsigned hole = i;
+			int j = k;
+			for (; steps[j].parent >= 0; j = steps[j].parent) {
+				move(steps[steps[j].parent].ent, steps[j].slot, steps[j].ent, hole);
+				hole = steps[j].slot;
+			}
+			StoreRelease(*m_version, version+2);
+			bucket = steps[j].ent;
+			slot = hole;
+			return true;
+		}
+	}
+	return false;
+}
+
 
 static_assert(RECYCLE_DELAY_MS > 0);
 static_assert(RECYCLE_BIN_SIZE < RECYCLE_CAPACITY && (RECYCLE_BIN_SIZE&(RECYCLE_BIN_SIZE-1)) == 0);
@@ -292,42 +932,59 @@ void LuckyEstuary::_recycle(uint32_t vic) const {
 		&& sizeof(m_meta->recycle.r) == sizeof(m_meta->recycle.w));
 	assert(vic != Node::END);
 	if ((m_meta->recycle.w+1)%RECYCLE_CAPACITY == m_meta->recycle.r) {	//full
-		const auto stamp = m_stamps[m_meta->recycle.r/RECYCLE_BIN_SIZE];
-		const auto now_ms = GetStamp();
-		ConsistencyAssert(now_ms > stamp);
-		const auto extra_delay = RECYCLE_DELAY_MS - (now_ms - stamp);
-		if (extra_delay > 0) {
-			std::this_thread::sleep_for(std::chrono::milliseconds(extra_delay));
-		}
-		ConsistencyAssert(m_meta->recycle.r % RECYCLE_BIN_SIZE == 0);
-		const unsigned begin = m_meta->recycle.r;
-		const unsigned end = begin + RECYCLE_BIN_SIZE;
-		m_meta->recycle.r = end % RECYCLE_CAPACITY;
-		Node fake;
-		auto tail = &fake;
-		for (unsigned i = begin; i < end; i++) {
-			assert(m_recycle[i] != Node::END);
-			tail->free = m_recycle[i];
-			m_recycle[i] = Node::END;
-			tail = NODE(tail->free);
-			tail->next = Node::END;
-		}
-		tail->free = Node::END;
-		if (m_meta->free_list.tail == Node::END) {
-			assert(m_meta->free_list.head == Node::END);
-			m_meta->free_list.head = fake.free;
-		} else {
-			NODE(m_meta->free_list.tail)->free = fake.free;
-		}
-		m_meta->free_list.tail = ((uint8_t*)tail - m_data) / m_const.item_size;
+		_reclaim();
 	}
 
 	auto& stamp = m_stamps[m_meta->recycle.w/RECYCLE_BIN_SIZE];
 	m_recycle[m_meta->recycle.w++] = vic;
 	m_meta->recycle.w %= RECYCLE_CAPACITY;
 	if (m_meta->recycle.w % RECYCLE_BIN_SIZE == 0) {
-		stamp = GetStamp();
+		stamp = m_epoch != nullptr? m_epoch->current : GetStamp();
+	}
+}
+
+//move the oldest bin in ring to free list
+void LuckyEstuary::_reclaim() const {
+	ConsistencyAssert((m_meta->recycle.w+RECYCLE_CAPACITY-m_meta->recycle.r)%RECYCLE_CAPACITY >= RECYCLE_BIN_SIZE);
+	const auto stamp = m_stamps[m_meta->recycle.r/RECYCLE_BIN_SIZE];
+	const auto start = StatClock();
+	if (m_epoch != nullptr) {
+		_synchronize(stamp + 2);
+	} else {
+		const auto now_ms = GetStamp();
+		ConsistencyAssert(now_ms >= stamp);
+		const auto extra_delay = RECYCLE_DELAY_MS - (now_ms - stamp);
+		if (extra_delay > 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(extra_delay));
+		}
+	}
+	StatAdd(Statistics::RECLAIM_WAIT_NS, StatClock() - start);
+	ConsistencyAssert(m_meta->recycle.r % RECYCLE_BIN_SIZE == 0);
+	const unsigned begin = m_meta->recycle.r;
+	const unsigned end = begin + RECYCLE_BIN_SIZE;
+	m_meta->recycle.r = end % RECYCLE_CAPACITY;
+	Node fake;
+	auto tail = &fake;
+	for (unsigned i = begin; i < end; i++) {
+		assert(m_recycle[i] != Node::END);
+		tail->free = m_recycle[i];
+		m_recycle[i] = Node::END;
+		tail = NODE(tail->free);
+		tail->next = Node::END;
+	}
+	tail->free = Node::END;
+	if (m_meta->free_list.tail == Node::END) {
+		assert(m_meta->free_list.head == Node::END);
+		m_meta->free_list.head = fake.free;
+	} else {
+		NODE(m_meta->free_list.tail)->free = fake.free;
 	}
+	m_meta->free_list.tail = ((uint8_t*)tail - m_data) / m_const.item_size;
+}
+
+//flip epoch until target, core lock should be held
+void LuckyEstuary::_synchronize(uint64_t target) const {
+	m_epoch->synchronize(target);
 }
 
 static bool InitLock(LuckyEstuary::Lock* lock, bool shared=true) {
@@ -346,13 +1003,66 @@ LuckyEstuary::~LuckyEstuary() noexcept {
 	if (m_meta == nullptr) {
 		return;
 	}
+	if (m_stripes != nullptr) {
+		//give back nodes held by stripes
+		try {
+			MutexLock master_lock(&m_lock->core);
+			for (unsigned i = 0; i < STRIPE_COUNT; i++) {
+				_flush(m_stripes[i]);
+			}
+			m_meta->writing = false;
+		} catch (...) {}
+	}
 	if (m_monopoly_extra != nullptr) {
 		pthread_mutex_destroy(&m_lock->core);
+		for (unsigned i = 0; m_stripes != nullptr && i < STRIPE_COUNT; i++) {
+			pthread_mutex_destroy(&m_stripes[i].lock);
+		}
 	}
 }
 
-static FORCE_INLINE size_t ItemSize(uint8_t key_len, uint32_t val_len) {
-	return ((sizeof(uint32_t)+key_len+val_len)+(sizeof(uint32_t)-1)) & ~(sizeof(uint32_t)-1U);
+//readers alive now mean nothing to the saved file
+static bool ClearReaders(const std::string& path, size_t offset) noexcept {
+	int fd = open(path.c_str(), O_WRONLY);
+	if (fd < 0) {
+		return false;
+	}
+	LuckyEstuary::Epoch epoch;
+	memset(&epoch, 0, sizeof(epoch));
+	constexpr auto off = offsetof(LuckyEstuary::Epoch, slots);
+	auto done = pwrite(fd, (const uint8_t*)&epoch + off, sizeof(epoch) - off, offset + off) == sizeof(epoch) - off;
+	close(fd);
+	return done;
+}
+
+bool LuckyEstuary::dump(const std::string& path) const noexcept {
+	auto save = [this, &path]()->bool {
+		return m_resource.dump(path.c_str())
+			&& (m_epoch == nullptr || ClearReaders(path, (uint8_t*)m_epoch - m_resource.addr()));
+	};
+	if (m_stripes == nullptr) {
+		return save();
+	}
+	//nodes held by stripes should be returned before saving
+	try {
+		std::vector<MutexLock> locks;
+		locks.reserve(STRIPE_COUNT+1);
+		for (unsigned i = 0; i < STRIPE_COUNT; i++) {
+			locks.emplace_back(&m_stripes[i].lock);
+		}
+		locks.emplace_back(&m_lock->core);
+		for (unsigned i = 0; i < STRIPE_COUNT; i++) {
+			_flush(m_stripes[i]);
+		}
+		//the copy is complete, but this instance may go on writing
+		const bool writing = m_meta->writing;
+		m_meta->writing = false;
+		const bool done = save();
+		m_meta->writing = writing;
+		return done;
+	} catch (...) {
+		return false;
+	}
 }
 
 LuckyEstuary LuckyEstuary::Load(const std::string& path, LoadPolicy policy) {
@@ -368,15 +1078,48 @@ LuckyEstuary LuckyEstuary::Load(const std::string& path, LoadPolicy policy) {
 		case COPY_DATA:
 			res = MemMap(path.c_str(), MemMap::load_by_copy);
 			break;
+		case LAZY:
+			res = MemMap(path.c_str(), false, true);
+			break;
 		default:
 			return out;
 	}
 	if (!!res) {
 		out._init(std::move(res), policy!=SHARED, path.c_str());
 	}
+	if (policy == LAZY && !!out) {
+		//table is small and touched by every probe
+		const size_t table_end = out.m_data - out.m_resource.addr();
+		out.m_resource.warmup(0, table_end);
+		out.m_warm.cursor = table_end;
+		out.m_warm.done = table_end;
+	}
 	return out;
 }
 
+bool LuckyEstuary::warmup(size_t budget) const noexcept {
+	const auto size = m_resource.size();
+	if (m_meta == nullptr || LoadAcquire(m_warm.cursor) >= size) {
+		return true;
+	}
+	const auto off = AddRelaxed(m_warm.cursor, budget);
+	if (off >= size) {
+		return true;
+	}
+	const auto len = std::min(budget, size - off);
+	m_resource.warmup(off, len);
+	AddRelaxed(m_warm.done, len);
+	return off + len >= size;
+}
+
+unsigned LuckyEstuary::warmup_progress() const noexcept {
+	const auto size = m_resource.size();
+	if (m_meta == nullptr || size == 0) {
+		return 0;
+	}
+	return std::min(LoadAcquire(m_warm.done), size) * 100 / size;
+}
+
 LuckyEstuary LuckyEstuary::Load(size_t size, const std::function<bool(uint8_t*)>& load) {
 	LuckyEstuary out;
 	MemMap res(size, load);
@@ -388,12 +1131,20 @@ LuckyEstuary LuckyEstuary::Load(size_t size, const std::function<bool(uint8_t*)>
 
 struct Offsets {
 	size_t lock = 0;
+	size_t epoch = 0;
 	size_t stamps = 0;
 	size_t recycle = 0;
 	size_t table = 0;
 	size_t data = 0;
 };
 
+static uint64_t MaxCapacity(const Header& meta) {
+	if (meta.magic & CUCKOO_BIT) {
+		return (uint64_t)meta.total_entry * BUCKET_SLOTS * LuckyEstuary::MAX_CUCKOO_LOAD / 100;
+	}
+	return (uint64_t)meta.total_entry * LuckyEstuary::MAX_LOAD_FACTOR;
+}
+
 static bool GetOffsets(const MemMap& res, Offsets& offsets, bool strict=false) {
 	if (!res || res.size() < sizeof(Header)) {
 		return false;
@@ -401,15 +1152,24 @@ static bool GetOffsets(const MemMap& res, Offsets& offsets, bool strict=false) {
 	auto meta = (Header*) res.addr();
 	offsets.lock = sizeof(Header);
 	offsets.stamps = offsets.lock + sizeof(pthread_mutex_t);
+	if (meta->magic & EPOCH_BIT) {
+		offsets.epoch = (offsets.stamps + EPOCH_PAGE_SIZE-1) & ~(EPOCH_PAGE_SIZE-1);
+		offsets.stamps = offsets.epoch + sizeof(LuckyEstuary::Epoch);
+	}
 	offsets.recycle = offsets.stamps + sizeof(int64_t) * (RECYCLE_CAPACITY/RECYCLE_BIN_SIZE);
 	offsets.table = offsets.recycle + sizeof(uint32_t) * RECYCLE_CAPACITY;
-	offsets.data = offsets.table + sizeof(uint32_t) * meta->total_entry;
+	if (meta->magic & CUCKOO_BIT) {	//[version line][bucket][bucket]...
+		offsets.table = (offsets.table + CACHE_BLOCK_SIZE-1) & ~(size_t)(CACHE_BLOCK_SIZE-1);
+		offsets.data = offsets.table + CACHE_BLOCK_SIZE + sizeof(Bucket) * meta->total_entry;
+	} else {
+		offsets.data = offsets.table + sizeof(uint32_t) * meta->total_entry;
+	}
 	const auto item_size = ItemSize(meta->key_len, meta->val_len);
 	const auto capacity = meta->capacity + RECYCLE_CAPACITY;
 	const auto data_end = offsets.data + item_size * capacity;
-	if (meta->magic != MAGIC || meta->key_len == 0 || meta->val_len > LuckyEstuary::MAX_VAL_LEN
+	if ((meta->magic & ~(EPOCH_BIT|CUCKOO_BIT)) != MAGIC || meta->key_len == 0 || meta->val_len > LuckyEstuary::MAX_VAL_LEN
 			|| meta->capacity < LuckyEstuary::MIN_CAPACITY || meta->capacity > LuckyEstuary::MAX_CAPACITY
-			|| meta->total_entry == 0 || meta->capacity > meta->total_entry * LuckyEstuary::MAX_LOAD_FACTOR
+			|| meta->total_entry == 0 || meta->capacity > MaxCapacity(*meta)
 			|| res.size() < data_end) {
 		return false;
 	}
@@ -432,27 +1192,57 @@ void LuckyEstuary::_init(MemMap&& res, bool monopoly, const char* path) {
 
 	std::unique_ptr<uint8_t[]> monopoly_extra;
 	auto lock = (Lock*)(res.addr() + offsets.lock);
+	Stripe* stripes = nullptr;
+	const bool cuckoo = meta->magic & CUCKOO_BIT;
 	if (monopoly) {
 		if (meta->writing) {
 			Logger::Printf("file is not saved correctly: %s\n", path);
 			return;
 		}
-		monopoly_extra = std::make_unique<uint8_t[]>(sizeof(Lock));
-		lock = (Lock*)monopoly_extra.get();
-		if (!InitLock(lock)) {
+		//lock and stripes in private memory: [lock][stripe][stripe]...
+		static_assert(sizeof(Lock) <= sizeof(Stripe) && sizeof(Stripe) % CACHE_BLOCK_SIZE == 0);
+		monopoly_extra = std::make_unique<uint8_t[]>(sizeof(Stripe)*(STRIPE_COUNT+1) + CACHE_BLOCK_SIZE);
+		auto base = (uint8_t*)(((uintptr_t)monopoly_extra.get() + CACHE_BLOCK_SIZE-1) & ~(uintptr_t)(CACHE_BLOCK_SIZE-1));
+		lock = (Lock*)base;
+		if (!cuckoo) {	//buckets are shared by stripes
+			stripes = (Stripe*)(base + sizeof(Stripe));
+		}
+		bool done = InitLock(lock);
+		for (unsigned i = 0; done && stripes != nullptr && i < STRIPE_COUNT; i++) {
+			new(&stripes[i])Stripe;
+			done = pthread_mutex_init(&stripes[i].lock, nullptr) == 0;
+		}
+		if (!done) {
 			Logger::Printf("fail to reset locks in: %s\n", path);
 			return;
 		}
 	}
 
+	Epoch* epoch = nullptr;
+	if (offsets.epoch != 0) {
+		epoch = (Epoch*)(res.addr() + offsets.epoch);
+		if (monopoly) {	//left by dead readers
+			memset(epoch->slots, 0, sizeof(epoch->slots));
+		}
+	}
+
 	m_meta = meta;
 	m_lock = lock;
+	m_stripes = stripes;
+	m_epoch = epoch;
 	m_stamps = (int64_t*)(res.addr()+offsets.stamps);
 	m_recycle = (uint32_t*)(res.addr()+offsets.recycle);
-	m_table = (uint32_t*)(res.addr()+offsets.table);
+	if (cuckoo) {
+		m_version = (uint64_t*)(res.addr()+offsets.table);
+		m_buckets = (Bucket*)(res.addr()+offsets.table+CACHE_BLOCK_SIZE);
+	} else {
+		m_table = (uint32_t*)(res.addr()+offsets.table);
+	}
 	m_data = res.addr()+offsets.data;
 	m_monopoly_extra = std::move(monopoly_extra);
 	m_resource = std::move(res);
+	m_warm.cursor = m_resource.size();
+	m_warm.done = m_resource.size();
 	m_const.key_len = meta->key_len;
 	m_const.val_len = meta->val_len;
 	m_const.item_size = item_size;
@@ -461,19 +1251,109 @@ void LuckyEstuary::_init(MemMap&& res, bool monopoly, const char* path) {
 	m_const.total_entry = meta->total_entry;
 }
 
-bool LuckyEstuary::Create(const std::string& path, const Config& config, IDataReader* source) {
-	if (config.capacity < MIN_CAPACITY || config.capacity > MAX_CAPACITY
-		|| config.entry == 0 || config.capacity > config.entry * MAX_LOAD_FACTOR
-		|| config.key_len == 0 || config.key_len > MAX_KEY_LEN || config.val_len > MAX_VAL_LEN) {
-		Logger::Printf("bad arguments\n");
-		return false;
+// items are copied one by one at first, then hashed and linked by table shards in parallel
+static bool ParallelFill(const Header& header, uint32_t* table, uint8_t* data, IDataReader& source,
+						 unsigned concurrency, uint32_t& cnt, std::vector<uint32_t>& spare) {
+	const auto item_size = ItemSize(header.key_len, header.val_len);
+	auto get_node = [data, item_size](uint32_t idx)->Node* {
+		return (Node*)(data + idx*item_size);
+	};
+	const auto total = source.total();
+	for (size_t i = 0; i < total; i++) {
+		auto rec = source.read();
+		if (rec.key.ptr == nullptr || rec.key.len != header.key_len
+			|| rec.val.len != header.val_len || (rec.val.len != 0 && rec.val.ptr == nullptr)) {
+			Logger::Printf("broken item\n");
+			return false;
+		}
+		auto node = get_node(i);
+		if (header.key_len == sizeof(uint64_t)) {
+			*(uint64_t*)node->line = *(const uint64_t*)rec.key.ptr;
+		} else {
+			memcpy(node->line, rec.key.ptr, header.key_len);
+		}
+		memcpy(node->line+header.key_len, rec.val.ptr, header.val_len);
 	}
+	cnt = total;
+
+	struct Item {
+		uint32_t ent;
+		uint32_t id;
+	};
+	const unsigned n_shard = concurrency * 4;
+	const uint64_t n_entry = header.total_entry;
+	const Divisor<uint64_t> total_entry(n_entry);
+
+	//buckets[part*n_shard+shard] keeps input order within each part
+	std::vector<std::vector<Item>> buckets(concurrency*n_shard);
+	ParallelRun(concurrency, [&](unsigned part) {
+		auto bucket = &buckets[part*n_shard];
+		const auto expect = (total/concurrency) / n_shard + (total/concurrency) / (n_shard*8) + 1;
+		for (unsigned i = 0; i < n_shard; i++) {
+			bucket[i].reserve(expect);
+		}
+		constexpr unsigned STEP = 64;
+		uint64_t codes[STEP];
+		const uint32_t end = total*(part+1)/concurrency;
+		for (uint32_t id = total*part/concurrency; id < end; id += STEP) {
+			const auto cnt = std::min(STEP, end - id);
+			HashBatch(get_node(id)->line, item_size, header.key_len, cnt, header.seed, codes);
+			for (unsigned i = 0; i < cnt; i++) {
+				const uint32_t ent = codes[i] % total_entry;
+				bucket[(uint64_t)ent*n_shard/n_entry].push_back({ent, id+i});
+			}
+		}
+	});
+
+	std::vector<std::vector<uint32_t>> spares(concurrency);
+	std::atomic<unsigned> next_shard(0);
+	ParallelRun(concurrency, [&](unsigned worker) {
+		auto& dup = spares[worker];
+		for (unsigned shard; (shard = next_shard++) < n_shard; ) {
+			for (unsigned part = 0; part < concurrency; part++) {
+				for (auto& item : buckets[part*n_shard+shard]) {
+					auto neo = get_node(item.id);
+					bool found = false;
+					for (auto idx = table[item.ent]; idx != Node::END; ) {
+						auto node = get_node(idx);
+						if (Equal(node->line, neo->line, header.key_len)) {
+							found = true;
+							memcpy(node->line+header.key_len, neo->line+header.key_len, header.val_len);
+							break;
+						}
+						idx = node->next;
+					}
+					if (found) {
+						dup.push_back(item.id);
+					} else {
+						neo->next = table[item.ent];
+						table[item.ent] = item.id;
+					}
+				}
+				std::vector<Item>().swap(buckets[part*n_shard+shard]);
+			}
+		}
+	});
+	for (auto& dup : spares) {
+		spare.insert(spare.end(), dup.begin(), dup.end());
+	}
+	return true;
+}
+
+bool LuckyEstuary::Create(const std::string& path, const Config& config, IDataReader* source) {
 	Header header;
+	header.magic = MAGIC | (config.epoch? EPOCH_BIT : 0) | (config.cuckoo? CUCKOO_BIT : 0);
 	header.key_len = config.key_len;
 	header.val_len = config.val_len;
-	header.total_entry = config.entry;
+	header.total_entry = config.cuckoo? (config.entry + (BUCKET_SLOTS-1ULL)) / BUCKET_SLOTS : config.entry;
 	header.capacity = config.capacity;
 	header.seed = GetSeed();
+	if (config.capacity < MIN_CAPACITY || config.capacity > MAX_CAPACITY
+		|| config.entry == 0 || config.capacity > MaxCapacity(header)
+		|| config.key_len == 0 || config.key_len > MAX_KEY_LEN || config.val_len > MAX_VAL_LEN) {
+		Logger::Printf("bad arguments\n");
+		return false;
+	}
 
 	static_assert(sizeof(Header) % sizeof(uintptr_t) == 0, "alignment check");
 
@@ -483,11 +1363,22 @@ bool LuckyEstuary::Create(const std::string& path, const Config& config, IDataRe
 	size_t size = sizeof(header);
 	const auto lock_off = size;
 	size += sizeof(Lock);
+	if (config.epoch) {	//zeroed by truncating
+		size = (size + EPOCH_PAGE_SIZE-1) & ~(EPOCH_PAGE_SIZE-1);
+		size += sizeof(Epoch);
+	}
 	size += sizeof(int64_t) * (RECYCLE_CAPACITY/RECYCLE_BIN_SIZE);
 	const auto recycle_off = size;
 	size += sizeof(uint32_t) * RECYCLE_CAPACITY;
+	if (config.cuckoo) {
+		size = (size + CACHE_BLOCK_SIZE-1) & ~(size_t)(CACHE_BLOCK_SIZE-1);
+	}
 	const auto table_off = size;
-	size += sizeof(uint32_t) * header.total_entry;
+	if (config.cuckoo) {	//version is zeroed by truncating
+		size += CACHE_BLOCK_SIZE + sizeof(Bucket) * header.total_entry;
+	} else {
+		size += sizeof(uint32_t) * header.total_entry;
+	}
 	const auto data_off = size;
 	size += item_size * capacity;
 
@@ -513,11 +1404,19 @@ bool LuckyEstuary::Create(const std::string& path, const Config& config, IDataRe
 	for (unsigned i = 0; i < RECYCLE_CAPACITY; i++) {
 		recycle[i] = Node::END;
 	}
-	for (size_t i = 0; i < header.total_entry; i++) {
+	if (config.cuckoo) {
+		auto buckets = (Bucket*)(res.addr() + table_off + CACHE_BLOCK_SIZE);
+		for (size_t i = 0; i < header.total_entry; i++) {
+			for (auto& id : buckets[i].id) {
+				id = Node::END;
+			}
+		}
+	} else for (size_t i = 0; i < header.total_entry; i++) {
 		table[i] = Node::END;
 	}
 
 	uint32_t cnt = 0;
+	std::vector<uint32_t> spare;	//nodes of duplicate items
 	if (source != nullptr) {
 		Divisor<uint64_t> total_entry(header.total_entry);
 		source->reset();
@@ -526,7 +1425,14 @@ bool LuckyEstuary::Create(const std::string& path, const Config& config, IDataRe
 			Logger::Printf("too many items\n");
 			return false;
 		}
-		for (size_t i = 0; i < total; i++) {
+		const auto concurrency = std::min<size_t>(Concurrency(config.concurrency), total/MIN_CAPACITY+1);
+		if (config.cuckoo) {
+			//filled later
+		} else if (concurrency > 1) {
+			if (!ParallelFill(header, table, data, *source, concurrency, cnt, spare)) {
+				return false;
+			}
+		} else for (size_t i = 0; i < total; i++) {
 			auto rec = source->read();
 			if (rec.key.ptr == nullptr || rec.key.len != header.key_len
 				|| rec.val.len != header.val_len || (rec.val.len != 0 && rec.val.ptr == nullptr)) {
@@ -559,7 +1465,7 @@ bool LuckyEstuary::Create(const std::string& path, const Config& config, IDataRe
 	}
 
 	assert(cnt < capacity);
-	meta->item = cnt;
+	meta->item = cnt - spare.size();
 	meta->free_list.head = cnt;
 	meta->free_list.tail = capacity-1;
 	while (cnt < capacity) {
@@ -568,9 +1474,47 @@ bool LuckyEstuary::Create(const std::string& path, const Config& config, IDataRe
 		node->free = ++cnt;
 	}
 	get_node(capacity-1)->free = Node::END;
+	for (auto id : spare) {
+		auto node = get_node(id);
+		node->next = Node::END;
+		node->free = meta->free_list.head;
+		meta->free_list.head = id;
+	}
+	if (!config.cuckoo || source == nullptr) {
+		return true;
+	}
+
+	//placing may kick other items, so items are inserted one by one like updating
+	LuckyEstuary dict;
+	dict._init(std::move(res), true, path.c_str());
+	if (!dict) {
+		return false;
+	}
+	const auto total = source->total();
+	for (size_t i = 0; i < total; i++) {
+		auto rec = source->read();
+		if (rec.key.ptr == nullptr || rec.key.len != header.key_len
+			|| rec.val.len != header.val_len || (rec.val.len != 0 && rec.val.ptr == nullptr)) {
+			Logger::Printf("broken item\n");
+			return false;
+		}
+		if (!dict._cuckoo_update(rec.key.ptr, rec.val.ptr)) {
+			Logger::Printf("fail to place item\n");
+			return false;
+		}
+	}
 	return true;
 }
 
+static void Describe(const Header& meta, LuckyEstuary::Config& config) {
+	config.epoch = meta.magic & EPOCH_BIT;
+	config.cuckoo = meta.magic & CUCKOO_BIT;
+	config.entry = config.cuckoo? meta.total_entry * BUCKET_SLOTS : meta.total_entry;
+	config.capacity = meta.capacity;
+	config.key_len = meta.key_len;
+	config.val_len = meta.val_len;
+}
+
 bool LuckyEstuary::Extend(const std::string& path, unsigned percent, Config* result) {
 	if (percent == 0 || percent > 100) {
 		return false;
@@ -587,7 +1531,7 @@ bool LuckyEstuary::Extend(const std::string& path, unsigned percent, Config* res
 		return false;
 	}
 	auto meta = (Header*)res.addr();
-	const auto max_cap = std::min(MAX_CAPACITY, meta->total_entry * MAX_LOAD_FACTOR);
+	const auto max_cap = std::min<uint64_t>(MAX_CAPACITY, MaxCapacity(*meta));
 	if (meta->capacity == max_cap) {
 		Logger::Printf("cannot extend: %s\n", path.c_str());
 		close(fd);
@@ -637,14 +1581,183 @@ bool LuckyEstuary::Extend(const std::string& path, unsigned percent, Config* res
 	meta->free_list.tail = capacity-1;
 
 	meta->capacity += extend;
+	if (result != nullptr) {
+		Describe(*meta, *result);
+	}
 	close(fd);
+	return true;
+}
 
+bool LuckyEstuary::Inspect(const std::string& path, Layout& out, unsigned concurrency) {
+	MemMap res(path.c_str());
+	Offsets offsets;
+	if (!GetOffsets(res, offsets, true)) {
+		Logger::Printf("broken file: %s\n", path.c_str());
+		return false;
+	}
+	auto meta = (const Header*)res.addr();
+	if (meta->writing) {
+		Logger::Printf("file is not saved correctly: %s\n", path.c_str());
+		return false;
+	}
+	out = Layout();
+	Describe(*meta, out.config);
+
+	const auto table = (const uint32_t*)(res.addr() + offsets.table);
+	const auto buckets = out.config.cuckoo? (const Bucket*)(res.addr() + offsets.table + CACHE_BLOCK_SIZE) : nullptr;
+	const auto data = res.addr() + offsets.data;
+	const auto item_size = ItemSize(meta->key_len, meta->val_len);
+	const uint32_t total_node = meta->capacity + RECYCLE_CAPACITY;
+	auto get_node = [data, item_size](uint32_t idx)->const Node* {
+		return (const Node*)(data + idx*item_size);
+	};
+
+	const unsigned n = Concurrency(concurrency);
+	std::vector<Layout> parts(n);
+	std::atomic<bool> broken = {false};
+	ParallelRun(n, [&](unsigned id) {
+		auto& part = parts[id];
+		const size_t end = (size_t)meta->total_entry * (id+1) / n;
+		for (size_t i = (size_t)meta->total_entry * id / n; i < end; i++) {
+			uint32_t len = 0;
+			if (buckets != nullptr) {
+				for (auto idx : buckets[i].id) {
+					if (idx == Node::END) {
+						continue;
+					}
+					if (idx >= total_node) {
+						broken = true;
+						return;
+					}
+					len++;
+				}
+				part.empty_entry += BUCKET_SLOTS - len;
+			} else {
+				for (auto idx = table[i]; idx != Node::END; idx = get_node(idx)->next) {
+					if (idx >= total_node || ++len > meta->item) {
+						broken = true;
+						return;
+					}
+				}
+				part.empty_entry += len == 0;
+			}
+			part.item += len;
+			part.max_chain = std::max(part.max_chain, len);
+			part.chain_length[Log2Bucket(len, Layout::BUCKETS)]++;
+		}
+	});
+	if (broken) {
+		Logger::Printf("broken table: %s\n", path.c_str());
+		return false;
+	}
+	for (auto& part : parts) {
+		out.item += part.item;
+		out.empty_entry += part.empty_entry;
+		out.max_chain = std::max(out.max_chain, part.max_chain);
+		for (unsigned j = 0; j < Layout::BUCKETS; j++) {
+			out.chain_length[j] += part.chain_length[j];
+		}
+	}
+
+	for (auto idx = meta->free_list.head; idx != Node::END; idx = get_node(idx)->free) {
+		if (idx >= total_node || ++out.free_node > total_node) {
+			Logger::Printf("broken free list: %s\n", path.c_str());
+			return false;
+		}
+	}
+	out.recycling_node = (meta->recycle.w + RECYCLE_CAPACITY - meta->recycle.r) % RECYCLE_CAPACITY;
+	if (out.item != meta->item || (uint64_t)out.item + out.free_node + out.recycling_node > total_node) {
+		Logger::Printf("inconsistent items in: %s\n", path.c_str());
+		return false;
+	}
+	out.room = meta->capacity > out.item? meta->capacity - out.item : 0;
+	return true;
+}
+
+bool LuckyEstuary::Grow(const std::string& path, unsigned percent, Config* result) {
+	if (percent == 0 || percent > 100) {
+		return false;
+	}
+	int fd = OpenAndLock(path.c_str(), true, false);
+	if (fd < 0) {
+		return false;
+	}
+	MemMap res(fd);
+	Offsets offsets;
+	if (!GetOffsets(res, offsets, true)) {
+		Logger::Printf("broken file: %s\n", path.c_str());
+		close(fd);
+		return false;
+	}
+	auto meta = (Header*)res.addr();
+	if (meta->writing) {
+		Logger::Printf("file is not saved correctly: %s\n", path.c_str());
+		close(fd);
+		return false;
+	}
+	if (meta->magic & CUCKOO_BIT) {
+		Logger::Printf("cannot grow cuckoo buckets: %s\n", path.c_str());
+		close(fd);
+		return false;
+	}
+	const uint64_t old_entry = meta->total_entry;
+	const auto new_entry = std::min<uint64_t>(old_entry + (old_entry * percent + 99) / 100, UINT32_MAX);
+	if (new_entry <= old_entry) {
+		Logger::Printf("cannot grow: %s\n", path.c_str());
+		close(fd);
+		return false;
+	}
+	const auto item_size = ItemSize(meta->key_len, meta->val_len);
+	const auto extend = (new_entry - old_entry) * sizeof(uint32_t);
+	const auto tail_size = res.size() - offsets.data;	//data and anything after
+
+	//new file is locked before it can be seen by others
+	const auto tmp = path + ".grow";
+	MemMap out(tmp.c_str(), false, true, res.size() + extend);
+	struct stat st;
+	if (!out || fstat(fd, &st) != 0 || fchmod(out.fd(), st.st_mode & 07777) != 0) {
+		Logger::Printf("fail to create: %s\n", tmp.c_str());
+		close(fd);
+		return false;
+	}
+	memcpy(out.addr(), res.addr(), offsets.table);
+	meta = (Header*)out.addr();
+	meta->writing = true;
+	auto parked = (const uint32_t*)(res.addr() + offsets.table);
+	auto table = (uint32_t*)(out.addr() + offsets.table);
+	auto data = out.addr() + offsets.data + extend;
+	memcpy(data, res.addr() + offsets.data, tail_size);
+	auto get_node = [data, item_size](uint32_t idx)->Node* {
+		return (Node*)(data + idx*item_size);
+	};
+
+	for (size_t i = 0; i < new_entry; i++) {
+		table[i] = Node::END;
+	}
+	Divisor<uint64_t> total_entry(new_entry);
+	for (size_t i = 0; i < old_entry; i++) {
+		for (auto id = parked[i]; id != Node::END; ) {
+			auto node = get_node(id);
+			const auto next = node->next;
+			const auto ent = Hash(node->line, meta->key_len, meta->seed) % total_entry;
+			node->next = table[ent];
+			table[ent] = id;
+			id = next;
+		}
+	}
+	meta->total_entry = new_entry;
+	meta->writing = false;
 	if (result != nullptr) {
-		result->entry = meta->total_entry;
-		result->capacity = meta->capacity;
-		result->key_len = meta->key_len;
-		result->val_len = meta->val_len;
+		Describe(*meta, *result);
+	}
+
+	if (!ReplaceFile(out.fd(), tmp.c_str(), path.c_str())) {
+		Logger::Printf("fail to replace: %s\n", path.c_str());
+		unlink(tmp.c_str());
+		close(fd);
+		return false;
 	}
+	close(fd);
 	return true;
 }
 
@@ -0,0 +1,235 @@
+//==============================================================================
+// Dictionary designed for read-mostly scene.
+// Copyright (C) 2020	Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <sharded_estuary.h>
+#include "internal.h"
+
+namespace estuary {
+
+static constexpr uint64_t ROUTE_SEED = 0x5eed0f5a4d3d6e21ULL;
+
+//never depend on the seed of any shard, which is random
+static FORCE_INLINE unsigned Route(Slice key, unsigned shards) noexcept {
+	const auto code = Hash(key.ptr, key.len, ROUTE_SEED);
+	return ((code >> 32U) * shards) >> 32U;
+}
+
+unsigned ShardedEstuary::locate(Slice key) const noexcept {
+	return Route(key, m_shards.size());
+}
+
+unsigned ShardedEstuary::batch_fetch(unsigned batch, const Slice* __restrict__ keys, std::string* __restrict__ out,
+									 unsigned* __restrict__ miss) const {
+	if (m_shards.size() == 1) {
+		return m_shards[0].batch_fetch(batch, keys, out, miss);
+	}
+	static thread_local std::vector<unsigned> route;
+	static thread_local std::vector<unsigned> index;
+	static thread_local std::vector<unsigned> lost;
+	static thread_local std::vector<Slice> part;
+	static thread_local std::vector<std::string> result;
+	route.resize(batch);
+	for (unsigned i = 0; i < batch; i++) {
+		route[i] = locate(keys[i]);
+	}
+	unsigned hit = 0;
+	for (unsigned s = 0; s < m_shards.size(); s++) {
+		index.clear();
+		part.clear();
+		for (unsigned i = 0; i < batch; i++) {
+			if (route[i] == s) {
+				index.push_back(i);
+				part.push_back(keys[i]);
+			}
+		}
+		if (index.empty()) {
+			continue;
+		}
+		result.resize(index.size());
+		lost.resize(index.size());
+		const auto cnt = m_shards[s].batch_fetch(index.size(), part.data(), result.data(), lost.data());
+		hit += cnt;
+		for (unsigned j = 0; j < index.size() - cnt; j++) {
+			route[index[lost[j]]] = UINT32_MAX;	//mark missing
+		}
+		//results of misses are left by former calls, out of misses should be untouched
+		for (unsigned j = 0; j < index.size(); j++) {
+			if (route[index[j]] != UINT32_MAX) {
+				out[index[j]].swap(result[j]);
+			}
+		}
+	}
+	if (miss != nullptr) {
+		for (unsigned i = 0; i < batch; i++) {
+			if (route[i] == UINT32_MAX) {
+				*miss++ = i;
+			}
+		}
+	}
+	return hit;
+}
+
+size_t ShardedEstuary::item() const noexcept {
+	size_t total = 0;
+	for (auto& shard : m_shards) {
+		total += shard.item();
+	}
+	return total;
+}
+
+size_t ShardedEstuary::data_free() const {
+	size_t total = 0;
+	for (auto& shard : m_shards) {
+		total += shard.data_free();
+	}
+	return total;
+}
+
+size_t ShardedEstuary::item_limit() const {
+	size_t total = 0;
+	for (auto& shard : m_shards) {
+		total += shard.item_limit();
+	}
+	return total;
+}
+
+std::string ShardedEstuary::ShardPath(const std::string& path, unsigned idx) {
+	return path + "." + std::to_string(idx);
+}
+
+namespace {
+//pick records belonged to one shard, the source is scanned once more at every reset
+class ShardReader : public IDataReader {
+public:
+	ShardReader(IDataReader& source, unsigned shards, unsigned idx, size_t total)
+		: m_source(source), m_shards(shards), m_idx(idx), m_total(total), m_remain(source.total()) {}
+	void reset() override {
+		m_source.reset();
+		m_remain = m_source.total();
+	}
+	size_t total() override {
+		return m_total;
+	}
+	//give a null key when the source is used up
+	Record read() override {
+		while (m_remain != 0) {
+			m_remain--;
+			auto rec = m_source.read();
+			if (rec.key.ptr == nullptr) {
+				break;
+			}
+			if (Route(rec.key, m_shards) == m_idx) {
+				return rec;
+			}
+		}
+		m_remain = 0;
+		return {};
+	}
+private:
+	IDataReader& m_source;
+	const unsigned m_shards;
+	const unsigned m_idx;
+	const size_t m_total;
+	size_t m_remain;
+};
+} //namespace
+
+static std::vector<size_t> CountShards(IDataReader& source, unsigned shards) {
+	std::vector<size_t> count(shards, 0);
+	source.reset();
+	const auto total = source.total();
+	for (size_t i = 0; i < total; i++) {
+		count[Route(source.read().key, shards)]++;
+	}
+	return count;
+}
+
+static Estuary::Config ShardConfig(const Estuary::Config& config, unsigned shards, size_t count, size_t total) {
+	constexpr size_t MIN_ITEM_LIMIT = 128;
+	auto out = config;
+	if (total == 0) {
+		out.item_limit = (config.item_limit + shards - 1) / shards;
+	} else {
+		out.item_limit = std::max((config.item_limit * count + total - 1) / total, count);
+	}
+	out.item_limit = std::max(out.item_limit, MIN_ITEM_LIMIT);
+	return out;
+}
+
+bool ShardedEstuary::Create(const std::string& path, unsigned shards, const Estuary::Config& config,
+							IDataReader* source) {
+	if (shards == 0 || shards > MAX_SHARDS) {
+		return false;
+	}
+	if (source == nullptr) {
+		for (unsigned i = 0; i < shards; i++) {
+			if (!Estuary::Create(ShardPath(path, i), ShardConfig(config, shards, 0, 0))) {
+				return false;
+			}
+		}
+		return true;
+	}
+	const auto total = source->total();
+	const auto count = CountShards(*source, shards);
+	for (unsigned i = 0; i < shards; i++) {
+		ShardReader reader(*source, shards, i, count[i]);
+		if (!Estuary::Create(ShardPath(path, i), ShardConfig(config, shards, count[i], total), &reader)) {
+			Logger::Printf("fail to create shard %u\n", i);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ShardedEstuary::Rebuild(const std::string& path, unsigned shards, unsigned idx,
+							 const Estuary::Config& config, IDataReader& source) {
+	if (shards == 0 || shards > MAX_SHARDS || idx >= shards) {
+		return false;
+	}
+	const auto total = source.total();
+	const auto count = CountShards(source, shards);
+	ShardReader reader(source, shards, idx, count[idx]);
+	return Estuary::Create(ShardPath(path, idx), ShardConfig(config, shards, count[idx], total), &reader);
+}
+
+ShardedEstuary ShardedEstuary::Load(const std::string& path, unsigned shards, Estuary::LoadPolicy policy) {
+	ShardedEstuary out;
+	if (shards == 0 || shards > MAX_SHARDS) {
+		return out;
+	}
+	out.m_shards.reserve(shards);
+	for (unsigned i = 0; i < shards; i++) {
+		auto shard = Estuary::Load(ShardPath(path, i), policy);
+		if (!shard) {
+			return {};
+		}
+		out.m_shards.push_back(std::move(shard));
+	}
+	return out;
+}
+
+bool ShardedEstuary::dump(const std::string& path) const noexcept {
+	for (unsigned i = 0; i < m_shards.size(); i++) {
+		if (!m_shards[i].dump(ShardPath(path, i))) {
+			return false;
+		}
+	}
+	return !m_shards.empty();
+}
+
+} //estuary
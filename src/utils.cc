@@ -18,6 +18,9 @@
 
 #include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <string>
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -64,6 +67,22 @@ bool ExtendFile(int fd, size_t size) noexcept {
 	return true;
 }
 
+bool SyncFile(const char* path, bool directory) noexcept {
+	auto fd = open(path, directory? O_RDONLY|O_DIRECTORY : O_WRONLY);
+	if (fd < 0) {
+		return false;
+	}
+	const bool done = fdatasync(fd) == 0;
+	close(fd);
+	return done;
+}
+
+bool ReplaceFile(int fd, const char* tmp, const char* path) noexcept {
+	const auto name = strrchr(path, '/');
+	const auto dir = name == nullptr? std::string(".") : std::string(path, name+1-path);
+	return fdatasync(fd) == 0 && rename(tmp, path) == 0 && SyncFile(dir.c_str(), true);
+}
+
 struct DefaultLogger : public Logger {
 	void printf(const char* format, va_list args) override;
 	static DefaultLogger instance;
@@ -175,6 +194,70 @@ MemMap::MemMap(const char* path, LoadByCopy) {
 	close(fd);
 }
 
+MemMap::MemMap(const char* path, ReadOnly) noexcept {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		Logger::Printf("fail to open file: %s\n", path);
+		return;
+	}
+	if (flock(fd, LOCK_NB|LOCK_SH) != 0) {
+		Logger::Printf("fail to lock file: %s\n", path);
+		close(fd);
+		return;
+	}
+	struct stat stat;
+	if (fstat(fd, &stat) != 0 || stat.st_size <= 0) {
+		Logger::Printf("fail to read file: %s\n", path);
+		close(fd);
+		return;
+	}
+	const size_t size = stat.st_size;
+	auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED|MAP_POPULATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	m_addr = static_cast<uint8_t*>(addr);
+	m_size = size;
+	m_fd = fd;
+}
+
+MemMap::MemMap(int fd, ReadOnly) noexcept {
+	struct stat stat;
+	if (fstat(fd, &stat) != 0 || stat.st_size <= 0) {
+		return;
+	}
+	const size_t size = stat.st_size;
+	auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		return;
+	}
+	m_addr = static_cast<uint8_t*>(addr);
+	m_size = size;
+}
+
+MemMap::MemMap(const char* path, LoadByDemand) noexcept {
+	int fd = OpenAndLock(path, true, false);
+	if (fd < 0) {
+		return;
+	}
+	struct stat stat;
+	if (fstat(fd, &stat) != 0 || stat.st_size <= 0) {
+		Logger::Printf("fail to read file: %s\n", path);
+		close(fd);
+		return;
+	}
+	const size_t size = stat.st_size;
+	auto addr = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	m_addr = static_cast<uint8_t*>(addr);
+	m_size = size;
+	m_fd = fd;
+}
+
 MemMap::MemMap(size_t size, const std::function<bool(uint8_t*)>& load) {
   if (size == 0) {
     Logger::Printf("unexpected size 0\n");
@@ -212,6 +295,20 @@ MemMap::~MemMap() noexcept {
 	}
 }
 
+void MemMap::warmup(size_t off, size_t len) const noexcept {
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	if (m_addr == nullptr || off >= m_size) {
+		return;
+	}
+	len = std::min(len, m_size - off);
+	auto begin = (uintptr_t)(m_addr + off) & ~(uintptr_t)(page_size-1);
+	auto end = (uintptr_t)(m_addr + off + len);
+	madvise((void*)begin, end - begin, MADV_WILLNEED);
+	for (auto p = begin; p < end; p += page_size) {
+		*(volatile const uint8_t*)p;
+	}
+}
+
 bool MemMap::dump(const char* path) const noexcept {
 	if (!*this) {
 		return false;
@@ -234,4 +331,101 @@ bool MemMap::dump(const char* path) const noexcept {
 	return remain == 0;
 }
 
+uint64_t Statistics::count(Histogram h) const noexcept {
+	uint64_t total = 0;
+	for (auto cnt : histogram[h]) {
+		total += cnt;
+	}
+	return total;
+}
+
+uint64_t Statistics::percentile(Histogram h, double p) const noexcept {
+	const auto total = count(h);
+	if (total == 0) {
+		return 0;
+	}
+	p = std::min(std::max(p, 0.0), 1.0);
+	const auto rank = std::max<uint64_t>(1, p * total);
+	uint64_t sum = 0;
+	for (unsigned i = 0; i < BUCKETS-1; i++) {
+		sum += histogram[h][i];
+		if (sum >= rank) {
+			return (1ULL << i) - 1U;
+		}
+	}
+	return UINT64_MAX;
+}
+
+Statistics Statistics::operator-(const Statistics& base) const noexcept {
+	auto out = *this;
+	for (unsigned i = 0; i < COUNTER_NUM; i++) {
+		out.counter[i] -= base.counter[i];
+	}
+	for (unsigned i = 0; i < HISTOGRAM_NUM; i++) {
+		for (unsigned j = 0; j < BUCKETS; j++) {
+			out.histogram[i][j] -= base.histogram[i][j];
+		}
+	}
+	return out;
+}
+
+#ifdef ENABLE_STATISTICS
+thread_local StatBlock* t_stat_block = nullptr;
+
+static pthread_mutex_t s_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<StatBlock*>* s_stat_blocks = nullptr;
+static std::vector<StatBlock*>* s_idle_blocks = nullptr;
+
+//blocks are never freed but handed over to new threads, so values are kept after threads exit
+StatBlock* RegisterStatBlock() {
+	struct Releaser {
+		~Releaser() noexcept {
+			if (t_stat_block != nullptr) {
+				MutexLock lock(&s_stat_lock);
+				s_idle_blocks->push_back(t_stat_block);
+				t_stat_block = nullptr;
+			}
+		}
+	};
+	static thread_local Releaser releaser;
+	(void)releaser;
+
+	MutexLock lock(&s_stat_lock);
+	if (s_stat_blocks == nullptr) {
+		s_stat_blocks = new std::vector<StatBlock*>();
+		s_idle_blocks = new std::vector<StatBlock*>();
+	}
+	if (!s_idle_blocks->empty()) {
+		auto block = s_idle_blocks->back();
+		s_idle_blocks->pop_back();
+		return block;
+	}
+	auto block = new StatBlock();
+	s_stat_blocks->push_back(block);
+	return block;
+}
+#endif
+
+Statistics Stats() noexcept {
+	Statistics out;
+#ifdef ENABLE_STATISTICS
+	out.enabled = true;
+	pthread_mutex_lock(&s_stat_lock);
+	if (s_stat_blocks != nullptr) {
+		for (auto block : *s_stat_blocks) {
+			for (unsigned i = 0; i < Statistics::COUNTER_NUM; i++) {
+				out.counter[i] += LoadRelaxed(block->counter[i]);
+			}
+			for (unsigned i = 0; i < Statistics::HISTOGRAM_NUM; i++) {
+				for (unsigned j = 0; j < Statistics::BUCKETS; j++) {
+					out.histogram[i][j] += LoadRelaxed(block->histogram[i][j]);
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&s_stat_lock);
+#endif
+	return out;
+}
+
 } //estuary
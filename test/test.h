@@ -85,3 +85,62 @@ private:
 	const unsigned m_shift;
 };
 
+class JsonGenerator : public estuary::IDataReader {
+public:
+	JsonGenerator(uint64_t begin, uint64_t total, unsigned version=0)
+		: m_current(begin-1), m_begin(begin), m_total(total), m_version(version)
+	{}
+	JsonGenerator(const JsonGenerator&) = delete;
+	JsonGenerator& operator=(const JsonGenerator&) = delete;
+
+	void reset() override {
+		m_current = m_begin-1;
+	}
+	size_t total() override {
+		return m_total;
+	}
+	estuary::IDataReader::Record read() override {
+		m_current++;
+		m_val = "{\"id\":" + std::to_string(m_current) + ",\"version\":" + std::to_string(m_version)
+			+ ",\"name\":\"user-" + std::to_string(m_current % 997) + "\",\"tags\":[";
+		for (unsigned i = 0; i < m_current % 8; i++) {
+			m_val += "\"tag-" + std::to_string((m_current + i) % 5) + "\",";
+		}
+		m_val += "\"end\"],\"enabled\":true}";
+		return {{(const uint8_t*)&m_current, sizeof(uint64_t)}, {(const uint8_t*)m_val.data(), m_val.size()}};
+	}
+
+private:
+	uint64_t m_current;
+	std::string m_val;
+	const uint64_t m_begin;
+	const uint64_t m_total;
+	const unsigned m_version;
+};
+
+
+class ConcatReader : public estuary::IDataReader {
+public:
+	ConcatReader(estuary::IDataReader& first, estuary::IDataReader& second)
+		: m_first(first), m_second(second)
+	{}
+	ConcatReader(const ConcatReader&) = delete;
+	ConcatReader& operator=(const ConcatReader&) = delete;
+
+	void reset() override {
+		m_first.reset();
+		m_second.reset();
+		m_current = 0;
+	}
+	size_t total() override {
+		return m_first.total() + m_second.total();
+	}
+	estuary::IDataReader::Record read() override {
+		return m_current++ < m_first.total()? m_first.read() : m_second.read();
+	}
+
+private:
+	estuary::IDataReader& m_first;
+	estuary::IDataReader& m_second;
+	size_t m_current = 0;
+};
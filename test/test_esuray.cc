@@ -17,9 +17,20 @@
 //==============================================================================
 
 #include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <csignal>
 #include <gtest/gtest.h>
 #include <estuary.h>
 #include "test.h"
+#include "../src/internal.h"
 
 static constexpr unsigned PIECE = 1000;
 
@@ -194,4 +205,1484 @@ TEST(Estuary, Erase) {
 		ASSERT_EQ(val.size(), rec.val.len);
 		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
 	}
-}
\ No newline at end of file
+}
+TEST(Estuary, BatchFetch) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "batch.es";
+
+	VariedValueGenerator source(0, PIECE);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &source));
+
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+
+	std::vector<uint64_t> key_vec(PIECE*2);
+	std::vector<estuary::Slice> keys(PIECE*2);
+	for (unsigned i = 0; i < PIECE*2; i++) {
+		key_vec[i] = (i%2 == 0)? i/2 : i/2+PIECE;
+		keys[i] = {(const uint8_t*)&key_vec[i], sizeof(uint64_t)};
+	}
+	std::vector<std::string> out(PIECE*2);
+	std::vector<unsigned> miss(PIECE*2);
+
+	ASSERT_EQ(dict.batch_fetch(PIECE*2, keys.data(), out.data(), miss.data()), PIECE);
+	for (unsigned i = 0; i < PIECE; i++) {
+		ASSERT_EQ(miss[i]%2, 1U);
+	}
+	source.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = source.read();
+		auto& val = out[i*2];
+		ASSERT_EQ(val.size(), rec.val.len);
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+	}
+
+	ASSERT_EQ(dict.batch_fetch(3, keys.data(), out.data()), 2U);
+	ASSERT_EQ(dict.batch_fetch(0, keys.data(), out.data()), 0U);
+}
+
+TEST(Estuary, Peek) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "peek.es";
+
+	VariedValueGenerator input1(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &input1));
+
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+
+	estuary::Slice val;
+	estuary::Estuary::Ticket ticket;
+	input1.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input1.read();
+		ASSERT_TRUE(dict.peek(rec.key, val, ticket));
+		ASSERT_EQ(val.len, rec.val.len);
+		ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+		ASSERT_TRUE(dict.check(ticket));
+	}
+
+	VariedValueGenerator input2(0, PIECE, 10);
+	auto rec = input2.read();
+	ASSERT_TRUE(dict.peek(rec.key, val, ticket));
+	ASSERT_TRUE(dict.check(ticket));
+	ASSERT_TRUE(dict.update(rec.key, rec.val));
+	ASSERT_FALSE(dict.check(ticket));
+	ASSERT_TRUE(dict.peek(rec.key, val, ticket));
+	ASSERT_EQ(val.len, rec.val.len);
+	ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+	ASSERT_TRUE(dict.erase(rec.key));
+	ASSERT_FALSE(dict.check(ticket));
+	ASSERT_FALSE(dict.peek(rec.key, val, ticket));
+	ASSERT_FALSE(dict.check(estuary::Estuary::Ticket()));
+}
+
+TEST(Estuary, ParallelBuild) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "parallel.es";
+
+	auto config = CONFIG;
+	config.concurrency = 4;
+	VariedValueGenerator input1(0, PIECE/4, 5);
+	VariedValueGenerator input2(0, PIECE*3/4, 10);
+	ConcatReader source(input1, input2);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, config, &source));
+
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE*3/4);
+
+	std::string val;
+	input2.reset();
+	for (unsigned i = 0; i < PIECE*3/4; i++) {
+		auto rec = input2.read();
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(val.size(), rec.val.len);
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+	}
+
+	VariedValueGenerator input3(PIECE/2, PIECE/2, 5);
+	for (unsigned i = 0; i < PIECE/2; i++) {
+		auto rec = input3.read();
+		ASSERT_TRUE(dict.update(rec.key, rec.val));
+	}
+	input3.reset();
+	for (unsigned i = 0; i < PIECE/2; i++) {
+		auto rec = input3.read();
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(val.size(), rec.val.len);
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+	}
+	ASSERT_EQ(dict.item(), PIECE);
+}
+
+//whether some probe runs off the end of table, slots taken by linear probing don't depend on order
+static bool ProbeWrapped(const std::string& filename, uint64_t total, size_t total_entry) {
+	uint64_t seed = 0;
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	const auto ret = pread(fd, &seed, sizeof(seed), 8);	//after magic, features, writing and kv_limit
+	close(fd);
+	if (ret != sizeof(seed)) {
+		return false;
+	}
+	std::vector<unsigned> homes(total_entry, 0);
+	for (uint64_t i = 0; i < total; i++) {
+		homes[estuary::Hash((const uint8_t*)&i, sizeof(i), seed) % total_entry]++;
+	}
+	size_t carry = 0;
+	for (auto cnt : homes) {
+		carry += cnt;
+		if (carry != 0) {
+			carry--;
+		}
+	}
+	return carry != 0;
+}
+
+TEST(Estuary, ParallelBuildWrap) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "parallel-wrap.es";
+
+	constexpr unsigned TOTAL = PIECE * 4;
+	auto config = CONFIG;
+	config.item_limit = TOTAL;	//table is as full as possible
+	config.concurrency = 4;
+	unsigned wrapped = 0;
+	for (unsigned round = 0; round < 64 && wrapped < 4; round++) {
+		VariedValueGenerator input(0, TOTAL, 5);
+		ASSERT_TRUE(estuary::Estuary::Create(filename, config, &input));
+		auto dict = estuary::Estuary::Load(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.item(), TOTAL);
+		if (ProbeWrapped(filename, TOTAL, TOTAL*3/2)) {
+			wrapped++;
+		}
+		std::string val;
+		input.reset();
+		for (unsigned i = 0; i < TOTAL; i++) {
+			auto rec = input.read();
+			ASSERT_TRUE(dict.fetch(rec.key, val));
+			ASSERT_EQ(val.size(), rec.val.len);
+		}
+	}
+	ASSERT_GT(wrapped, 0U);
+}
+
+TEST(Estuary, SortedBuild) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "sorted.es";
+
+	auto config = CONFIG;
+	config.sort_memory = 16*1024;	//force spilling
+	VariedValueGenerator input1(0, PIECE/4, 5);
+	VariedValueGenerator input2(0, PIECE*3/4, 10);
+	ConcatReader source(input1, input2);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, config, &source));
+
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE*3/4);
+
+	std::string val;
+	input2.reset();
+	for (unsigned i = 0; i < PIECE*3/4; i++) {
+		auto rec = input2.read();
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(val.size(), rec.val.len);
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+	}
+
+	VariedValueGenerator input3(PIECE/2, PIECE/2, 5);
+	for (unsigned i = 0; i < PIECE/2; i++) {
+		auto rec = input3.read();
+		ASSERT_TRUE(dict.update(rec.key, rec.val));
+	}
+	input3.reset();
+	for (unsigned i = 0; i < PIECE/2; i++) {
+		auto rec = input3.read();
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(val.size(), rec.val.len);
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+	}
+	ASSERT_EQ(dict.item(), PIECE);
+
+	input2.reset();
+	for (unsigned i = 0; i < PIECE*3/4; i++) {
+		auto rec = input2.read();
+		ASSERT_TRUE(dict.erase(rec.key));
+	}
+	ASSERT_EQ(dict.item(), PIECE/4);
+}
+
+TEST(Estuary, BatchUpdate) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "batch-update.es";
+
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG));
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+
+	std::vector<uint64_t> key_vec(PIECE);
+	std::vector<estuary::Slice> keys(PIECE);
+	std::vector<estuary::Slice> vals(PIECE);
+	std::vector<unsigned> fail(PIECE);
+	std::string val_buf(UINT8_MAX+1, 'x');
+	//churn to trigger both sweeping and defragmentation
+	for (unsigned round = 0; round < 16; round++) {
+		for (unsigned i = 0; i < PIECE; i++) {
+			key_vec[i] = round*PIECE/2 + i;
+			keys[i] = {(const uint8_t*)&key_vec[i], sizeof(uint64_t)};
+			vals[i] = {(const uint8_t*)val_buf.data(), (key_vec[i]+round)%UINT8_MAX};
+		}
+		vals[1].len = UINT8_MAX+1;	//too long
+		ASSERT_EQ(dict.batch_update(PIECE, keys.data(), vals.data(), fail.data()), PIECE-1);
+		ASSERT_EQ(fail[0], 1U);
+		ASSERT_EQ(dict.item(), PIECE-1);
+
+		std::string val;
+		for (unsigned i = 0; i < PIECE; i++) {
+			ASSERT_EQ(dict.fetch(keys[i], val), i != 1);
+			if (i != 1) {
+				ASSERT_EQ(val.size(), vals[i].len);
+			}
+		}
+		ASSERT_EQ(dict.batch_erase(PIECE, keys.data(), fail.data()), PIECE-1);
+		ASSERT_EQ(fail[0], 1U);
+		ASSERT_EQ(dict.item(), 0U);
+	}
+
+	VariedValueGenerator source(0, PIECE);
+	ASSERT_EQ(dict.batch_update(source), PIECE);
+	ASSERT_EQ(dict.item(), PIECE);
+	ASSERT_EQ(dict.batch_erase(0, keys.data()), 0U);
+}
+
+TEST(Estuary, Compact) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "compact.es";
+
+	VariedValueGenerator source(0, PIECE);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &source));
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+
+	//punch holes everywhere, then let cursor wrap to the front
+	source.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = source.read();
+		if (i % 3 == 0) {
+			ASSERT_TRUE(dict.erase(rec.key));
+		}
+	}
+	VariedValueGenerator input1(0, PIECE, 9);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input1.read();
+		if (i % 3 == 1) {
+			ASSERT_TRUE(dict.update(rec.key, rec.val));
+		}
+	}
+	const auto free = dict.data_free();
+	unsigned step = 0;
+	while (!dict.compact(16)) {
+		step++;
+	}
+	ASSERT_GT(step, 1U);
+	ASSERT_TRUE(dict.compact(16));
+	ASSERT_EQ(dict.data_free(), free);
+
+	std::string val;
+	source.reset();
+	input1.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = source.read();
+		auto rec1 = input1.read();
+		if (i % 3 == 1) {
+			rec = rec1;
+		}
+		ASSERT_EQ(dict.fetch(rec.key, val), i % 3 != 0);
+		if (i % 3 != 0) {
+			ASSERT_EQ(val.size(), rec.val.len);
+			ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+		}
+	}
+	VariedValueGenerator input2(PIECE, PIECE/3, 7);
+	ASSERT_EQ(dict.batch_update(input2), PIECE/3);
+}
+
+TEST(Estuary, Sweep) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "sweep.es";
+
+	VariedValueGenerator source(0, PIECE/2);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &source));
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+
+	//stable keys should never be missed while others are churning
+	std::atomic<bool> quit(false);
+	std::atomic<unsigned> miss(0);
+	std::thread reader([&dict, &quit, &miss]() {
+		VariedValueGenerator input(0, PIECE/2);
+		std::string val;
+		while (!quit.load()) {
+			input.reset();
+			for (unsigned i = 0; i < PIECE/2; i++) {
+				auto rec = input.read();
+				if (!dict.fetch(rec.key, val)) {
+					miss++;
+				}
+			}
+		}
+	});
+
+	for (unsigned round = 0; round < 256; round++) {
+		VariedValueGenerator input(PIECE*(round+1), PIECE/4);
+		for (unsigned i = 0; i < PIECE/4; i++) {
+			auto rec = input.read();
+			ASSERT_TRUE(dict.update(rec.key, rec.val));
+		}
+		input.reset();
+		for (unsigned i = 0; i < PIECE/4; i++) {
+			auto rec = input.read();
+			ASSERT_TRUE(dict.erase(rec.key));
+		}
+	}
+	quit = true;
+	reader.join();
+	ASSERT_EQ(miss.load(), 0U);
+	ASSERT_EQ(dict.item(), PIECE/2);
+}
+
+TEST(Estuary, Grow) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "grow.es";
+
+	VariedValueGenerator input(0, PIECE);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &input));
+	{
+		auto dict = estuary::Estuary::Load(filename);
+		ASSERT_FALSE(!dict);
+		input.reset();
+		for (unsigned i = 0; i < PIECE; i += 3) {
+			ASSERT_TRUE(dict.erase(input.read().key));
+			input.read();
+			input.read();
+		}
+		ASSERT_FALSE(estuary::Estuary::Grow(filename, 50));	//in use
+	}
+
+	//the old file is intact if the new one cannot be built
+	const auto tmp = filename + ".grow";
+	rmdir(tmp.c_str());
+	ASSERT_EQ(mkdir(tmp.c_str(), 0755), 0);
+	ASSERT_FALSE(estuary::Estuary::Grow(filename, 50));
+	ASSERT_EQ(rmdir(tmp.c_str()), 0);
+	ASSERT_EQ(estuary::Estuary::Load(filename).item(), PIECE - (PIECE+2)/3);
+
+	estuary::Estuary::Config cfg;
+	ASSERT_TRUE(estuary::Estuary::Grow(filename, 50, &cfg));
+	ASSERT_GE(cfg.item_limit, CONFIG.item_limit*3/2);
+	ASSERT_NE(access(tmp.c_str(), F_OK), 0);
+	ASSERT_TRUE(estuary::Estuary::Extend(filename, 50));
+
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item_limit(), cfg.item_limit);
+	ASSERT_EQ(dict.item(), PIECE - (PIECE+2)/3);
+
+	std::string val;
+	input.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input.read();
+		if (i % 3 == 0) {
+			ASSERT_FALSE(dict.fetch(rec.key, val));
+		} else {
+			ASSERT_TRUE(dict.fetch(rec.key, val));
+			ASSERT_EQ(val.size(), rec.val.len);
+			ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+		}
+	}
+
+	VariedValueGenerator more(0, PIECE*3/2);
+	for (unsigned i = 0; i < PIECE*3/2; i++) {
+		auto rec = more.read();
+		ASSERT_TRUE(dict.update(rec.key, rec.val));
+	}
+	ASSERT_EQ(dict.item(), PIECE*3/2);
+	more.reset();
+	for (unsigned i = 0; i < PIECE*3/2; i++) {
+		auto rec = more.read();
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+	}
+}
+
+TEST(Estuary, LazyLoad) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "lazy.es";
+
+	VariedValueGenerator source(0, PIECE);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &source));
+
+	auto dict = estuary::Estuary::Load(filename, estuary::Estuary::LAZY);
+	ASSERT_FALSE(!dict);
+	ASSERT_LT(dict.warmup_progress(), 100U);
+	ASSERT_TRUE(!estuary::Estuary::Load(filename, estuary::Estuary::SHARED));	//exclusive
+
+	std::string val;
+	unsigned last = dict.warmup_progress();
+	source.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = source.read();
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+		if (i % 64 == 0 && !dict.warmup(4096)) {
+			ASSERT_GE(dict.warmup_progress(), last);
+			last = dict.warmup_progress();
+		}
+	}
+	while (!dict.warmup(4096));
+	ASSERT_EQ(dict.warmup_progress(), 100U);
+
+	dict = estuary::Estuary();
+	dict = estuary::Estuary::Load(filename, estuary::Estuary::MONOPOLY);
+	ASSERT_FALSE(!dict);
+	ASSERT_TRUE(dict.warmup(4096));
+	ASSERT_EQ(dict.warmup_progress(), 100U);
+}
+
+//in bytes
+static size_t ProcStatus(const char* field) {
+	auto fp = fopen("/proc/self/status", "r");
+	if (fp == nullptr) {
+		return 0;
+	}
+	char line[256];
+	size_t kb = 0;
+	while (fgets(line, sizeof(line), fp) != nullptr) {
+		if (strncmp(line, field, strlen(field)) == 0) {
+			kb = strtoull(line + strlen(field), nullptr, 10);
+			break;
+		}
+	}
+	fclose(fp);
+	return kb * 1024;
+}
+
+TEST(Estuary, TieredLoad) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "tiered.es";
+
+	VariedValueGenerator input1(0, PIECE, 5);
+	auto config = CONFIG;
+	config.item_limit = PIECE*4;	//room for updates without moving old records
+	ASSERT_TRUE(estuary::Estuary::Create(filename, config, &input1));
+
+	auto dict = estuary::Estuary::Load(filename, estuary::Estuary::TIERED);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE);
+
+	std::string val;
+	VariedValueGenerator input2(0, PIECE, 10);
+	//pages of the first half are left clean
+	auto updated = [](unsigned i) { return i % 2 == 0 && i >= PIECE/2; };
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		if (updated(i)) {
+			ASSERT_TRUE(dict.update(rec.key, rec.val));
+		}
+	}
+	//hot pages are pinned within budget
+	constexpr size_t BUDGET = 16*1024;
+	input2.reset();
+	for (unsigned i = 0; i < PIECE/8; i++) {
+		auto rec = input2.read();
+		for (unsigned j = 0; j < 64; j++) {
+			ASSERT_TRUE(dict.fetch(rec.key, val));
+		}
+	}
+	const auto locked = ProcStatus("VmLck:");
+	const auto anon = ProcStatus("RssAnon:");
+	const auto pinned = dict.promote(BUDGET);
+	ASSERT_GT(pinned, 0U);
+	ASSERT_LE(pinned, BUDGET);
+	//pinned in page cache without private copies
+	ASSERT_EQ(ProcStatus("VmLck:"), locked + pinned);
+	ASSERT_LT(ProcStatus("RssAnon:"), anon + pinned);
+	ASSERT_LE(dict.promote(BUDGET), BUDGET);
+	ASSERT_EQ(dict.promote(0), 0U);
+	ASSERT_EQ(ProcStatus("VmLck:"), locked);
+
+	input1.reset();
+	input2.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec1 = input1.read();
+		auto rec2 = input2.read();
+		auto& rec = updated(i)? rec2 : rec1;
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(val.size(), rec.val.len);
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+	}
+
+	//changes are private until dumped
+	const std::string filename2 = "tiered-dump.es";
+	ASSERT_TRUE(dict.dump(filename2));
+	dict = estuary::Estuary();
+	for (auto& name : {filename, filename2}) {
+		dict = estuary::Estuary::Load(name, estuary::Estuary::SHARED);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.item(), PIECE);
+		input1.reset();
+		input2.reset();
+		for (unsigned i = 0; i < PIECE; i++) {
+			auto rec1 = input1.read();
+			auto rec2 = input2.read();
+			auto& rec = updated(i) && name == filename2? rec2 : rec1;
+			ASSERT_TRUE(dict.fetch(rec.key, val));
+			ASSERT_EQ(val.size(), rec.val.len);
+			ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+		}
+	}
+}
+
+TEST(Estuary, Compress) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename1 = "raw.es";
+	const std::string filename2 = "compress.es";
+
+	auto config = CONFIG;
+	config.max_val_len = 1024;
+	config.avg_item_size = 256;
+	JsonGenerator input1(0, PIECE);
+	ASSERT_TRUE(estuary::Estuary::Create(filename1, config, &input1));
+	config.compress = true;
+	ASSERT_TRUE(estuary::Estuary::Create(filename2, config, &input1));
+
+	estuary::Estuary::Config ext_cfg;
+	ASSERT_TRUE(estuary::Estuary::Extend(filename2, 1, &ext_cfg));
+	ASSERT_TRUE(ext_cfg.compress);
+	ASSERT_EQ(ext_cfg.max_val_len, config.max_val_len);
+
+	auto raw = estuary::Estuary::Load(filename1, estuary::Estuary::SHARED);
+	auto dict = estuary::Estuary::Load(filename2);
+	ASSERT_FALSE(!raw);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.max_val_len(), config.max_val_len);
+	ASSERT_EQ(dict.item(), PIECE);
+	//most of data space is saved
+	const auto used1 = raw.data_free();
+	const auto used2 = dict.data_free();
+	ASSERT_GT(used2, used1);
+
+	std::string val;
+	estuary::Slice view;
+	estuary::Estuary::Ticket ticket;
+	input1.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input1.read();
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(val, std::string((const char*)rec.val.ptr, rec.val.len));
+		ASSERT_TRUE(dict.peek(rec.key, view, ticket));
+		ASSERT_EQ(std::string((const char*)view.ptr, view.len), val);
+		ASSERT_TRUE(dict.check(ticket));
+	}
+
+	JsonGenerator input2(0, PIECE, 1);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		if (i % 2 == 0) {
+			ASSERT_TRUE(dict.update(rec.key, rec.val));
+		} else {
+			ASSERT_TRUE(dict.update(rec.key, {}));
+		}
+	}
+	uint8_t big[1025] = {};
+	ASSERT_FALSE(dict.update(input2.read().key, {big, sizeof(big)}));
+
+	std::vector<uint64_t> ids(PIECE);
+	std::vector<estuary::Slice> keys(PIECE);
+	std::vector<std::string> vals(PIECE);
+	for (unsigned i = 0; i < PIECE; i++) {
+		ids[i] = i;
+		keys[i] = {(const uint8_t*)&ids[i], sizeof(uint64_t)};
+	}
+	ASSERT_EQ(dict.batch_fetch(PIECE, keys.data(), vals.data()), PIECE);
+
+	const std::string filename3 = "compress-dump.es";
+	ASSERT_TRUE(dict.dump(filename3));
+	dict = estuary::Estuary::Load(filename3, estuary::Estuary::SHARED);
+	ASSERT_FALSE(!dict);
+	input2.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		if (i % 2 == 0) {
+			ASSERT_EQ(val, std::string((const char*)rec.val.ptr, rec.val.len));
+		} else {
+			ASSERT_TRUE(val.empty());
+		}
+		ASSERT_EQ(vals[i], val);
+	}
+}
+
+TEST(Estuary, Delta) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "delta-src.es";
+	const std::string replica = "delta-dst.es";
+	const std::string delta = "delta.esd";
+
+	VariedValueGenerator input1(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &input1));
+	auto dict = estuary::Estuary::Load(filename, estuary::Estuary::MONOPOLY);
+	ASSERT_FALSE(!dict);
+	ASSERT_TRUE(dict.dump(replica));
+
+	auto file_size = [](const std::string& path)->size_t {
+		struct stat st;
+		return stat(path.c_str(), &st) == 0? st.st_size : 0;
+	};
+	auto verify = [&dict, &replica]() {
+		auto copy = estuary::Estuary::Load(replica, estuary::Estuary::SHARED);
+		ASSERT_FALSE(!copy);
+		ASSERT_EQ(copy.item(), dict.item());
+		ASSERT_EQ(copy.data_free(), dict.data_free());
+		std::string val1, val2;
+		for (uint64_t i = 0; i < PIECE*2; i++) {
+			estuary::Slice key = {(const uint8_t*)&i, sizeof(i)};
+			const bool hit = dict.fetch(key, val1);
+			ASSERT_EQ(copy.fetch(key, val2), hit);
+			if (hit) {
+				ASSERT_EQ(val1, val2);
+			}
+		}
+	};
+
+	//nothing but meta
+	ASSERT_TRUE(dict.dump_delta(delta));
+	ASSERT_TRUE(estuary::Estuary::ApplyDelta(replica, delta));
+	verify();
+
+	VariedValueGenerator input2(0, PIECE/50, 10);
+	for (unsigned i = 0; i < PIECE/50; i++) {
+		auto rec = input2.read();
+		ASSERT_TRUE(dict.update(rec.key, rec.val));
+	}
+	ASSERT_TRUE(dict.dump_delta(delta));
+	ASSERT_LT(file_size(delta), file_size(filename) / 4);
+	ASSERT_TRUE(estuary::Estuary::ApplyDelta(replica, delta));
+	verify();
+
+	//erasing, sweeping and defragmentation
+	for (uint64_t i = 0; i < PIECE; i += 2) {
+		ASSERT_TRUE(dict.erase({(const uint8_t*)&i, sizeof(i)}));
+	}
+	VariedValueGenerator input3(PIECE, PIECE/2, 20);
+	for (unsigned i = 0; i < PIECE/2; i++) {
+		auto rec = input3.read();
+		ASSERT_TRUE(dict.update(rec.key, rec.val));
+	}
+	while (!dict.compact(64));
+	ASSERT_TRUE(dict.dump_delta(delta));
+	ASSERT_TRUE(estuary::Estuary::ApplyDelta(replica, delta));
+	verify();
+	//applied one is stale
+	ASSERT_FALSE(estuary::Estuary::ApplyDelta(replica, delta));
+
+	//deltas should be applied in order without skipping
+	const std::string delta2 = "delta2.esd";
+	uint64_t key = 1;
+	ASSERT_TRUE(dict.erase({(const uint8_t*)&key, sizeof(key)}));
+	ASSERT_TRUE(dict.dump_delta(delta));
+	key = 3;
+	ASSERT_TRUE(dict.erase({(const uint8_t*)&key, sizeof(key)}));
+	ASSERT_TRUE(dict.dump_delta(delta2));
+	ASSERT_FALSE(estuary::Estuary::ApplyDelta(replica, delta2));
+	ASSERT_TRUE(estuary::Estuary::ApplyDelta(replica, delta));
+	ASSERT_TRUE(estuary::Estuary::ApplyDelta(replica, delta2));
+	verify();
+
+	//changes of other writers are unknown in SHARED mode
+	auto shared = estuary::Estuary::Load(replica, estuary::Estuary::SHARED);
+	ASSERT_FALSE(!shared);
+	ASSERT_FALSE(shared.dump_delta(delta));
+	shared = estuary::Estuary();
+
+	//replica of another base is refused
+	const std::string other = "delta-other.es";
+	ASSERT_TRUE(estuary::Estuary::Create(other, CONFIG, &input1));
+	ASSERT_FALSE(estuary::Estuary::ApplyDelta(other, delta));
+}
+
+TEST(Estuary, WriteAheadLog) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "wal.es";
+	const std::string log = "wal.log";
+	unlink(log.c_str());
+
+	VariedValueGenerator input1(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &input1));
+	ASSERT_TRUE(!estuary::Estuary::Load(filename, log, estuary::Estuary::MONOPOLY));
+
+	auto dict = estuary::Estuary::Load(filename, log);
+	ASSERT_FALSE(!dict);
+	VariedValueGenerator input2(0, PIECE, 10);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		if (i % 3 == 0) {
+			ASSERT_TRUE(dict.update(rec.key, rec.val));
+		} else if (i % 3 == 1) {
+			ASSERT_TRUE(dict.erase(rec.key));
+		}
+	}
+	ASSERT_TRUE(dict.sync());
+
+	auto verify = [&input1, &input2](const estuary::Estuary& dict) {
+		ASSERT_EQ(dict.item(), PIECE - PIECE/3);
+		std::string val;
+		input1.reset();
+		input2.reset();
+		for (unsigned i = 0; i < PIECE; i++) {
+			auto rec1 = input1.read();
+			auto rec2 = input2.read();
+			if (i % 3 == 1) {
+				ASSERT_FALSE(dict.fetch(rec1.key, val));
+				continue;
+			}
+			auto& rec = i % 3 == 0? rec2 : rec1;
+			ASSERT_TRUE(dict.fetch(rec.key, val));
+			ASSERT_EQ(val.size(), rec.val.len);
+			ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+		}
+	};
+
+	//base file is untouched, changes come back by replaying
+	ASSERT_TRUE(!estuary::Estuary::Load(filename, estuary::Estuary::MONOPOLY));
+	dict = estuary::Estuary();
+	dict = estuary::Estuary::Load(filename, estuary::Estuary::SHARED);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE);
+	dict = estuary::Estuary();
+	dict = estuary::Estuary::Load(filename, log, estuary::Estuary::TIERED);
+	ASSERT_FALSE(!dict);
+	verify(dict);
+
+	//broken tail is dropped
+	dict = estuary::Estuary();
+	auto fd = open(log.c_str(), O_WRONLY|O_APPEND);
+	ASSERT_GE(fd, 0);
+	const uint8_t junk[20] = {1, 2, 3};
+	ASSERT_EQ(write(fd, junk, sizeof(junk)), (ssize_t)sizeof(junk));
+	close(fd);
+	dict = estuary::Estuary::Load(filename, log);
+	ASSERT_FALSE(!dict);
+	verify(dict);
+
+	ASSERT_TRUE(dict.checkpoint(filename));
+	struct stat st;
+	ASSERT_EQ(stat(log.c_str(), &st), 0);
+	ASSERT_EQ(st.st_size, 0);
+	//the new base file is still held by the writer
+	ASSERT_TRUE(!estuary::Estuary::Load(filename, estuary::Estuary::MONOPOLY));
+	dict = estuary::Estuary();
+	dict = estuary::Estuary::Load(filename, estuary::Estuary::SHARED);
+	ASSERT_FALSE(!dict);
+	verify(dict);
+	dict = estuary::Estuary();
+	dict = estuary::Estuary::Load(filename, log);
+	ASSERT_FALSE(!dict);
+	verify(dict);
+	dict = estuary::Estuary();
+
+	//log is cut back to synced part when writing fails, and writes are refused
+	const auto pid = fork();
+	ASSERT_GE(pid, 0);
+	if (pid == 0) {
+		auto child = estuary::Estuary::Load(filename, log);
+		const std::string big(200, 'x');
+		uint64_t key = 0;
+		bool ok = !!child && child.update({(const uint8_t*)&key, sizeof(key)}, {(const uint8_t*)"synced", 6})
+			&& child.sync();
+		signal(SIGXFSZ, SIG_IGN);
+		struct rlimit limit = {4096, RLIM_INFINITY};
+		ok = ok && setrlimit(RLIMIT_FSIZE, &limit) == 0;
+		for (key = 1; ok && child.update({(const uint8_t*)&key, sizeof(key)}, {(const uint8_t*)big.data(), big.size()}); key++) {
+			child.sync();
+		}
+		key = 0;
+		ok = ok && !child.sync() && !child.erase({(const uint8_t*)&key, sizeof(key)});
+		limit = {RLIM_INFINITY, RLIM_INFINITY};
+		ok = ok && setrlimit(RLIMIT_FSIZE, &limit) == 0;
+		//checkpoint makes everything durable again
+		ok = ok && child.checkpoint(filename) && child.erase({(const uint8_t*)&key, sizeof(key)}) && child.sync();
+		_exit(ok? 0 : 1);
+	}
+	int status = 0;
+	ASSERT_EQ(waitpid(pid, &status, 0), pid);
+	ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	dict = estuary::Estuary::Load(filename, log);
+	ASSERT_FALSE(!dict);
+	std::string val;
+	uint64_t key = 0;
+	ASSERT_FALSE(dict.fetch({(const uint8_t*)&key, sizeof(key)}, val));
+	key = 1;
+	ASSERT_TRUE(dict.fetch({(const uint8_t*)&key, sizeof(key)}, val));
+	ASSERT_EQ(val.size(), 200U);
+}
+
+TEST(Estuary, ReplicatedLoad) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "replicated.es";
+
+	VariedValueGenerator input1(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &input1));
+	auto dict = estuary::Estuary::Load(filename, estuary::Estuary::REPLICATED);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE);
+
+	//readers on any node see updates soon
+	std::atomic<bool> quit = {false};
+	std::vector<std::thread> readers;
+	for (unsigned t = 0; t < 4; t++) {
+		readers.emplace_back([&dict, &quit]() {
+			std::string val;
+			while (!quit.load()) {
+				for (uint64_t i = 0; i < PIECE; i++) {
+					if (dict.fetch({(const uint8_t*)&i, sizeof(i)}, val) && !val.empty()) {
+						ASSERT_EQ((uint8_t)val.back(), (uint8_t)val.size());
+					}
+				}
+			}
+		});
+	}
+	VariedValueGenerator input2(0, PIECE, 10);
+	for (unsigned round = 0; round < 4; round++) {
+		input2.reset();
+		for (unsigned i = 0; i < PIECE; i++) {
+			auto rec = input2.read();
+			if (i % 2 == round % 2) {
+				ASSERT_TRUE(dict.erase(rec.key));
+			} else {
+				ASSERT_TRUE(dict.update(rec.key, rec.val));
+			}
+		}
+	}
+	quit.store(true);
+	for (auto& t : readers) {
+		t.join();
+	}
+
+	ASSERT_EQ(dict.item(), PIECE/2);
+	std::string val;
+	estuary::Slice view;
+	estuary::Estuary::Ticket ticket;
+	input2.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		if (i % 2 == 0) {
+			ASSERT_TRUE(dict.fetch(rec.key, val));
+			ASSERT_EQ(val.size(), rec.val.len);
+			ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+			ASSERT_TRUE(dict.peek(rec.key, view, ticket));
+			ASSERT_TRUE(dict.check(ticket));
+		} else {
+			ASSERT_FALSE(dict.fetch(rec.key, val));
+		}
+	}
+}
+
+TEST(Estuary, Statistics) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "stats.es";
+
+	VariedValueGenerator input1(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &input1));
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+
+	const auto base = estuary::Stats();
+	std::string val;
+	for (uint64_t i = 0; i < PIECE*2; i++) {
+		ASSERT_EQ(dict.fetch({(const uint8_t*)&i, sizeof(i)}, val), i < PIECE);
+	}
+	VariedValueGenerator input2(0, PIECE, 10);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		ASSERT_TRUE(dict.update(rec.key, rec.val));
+	}
+	const auto stats = estuary::Stats() - base;
+	if (!stats.enabled) {
+		ASSERT_EQ(stats.counter[estuary::Statistics::FETCH], 0U);
+		ASSERT_EQ(stats.count(estuary::Statistics::PROBE_LENGTH), 0U);
+		return;
+	}
+	ASSERT_EQ(stats.counter[estuary::Statistics::FETCH] - stats.counter[estuary::Statistics::FETCH_RETRY], PIECE*2);
+	ASSERT_EQ(stats.counter[estuary::Statistics::FETCH_MISS], PIECE);
+	ASSERT_EQ(stats.count(estuary::Statistics::PROBE_LENGTH), stats.counter[estuary::Statistics::FETCH]);
+	ASSERT_EQ(stats.counter[estuary::Statistics::UPDATE], PIECE);
+	ASSERT_EQ(stats.count(estuary::Statistics::UPDATE_NS), PIECE);
+	ASSERT_GT(stats.percentile(estuary::Statistics::UPDATE_NS, 0.5), 0U);
+	ASSERT_LE(stats.percentile(estuary::Statistics::PROBE_LENGTH, 0.5),
+		stats.percentile(estuary::Statistics::PROBE_LENGTH, 0.99));
+}
+
+TEST(Estuary, Inspect) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename1 = "inspect.es";
+	const std::string filename2 = "inspect-dump.es";
+
+	VariedValueGenerator input1(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename1, CONFIG, &input1));
+	estuary::Estuary::Layout layout;
+	ASSERT_TRUE(estuary::Estuary::Inspect(filename1, layout, 4));
+	ASSERT_EQ(layout.item, PIECE);
+	ASSERT_EQ(layout.deleted_entry, 0U);
+
+	auto dict = estuary::Estuary::Load(filename1);
+	ASSERT_FALSE(!dict);
+	VariedValueGenerator input2(0, PIECE, 10);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		if (i % 3 == 0) {
+			ASSERT_TRUE(dict.erase(rec.key));
+		} else {
+			ASSERT_TRUE(dict.update(rec.key, rec.val));
+		}
+	}
+	ASSERT_TRUE(dict.dump(filename2));
+
+	for (unsigned n : {1U, 3U, 8U}) {
+		ASSERT_TRUE(estuary::Estuary::Inspect(filename2, layout, n));
+		ASSERT_EQ(layout.item, dict.item());
+		ASSERT_EQ(layout.config.item_limit, dict.item_limit());
+		ASSERT_GE(layout.free_block * 8, dict.data_free());
+		ASSERT_GT(layout.deleted_entry, 0U);
+		ASSERT_EQ(layout.total_entry, layout.clean_entry + layout.deleted_entry + layout.item);
+		size_t probed = 0;
+		size_t sections = 0;
+		for (unsigned i = 0; i < estuary::Estuary::Layout::BUCKETS; i++) {
+			probed += layout.probe_distance[i];
+			sections += layout.free_section_size[i];
+		}
+		ASSERT_EQ(probed, layout.item);
+		ASSERT_EQ(sections, layout.free_section);
+		ASSERT_GT(layout.free_section, 0U);
+		ASSERT_LE(layout.max_free_section, layout.free_block);
+		ASSERT_GT(layout.room, 0U);
+		ASSERT_LE(layout.room, layout.config.item_limit - layout.item);
+	}
+
+	//file held by a live instance
+	ASSERT_TRUE(estuary::Estuary::Inspect(filename1, layout));
+	ASSERT_EQ(layout.item, dict.item());
+}
+
+TEST(Estuary, Scan) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "scan.es";
+
+	VariedValueGenerator input1(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &input1));
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+	VariedValueGenerator input2(0, PIECE, 10);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		if (i % 4 == 0) {
+			ASSERT_TRUE(dict.erase(rec.key));
+		} else if (i % 4 == 1) {
+			ASSERT_TRUE(dict.update(rec.key, rec.val));
+		}
+	}
+
+	for (unsigned total : {1U, 3U, 16U}) {
+		std::vector<unsigned> seen(PIECE, 0);
+		size_t cnt = 0;
+		for (unsigned piece = 0; piece < total; piece++) {
+			auto cursor = dict.scan(piece, total);
+			std::string key, val;
+			while (cursor.next(key, val)) {
+				ASSERT_EQ(key.size(), sizeof(uint64_t));
+				const auto id = *(const uint64_t*)key.data();
+				ASSERT_LT(id, PIECE);
+				ASSERT_NE(id % 4, 0U);
+				const uint8_t len = id + (id % 4 == 1? 10 : 5);
+				ASSERT_EQ(val, std::string(len, (char)len));
+				seen[id]++;
+				cnt++;
+			}
+		}
+		ASSERT_EQ(cnt, dict.item());
+		for (unsigned i = 0; i < PIECE; i++) {
+			ASSERT_EQ(seen[i], i % 4 == 0? 0U : 1U);
+		}
+	}
+	auto cursor = dict.scan(3, 3);
+	std::string key, val;
+	ASSERT_FALSE(cursor.next(key, val));
+
+	//records are moved by writers between chunks
+	constexpr unsigned BIG_PIECE = PIECE * 20;
+	auto config = CONFIG;
+	config.item_limit = BIG_PIECE;
+	VariedValueGenerator input3(0, BIG_PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create("scan-big.es", config, &input3));
+	dict = estuary::Estuary::Load("scan-big.es");
+	ASSERT_FALSE(!dict);
+	std::atomic<bool> quit = {false};
+	std::thread writer([&dict, &quit]() {
+		VariedValueGenerator input(0, BIG_PIECE, 10);
+		while (!quit.load()) {
+			input.reset();
+			for (unsigned i = 0; i < BIG_PIECE && !quit.load(); i++) {
+				auto rec = input.read();
+				ASSERT_TRUE(dict.update(rec.key, rec.val));
+			}
+		}
+	});
+	for (unsigned round = 0; round < 4; round++) {
+		size_t cnt = 0;
+		cursor = dict.scan();
+		while (cursor.next(key, val)) {
+			ASSERT_EQ(key.size(), sizeof(uint64_t));
+			const auto id = *(const uint64_t*)key.data();
+			ASSERT_LT(id, BIG_PIECE);
+			const uint8_t len = val.size();
+			ASSERT_TRUE(len == (uint8_t)(id + 5) || len == (uint8_t)(id + 10));
+			ASSERT_EQ(val, std::string(len, (char)len));
+			cnt++;
+		}
+		ASSERT_GT(cnt, 0U);
+	}
+	quit.store(true);
+	writer.join();
+
+	//pieces start far beyond the first records
+	std::vector<unsigned> seen(BIG_PIECE, 0);
+	for (unsigned piece = 0; piece < 7; piece++) {
+		cursor = dict.scan(piece, 7);
+		while (cursor.next(key, val)) {
+			const auto id = *(const uint64_t*)key.data();
+			ASSERT_LT(id, BIG_PIECE);
+			seen[id]++;
+		}
+	}
+	for (unsigned i = 0; i < BIG_PIECE; i++) {
+		ASSERT_EQ(seen[i], 1U);
+	}
+}
+
+TEST(Estuary, AsyncFetch) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "async.es";
+
+	VariedValueGenerator input1(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &input1));
+
+	auto check = [](const estuary::Estuary& dict, unsigned shift) {
+		estuary::Estuary::AsyncFetcher fetcher(dict, 16);
+		ASSERT_FALSE(!fetcher);
+		std::vector<int> result(PIECE*2, -1);
+		VariedValueGenerator input(0, PIECE*2, shift);
+		for (unsigned i = 0; i < PIECE*2; i++) {
+			auto rec = input.read();
+			std::string expected((const char*)rec.val.ptr, rec.val.len);
+			auto done = [&result, i, expected](bool found, estuary::Slice val) {
+				result[i] = found && expected == std::string((const char*)val.ptr, val.len);
+			};
+			while (!fetcher.submit(rec.key, done)) {
+				ASSERT_EQ(fetcher.pending(), 16U);
+				fetcher.poll(true);
+			}
+		}
+		while (fetcher.pending() != 0) {
+			fetcher.poll(true);
+		}
+		for (unsigned i = 0; i < PIECE*2; i++) {
+			ASSERT_EQ(result[i], i < PIECE? 1 : 0);
+		}
+	};
+
+	for (auto policy : {estuary::Estuary::SHARED, estuary::Estuary::LAZY, estuary::Estuary::COPY_DATA}) {
+		auto dict = estuary::Estuary::Load(filename, policy);
+		ASSERT_FALSE(!dict);
+		check(dict, 5);
+	}
+
+	//records written after loading are not in file
+	auto dict = estuary::Estuary::Load(filename, estuary::Estuary::TIERED);
+	ASSERT_FALSE(!dict);
+	VariedValueGenerator input2(0, PIECE, 10);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		ASSERT_TRUE(dict.update(rec.key, rec.val));
+	}
+	check(dict, 10);
+	dict = estuary::Estuary();
+
+	//long records are read twice, while being updated by a writer
+	auto config = CONFIG;
+	config.max_val_len = 4000;
+	config.avg_item_size = 2000;
+	const std::string filename2 = "async-long.es";
+	VariedValueGenerator input3(0, 0);
+	ASSERT_TRUE(estuary::Estuary::Create(filename2, config, &input3));
+	dict = estuary::Estuary::Load(filename2);
+	ASSERT_FALSE(!dict);
+	auto long_val = [](uint64_t id, unsigned round) {
+		return std::string(1000 + id % 3000, (char)(id + round));
+	};
+	for (uint64_t i = 0; i < PIECE; i++) {
+		const auto val = long_val(i, 0);
+		ASSERT_TRUE(dict.update({(const uint8_t*)&i, sizeof(i)}, {(const uint8_t*)val.data(), val.size()}));
+	}
+	std::atomic<bool> quit = {false};
+	std::thread writer([&dict, &quit, &long_val]() {
+		for (unsigned round = 1; !quit.load(); round = round % 2 + 1) {
+			for (uint64_t i = 0; i < PIECE && !quit.load(); i += 2) {
+				const auto val = long_val(i, round);
+				ASSERT_TRUE(dict.update({(const uint8_t*)&i, sizeof(i)}, {(const uint8_t*)val.data(), val.size()}));
+			}
+		}
+	});
+	estuary::Estuary::AsyncFetcher fetcher(dict);
+	unsigned good = 0;
+	for (unsigned k = 0; k < 5; k++) {
+		for (uint64_t i = 0; i < PIECE; i++) {
+			auto done = [&good, &long_val, i](bool found, estuary::Slice val) {
+				const std::string got((const char*)val.ptr, val.len);
+				good += found && (got == long_val(i, 0) || got == long_val(i, 1) || got == long_val(i, 2));
+			};
+			while (!fetcher.submit({(const uint8_t*)&i, sizeof(i)}, done)) {
+				fetcher.poll(true);
+			}
+		}
+		while (fetcher.pending() != 0) {
+			fetcher.poll(true);
+		}
+	}
+	quit.store(true);
+	writer.join();
+	ASSERT_EQ(good, PIECE*5);
+}
+
+TEST(Estuary, Expiration) {
+	estuary::Logger::Bind(nullptr);
+	const uint32_t now = time(nullptr);
+	//ids of i%3==0 are expired, i%3==1 never expire, i%3==2 expire an hour later
+	class ExpiringGenerator : public estuary::IDataReader {
+	public:
+		ExpiringGenerator(uint32_t now) : m_input(0, PIECE, 5), m_now(now) {}
+		void reset() override { m_input.reset(); m_id = 0; }
+		size_t total() override { return PIECE; }
+		Record read() override {
+			auto rec = m_input.read();
+			rec.expire = m_id % 3 == 0? m_now - 1 : (m_id % 3 == 1? 0 : m_now + 3600);
+			m_id++;
+			return rec;
+		}
+	private:
+		VariedValueGenerator m_input;
+		const uint32_t m_now;
+		unsigned m_id = 0;
+	};
+
+	for (bool compress : {false, true}) {
+		const std::string filename = compress? "expire-compress.es" : "expire.es";
+		auto config = CONFIG;
+		config.expiration = true;
+		config.compress = compress;
+		ExpiringGenerator input1(now);
+		ASSERT_TRUE(estuary::Estuary::Create(filename, config, &input1));
+		estuary::Estuary::Config ext_cfg;
+		ASSERT_TRUE(estuary::Estuary::Extend(filename, 1, &ext_cfg));
+		ASSERT_TRUE(ext_cfg.expiration);
+		ASSERT_EQ(ext_cfg.max_val_len, config.max_val_len);
+
+		auto dict = estuary::Estuary::Load(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.max_val_len(), config.max_val_len);
+		ASSERT_EQ(dict.item(), PIECE);
+
+		std::string val;
+		estuary::Slice view;
+		estuary::Estuary::Ticket ticket;
+		std::vector<uint64_t> ids(PIECE);
+		std::vector<estuary::Slice> keys(PIECE);
+		std::vector<std::string> vals(PIECE);
+		VariedValueGenerator input2(0, PIECE, 5);
+		for (unsigned i = 0; i < PIECE; i++) {
+			auto rec = input2.read();
+			ids[i] = i;
+			keys[i] = {(const uint8_t*)&ids[i], sizeof(uint64_t)};
+			if (i % 3 == 0) {
+				ASSERT_FALSE(dict.fetch(rec.key, val));
+				ASSERT_FALSE(dict.peek(rec.key, view, ticket));
+				continue;
+			}
+			ASSERT_TRUE(dict.fetch(rec.key, val));
+			ASSERT_EQ(val, std::string((const char*)rec.val.ptr, rec.val.len));
+			ASSERT_TRUE(dict.peek(rec.key, view, ticket));
+			ASSERT_EQ(std::string((const char*)view.ptr, view.len), val);
+		}
+		std::vector<unsigned> miss(PIECE);
+		ASSERT_EQ(dict.batch_fetch(PIECE, keys.data(), vals.data(), miss.data()), PIECE - (PIECE+2)/3);
+		for (unsigned i = 0; i < (PIECE+2)/3; i++) {
+			ASSERT_EQ(miss[i] % 3, 0U);
+		}
+		size_t cnt = 0;
+		auto cursor = dict.scan();
+		std::string key;
+		while (cursor.next(key, val)) {
+			const auto id = *(const uint64_t*)key.data();
+			ASSERT_NE(id % 3, 0U);
+			ASSERT_EQ(val, vals[id]);
+			cnt++;
+		}
+		ASSERT_EQ(cnt, PIECE - (PIECE+2)/3);
+		estuary::Estuary::AsyncFetcher fetcher(dict);
+		unsigned hit = 0;
+		for (unsigned i = 0; i < PIECE; i++) {
+			while (!fetcher.submit(keys[i], [&hit](bool found, estuary::Slice) { hit += found; })) {
+				fetcher.poll(true);
+			}
+		}
+		while (fetcher.pending() != 0) {
+			fetcher.poll(true);
+		}
+		ASSERT_EQ(hit, PIECE - (PIECE+2)/3);
+
+		ASSERT_TRUE(dict.update(keys[1], {}, now - 1));
+		ASSERT_FALSE(dict.fetch(keys[1], val));
+		ASSERT_TRUE(dict.update(keys[1], {(const uint8_t*)vals[1].data(), vals[1].size()}));
+		ASSERT_TRUE(dict.fetch(keys[1], val));
+
+		//expired records are reclaimed by defragmentation without erasing
+		for (unsigned round = 0; round < 64 && dict.item() > PIECE - (PIECE+2)/3; round++) {
+			for (unsigned i = 1; i < PIECE; i += 3) {
+				const std::string neo(vals[i].size(), (char)round);
+				ASSERT_TRUE(dict.update(keys[i], {(const uint8_t*)neo.data(), neo.size()}));
+			}
+		}
+		ASSERT_EQ(dict.item(), PIECE - (PIECE+2)/3);
+		for (unsigned i = 0; i < PIECE; i++) {
+			ASSERT_EQ(dict.fetch(keys[i], val), i % 3 != 0);
+		}
+	}
+
+	VariedValueGenerator input3(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create("expire-none.es", CONFIG, &input3));
+	auto dict = estuary::Estuary::Load("expire-none.es");
+	ASSERT_FALSE(!dict);
+	input3.reset();
+	auto rec = input3.read();
+	ASSERT_FALSE(dict.update(rec.key, rec.val, now + 3600));
+	ASSERT_TRUE(dict.update(rec.key, rec.val, 0));
+
+	//expire times survive in log
+	const std::string log = "expire.log";
+	unlink(log.c_str());
+	auto config = CONFIG;
+	config.expiration = true;
+	ASSERT_TRUE(estuary::Estuary::Create("expire-wal.es", config, &input3));
+	dict = estuary::Estuary::Load("expire-wal.es", log);
+	ASSERT_FALSE(!dict);
+	input3.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		rec = input3.read();
+		ASSERT_TRUE(dict.update(rec.key, rec.val, i % 2 == 0? now - 1 : now + 3600));
+	}
+	ASSERT_TRUE(dict.sync());
+	dict = estuary::Estuary();
+	dict = estuary::Estuary::Load("expire-wal.es", log);
+	ASSERT_FALSE(!dict);
+	input3.reset();
+	std::string val;
+	for (unsigned i = 0; i < PIECE; i++) {
+		rec = input3.read();
+		ASSERT_EQ(dict.fetch(rec.key, val), i % 2 != 0);
+	}
+}
+
+TEST(Estuary, Pool) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "pool.es";
+	const std::string replica = "pool-replica.es";
+	const std::string delta = "pool.delta";
+	auto config = CONFIG;
+	config.pool = true;
+	VariedValueGenerator input(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, config, &input));
+	estuary::Estuary::Config ext_cfg;
+	ASSERT_TRUE(estuary::Estuary::Extend(filename, 1, &ext_cfg));
+	ASSERT_TRUE(ext_cfg.pool);
+
+	auto dict = estuary::Estuary::Load(filename, estuary::Estuary::MONOPOLY);
+	ASSERT_FALSE(!dict);
+	ASSERT_TRUE(dict.dump(replica));
+	std::vector<std::string> vals(PIECE);
+	std::vector<bool> present(PIECE, true);
+	input.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input.read();
+		vals[i].assign((const char*)rec.val.ptr, rec.val.len);
+	}
+	auto verify = [&vals, &present](const estuary::Estuary& dict) {
+		std::string val;
+		for (uint64_t i = 0; i < PIECE; i++) {
+			ASSERT_EQ(dict.fetch({(const uint8_t*)&i, sizeof(i)}, val), present[i]);
+			if (present[i]) {
+				ASSERT_EQ(val, vals[i]);
+			}
+		}
+	};
+
+	//random sizes leave slots of all classes behind
+	std::mt19937 rnd(1);
+	auto mutate = [&rnd, &vals, &present](const estuary::Estuary& dict, unsigned rounds) {
+		for (unsigned round = 0; round < rounds; round++) {
+			const uint64_t id = rnd() % PIECE;
+			estuary::Slice key = {(const uint8_t*)&id, sizeof(id)};
+			if (rnd() % 8 == 0) {
+				ASSERT_EQ(dict.erase(key), (bool)present[id]);
+				present[id] = false;
+				continue;
+			}
+			vals[id].assign(rnd() % 200, (char)round);
+			ASSERT_TRUE(dict.update(key, {(const uint8_t*)vals[id].data(), vals[id].size()}));
+			present[id] = true;
+		}
+	};
+	const auto base = estuary::Stats();
+	for (unsigned i = 0; i < 10; i++) {	//slots are reused only after a while
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		mutate(dict, PIECE*2);
+	}
+	verify(dict);
+	const auto stats = estuary::Stats() - base;
+	if (stats.enabled) {	//most of updates avoid defragmentation
+		ASSERT_GT(stats.counter[estuary::Statistics::POOL_REUSE]*2, stats.counter[estuary::Statistics::UPDATE]);
+	}
+
+	const std::string snapshot = "pool-snapshot.es";
+	ASSERT_TRUE(dict.dump(snapshot));
+	estuary::Estuary::Layout layout;
+	ASSERT_TRUE(estuary::Estuary::Inspect(snapshot, layout));
+	ASSERT_TRUE(layout.config.pool);
+	ASSERT_GT(layout.pooled_block, 0U);
+	ASSERT_LE(layout.pooled_block, layout.free_block);
+
+	//free lists are shipped with delta and still work in replica
+	ASSERT_TRUE(dict.dump_delta(delta));
+	ASSERT_TRUE(estuary::Estuary::ApplyDelta(replica, delta));
+	auto copy = estuary::Estuary::Load(replica, estuary::Estuary::COPY_DATA);
+	ASSERT_FALSE(!copy);
+	ASSERT_EQ(copy.item(), dict.item());
+	ASSERT_EQ(copy.data_free(), dict.data_free());
+	verify(copy);
+	auto saved_vals = vals;
+	auto saved_present = present;
+	const auto seed = rnd;
+	mutate(copy, PIECE*5);
+	verify(copy);
+
+	//the same after reloading and compacting
+	vals = saved_vals;
+	present = saved_present;
+	rnd = seed;
+	dict = estuary::Estuary();
+	dict = estuary::Estuary::Load(filename, estuary::Estuary::TIERED);
+	ASSERT_FALSE(!dict);
+	mutate(dict, PIECE*5);
+	while (!dict.compact(64));
+	verify(dict);
+	ASSERT_EQ(dict.data_free(), copy.data_free());
+}
+
+TEST(Estuary, PoolDelay) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "pool-delay.es";
+	auto config = CONFIG;
+	config.pool = true;
+	VariedValueGenerator input(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, config, &input));
+	auto dict = estuary::Estuary::Load(filename);
+	ASSERT_FALSE(!dict);
+
+	//the old slot comes back with the old content if it's reused at once
+	const uint64_t id = 7;
+	const estuary::Slice key = {(const uint8_t*)&id, sizeof(id)};
+	estuary::Slice out;
+	estuary::Estuary::Ticket ticket;
+	ASSERT_TRUE(dict.peek(key, out, ticket));
+	const std::string old_val((const char*)out.ptr, out.len);
+	const std::string new_val(100, 'x');
+	ASSERT_TRUE(dict.update(key, {(const uint8_t*)new_val.data(), new_val.size()}));
+	ASSERT_TRUE(dict.update(key, {(const uint8_t*)old_val.data(), old_val.size()}));
+	ASSERT_FALSE(dict.check(ticket));
+	std::string val;
+	ASSERT_TRUE(dict.fetch(key, val));
+	ASSERT_EQ(val, old_val);
+}
+
+TEST(Estuary, ReadOnly) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "readonly.es";
+	unlink((filename + ".readers").c_str());
+	VariedValueGenerator input(0, PIECE, 5);
+	ASSERT_TRUE(estuary::Estuary::Create(filename, CONFIG, &input));
+	{	//exclusive loading blocks attaching
+		auto monopoly = estuary::Estuary::Load(filename, estuary::Estuary::MONOPOLY);
+		ASSERT_FALSE(!monopoly);
+		ASSERT_TRUE(!estuary::Estuary::Load(filename, estuary::Estuary::READ_ONLY));
+	}
+	auto writer = estuary::Estuary::Load(filename, estuary::Estuary::SHARED);
+	ASSERT_FALSE(!writer);
+	auto reader = estuary::Estuary::Load(filename, estuary::Estuary::READ_ONLY);
+	ASSERT_FALSE(!reader);
+	ASSERT_EQ(reader.item(), PIECE);
+	ASSERT_EQ(estuary::Estuary::Readers(filename), std::vector<int>{getpid()});
+
+	uint64_t id = 1;
+	const estuary::Slice key = {(const uint8_t*)&id, sizeof(id)};
+	const estuary::Slice val = {(const uint8_t*)"abc", 3};
+	std::string out, tmp;
+	ASSERT_FALSE(reader.update(key, val));
+	ASSERT_FALSE(reader.erase(key));
+	ASSERT_EQ(reader.batch_update(1, &key, &val), 0U);
+	ASSERT_TRUE(reader.compact(SIZE_MAX));
+	ASSERT_FALSE(reader.dump_delta("readonly.delta"));
+	ASSERT_FALSE(reader.scan().next(tmp, out));
+
+	const auto generation = reader.generation();
+	ASSERT_TRUE(writer.update(key, val));
+	ASSERT_EQ(reader.generation(), generation + 1);
+	ASSERT_TRUE(reader.fetch(key, out));
+	ASSERT_EQ(out, "abc");
+	for (uint64_t i = 0; i < PIECE; i += 2) {
+		ASSERT_TRUE(writer.erase({(const uint8_t*)&i, sizeof(i)}));
+	}
+	ASSERT_EQ(reader.item(), PIECE/2);
+	for (uint64_t i = 0; i < PIECE; i++) {
+		ASSERT_EQ(reader.fetch({(const uint8_t*)&i, sizeof(i)}, out), i % 2 != 0);
+	}
+
+	//reader in another process exits without detaching, its slot is reclaimed
+	auto pid = fork();
+	ASSERT_GE(pid, 0);
+	if (pid == 0) {
+		auto child = estuary::Estuary::Load(filename, estuary::Estuary::READ_ONLY);
+		std::string v;
+		const bool ok = !!child && child.fetch(key, v) && v == "abc"
+			&& estuary::Estuary::Readers(filename).size() == 2;
+		_exit(ok? 0 : 1);
+	}
+	int status = 0;
+	ASSERT_EQ(waitpid(pid, &status, 0), pid);
+	ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	ASSERT_EQ(estuary::Estuary::Readers(filename), std::vector<int>{getpid()});
+	reader = estuary::Estuary();
+	ASSERT_TRUE(estuary::Estuary::Readers(filename).empty());
+}
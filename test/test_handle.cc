@@ -0,0 +1,126 @@
+//==============================================================================
+// Dictionary designed for read-mostly scene.
+// Copyright (C) 2020	Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include <gtest/gtest.h>
+#include <handle.h>
+#include "test.h"
+
+static constexpr unsigned PIECE = 1000;
+
+static const estuary::Estuary::Config CONFIG = {
+	.item_limit = PIECE,
+	.max_key_len = sizeof(uint64_t),
+	.max_val_len = UINT8_MAX,
+	.avg_item_size = UINT8_MAX / 2 + 1 + sizeof(uint64_t)
+};
+
+TEST(Handle, Swap) {
+	estuary::Logger::Bind(nullptr);
+	//values of the two files differ in length
+	const std::string files[2] = {"handle-a.es", "handle-b.es"};
+	for (unsigned i = 0; i < 2; i++) {
+		VariedValueGenerator source(0, PIECE, 5 + i*100);
+		ASSERT_TRUE(estuary::Estuary::Create(files[i], CONFIG, &source));
+	}
+	estuary::EstuaryHandle empty;
+	ASSERT_TRUE(!empty.get());
+	ASSERT_FALSE(empty.wait());
+
+	estuary::EstuaryHandle handle(estuary::Estuary::Load(files[0], estuary::Estuary::COPY_DATA));
+	ASSERT_FALSE(!handle.get());
+	ASSERT_EQ(handle.version(), 0U);
+
+	//every lookup sees one whole instance
+	std::atomic<bool> stop = {false};
+	std::atomic<unsigned> broken = {0};
+	std::atomic<uint64_t> lookups = {0};
+	std::vector<std::thread> readers;
+	for (unsigned t = 0; t < 4; t++) {
+		readers.emplace_back([&handle, &stop, &broken, &lookups]() {
+			std::string val;
+			for (uint64_t i = 0; !stop; i = (i + 1) % PIECE) {
+				auto dict = handle.get();
+				const auto shift = dict->item() != 0 && dict->fetch({(const uint8_t*)&i, sizeof(i)}, val)?
+					(uint8_t)(val.size() - i) : 0xff;
+				if (shift != 5 && shift != 105) {
+					broken++;
+				}
+				lookups++;
+			}
+		});
+	}
+
+	for (unsigned round = 1; round <= 6; round++) {
+		const auto& file = files[round % 2];
+		if (round % 3 == 0) {
+			handle.swap(estuary::Estuary::Load(file, estuary::Estuary::COPY_DATA));
+		} else {
+			ASSERT_TRUE(handle.reload([&file]() {
+				auto dict = estuary::Estuary::Load(file, estuary::Estuary::LAZY);
+				while (!!dict && !dict.warmup(1U << 20U));
+				return dict;
+			}));
+			ASSERT_FALSE(handle.reload([]() { return estuary::Estuary(); }));
+			ASSERT_TRUE(handle.wait());
+		}
+		ASSERT_EQ(handle.version(), round);
+		const auto base = lookups.load();
+		while (lookups < base + 1000) {
+			std::this_thread::yield();
+		}
+	}
+	stop = true;
+	for (auto& t : readers) {
+		t.join();
+	}
+	ASSERT_EQ(broken, 0U);
+
+	//old instance lives until the guard is released
+	std::string val;
+	uint64_t key = 1;
+	{
+		auto guard = handle.get();
+		ASSERT_TRUE(handle.reload([&files]() {
+			return estuary::Estuary::Load(files[1], estuary::Estuary::COPY_DATA);
+		}));
+		for (unsigned i = 0; i < 100; i++) {
+			ASSERT_TRUE(guard->fetch({(const uint8_t*)&key, sizeof(key)}, val));
+			ASSERT_EQ(val.size(), key + 5);
+			std::this_thread::yield();
+		}
+		ASSERT_EQ(handle.version(), 6U);
+	}
+	ASSERT_TRUE(handle.wait());
+	ASSERT_TRUE(handle.get()->fetch({(const uint8_t*)&key, sizeof(key)}, val));
+	ASSERT_EQ(val.size(), key + 105);
+
+	//failed loading leaves the current one
+	ASSERT_TRUE(handle.reload([]() { return estuary::Estuary::Load("handle-missing.es"); }));
+	ASSERT_FALSE(handle.wait());
+	ASSERT_EQ(handle.version(), 7U);
+	ASSERT_FALSE(!handle.get());
+	ASSERT_TRUE(handle.reload([]()->estuary::Estuary { throw std::runtime_error("broken"); }));
+	ASSERT_FALSE(handle.wait());
+	ASSERT_EQ(handle.version(), 7U);
+	ASSERT_FALSE(!handle.get());
+}
@@ -19,6 +19,11 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <gtest/gtest.h>
 #include <lucky_estuary.h>
 #include "test.h"
@@ -161,3 +166,509 @@ TEST(LuckyEstuary, Write) {
 	ASSERT_TRUE(dict.fetch(rec.key.ptr, out.get()));
 	ASSERT_EQ(memcmp(out.get(), rec.val.ptr, rec.val.len), 0);
 }
+
+TEST(LuckyEstuary, ParallelBuild) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "parallel.les";
+	constexpr unsigned PIECE = estuary::LuckyEstuary::MIN_CAPACITY;
+
+	estuary::LuckyEstuary::Config config;
+	config.entry = PIECE;
+	config.capacity = PIECE*2;
+	config.key_len = sizeof(uint64_t);
+	config.val_len = EmbeddingGenerator::VALUE_SIZE;
+	config.concurrency = 4;
+
+	EmbeddingGenerator input1(0, PIECE/2, EmbeddingGenerator::MASK0);
+	EmbeddingGenerator input2(0, PIECE, EmbeddingGenerator::MASK1);
+	ConcatReader source(input1, input2);
+	ASSERT_TRUE(estuary::LuckyEstuary::Create(filename, config, &source));
+
+	auto dict = estuary::LuckyEstuary::Load(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE);
+
+	auto out = std::make_unique<uint8_t[]>(config.val_len);
+	input2.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		ASSERT_TRUE(dict.fetch(rec.key.ptr, out.get()));
+		ASSERT_EQ(memcmp(out.get(), rec.val.ptr, rec.val.len), 0);
+	}
+
+	EmbeddingGenerator input3(PIECE, PIECE, EmbeddingGenerator::MASK0);
+	ASSERT_EQ(dict.batch_update(input3), PIECE);
+	ASSERT_EQ(dict.item(), PIECE*2);
+	auto rec = input3.read();
+	ASSERT_FALSE(dict.update(rec.key.ptr, rec.val.ptr));
+
+	input3.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		rec = input3.read();
+		ASSERT_TRUE(dict.fetch(rec.key.ptr, out.get()));
+		ASSERT_EQ(memcmp(out.get(), rec.val.ptr, rec.val.len), 0);
+	}
+}
+
+TEST(LuckyEstuary, ConcurrentWrite) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "concurrent.les";
+	constexpr unsigned PIECE = estuary::LuckyEstuary::MIN_CAPACITY;
+	constexpr unsigned WRITER = 4;
+
+	estuary::LuckyEstuary::Config config;
+	config.entry = PIECE;
+	config.capacity = PIECE;
+	config.key_len = sizeof(uint64_t);
+	config.val_len = EmbeddingGenerator::VALUE_SIZE;
+	ASSERT_TRUE(estuary::LuckyEstuary::Create(filename, config));
+
+	auto dict = estuary::LuckyEstuary::Load(filename, estuary::LuckyEstuary::MONOPOLY);
+	ASSERT_FALSE(!dict);
+
+	//values should never be torn or reused too early
+	std::atomic<bool> quit(false);
+	std::atomic<unsigned> broken(0);
+	std::thread reader([&dict, &quit, &broken]() {
+		uint64_t val[EmbeddingGenerator::VALUE_SIZE/sizeof(uint64_t)];
+		while (!quit.load()) {
+			for (uint64_t key = 0; key < PIECE; key++) {
+				if (dict.fetch((const uint8_t*)&key, (uint8_t*)val)) {
+					auto mask = val[0] ^ key;
+					if ((mask != EmbeddingGenerator::MASK0 && mask != EmbeddingGenerator::MASK1)
+						|| val[1] != val[0] || val[2] != val[0] || val[3] != val[0]) {
+						broken++;
+					}
+				}
+			}
+		}
+	});
+
+	std::atomic<unsigned> fail(0);
+	std::vector<std::thread> writers;
+	for (unsigned t = 0; t < WRITER; t++) {
+		writers.emplace_back([&dict, &fail, t]() {
+			const auto begin = PIECE/WRITER*t;
+			for (auto mask : {EmbeddingGenerator::MASK0, EmbeddingGenerator::MASK1, EmbeddingGenerator::MASK0}) {
+				EmbeddingGenerator input(begin, PIECE/WRITER, mask);
+				for (unsigned i = 0; i < PIECE/WRITER; i++) {
+					auto rec = input.read();
+					if (!dict.update(rec.key.ptr, rec.val.ptr)) {
+						fail++;
+					}
+				}
+			}
+			EmbeddingGenerator input(begin, PIECE/WRITER);
+			for (unsigned i = 0; i < PIECE/WRITER; i++) {
+				auto rec = input.read();
+				if (i % 2 == 0 && !dict.erase(rec.key.ptr)) {
+					fail++;
+				}
+			}
+		});
+	}
+	for (auto& th : writers) {
+		th.join();
+	}
+	quit = true;
+	reader.join();
+	ASSERT_EQ(fail.load(), 0U);
+	ASSERT_EQ(broken.load(), 0U);
+	ASSERT_EQ(dict.item(), PIECE/2);
+
+	//nodes held by stripes should be saved too
+	const std::string filename2 = "concurrent-dump.les";
+	ASSERT_TRUE(dict.dump(filename2));
+	dict = estuary::LuckyEstuary::Load(filename2, estuary::LuckyEstuary::SHARED);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE/2);
+	EmbeddingGenerator input(0, PIECE);
+	ASSERT_EQ(dict.batch_update(input), PIECE);
+	ASSERT_EQ(dict.item(), PIECE);
+	auto out = std::make_unique<uint8_t[]>(config.val_len);
+	input.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input.read();
+		ASSERT_TRUE(dict.fetch(rec.key.ptr, out.get()));
+		ASSERT_EQ(memcmp(out.get(), rec.val.ptr, rec.val.len), 0);
+	}
+	dict = estuary::LuckyEstuary();
+
+	//nodes held by stripes go back to the file when closing
+	for (unsigned round = 0; round < 3; round++) {
+		dict = estuary::LuckyEstuary::Load(filename, estuary::LuckyEstuary::MONOPOLY);
+		ASSERT_FALSE(!dict);
+		EmbeddingGenerator source(0, PIECE, round % 2 == 0? EmbeddingGenerator::MASK1 : EmbeddingGenerator::MASK0);
+		ASSERT_EQ(dict.batch_update(source), PIECE);
+		dict = estuary::LuckyEstuary();
+		estuary::LuckyEstuary::Layout layout;
+		ASSERT_TRUE(estuary::LuckyEstuary::Inspect(filename, layout));
+		ASSERT_EQ(layout.item, PIECE);
+		ASSERT_EQ(layout.item + layout.room, config.capacity);
+	}
+
+	//crash in the middle of striped writing can be detected
+	const auto pid = fork();
+	ASSERT_GE(pid, 0);
+	if (pid == 0) {
+		auto child = estuary::LuckyEstuary::Load(filename, estuary::LuckyEstuary::MONOPOLY);
+		uint64_t key = 1;
+		_exit(!child || !child.erase((const uint8_t*)&key)? 1 : 0);
+	}
+	int status = 0;
+	ASSERT_EQ(waitpid(pid, &status, 0), pid);
+	ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	ASSERT_TRUE(!estuary::LuckyEstuary::Load(filename, estuary::LuckyEstuary::MONOPOLY));
+}
+
+TEST(LuckyEstuary, EpochReclaim) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "epoch.les";
+	constexpr unsigned PIECE = estuary::LuckyEstuary::MIN_CAPACITY;
+
+	estuary::LuckyEstuary::Config config;
+	config.entry = PIECE;
+	config.capacity = PIECE;
+	config.key_len = sizeof(uint64_t);
+	config.val_len = EmbeddingGenerator::VALUE_SIZE;
+	config.epoch = true;
+	EmbeddingGenerator input(0, PIECE);
+	ASSERT_TRUE(estuary::LuckyEstuary::Create(filename, config, &input));
+
+	auto dict = estuary::LuckyEstuary::Load(filename, estuary::LuckyEstuary::SHARED);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE);
+
+	//recycle ring is filled many times, nodes should not be reused under readers
+	std::atomic<bool> quit(false);
+	std::atomic<unsigned> broken(0);
+	std::vector<std::thread> readers;
+	for (unsigned t = 0; t < 2; t++) {
+		readers.emplace_back([&dict, &quit, &broken]() {
+			uint64_t val[EmbeddingGenerator::VALUE_SIZE/sizeof(uint64_t)];
+			while (!quit.load()) {
+				for (uint64_t key = 0; key < PIECE; key++) {
+					if (!dict.fetch((const uint8_t*)&key, (uint8_t*)val)) {
+						broken++;
+						continue;
+					}
+					auto mask = val[0] ^ key;
+					if ((mask != EmbeddingGenerator::MASK0 && mask != EmbeddingGenerator::MASK1)
+						|| val[1] != val[0] || val[2] != val[0] || val[3] != val[0]) {
+						broken++;
+					}
+				}
+			}
+		});
+	}
+	for (unsigned i = 0; i < 8; i++) {
+		EmbeddingGenerator update(0, PIECE, i%2 == 0? EmbeddingGenerator::MASK1 : EmbeddingGenerator::MASK0);
+		ASSERT_EQ(dict.batch_update(update), PIECE);
+	}
+	quit = true;
+	for (auto& th : readers) {
+		th.join();
+	}
+	ASSERT_EQ(broken.load(), 0U);
+	ASSERT_EQ(dict.item(), PIECE);
+
+	const std::string filename2 = "epoch-dump.les";
+	ASSERT_TRUE(dict.dump(filename2));
+	dict = estuary::LuckyEstuary::Load(filename2, estuary::LuckyEstuary::MONOPOLY);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE);
+	auto out = std::make_unique<uint8_t[]>(config.val_len);
+	input.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input.read();
+		ASSERT_TRUE(dict.fetch(rec.key.ptr, out.get()));
+		ASSERT_EQ(memcmp(out.get(), rec.val.ptr, rec.val.len), 0);
+		ASSERT_TRUE(dict.erase(rec.key.ptr));
+	}
+	ASSERT_EQ(dict.item(), 0U);
+}
+
+TEST(LuckyEstuary, Grow) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "grow.les";
+	constexpr unsigned PIECE = estuary::LuckyEstuary::MIN_CAPACITY;
+
+	estuary::LuckyEstuary::Config config;
+	config.entry = PIECE/2;
+	config.capacity = PIECE;
+	config.key_len = sizeof(uint64_t);
+	config.val_len = EmbeddingGenerator::VALUE_SIZE;
+	EmbeddingGenerator input(0, PIECE);
+	ASSERT_TRUE(estuary::LuckyEstuary::Create(filename, config, &input));
+	ASSERT_FALSE(estuary::LuckyEstuary::Extend(filename, 10));	//load factor limit
+
+	//the old file is intact if the new one cannot be built
+	const auto tmp = filename + ".grow";
+	rmdir(tmp.c_str());
+	ASSERT_EQ(mkdir(tmp.c_str(), 0755), 0);
+	ASSERT_FALSE(estuary::LuckyEstuary::Grow(filename, 100));
+	ASSERT_EQ(rmdir(tmp.c_str()), 0);
+	ASSERT_EQ(estuary::LuckyEstuary::Load(filename, estuary::LuckyEstuary::SHARED).item(), PIECE);
+
+	estuary::LuckyEstuary::Config cfg;
+	ASSERT_TRUE(estuary::LuckyEstuary::Grow(filename, 100, &cfg));
+	ASSERT_NE(access(tmp.c_str(), F_OK), 0);
+	ASSERT_EQ(cfg.entry, PIECE);
+	ASSERT_EQ(cfg.capacity, PIECE);
+	ASSERT_TRUE(estuary::LuckyEstuary::Extend(filename, 100, &cfg));
+	ASSERT_EQ(cfg.capacity, PIECE*2);
+
+	auto dict = estuary::LuckyEstuary::Load(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE);
+	auto out = std::make_unique<uint8_t[]>(config.val_len);
+	input.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input.read();
+		ASSERT_TRUE(dict.fetch(rec.key.ptr, out.get()));
+		ASSERT_EQ(memcmp(out.get(), rec.val.ptr, rec.val.len), 0);
+	}
+	EmbeddingGenerator more(PIECE, PIECE);
+	ASSERT_EQ(dict.batch_update(more), PIECE);
+	ASSERT_EQ(dict.item(), PIECE*2);
+}
+
+TEST(LuckyEstuary, FixedView) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "fixed.les";
+	constexpr unsigned PIECE = estuary::LuckyEstuary::MIN_CAPACITY;
+	constexpr unsigned VALUE_SIZE = EmbeddingGenerator::VALUE_SIZE;
+
+	estuary::LuckyEstuary::Config config;
+	config.entry = PIECE;
+	config.capacity = PIECE;
+	config.key_len = sizeof(uint64_t);
+	config.val_len = VALUE_SIZE;
+	EmbeddingGenerator source(0, PIECE);
+	ASSERT_TRUE(estuary::LuckyEstuary::Create(filename, config, &source));
+
+	auto dict = estuary::LuckyEstuary::Load(filename);
+	ASSERT_FALSE(!dict);
+	using View = estuary::LuckyEstuaryT<sizeof(uint64_t), VALUE_SIZE>;
+	using WideView = estuary::LuckyEstuaryT<sizeof(uint64_t), VALUE_SIZE*2>;
+	ASSERT_TRUE(!WideView(dict));
+	estuary::LuckyEstuary empty;
+	ASSERT_TRUE(!View(empty));
+	View view(dict);
+	ASSERT_FALSE(!view);
+
+	std::vector<uint64_t> keys(PIECE*2);
+	for (unsigned i = 0; i < PIECE; i++) {
+		keys[2*i] = i;
+		keys[2*i+1] = i+PIECE;
+	}
+	auto out1 = std::make_unique<uint8_t[]>(keys.size()*VALUE_SIZE);
+	auto out2 = std::make_unique<uint8_t[]>(keys.size()*VALUE_SIZE);
+	std::vector<unsigned> miss1(keys.size());
+	std::vector<unsigned> miss2(keys.size());
+	ASSERT_EQ(view.batch_try_fetch(keys.size(), (const uint8_t*)keys.data(), out1.get(), miss1.data()), PIECE);
+	ASSERT_EQ(dict.batch_try_fetch(keys.size(), (const uint8_t*)keys.data(), out2.get(), miss2.data()), PIECE);
+	ASSERT_EQ(miss1, miss2);
+
+	uint8_t val[VALUE_SIZE];
+	EmbeddingGenerator check(0, PIECE*2);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = check.read();
+		ASSERT_EQ(memcmp(out1.get() + 2*i*VALUE_SIZE, rec.val.ptr, VALUE_SIZE), 0);
+		ASSERT_TRUE(view.fetch(rec.key.ptr, val));
+		ASSERT_EQ(memcmp(val, rec.val.ptr, VALUE_SIZE), 0);
+	}
+	for (unsigned i = 0; i < PIECE; i++) {
+		ASSERT_FALSE(view.fetch(check.read().key.ptr, val));
+	}
+}
+
+TEST(LuckyEstuary, Inspect) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename1 = "inspect.les";
+	const std::string filename2 = "inspect-dump.les";
+	constexpr unsigned PIECE = estuary::LuckyEstuary::MIN_CAPACITY;
+
+	estuary::LuckyEstuary::Config config;
+	config.entry = PIECE;
+	config.capacity = PIECE*2;
+	config.key_len = sizeof(uint64_t);
+	config.val_len = EmbeddingGenerator::VALUE_SIZE;
+	EmbeddingGenerator input(0, PIECE);
+	ASSERT_TRUE(estuary::LuckyEstuary::Create(filename1, config, &input));
+	estuary::LuckyEstuary::Layout layout;
+	ASSERT_TRUE(estuary::LuckyEstuary::Inspect(filename1, layout, 4));
+	ASSERT_EQ(layout.item, PIECE);
+	ASSERT_EQ(layout.room, PIECE);
+	ASSERT_EQ(layout.recycling_node, 0U);
+
+	auto dict = estuary::LuckyEstuary::Load(filename1, estuary::LuckyEstuary::SHARED);
+	ASSERT_FALSE(!dict);
+	input.reset();
+	for (unsigned i = 0; i < PIECE/2; i++) {
+		auto rec = input.read();
+		ASSERT_TRUE(dict.erase(rec.key.ptr));
+	}
+	ASSERT_TRUE(dict.dump(filename2));
+
+	ASSERT_TRUE(estuary::LuckyEstuary::Inspect(filename2, layout, 3));
+	ASSERT_EQ(layout.item, PIECE/2);
+	ASSERT_EQ(layout.config.capacity, PIECE*2);
+	ASSERT_EQ(layout.room, PIECE*3/2);
+	ASSERT_GT(layout.recycling_node, 0U);
+	ASSERT_GT(layout.empty_entry, 0U);
+	uint64_t chains = 0;
+	for (unsigned i = 0; i < estuary::LuckyEstuary::Layout::BUCKETS; i++) {
+		chains += layout.chain_length[i];
+	}
+	ASSERT_EQ(chains, config.entry);
+	ASSERT_GE(layout.max_chain, 1U);
+}
+
+TEST(LuckyEstuary, Scan) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "scan.les";
+	constexpr unsigned PIECE = estuary::LuckyEstuary::MIN_CAPACITY;
+
+	estuary::LuckyEstuary::Config config;
+	config.entry = PIECE;
+	config.capacity = PIECE;
+	config.key_len = sizeof(uint64_t);
+	config.val_len = EmbeddingGenerator::VALUE_SIZE;
+	EmbeddingGenerator input(0, PIECE);
+	ASSERT_TRUE(estuary::LuckyEstuary::Create(filename, config, &input));
+	auto dict = estuary::LuckyEstuary::Load(filename);
+	ASSERT_FALSE(!dict);
+	EmbeddingGenerator input2(0, PIECE, EmbeddingGenerator::MASK1);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		if (i % 3 == 0) {
+			ASSERT_TRUE(dict.erase(rec.key.ptr));
+		} else if (i % 3 == 1) {
+			ASSERT_TRUE(dict.update(rec.key.ptr, rec.val.ptr));
+		}
+	}
+
+	uint64_t key;
+	uint64_t val[EmbeddingGenerator::VALUE_SIZE/sizeof(uint64_t)];
+	for (unsigned total : {1U, 7U}) {
+		std::vector<unsigned> seen(PIECE, 0);
+		size_t cnt = 0;
+		for (unsigned piece = 0; piece < total; piece++) {
+			auto cursor = dict.scan(piece, total);
+			while (cursor.next((uint8_t*)&key, (uint8_t*)val)) {
+				ASSERT_LT(key, PIECE);
+				ASSERT_NE(key % 3, 0U);
+				const auto mask = key % 3 == 1? EmbeddingGenerator::MASK1 : EmbeddingGenerator::MASK0;
+				ASSERT_EQ(val[0], key ^ mask);
+				seen[key]++;
+				cnt++;
+			}
+		}
+		ASSERT_EQ(cnt, dict.item());
+		for (unsigned i = 0; i < PIECE; i++) {
+			ASSERT_EQ(seen[i], i % 3 == 0? 0U : 1U);
+		}
+	}
+}
+
+TEST(LuckyEstuary, Cuckoo) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "cuckoo.les";
+	constexpr unsigned PIECE = estuary::LuckyEstuary::MIN_CAPACITY;
+	constexpr unsigned VALUE_SIZE = EmbeddingGenerator::VALUE_SIZE;
+
+	estuary::LuckyEstuary::Config config;
+	config.cuckoo = true;
+	config.entry = PIECE;
+	config.capacity = PIECE;
+	config.key_len = sizeof(uint64_t);
+	config.val_len = VALUE_SIZE;
+	ASSERT_FALSE(estuary::LuckyEstuary::Create(filename, config));
+	config.entry = PIECE * 100 / estuary::LuckyEstuary::MAX_CUCKOO_LOAD + 1;
+	EmbeddingGenerator source(0, PIECE);
+	ASSERT_TRUE(estuary::LuckyEstuary::Create(filename, config, &source));
+
+	estuary::LuckyEstuary::Layout layout;
+	ASSERT_TRUE(estuary::LuckyEstuary::Inspect(filename, layout));
+	ASSERT_TRUE(layout.config.cuckoo);
+	ASSERT_GE(layout.config.entry, config.entry);
+	ASSERT_EQ(layout.item, PIECE);
+	ASSERT_EQ(layout.empty_entry, layout.config.entry - PIECE);
+	ASSERT_LE(layout.max_chain, 12U);
+	ASSERT_FALSE(estuary::LuckyEstuary::Grow(filename, 10));
+
+	auto dict = estuary::LuckyEstuary::Load(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE);
+	std::vector<uint64_t> keys(PIECE*2);
+	for (unsigned i = 0; i < PIECE; i++) {
+		keys[2*i] = i;
+		keys[2*i+1] = i+PIECE;
+	}
+	auto out = std::make_unique<uint8_t[]>(keys.size()*VALUE_SIZE);
+	std::vector<unsigned> miss(keys.size());
+	ASSERT_EQ(dict.batch_try_fetch(keys.size(), (const uint8_t*)keys.data(), out.get(), miss.data()), PIECE);
+	for (unsigned i = 0; i < PIECE; i++) {
+		ASSERT_EQ(miss[i], 2*i+1);
+	}
+	estuary::LuckyEstuaryT<sizeof(uint64_t), VALUE_SIZE> view(dict);
+	uint8_t val[VALUE_SIZE];
+	EmbeddingGenerator check(0, PIECE*2);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = check.read();
+		ASSERT_EQ(memcmp(out.get() + 2*i*VALUE_SIZE, rec.val.ptr, VALUE_SIZE), 0);
+		ASSERT_TRUE(view.fetch(rec.key.ptr, val));
+		ASSERT_EQ(memcmp(val, rec.val.ptr, VALUE_SIZE), 0);
+	}
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = check.read();
+		ASSERT_FALSE(dict.fetch(rec.key.ptr, val));
+		ASSERT_FALSE(dict.update(rec.key.ptr, rec.val.ptr));
+	}
+
+	//items kicked between buckets should never be missed by readers
+	dict = estuary::LuckyEstuary();
+	ASSERT_TRUE(estuary::LuckyEstuary::Create(filename, config));
+	dict = estuary::LuckyEstuary::Load(filename, estuary::LuckyEstuary::MONOPOLY);
+	ASSERT_FALSE(!dict);
+	std::atomic<unsigned> done(0);
+	std::atomic<unsigned> broken(0);
+	std::thread reader([&dict, &done, &broken]() {
+		uint64_t val[VALUE_SIZE/sizeof(uint64_t)];
+		for (uint64_t k = 0; done.load() < PIECE; k++) {
+			const uint64_t key = k % (done.load() + 1);
+			if (key < done.load() && !dict.fetch((const uint8_t*)&key, (uint8_t*)val)) {
+				broken++;
+			}
+		}
+	});
+	EmbeddingGenerator input(0, PIECE);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input.read();
+		ASSERT_TRUE(dict.update(rec.key.ptr, rec.val.ptr));
+		done.store(i+1);
+	}
+	reader.join();
+	ASSERT_EQ(broken.load(), 0U);
+	ASSERT_EQ(dict.item(), PIECE);
+
+	EmbeddingGenerator input2(0, PIECE, EmbeddingGenerator::MASK1);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = input2.read();
+		if (i % 2 == 0) {
+			ASSERT_TRUE(dict.erase(rec.key.ptr));
+		} else {
+			ASSERT_TRUE(dict.update(rec.key.ptr, rec.val.ptr));
+		}
+	}
+	ASSERT_EQ(dict.item(), PIECE/2);
+	size_t cnt = 0;
+	uint64_t key;
+	uint64_t line[VALUE_SIZE/sizeof(uint64_t)];
+	for (auto cursor = dict.scan(); cursor.next((uint8_t*)&key, (uint8_t*)line); cnt++) {
+		ASSERT_EQ(key % 2, 1U);
+		ASSERT_EQ(line[0], key ^ EmbeddingGenerator::MASK1);
+	}
+	ASSERT_EQ(cnt, PIECE/2);
+}
@@ -0,0 +1,169 @@
+//==============================================================================
+// Dictionary designed for read-mostly scene.
+// Copyright (C) 2020	Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <gtest/gtest.h>
+#include <sharded_estuary.h>
+#include "test.h"
+
+static constexpr unsigned PIECE = 4000;
+static constexpr unsigned SHARDS = 4;
+
+static const estuary::Estuary::Config CONFIG = {
+	.item_limit = PIECE,
+	.max_key_len = sizeof(uint64_t),
+	.max_val_len = UINT8_MAX,
+	.avg_item_size = UINT8_MAX / 2 + 1 + sizeof(uint64_t)
+};
+
+TEST(ShardedEstuary, BuildAndRead) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "sharded.es";
+
+	VariedValueGenerator source(0, PIECE);
+	ASSERT_TRUE(estuary::ShardedEstuary::Create(filename, SHARDS, CONFIG, &source));
+	ASSERT_TRUE(!estuary::ShardedEstuary::Load(filename, SHARDS+1));
+
+	auto dict = estuary::ShardedEstuary::Load(filename, SHARDS);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.shards(), SHARDS);
+	ASSERT_EQ(dict.item(), PIECE);
+	ASSERT_GE(dict.item_limit(), PIECE);
+	for (unsigned i = 0; i < SHARDS; i++) {
+		//roughly balanced
+		ASSERT_GT(dict.shard(i).item(), PIECE / SHARDS / 2);
+	}
+
+	std::string val;
+	source.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec = source.read();
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(val.size(), rec.val.len);
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+	}
+
+	constexpr unsigned BATCH = 64;
+	std::vector<uint64_t> ids(BATCH);
+	std::vector<estuary::Slice> keys(BATCH);
+	std::vector<std::string> vals(BATCH);
+	std::vector<unsigned> miss(BATCH);
+	for (unsigned i = 0; i < BATCH; i++) {
+		ids[i] = i % 2 == 0? i : PIECE + i;
+		keys[i] = {(const uint8_t*)&ids[i], sizeof(uint64_t)};
+	}
+	ASSERT_EQ(dict.batch_fetch(BATCH, keys.data(), vals.data(), miss.data()), BATCH/2);
+	for (unsigned i = 0; i < BATCH/2; i++) {
+		ASSERT_EQ(miss[i], i*2+1);
+	}
+	for (unsigned i = 0; i < BATCH; i += 2) {
+		ASSERT_TRUE(dict.fetch(keys[i], val));
+		ASSERT_EQ(vals[i], val);
+	}
+
+	//misses are untouched, even if buffers are left by former calls
+	for (unsigned i = 0; i < BATCH; i++) {
+		ids[i] = i % 2 == 0? PIECE + i : i;
+		vals[i] = "untouched";
+	}
+	ASSERT_EQ(dict.batch_fetch(BATCH, keys.data(), vals.data()), BATCH/2);
+	for (unsigned i = 0; i < BATCH; i++) {
+		if (i % 2 == 0) {
+			ASSERT_EQ(vals[i], "untouched");
+		} else {
+			ASSERT_TRUE(dict.fetch(keys[i], val));
+			ASSERT_EQ(vals[i], val);
+		}
+	}
+}
+
+//gives other keys after the first pass, so shards cannot get records counted before
+class ShiftingGenerator : public estuary::IDataReader {
+public:
+	void reset() override {
+		m_current = m_passes++ == 0? 0 : PIECE;
+	}
+	size_t total() override {
+		return PIECE;
+	}
+	Record read() override {
+		m_key = m_current++;
+		return {{(const uint8_t*)&m_key, sizeof(m_key)}, {(const uint8_t*)&m_key, sizeof(m_key)}};
+	}
+private:
+	unsigned m_passes = 0;
+	uint64_t m_current = 0;
+	uint64_t m_key = 0;
+};
+
+TEST(ShardedEstuary, ChangingSource) {
+	estuary::Logger::Bind(nullptr);
+	ShiftingGenerator source;
+	ASSERT_FALSE(estuary::ShardedEstuary::Create("sharded-changing.es", SHARDS, CONFIG, &source));
+}
+
+TEST(ShardedEstuary, ParallelWrite) {
+	estuary::Logger::Bind(nullptr);
+	const std::string filename = "sharded-write.es";
+	auto config = CONFIG;
+	config.item_limit = PIECE * 2;	//shards are not perfectly balanced
+	ASSERT_TRUE(estuary::ShardedEstuary::Create(filename, SHARDS, config));
+	auto dict = estuary::ShardedEstuary::Load(filename, SHARDS);
+	ASSERT_FALSE(!dict);
+
+	//writers on different shards never block each other
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < SHARDS; t++) {
+		workers.emplace_back([&dict, t]() {
+			VariedValueGenerator input(0, PIECE);
+			for (unsigned i = 0; i < PIECE; i++) {
+				auto rec = input.read();
+				if (dict.locate(rec.key) == t) {
+					ASSERT_TRUE(dict.update(rec.key, rec.val));
+				}
+			}
+		});
+	}
+	for (auto& t : workers) {
+		t.join();
+	}
+	ASSERT_EQ(dict.item(), PIECE);
+
+	//rebuild one shard from a new source
+	dict = estuary::ShardedEstuary();
+	VariedValueGenerator source(0, PIECE, 10);
+	ASSERT_TRUE(estuary::ShardedEstuary::Rebuild(filename, SHARDS, 1, CONFIG, source));
+	dict = estuary::ShardedEstuary::Load(filename, SHARDS, estuary::Estuary::SHARED);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE);
+
+	std::string val;
+	VariedValueGenerator input1(0, PIECE);
+	source.reset();
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto rec1 = input1.read();
+		auto rec2 = source.read();
+		auto& rec = dict.locate(rec1.key) == 1? rec2 : rec1;
+		ASSERT_TRUE(dict.fetch(rec.key, val));
+		ASSERT_EQ(val.size(), rec.val.len);
+		ASSERT_EQ(memcmp(val.data(), rec.val.ptr, rec.val.len), 0);
+	}
+	ASSERT_TRUE(dict.erase(input1.read().key) == false);
+}
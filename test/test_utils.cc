@@ -20,6 +20,7 @@
 #include <random>
 #include <gtest/gtest.h>
 #include <utils.h>
+#include "../src/internal.h"
 
 
 template<typename Word>
@@ -75,3 +76,97 @@ TEST(Divisor, Uint8) {
 }
 
 
+
+TEST(Hash, Batch) {
+	std::mt19937_64 rand;
+	std::vector<uint8_t> space(200*64);
+	for (auto& b : space) {
+		b = rand();
+	}
+	for (unsigned len = 0; len <= 100; len++) {
+		constexpr unsigned n = 37;
+		const uint64_t seed = rand();
+		std::vector<uint64_t> codes(n);
+		estuary::HashBatch(space.data(), len+3, len, n, seed, codes.data());
+		for (unsigned i = 0; i < n; i++) {
+			ASSERT_EQ(codes[i], estuary::Hash(space.data() + i*(len+3), len, seed));
+		}
+	}
+
+	//keys of mixed lengths
+	std::vector<estuary::Slice> keys(200);
+	for (unsigned i = 0; i < keys.size(); i++) {
+		keys[i] = {space.data() + i*64, i < 100? 8U : (unsigned)(rand() % 3 + 15)};
+	}
+	std::vector<uint64_t> codes(keys.size());
+	estuary::HashBatch(keys.data(), keys.size(), 99, codes.data());
+	for (unsigned i = 0; i < keys.size(); i++) {
+		ASSERT_EQ(codes[i], estuary::Hash(keys[i].ptr, keys[i].len, 99));
+	}
+}
+
+TEST(Hash, Kernels) {
+	using Kernel = void (*)(const uint8_t* const*, unsigned, uint64_t, uint64_t*) noexcept;
+	std::vector<std::pair<const char*, Kernel>> kernels = {{"scalar", estuary::HashGroup}};
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels.emplace_back("avx2", estuary::HashGroupAVX2);
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		kernels.emplace_back("avx512", estuary::HashGroupAVX512);
+	}
+#endif
+	constexpr unsigned N = estuary::HASH_GROUP;
+	std::mt19937_64 rand;
+	std::vector<uint8_t> space(N*200);
+	for (auto& b : space) {
+		b = rand();
+	}
+	for (auto& kernel : kernels) {
+		SCOPED_TRACE(kernel.first);
+		for (unsigned len = 0; len <= 150; len++) {
+			for (unsigned align = 0; align < 8; align++) {
+				const uint64_t seed = rand();
+				const uint8_t* msgs[N];
+				for (unsigned i = 0; i < N; i++) {
+					//every lane has its own alignment
+					msgs[i] = space.data() + i*(len+9) + (align+i)%8;
+				}
+				uint64_t codes[N];
+				kernel.second(msgs, len, seed, codes);
+				for (unsigned i = 0; i < N; i++) {
+					ASSERT_EQ(codes[i], estuary::Hash(msgs[i], len, seed)) << len << ' ' << align;
+				}
+			}
+		}
+	}
+}
+
+TEST(Table, ScanGroup) {
+	constexpr unsigned GROUP = CACHE_BLOCK_SIZE / sizeof(uint64_t);
+	constexpr uint64_t MAX_ADDR = (1ULL << 39U) - 1U;
+	auto make = [](uint64_t blk, uint64_t tag) { return blk | (tag << 56U); };
+	//live blocks whose low 32 bits look like clean or deleted ones
+	const uint64_t blks[] = {0, 1, 12345, 0xfffffffeULL, 0xffffffffULL, 0x1fffffffeULL,
+		0x7ffffffffeULL-1U, MAX_ADDR-1U, MAX_ADDR};
+	std::mt19937_64 rand;
+	alignas(CACHE_BLOCK_SIZE) uint64_t group[GROUP];
+	for (unsigned round = 0; round < 10000; round++) {
+		const unsigned tag = rand() & 0xffU;
+		uint32_t hit = 0, clean = 0;
+		for (unsigned i = 0; i < GROUP; i++) {
+			const auto blk = blks[rand() % (sizeof(blks)/sizeof(blks[0]))];
+			const auto t = rand() % 2 == 0? tag : rand() & 0xffU;
+			group[i] = make(blk, t) | ((rand() & 0xffffULL) << 39U);	//noise in other fields
+			if (blk >= MAX_ADDR-1U) {
+				clean |= (uint32_t)(blk == MAX_ADDR) << i;
+			} else {
+				hit |= (uint32_t)(t == tag) << i;
+			}
+		}
+		uint32_t clean_mask = 0;
+		ASSERT_EQ(estuary::ScanEntryGroup(group, tag, &clean_mask), hit);
+		ASSERT_EQ(clean_mask, clean);
+	}
+}
@@ -0,0 +1,98 @@
+//==============================================================================
+// Dictionary designed for read-mostly scene.
+// Copyright (C) 2020	Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+
+#include <cstdio>
+#include <string>
+#include <estuary.h>
+#include <lucky_estuary.h>
+#include <gflags/gflags.h>
+
+DEFINE_string(file, "bench.es", "dict filename");
+DEFINE_bool(lucky, false, "file is made by LuckyEstuary");
+DEFINE_uint32(thread, 0, "number of scanning threads, 0 means all cores");
+
+template <typename Word>
+static void PrintHistogram(const char* title, const Word* buckets, unsigned n) {
+	uint64_t total = 0;
+	for (unsigned i = 0; i < n; i++) {
+		total += buckets[i];
+	}
+	printf("%s:\n", title);
+	for (unsigned i = 0; i < n; i++) {
+		if (buckets[i] == 0) {
+			continue;
+		}
+		const uint64_t low = i == 0? 0 : 1ULL << (i-1);
+		const uint64_t high = i == 0? 0 : (i+1 == n? UINT64_MAX : (1ULL << i) - 1);
+		printf("  %12lu - %-12lu %14lu  %6.2f%%\n", low, high, (uint64_t)buckets[i], buckets[i]*100.0/total);
+	}
+}
+
+static int InspectEstuary() {
+	estuary::Estuary::Layout layout;
+	if (!estuary::Estuary::Inspect(FLAGS_file, layout, FLAGS_thread)) {
+		printf("fail to inspect: %s\n", FLAGS_file.c_str());
+		return -1;
+	}
+	const auto& config = layout.config;
+	const auto used_entry = layout.total_entry - layout.clean_entry;
+	printf("item: %lu / %lu\n", layout.item, config.item_limit);
+	printf("max key length: %u, max value length: %u, compress: %s, expiration: %s, pool: %s\n",
+		   config.max_key_len, config.max_val_len, config.compress? "yes" : "no",
+		   config.expiration? "yes" : "no", config.pool? "yes" : "no");
+	printf("entry: %lu total, %lu clean, %lu deleted (%.2f%% of used)\n", layout.total_entry,
+		   layout.clean_entry, layout.deleted_entry, used_entry == 0? 0.0 : layout.deleted_entry*100.0/used_entry);
+	printf("block: %lu total, %lu free (%.2f%%), %lu free sections, the largest has %lu blocks\n",
+		   layout.total_block, layout.free_block, layout.free_block*100.0/layout.total_block,
+		   layout.free_section, layout.max_free_section);
+	if (config.pool) {
+		printf("pool: %lu free blocks kept for reusing\n", layout.pooled_block);
+	}
+	printf("record: %.1f bytes on average, %lu bytes of padding\n",
+		   layout.item == 0? 0.0 : (double)layout.record_bytes/layout.item, layout.padding_bytes);
+	printf("room: about %lu more items, ", layout.room);
+	printf("avg_item_size is estimated as %u\n", config.avg_item_size);
+	PrintHistogram("probe distance", layout.probe_distance, estuary::Estuary::Layout::BUCKETS);
+	PrintHistogram("free section size", layout.free_section_size, estuary::Estuary::Layout::BUCKETS);
+	return 0;
+}
+
+static int InspectLuckyEstuary() {
+	estuary::LuckyEstuary::Layout layout;
+	if (!estuary::LuckyEstuary::Inspect(FLAGS_file, layout, FLAGS_thread)) {
+		printf("fail to inspect: %s\n", FLAGS_file.c_str());
+		return -1;
+	}
+	const auto& config = layout.config;
+	printf("item: %u / %u\n", layout.item, config.capacity);
+	printf("key length: %u, value length: %u, epoch: %s, cuckoo: %s\n",
+		   config.key_len, config.val_len, config.epoch? "yes" : "no", config.cuckoo? "yes" : "no");
+	printf("%s: %u total, %u empty (%.2f%%), load factor %.2f, the %s has %u nodes\n",
+		   config.cuckoo? "slot" : "entry", config.entry, layout.empty_entry, layout.empty_entry*100.0/config.entry,
+		   (double)layout.item/config.entry, config.cuckoo? "fullest bucket" : "longest chain", layout.max_chain);
+	printf("node: %u free, %u recycling\n", layout.free_node, layout.recycling_node);
+	printf("room: %u more items\n", layout.room);
+	PrintHistogram(config.cuckoo? "bucket occupancy" : "chain length", layout.chain_length, estuary::LuckyEstuary::Layout::BUCKETS);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	google::ParseCommandLineFlags(&argc, &argv, true);
+	return FLAGS_lucky? InspectLuckyEstuary() : InspectEstuary();
+}